@@ -0,0 +1,117 @@
+#include "config.h"
+
+#include "arena.hh"
+
+#include <cstdlib>
+#include <new>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+
+namespace nix {
+
+
+/* Allocate `size' bytes of zeroed memory that the garbage collector
+   scans for pointers. */
+static void * allocMemory(size_t size)
+{
+#if HAVE_BOEHMGC
+    void * p = GC_MALLOC(size);
+#else
+    void * p = calloc(1, size);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+
+#if HAVE_BOEHMGC
+static void chunkFreed(void * chunk, void * freedChunks)
+{
+    __sync_fetch_and_add((volatile size_t *) freedChunks, 1);
+}
+#endif
+
+
+Arena::Arena(const string & name, size_t chunkSize)
+    : name(name), current(0), chunkSize(chunkSize)
+    , freedChunks(new size_t(0))
+{
+    pthread_mutex_init(&mutex, 0);
+    stats.chunks = stats.reserved = stats.used = stats.wasted = stats.large = 0;
+    stats.freed = 0;
+}
+
+
+Arena::~Arena()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void * Arena::allocSlow(size_t size)
+{
+    /* Big objects would waste too much of a chunk. */
+    if (size > chunkSize / 4) {
+        void * p = allocMemory(size);
+        pthread_mutex_lock(&mutex);
+        stats.large += size;
+        pthread_mutex_unlock(&mutex);
+        return p;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    /* Another thread may have started a new chunk in the meantime. */
+    Chunk * c = current;
+    if (c) {
+        size_t offset = __sync_fetch_and_add(&c->used, size);
+        if (offset + size <= c->size) {
+            pthread_mutex_unlock(&mutex);
+            return c->data + offset;
+        }
+
+        /* Retire the chunk.  Marking it as full makes allocations
+           that are still in flight fail, so `used' is exact. */
+        size_t used = __sync_lock_test_and_set(&c->used, c->size);
+        if (used > c->size) used = c->size;
+        stats.used += used;
+        stats.wasted += c->size - used;
+    }
+
+    c = (Chunk *) allocMemory(sizeof(Chunk) + chunkSize);
+    c->size = chunkSize;
+    c->used = size;
+#if HAVE_BOEHMGC
+    /* Count the chunks that the collector reclaims, which shows how
+       much memory is retained by a few live objects per chunk. */
+    GC_register_finalizer_no_order(c, chunkFreed, (void *) freedChunks, 0, 0);
+#endif
+    stats.chunks++;
+    stats.reserved += chunkSize;
+
+    /* Make sure that other threads see an initialised chunk. */
+    __sync_synchronize();
+    current = c;
+
+    pthread_mutex_unlock(&mutex);
+
+    return c->data;
+}
+
+
+Arena::Stats Arena::getStats()
+{
+    pthread_mutex_lock(&mutex);
+    Stats res = stats;
+    res.freed = *freedChunks;
+    Chunk * c = current;
+    if (c) res.used += c->used < c->size ? c->used : c->size;
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+
+}
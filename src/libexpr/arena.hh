@@ -0,0 +1,80 @@
+#pragma once
+
+#include "types.hh"
+
+#include <pthread.h>
+
+
+namespace nix {
+
+
+/* A bump-pointer allocator for the evaluator's small objects (values,
+   environments and sets).  Objects are carved out of large chunks,
+   which avoids the per-object header and size-class rounding of
+   malloc() or libgc, and keeps objects that are allocated together
+   close together in memory.
+
+   With libgc, chunks are collected as a whole: a chunk stays alive as
+   long as any object in it is reachable, and all of it is scanned for
+   pointers.  Chunks are therefore kept fairly small.  Without libgc,
+   memory is never freed, as before.  Allocation only takes a lock
+   when a chunk is full, so worker threads can allocate concurrently
+   (see ConcurrentEval). */
+class Arena
+{
+public:
+    Arena(const string & name, size_t chunkSize = 64 * 1024);
+    ~Arena();
+
+    /* Allocate `size' bytes of zeroed memory. */
+    void * alloc(size_t size)
+    {
+        size = (size + alignment - 1) & ~(alignment - 1);
+        Chunk * c = current;
+        if (c) {
+            size_t offset = __sync_fetch_and_add(&c->used, size);
+            if (offset + size <= c->size) return c->data + offset;
+        }
+        return allocSlow(size);
+    }
+
+    struct Stats
+    {
+        size_t chunks;
+        size_t reserved; /* bytes in chunks */
+        size_t used;     /* bytes handed out from chunks */
+        size_t wasted;   /* unused bytes at the end of full chunks */
+        size_t large;    /* bytes in objects too big for a chunk */
+        size_t freed;    /* chunks reclaimed by the garbage collector */
+    };
+
+    Stats getStats();
+
+    const string name;
+
+private:
+    static const size_t alignment = 8;
+
+    struct Chunk
+    {
+        volatile size_t used;
+        size_t size;
+        char data[0] __attribute__((aligned(16)));
+    };
+
+    Chunk * volatile current;
+    const size_t chunkSize;
+
+    /* Incremented by the finalizers of chunks.  It isn't freed with
+       the arena, since finalizers may run after that. */
+    volatile size_t * freedChunks;
+
+    /* Protects switching chunks and the statistics. */
+    pthread_mutex_t mutex;
+    Stats stats;
+
+    void * allocSlow(size_t size);
+};
+
+
+}
@@ -61,7 +61,7 @@ Value * findAlongAttrPath(EvalState & state, const string & attrPath,
 
         if (apType == apAttr) {
 
-            if (v->type != tAttrs)
+            if (v->type() != tAttrs)
                 throw TypeError(
                     format("the expression selected by the selection path `%1%' should be a set but is %2%")
                     % attrPath % showType(*v));
@@ -69,23 +69,23 @@ Value * findAlongAttrPath(EvalState & state, const string & attrPath,
             if (attr.empty())
                 throw Error(format("empty attribute name in selection path `%1%'") % attrPath);
 
-            Bindings::iterator a = v->attrs->find(state.symbols.create(attr));
-            if (a == v->attrs->end())
+            Bindings::iterator a = v->attrs()->find(state.symbols.create(attr));
+            if (a == v->attrs()->end())
                 throw Error(format("attribute `%1%' in selection path `%2%' not found") % attr % attrPath);
             v = &*a->value;
         }
 
         else if (apType == apIndex) {
 
-            if (v->type != tList)
+            if (v->type() != tList)
                 throw TypeError(
                     format("the expression selected by the selection path `%1%' should be a list but is %2%")
                     % attrPath % showType(*v));
 
-            if (attrIndex >= v->list.length)
+            if (attrIndex >= v->list().length)
                 throw Error(format("list index %1% in selection path `%2%' is out of range") % attrIndex % attrPath);
 
-            v = v->list.elems[attrIndex];
+            v = v->list().elems[attrIndex];
         }
 
     }
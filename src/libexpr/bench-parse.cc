@@ -0,0 +1,108 @@
+/* Benchmark for the parse cache.  It measures the time needed to
+   parse a set of Nix expression files without the cache, to parse
+   them and fill the cache, and to load them from the cache, and
+   checks that the cached expressions are identical to the parsed
+   ones.
+
+   Usage: bench-parse PATH...
+
+   Each PATH is a Nix expression file or a directory, which is
+   searched recursively for `.nix' files (e.g. a Nixpkgs checkout).
+   The cache is kept in a temporary directory.  Build with `make
+   bench-parse'. */
+
+#include "eval.hh"
+#include "parse-cache.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <iostream>
+#include <cstdlib>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+
+
+using namespace nix;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+static void findNixFiles(const Path & path, Paths & files)
+{
+    struct stat st = lstat(path);
+    if (S_ISDIR(st.st_mode)) {
+        Strings names = readDirectory(path);
+        foreach (Strings::iterator, i, names)
+            findNixFiles(path + "/" + *i, files);
+    } else if (S_ISREG(st.st_mode) && hasSuffix(path, ".nix"))
+        files.push_back(path);
+}
+
+
+static double parseAll(EvalState & state, const Paths & files,
+    vector<Expr *> & exprs)
+{
+    exprs.clear();
+    double t0 = now();
+    foreach (Paths::const_iterator, i, files)
+        exprs.push_back(state.parseExprFromFile(*i));
+    return now() - t0;
+}
+
+
+int main(int argc, char * * argv)
+{
+    try {
+        settings.processEnvironment();
+        settings.loadConfFile();
+
+        Paths files;
+        for (int i = 1; i < argc; ++i)
+            findNixFiles(absPath(argv[i]), files);
+        if (files.empty()) throw Error("no Nix expression files given");
+
+        Path cacheDir = createTempDir();
+        setenv("XDG_CACHE_HOME", cacheDir.c_str(), 1);
+
+        EvalState state;
+        vector<Expr *> parsed, filled, loaded;
+
+        settings.parseCache = false;
+        double tParse = parseAll(state, files, parsed);
+
+        settings.parseCache = true;
+        double tFill = parseAll(state, files, filled);
+        double tLoad = parseAll(state, files, loaded);
+
+        SearchPathLookups lookups;
+        unsigned int i = 0;
+        size_t size = 0;
+        foreach (Paths::iterator, j, files) {
+            string s = serialiseExpr(parsed[i], *j, lookups);
+            if (serialiseExpr(loaded[i], *j, lookups) != s)
+                throw Error(format("cached expression for `%1%' differs") % *j);
+            size += s.size();
+            ++i;
+        }
+
+        std::cout << format("%1% files, %2% KiB cached\n") % files.size() % (size / 1024);
+        std::cout << format("  parse  %.3f s\n") % tParse;
+        std::cout << format("  fill   %.3f s\n") % tFill;
+        std::cout << format("  cached %.3f s\n") % tLoad;
+
+        deletePath(cacheDir);
+
+    } catch (std::exception & e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "common-opts.hh"
 #include "../libmain/shared.hh"
 #include "util.hh"
+#include "eval-cache.hh"
 
 
 namespace nix {
@@ -28,6 +29,9 @@ bool parseOptionArg(const string & arg, Strings::iterator & i,
     else
         mkString(*v, value);
 
+    if (state.inputs)
+        state.inputs->autoArgs[name] = arg + " " + (arg == "--arg" ? absPath(".") + " " : "") + value;
+
     autoArgs.sort(); // !!! inefficient
 
     return true;
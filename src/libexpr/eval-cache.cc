@@ -0,0 +1,659 @@
+#include "eval-cache.hh"
+#include "eval-inline.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <cstdlib>
+#include <cstring>
+
+#include <sqlite3.h>
+
+
+namespace nix {
+
+
+/* Results that haven't been used for this long are removed from the
+   cache. */
+static const time_t maxAge = 30 * 24 * 60 * 60;
+
+
+static const char * schema =
+    "create table if not exists Queries ("
+    "    id        integer primary key autoincrement not null,"
+    "    key       text unique not null,"
+    "    fields    integer not null,"
+    "    timestamp integer not null"
+    ");"
+    "create table if not exists Inputs ("
+    "    query     integer not null,"
+    "    type      integer not null,"
+    "    name      text not null,"
+    "    value     text not null,"
+    "    ino       integer not null,"
+    "    size      integer not null,"
+    "    ctime     integer not null,"
+    "    foreign key (query) references Queries(id) on delete cascade"
+    ");"
+    "create index if not exists IndexInputs on Inputs(query);"
+    "create table if not exists Derivations ("
+    "    query      integer not null,"
+    "    position   integer not null,"
+    "    attrPath   text not null,"
+    "    name       text not null,"
+    "    system     text not null,"
+    "    failed     integer not null," /* fields that gave an assertion failure */
+    "    drvPath    text,"
+    "    outPath    text,"
+    "    outputName text,"
+    "    outputs    text,"
+    "    meta       text,"
+    "    primary key (query, position),"
+    "    foreign key (query) references Queries(id) on delete cascade"
+    ");";
+
+
+static void setStat(EvalInput & input, const struct stat & st)
+{
+    input.ino = st.st_ino;
+    input.size = st.st_size;
+    /* A file can change again within the same second without its
+       ctime changing, so only trust ctimes from the past. */
+    input.ctime = st.st_ctime < time(0) ? st.st_ctime : -1;
+}
+
+
+static bool sameStat(const EvalInput & input, const struct stat & st)
+{
+    return input.ctime != -1
+        && input.ino == (long long) st.st_ino
+        && input.size == (long long) st.st_size
+        && input.ctime == (long long) st.st_ctime;
+}
+
+
+/* Return a hash of the entries of a directory and their types. */
+static string directorySignature(const Path & path)
+{
+    Strings names = readDirectory(path);
+    StringSet namesSorted(names.begin(), names.end());
+    string s;
+    foreach (StringSet::iterator, i, namesSorted) {
+        struct stat st;
+        char type =
+            stat((path + "/" + *i).c_str(), &st) == -1 ? 'x' :
+            S_ISDIR(st.st_mode) ? 'd' :
+            S_ISREG(st.st_mode) ? 'f' : 'o';
+        s += *i + ":" + type + "\n";
+    }
+    return printHash32(hashString(htSHA256, s));
+}
+
+
+void EvalInputs::add(const EvalInput & input)
+{
+    EvalLock lock;
+    /* Keep the first value, since that's what the evaluation saw
+       first. */
+    inputs.insert(std::make_pair(std::make_pair(input.type, input.name), input));
+}
+
+
+string EvalInputs::readFile(const Path & path)
+{
+    EvalInput input;
+    input.type = EvalInput::inFile;
+    input.name = path;
+    /* Stat the file before reading it, so that if it changes in
+       between, the ctime won't match the next time. */
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) setStat(input, st);
+    string s = nix::readFile(path);
+    input.value = printHash32(hashString(htSHA256, s));
+    add(input);
+    return s;
+}
+
+
+void EvalInputs::addTree(const Path & path)
+{
+    addTree(path, hashPath(htSHA256, path).first);
+}
+
+
+void EvalInputs::addTree(const Path & path, const Hash & hash)
+{
+    EvalInput input;
+    input.type = EvalInput::inTree;
+    input.name = path;
+    struct stat st = lstat(path);
+    if (S_ISREG(st.st_mode)) setStat(input, st);
+    input.value = printHash32(hash);
+    add(input);
+}
+
+
+void EvalInputs::addExists(const Path & path, bool exists)
+{
+    EvalInput input;
+    input.type = EvalInput::inExists;
+    input.name = path;
+    input.value = exists ? "1" : "0";
+    add(input);
+}
+
+
+void EvalInputs::addResolution(const Path & path, const Path & resolved)
+{
+    EvalInput input;
+    input.type = EvalInput::inResolve;
+    input.name = path;
+    input.value = resolved;
+    add(input);
+}
+
+
+void EvalInputs::addDirectory(const Path & path)
+{
+    EvalInput input;
+    input.type = EvalInput::inDirectory;
+    input.name = path;
+    input.value = directorySignature(path);
+    add(input);
+}
+
+
+void EvalInputs::addEnv(const string & name, const string & value)
+{
+    EvalInput input;
+    input.type = EvalInput::inEnv;
+    input.name = name;
+    input.value = value;
+    add(input);
+}
+
+
+void EvalInputs::setUncacheable()
+{
+    EvalLock lock;
+    uncacheable = true;
+}
+
+
+/* Return whether `input' is unchanged. */
+static bool isValid(const EvalInput & input)
+{
+    try {
+        struct stat st;
+        switch (input.type) {
+
+            case EvalInput::inFile:
+                if (stat(input.name.c_str(), &st) == -1) return false;
+                return sameStat(input, st) ||
+                    printHash32(hashString(htSHA256, readFile(input.name))) == input.value;
+
+            case EvalInput::inTree:
+                if (lstat(input.name.c_str(), &st) == -1) return false;
+                return (S_ISREG(st.st_mode) && sameStat(input, st)) ||
+                    printHash32(hashPath(htSHA256, input.name).first) == input.value;
+
+            case EvalInput::inExists:
+                return pathExists(input.name) == (input.value == "1");
+
+            case EvalInput::inResolve:
+                return resolveExprPath(input.name) == input.value;
+
+            case EvalInput::inDirectory:
+                return directorySignature(input.name) == input.value;
+
+            case EvalInput::inEnv:
+                return getEnv(input.name) == input.value;
+
+            default:
+                return false;
+        }
+    } catch (Error & e) {
+        return false;
+    }
+}
+
+
+/* Serialise the meta attributes of a derivation.  The format is a
+   sequence of tagged values: `n' (an invalid meta attribute), `i123;',
+   `b0', `b1', `s<length>:<contents>', `l<length>;' followed by the
+   elements, and `a<length>;' followed by pairs of strings and
+   values.  Meta attributes can't contain NUL characters, so the
+   result can be stored as text. */
+static void writeMetaValue(const Value & v, string & s)
+{
+    switch (v.type()) {
+        case tInt:
+            s += (format("i%1%;") % v.integer()).str();
+            break;
+        case tBool:
+            s += v.boolean() ? "b1" : "b0";
+            break;
+        case tString: {
+            size_t len = strlen(v.string().s);
+            s += (format("s%1%:") % len).str();
+            s.append(v.string().s, len);
+            break;
+        }
+        case tList:
+            s += (format("l%1%;") % v.list().length).str();
+            for (unsigned int n = 0; n < v.list().length; ++n)
+                writeMetaValue(*v.list().elems[n], s);
+            break;
+        case tAttrs:
+            s += (format("a%1%;") % v.attrs()->size()).str();
+            foreach (Bindings::iterator, i, *v.attrs()) {
+                string name = i->name;
+                s += (format("s%1%:") % name.size()).str() + name;
+                writeMetaValue(*i->value, s);
+            }
+            break;
+        default:
+            /* Can't happen since checkMeta() has forced everything. */
+            abort();
+    }
+}
+
+
+static string serialiseMeta(DrvInfo & drv)
+{
+    StringSet names = drv.queryMetaNames();
+    string s = (format("a%1%;") % names.size()).str();
+    foreach (StringSet::iterator, i, names) {
+        s += (format("s%1%:") % i->size()).str() + *i;
+        Value * v = drv.queryMeta(*i);
+        if (v) writeMetaValue(*v, s); else s += "n";
+    }
+    return s;
+}
+
+
+struct MetaParser
+{
+    EvalState & state;
+    const string & s;
+    size_t pos;
+
+    MetaParser(EvalState & state, const string & s) : state(state), s(s), pos(0) { };
+
+    long number(char end)
+    {
+        size_t i = s.find(end, pos);
+        if (i == string::npos) throw Error("corrupt meta attributes in the evaluation cache");
+        long n = atol(s.c_str() + pos);
+        pos = i + 1;
+        return n;
+    }
+
+    string str()
+    {
+        if (s[pos++] != 's') throw Error("corrupt meta attributes in the evaluation cache");
+        size_t len = number(':');
+        string res(s, pos, len);
+        pos += len;
+        return res;
+    }
+
+    void value(Value & v)
+    {
+        if (pos >= s.size()) throw Error("corrupt meta attributes in the evaluation cache");
+        switch (s[pos++]) {
+            case 'n':
+                mkNull(v);
+                break;
+            case 'i':
+                mkInt(v, number(';'));
+                break;
+            case 'b':
+                mkBool(v, s[pos++] == '1');
+                break;
+            case 's':
+                pos--;
+                mkString(v, str());
+                break;
+            case 'l': {
+                unsigned int len = number(';');
+                state.mkList(v, len);
+                for (unsigned int n = 0; n < len; ++n) {
+                    v.list().elems[n] = state.allocValue();
+                    value(*v.list().elems[n]);
+                }
+                break;
+            }
+            case 'a': {
+                unsigned int len = number(';');
+                state.mkAttrs(v, len);
+                for (unsigned int n = 0; n < len; ++n) {
+                    string name = str();
+                    value(*state.allocAttr(v, state.symbols.create(name)));
+                }
+                v.attrs()->sort();
+                break;
+            }
+            default:
+                throw Error("corrupt meta attributes in the evaluation cache");
+        }
+    }
+};
+
+
+static string columnText(sqlite3_stmt * stmt, int col)
+{
+    const char * s = (const char *) sqlite3_column_text(stmt, col);
+    return s ? string(s, sqlite3_column_bytes(stmt, col)) : "";
+}
+
+
+EvalCache::EvalCache(EvalState & state, const string & query,
+    Bindings & autoArgs, unsigned int fields)
+    : state(state), fields(fields), prevFields(0)
+{
+    if (!settings.evalCache || !state.inputs || query == "") return;
+
+    const string sep(1, 0);
+    string s = "eval-cache-v1" + sep + nixVersion + sep + settings.thisSystem
+        + sep + settings.nixStore + sep + query;
+
+    foreach (EvalState::SearchPath::iterator, i, state.searchPath)
+        s += sep + i->first + "=" + i->second;
+
+    /* The auto-arguments are only known by the text they were
+       parsed from. */
+    std::map<string, string> args;
+    foreach (Bindings::iterator, i, autoArgs) {
+        std::map<string, string>::iterator j = state.inputs->autoArgs.find(i->name);
+        if (j == state.inputs->autoArgs.end() || args.find(i->name) != args.end()) return;
+        args[i->name] = j->second;
+    }
+    for (std::map<string, string>::iterator i = args.begin(); i != args.end(); ++i)
+        s += sep + i->first + "=" + i->second;
+
+    key = printHash32(hashString(htSHA256, s));
+}
+
+
+bool EvalCache::open()
+{
+    if (db) return true;
+
+    Path dir = getCacheDir();
+    createDirs(dir);
+    Path dbPath = dir + "/eval-cache-v1.sqlite";
+
+    if (sqlite3_open_v2(dbPath.c_str(), &db.db,
+            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK)
+        throw Error(format("cannot open evaluation cache `%1%'") % dbPath);
+
+    if (sqlite3_busy_timeout(db, 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(db, "setting timeout");
+
+    if (sqlite3_exec(db, "pragma foreign_keys = 1;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "enabling foreign keys");
+
+    /* This is only a cache, so don't bother with fsync(). */
+    if (sqlite3_exec(db, "pragma synchronous = off;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting synchronous mode");
+
+    if (sqlite3_exec(db, "pragma main.journal_mode = wal;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "setting journal mode");
+
+    if (sqlite3_exec(db, schema, 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "initialising the evaluation cache");
+
+    return true;
+}
+
+
+bool EvalCache::validInputs(long long id)
+{
+    SQLiteStmt stmt;
+    stmt.create(db, "select type, name, value, ino, size, ctime from Inputs where query = ?;");
+    SQLiteStmtUse use(stmt);
+    stmt.bind64(id);
+
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        EvalInput input;
+        input.type = (EvalInput::Type) sqlite3_column_int(stmt, 0);
+        input.name = columnText(stmt, 1);
+        input.value = columnText(stmt, 2);
+        input.ino = sqlite3_column_int64(stmt, 3);
+        input.size = sqlite3_column_int64(stmt, 4);
+        input.ctime = sqlite3_column_int64(stmt, 5);
+        if (!isValid(input)) {
+            debug(format("evaluation cache: input `%1%' has changed") % input.name);
+            return false;
+        }
+    }
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying the evaluation cache");
+
+    return true;
+}
+
+
+bool EvalCache::lookup(DrvInfos & drvs)
+{
+    if (key == "") return false;
+
+    try {
+        open();
+
+        SQLiteStmt stmt;
+        stmt.create(db, "select id, fields from Queries where key = ?;");
+        SQLiteStmtUse use(stmt);
+        stmt.bind(key);
+        int r = sqlite3_step(stmt);
+        if (r == SQLITE_DONE) return false;
+        if (r != SQLITE_ROW)
+            throwSQLiteError(db, "querying the evaluation cache");
+        long long id = sqlite3_column_int64(stmt, 0);
+        unsigned int have = sqlite3_column_int(stmt, 1);
+
+        if (!validInputs(id)) return false;
+
+        if ((have & fields) != fields) {
+            prevFields = have;
+            return false;
+        }
+
+        SQLiteStmt stmt2;
+        stmt2.create(db,
+            "select attrPath, name, system, failed, drvPath, outPath, outputName, outputs, meta "
+            "from Derivations where query = ? order by position;");
+        SQLiteStmtUse use2(stmt2);
+        stmt2.bind64(id);
+
+        DrvInfos res;
+        while ((r = sqlite3_step(stmt2)) == SQLITE_ROW) {
+            DrvInfo drv(state, columnText(stmt2, 1), columnText(stmt2, 0), columnText(stmt2, 2), 0);
+
+            unsigned int failed = sqlite3_column_int(stmt2, 3);
+            if (failed & fields) drv.setFailed();
+
+            if ((have & fieldPaths) && !(failed & fieldPaths)) {
+                drv.drvPath = columnText(stmt2, 4);
+                drv.outPath = columnText(stmt2, 5);
+                drv.outputName = columnText(stmt2, 6);
+                Strings ss = tokenizeString<Strings>(columnText(stmt2, 7));
+                for (Strings::iterator i = ss.begin(); i != ss.end(); ) {
+                    string name = *i++;
+                    if (i == ss.end()) break;
+                    drv.outputs[name] = *i++;
+                }
+            }
+
+            if ((fields & fieldMeta) && !(failed & fieldMeta)) {
+                Value vMeta;
+                MetaParser(state, columnText(stmt2, 8)).value(vMeta);
+                if (vMeta.type() != tAttrs)
+                    throw Error("corrupt meta attributes in the evaluation cache");
+                drv.meta = vMeta.attrs();
+            }
+
+            res.push_back(drv);
+        }
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying the evaluation cache");
+
+        /* Derivations may have been garbage-collected since. */
+        if (!settings.readOnlyMode && (fields & fieldPaths))
+            foreach (DrvInfos::iterator, i, res)
+                if (!i->hasFailed() && i->drvPath != "" && !store->isValidPath(i->drvPath)) {
+                    prevFields = have;
+                    return false;
+                }
+
+        SQLiteStmt stmt3;
+        stmt3.create(db, "update Queries set timestamp = ? where id = ?;");
+        SQLiteStmtUse use3(stmt3);
+        stmt3.bind64(time(0));
+        stmt3.bind64(id);
+        if (sqlite3_step(stmt3) != SQLITE_DONE)
+            throwSQLiteError(db, "updating the evaluation cache");
+
+        printMsg(lvlChatty, format("using %1% cached derivations") % res.size());
+
+        drvs.splice(drvs.end(), res);
+        return true;
+
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: %1%") % e.msg());
+        key = "";
+        return false;
+    }
+}
+
+
+void EvalCache::insert(DrvInfos & drvs, bool ignoreAssertionFailures)
+{
+    if (key == "") return;
+
+    unsigned int fields2 = fields | prevFields;
+
+    /* Evaluate everything that is to be cached. */
+    vector<unsigned int> failed;
+    vector<string> metas;
+    try {
+        foreach (DrvInfos::iterator, i, drvs) {
+            unsigned int f = 0;
+            string meta;
+            if (fields2 & fieldPaths)
+                try {
+                    i->queryDrvPath();
+                    i->queryOutPath();
+                    i->queryOutputName();
+                    i->queryOutputs();
+                } catch (AssertionError & e) {
+                    if (!ignoreAssertionFailures) throw;
+                    f |= fieldPaths;
+                }
+            if (fields2 & fieldMeta)
+                try {
+                    meta = serialiseMeta(*i);
+                } catch (AssertionError & e) {
+                    if (!ignoreAssertionFailures) throw;
+                    f |= fieldMeta;
+                }
+            failed.push_back(f);
+            metas.push_back(meta);
+        }
+    } catch (Error & e) {
+        debug(format("not caching the result: %1%") % e.msg());
+        return;
+    }
+
+    if (state.inputs->uncacheable) {
+        debug("not caching the result, since it depends on the current time");
+        return;
+    }
+
+    try {
+        open();
+
+        retry_sqlite {
+            SQLiteTxn txn(db);
+
+            SQLiteStmt stmt;
+            stmt.create(db, "delete from Queries where key = ? or timestamp < ?;");
+            SQLiteStmtUse use(stmt);
+            stmt.bind(key);
+            stmt.bind64(time(0) - maxAge);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                throwSQLiteError(db, "updating the evaluation cache");
+
+            SQLiteStmt stmt2;
+            stmt2.create(db, "insert into Queries(key, fields, timestamp) values (?, ?, ?);");
+            SQLiteStmtUse use2(stmt2);
+            stmt2.bind(key);
+            stmt2.bind(fields2);
+            stmt2.bind64(time(0));
+            if (sqlite3_step(stmt2) != SQLITE_DONE)
+                throwSQLiteError(db, "updating the evaluation cache");
+            long long id = sqlite3_last_insert_rowid(db);
+
+            SQLiteStmt stmt3;
+            stmt3.create(db, "insert into Inputs(query, type, name, value, ino, size, ctime) values (?, ?, ?, ?, ?, ?, ?);");
+            foreach (EvalInputs::Inputs::iterator, i, state.inputs->inputs) {
+                SQLiteStmtUse use(stmt3);
+                stmt3.bind64(id);
+                stmt3.bind(i->second.type);
+                stmt3.bind(i->second.name);
+                stmt3.bind(i->second.value);
+                stmt3.bind64(i->second.ino);
+                stmt3.bind64(i->second.size);
+                stmt3.bind64(i->second.ctime);
+                if (sqlite3_step(stmt3) != SQLITE_DONE)
+                    throwSQLiteError(db, "updating the evaluation cache");
+            }
+
+            SQLiteStmt stmt4;
+            stmt4.create(db,
+                "insert into Derivations(query, position, attrPath, name, system, failed, "
+                "drvPath, outPath, outputName, outputs, meta) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+            unsigned int n = 0;
+            foreach (DrvInfos::iterator, i, drvs) {
+                SQLiteStmtUse use(stmt4);
+                stmt4.bind64(id);
+                stmt4.bind(n);
+                stmt4.bind(i->attrPath);
+                stmt4.bind(i->name);
+                stmt4.bind(i->system);
+                stmt4.bind(failed[n]);
+                if ((fields2 & fieldPaths) && !(failed[n] & fieldPaths)) {
+                    stmt4.bind(i->drvPath);
+                    stmt4.bind(i->outPath);
+                    stmt4.bind(i->outputName);
+                    string outputs;
+                    foreach (DrvInfo::Outputs::iterator, j, i->outputs)
+                        outputs += (outputs.empty() ? "" : " ") + j->first + " " + j->second;
+                    stmt4.bind(outputs);
+                } else {
+                    stmt4.bind(); stmt4.bind(); stmt4.bind(); stmt4.bind();
+                }
+                if ((fields2 & fieldMeta) && !(failed[n] & fieldMeta))
+                    stmt4.bind(metas[n]);
+                else
+                    stmt4.bind();
+                if (sqlite3_step(stmt4) != SQLITE_DONE)
+                    throwSQLiteError(db, "updating the evaluation cache");
+                n++;
+            }
+
+            txn.commit();
+        } end_retry_sqlite;
+
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: %1%") % e.msg());
+    }
+}
+
+
+}
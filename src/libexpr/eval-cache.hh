@@ -0,0 +1,130 @@
+#pragma once
+
+#include "eval.hh"
+#include "get-drvs.hh"
+#include "sqlite.hh"
+
+#include <map>
+
+
+namespace nix {
+
+
+/* An external input of an evaluation, i.e. something outside of the
+   Nix expression language that the result depends on. */
+struct EvalInput
+{
+    enum Type {
+        inFile = 1,  /* the contents of a file; `value' is their SHA-256 hash */
+        inTree,      /* a path copied to the store; `value' is its NAR hash */
+        inExists,    /* whether a path exists; `value' is "0" or "1" */
+        inResolve,   /* the result of resolveExprPath() on a path */
+        inDirectory, /* the entries of a directory and their types */
+        inEnv        /* the value of an environment variable */
+    };
+
+    Type type;
+    string name, value;
+
+    /* For files, the inode number, size and ctime at the time the
+       input was recorded.  If they still match, the file doesn't
+       need to be hashed again.  `ctime' is -1 if the file changed
+       too recently for this to be reliable. */
+    long long ino, size, ctime;
+
+    EvalInput() : ino(0), size(0), ctime(-1) { };
+};
+
+
+/* The inputs that an evaluation has depended on so far.  If the
+   evaluation cache is enabled, EvalState records them from the
+   start, so a result is valid as long as all of its inputs are. */
+class EvalInputs
+{
+public:
+    typedef std::map<std::pair<EvalInput::Type, string>, EvalInput> Inputs;
+    Inputs inputs;
+
+    /* The textual form of the `--arg' and `--argstr' options (see
+       parseOptionArg()), since the values they produce can't be
+       compared. */
+    std::map<string, string> autoArgs;
+
+    /* Set if the evaluation depended on something that can't be
+       checked later, such as the current time.  Its result is then
+       not cached. */
+    bool uncacheable;
+
+    EvalInputs() : uncacheable(false) { };
+
+    /* Read a file, recording its contents. */
+    string readFile(const Path & path);
+
+    /* Record a path copied to the store.  `hash' is its NAR hash,
+       if the caller already knows it. */
+    void addTree(const Path & path);
+    void addTree(const Path & path, const Hash & hash);
+    void addExists(const Path & path, bool exists);
+    void addResolution(const Path & path, const Path & resolved);
+    void addDirectory(const Path & path);
+    void addEnv(const string & name, const string & value);
+    void setUncacheable();
+
+private:
+    void add(const EvalInput & input);
+};
+
+
+/* A persistent cache (in ~/.cache/nix) of the derivations that a
+   query such as `nix-env -qa' finds.  A query is identified by a
+   string supplied by the caller (e.g. the path of the Nix expression
+   and the attribute path), the auto-arguments, the search path and
+   the system type.  A cached result is used if none of the inputs of
+   the evaluation that produced it have changed.  All of this is a
+   no-op unless the `eval-cache' option is set. */
+class EvalCache
+{
+public:
+
+    /* Flags for the derivation attributes that a cached result
+       includes, apart from the name, system and attribute path. */
+    enum {
+        fieldPaths = 1, /* drvPath, outPath, outputName and outputs */
+        fieldMeta = 2   /* all meta attributes */
+    };
+
+    /* An empty `query' disables the cache. */
+    EvalCache(EvalState & state, const string & query,
+        Bindings & autoArgs, unsigned int fields);
+
+    /* If a valid result is cached, append its derivations to `drvs'
+       and return true. */
+    bool lookup(DrvInfos & drvs);
+
+    /* Evaluate the requested attributes of `drvs' and store the
+       result.  Nothing is stored if that fails.  Derivations that
+       produce an assertion failure are stored as failed if
+       `ignoreAssertionFailures' is set. */
+    void insert(DrvInfos & drvs, bool ignoreAssertionFailures);
+
+private:
+    EvalState & state;
+    unsigned int fields;
+
+    /* The hash of the query, or empty if the query can't be
+       cached. */
+    string key;
+
+    /* Attributes that the previous result for this query had
+       besides `fields', so that they're not lost when it's
+       replaced. */
+    unsigned int prevFields;
+
+    SQLite db;
+
+    bool open();
+    bool validInputs(long long id);
+};
+
+
+}
@@ -20,23 +20,26 @@ LocalNoInlineNoReturn(void throwTypeError(const char * s, const Value & v))
 
 void EvalState::forceValue(Value & v)
 {
-    if (v.type == tThunk) {
-        Env * env = v.thunk.env;
-        Expr * expr = v.thunk.expr;
+    if (concurrent) {
+        forceValueConcurrent(v);
+        return;
+    }
+
+    if (v.type() == tThunk) {
+        Env * env = v.thunk().env;
+        Expr * expr = v.thunk().expr;
         try {
-            v.type = tBlackhole;
+            v.setBlackhole();
             //checkInterrupt();
             expr->eval(*this, *env, v);
         } catch (Error & e) {
-            v.type = tThunk;
-            v.thunk.env = env;
-            v.thunk.expr = expr;
+            v.setThunk(env, expr);
             throw;
         }
     }
-    else if (v.type == tApp)
-        callFunction(*v.app.left, *v.app.right, v);
-    else if (v.type == tBlackhole)
+    else if (v.type() == tApp)
+        callFunction(*v.app().left, *v.app().right, v);
+    else if (v.type() == tBlackhole)
         throwEvalError("infinite recursion encountered");
 }
 
@@ -44,7 +47,7 @@ void EvalState::forceValue(Value & v)
 inline void EvalState::forceAttrs(Value & v)
 {
     forceValue(v);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError("value is %1% while a set was expected", v);
 }
 
@@ -52,7 +55,7 @@ inline void EvalState::forceAttrs(Value & v)
 inline void EvalState::forceList(Value & v)
 {
     forceValue(v);
-    if (v.type != tList)
+    if (v.type() != tList)
         throwTypeError("value is %1% while a list was expected", v);
 }
 
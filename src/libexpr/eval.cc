@@ -5,9 +5,15 @@
 #include "derivations.hh"
 #include "globals.hh"
 #include "eval-inline.hh"
+#include "eval-cache.hh"
 
+#include <algorithm>
+#include <cstddef>
 #include <cstring>
+#include <new>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -22,6 +28,7 @@
 
 #define GC_STRDUP strdup
 #define GC_MALLOC malloc
+#define GC_MALLOC_ATOMIC malloc
 
 #define NEW new
 
@@ -31,33 +38,199 @@
 namespace nix {
 
 
-Bindings::iterator Bindings::find(const Symbol & name)
+/* Sets with at least this many attributes get a hash index. */
+static const size_t indexMinSize = 64;
+
+/* `//' produces a layered set if the larger operand has at least
+   this many attributes, and the attributes that have to be copied are
+   at most 1/layerRatio of that. */
+static const size_t layerMinSize = 256;
+static const size_t layerRatio = 8;
+
+
+/* An open-addressing hash table mapping symbols to positions (plus
+   one) in a set's vector.  It's valid as long as the vector has
+   `size' elements; adding attributes makes it stale, and sort()
+   discards it. */
+struct Bindings::Index
+{
+    size_t size;
+    unsigned int bits;
+    uint32_t slots[0];
+
+    size_t slot(const Symbol & name) const
+    {
+        return ((uint64_t) name.hash() * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+    }
+};
+
+
+Bindings::Extra * Bindings::getExtra()
+{
+    Extra * e = extra;
+    if (e) return e;
+    e = (Extra *) GC_MALLOC(sizeof(Extra));
+    if (!e) throw std::bad_alloc();
+    e->base = 0;
+    e->total = 0;
+    e->index = 0;
+    return __sync_bool_compare_and_swap(&extra, 0, e) ? e : extra;
+}
+
+
+Bindings::Index * Bindings::getIndex()
+{
+    Extra * e = getExtra();
+    Index * idx = e->index;
+    if (idx && idx->size == attrs.size()) return idx;
+
+    unsigned int bits = 1;
+    while ((size_t) 1 << bits < 2 * attrs.size()) bits++;
+    size_t capacity = (size_t) 1 << bits;
+
+    Index * idx2 = (Index *) GC_MALLOC_ATOMIC(sizeof(Index) + capacity * sizeof(uint32_t));
+    if (!idx2) throw std::bad_alloc();
+    memset(idx2->slots, 0, capacity * sizeof(uint32_t));
+    idx2->size = attrs.size();
+    idx2->bits = bits;
+    for (size_t n = 0; n < attrs.size(); ++n) {
+        size_t h = idx2->slot(attrs[n].name);
+        while (idx2->slots[h]) h = (h + 1) & (capacity - 1);
+        idx2->slots[h] = n + 1;
+    }
+
+    /* Other threads may be looking up attributes concurrently, so
+       publish the index atomically. */
+    __sync_bool_compare_and_swap(&e->index, idx, idx2);
+    return idx2;
+}
+
+
+Attr * Bindings::lookup(const Symbol & name)
 {
+    if (attrs.size() >= indexMinSize) {
+        Index * idx = getIndex();
+        size_t mask = ((size_t) 1 << idx->bits) - 1;
+        for (size_t h = idx->slot(name); idx->slots[h]; h = (h + 1) & mask) {
+            Attr & a(attrs[idx->slots[h] - 1]);
+            if (a.name == name) return &a;
+        }
+        return 0;
+    }
+
     Attr key(name, 0);
-    iterator i = lower_bound(begin(), end(), key);
-    if (i != end() && i->name == name) return i;
+    BindingsBase::iterator i = std::lower_bound(attrs.begin(), attrs.end(), key);
+    if (i != attrs.end() && i->name == name) return &*i;
+    return 0;
+}
+
+
+Bindings::iterator Bindings::find(const Symbol & name)
+{
+    Bindings * base = getBase();
+    Attr * a = lookup(name);
+    if (a) return iterator(a, last(attrs), base ? last(base->attrs) : 0, base ? last(base->attrs) : 0);
+    if (base && (a = base->lookup(name)))
+        return iterator(last(attrs), last(attrs), a, last(base->attrs));
     return end();
 }
 
 
 void Bindings::sort()
 {
-    std::sort(begin(), end());
+    std::sort(attrs.begin(), attrs.end());
+    if (extra) extra->index = 0;
+}
+
+
+void Bindings::insert(const Attr & attr)
+{
+    assert(!getBase());
+    attrs.insert(std::lower_bound(attrs.begin(), attrs.end(), attr), attr);
+}
+
+
+/* Merge two sorted vectors, preferring attributes from `v2'. */
+static void mergeAttrs(const BindingsBase & v1, const BindingsBase & v2, BindingsBase & res)
+{
+    BindingsBase::const_iterator i = v1.begin(), j = v2.begin();
+    while (i != v1.end() && j != v2.end()) {
+        if (i->name == j->name) {
+            res.push_back(*j);
+            ++i; ++j;
+        }
+        else if (i->name < j->name)
+            res.push_back(*i++);
+        else
+            res.push_back(*j++);
+    }
+    res.insert(res.end(), i, v1.end());
+    res.insert(res.end(), j, v2.end());
+}
+
+
+bool Bindings::layer(Bindings & b1, Bindings & b2)
+{
+    assert(!extra && attrs.empty());
+
+    Bindings * base1 = b1.getBase(), * base2 = b2.getBase();
+    size_t n1 = b1.size(), n2 = b2.size();
+    Bindings * base;
+
+    if (n1 >= n2) {
+        /* Put `b2' on top of `b1'. */
+        if (n1 < layerMinSize || base2) return false;
+        size_t n = (base1 ? b1.attrs.size() : 0) + n2;
+        if (n * layerRatio > n1) return false;
+        if (base1) {
+            attrs.reserve(n);
+            mergeAttrs(b1.attrs, b2.attrs, attrs);
+        } else
+            attrs = b2.attrs;
+        base = base1 ? base1 : &b1;
+    }
+
+    else {
+        /* Put the attributes in `b1' that aren't in `b2' on top of
+           `b2'. */
+        if (n2 < layerMinSize || base1) return false;
+        size_t n = (base2 ? b2.attrs.size() : 0) + n1;
+        if (n * layerRatio > n2) return false;
+        BindingsBase left;
+        foreach (BindingsBase::iterator, i, b1.attrs)
+            if (b2.find(i->name) == b2.end()) left.push_back(*i);
+        if (base2) {
+            attrs.reserve(left.size() + b2.attrs.size());
+            mergeAttrs(left, b2.attrs, attrs);
+        } else
+            attrs.swap(left);
+        base = base2 ? base2 : &b2;
+    }
+
+    size_t total = base->attrs.size();
+    foreach (BindingsBase::iterator, i, attrs)
+        if (!base->lookup(i->name)) total++;
+
+    Extra * e = getExtra();
+    e->base = base;
+    e->total = total;
+
+    return true;
 }
 
 
 std::ostream & operator << (std::ostream & str, const Value & v)
 {
-    switch (v.type) {
+    switch (v.type()) {
     case tInt:
-        str << v.integer;
+        str << v.integer();
         break;
     case tBool:
-        str << (v.boolean ? "true" : "false");
+        str << (v.boolean() ? "true" : "false");
         break;
     case tString:
         str << "\"";
-        for (const char * i = v.string.s; *i; i++)
+        for (const char * i = v.string().s; *i; i++)
             if (*i == '\"' || *i == '\\') str << "\\" << *i;
             else if (*i == '\n') str << "\\n";
             else if (*i == '\r') str << "\\r";
@@ -66,7 +239,7 @@ std::ostream & operator << (std::ostream & str, const Value & v)
         str << "\"";
         break;
     case tPath:
-        str << v.path; // !!! escaping?
+        str << v.path(); // !!! escaping?
         break;
     case tNull:
         str << "null";
@@ -75,7 +248,7 @@ std::ostream & operator << (std::ostream & str, const Value & v)
         str << "{ ";
         typedef std::map<string, Value *> Sorted;
         Sorted sorted;
-        foreach (Bindings::iterator, i, *v.attrs)
+        foreach (Bindings::iterator, i, *v.attrs())
             sorted[i->name] = i->value;
         foreach (Sorted::iterator, i, sorted)
             str << i->first << " = " << *i->second << "; ";
@@ -84,8 +257,8 @@ std::ostream & operator << (std::ostream & str, const Value & v)
     }
     case tList:
         str << "[ ";
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            str << *v.list.elems[n] << " ";
+        for (unsigned int n = 0; n < v.list().length; ++n)
+            str << *v.list().elems[n] << " ";
         str << "]";
         break;
     case tThunk:
@@ -110,7 +283,7 @@ std::ostream & operator << (std::ostream & str, const Value & v)
 
 string showType(const Value & v)
 {
-    switch (v.type) {
+    switch (v.type()) {
         case tInt: return "an integer";
         case tBool: return "a boolean";
         case tString: return "a string";
@@ -136,7 +309,7 @@ Symbol getName(const AttrName & name, EvalState & state, Env & env) {
         Value nameValue;
         name.expr->eval(state, env, nameValue);
         state.forceStringNoCtx(nameValue);
-        return state.symbols.create(nameValue.string.s);
+        return state.symbols.create(nameValue.string().s);
     }
 }
 
@@ -158,6 +331,11 @@ EvalState::EvalState()
     , sLine(symbols.create("line"))
     , sColumn(symbols.create("column"))
     , repair(false)
+    , inputs(settings.evalCache ? new EvalInputs : 0)
+    , concurrent(false)
+    , valueArena("values")
+    , envArena("environments")
+    , bindingsArena("sets")
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
     , baseEnvDispl(0)
@@ -210,6 +388,7 @@ EvalState::EvalState()
 
 EvalState::~EvalState()
 {
+    delete inputs;
 }
 
 
@@ -220,7 +399,7 @@ void EvalState::addConstant(const string & name, Value & v)
     staticBaseEnv.vars[symbols.create(name)] = baseEnvDispl;
     baseEnv.values[baseEnvDispl++] = v2;
     string name2 = string(name, 0, 2) == "__" ? string(name, 2) : name;
-    baseEnv.values[0]->attrs->push_back(Attr(symbols.create(name2), v2));
+    baseEnv.values[0]->attrs()->push_back(Attr(symbols.create(name2), v2));
 }
 
 
@@ -230,17 +409,16 @@ void EvalState::addPrimOp(const string & name,
     Value * v = allocValue();
     string name2 = string(name, 0, 2) == "__" ? string(name, 2) : name;
     Symbol sym = symbols.create(name2);
-    v->type = tPrimOp;
-    v->primOp = NEW PrimOp(primOp, arity, sym);
+    v->setPrimOp(NEW PrimOp(primOp, arity, sym));
     staticBaseEnv.vars[symbols.create(name)] = baseEnvDispl;
     baseEnv.values[baseEnvDispl++] = v;
-    baseEnv.values[0]->attrs->push_back(Attr(sym, v));
+    baseEnv.values[0]->attrs()->push_back(Attr(sym, v));
 }
 
 
 void EvalState::getBuiltin(const string & name, Value & v)
 {
-    v = *baseEnv.values[0]->attrs->find(symbols.create(name))->value;
+    v = *baseEnv.values[0]->attrs()->find(symbols.create(name))->value;
 }
 
 
@@ -321,11 +499,12 @@ void mkString(Value & v, const string & s, const PathSet & context)
     mkString(v, s.c_str());
     if (!context.empty()) {
         unsigned int n = 0;
-        v.string.context = (const char * *)
+        const char * * p = (const char * *)
             GC_MALLOC((context.size() + 1) * sizeof(char *));
         foreach (PathSet::const_iterator, i, context)
-            v.string.context[n++] = GC_STRDUP(i->c_str());
-        v.string.context[n] = 0;
+            p[n++] = GC_STRDUP(i->c_str());
+        p[n] = 0;
+        v.setString(v.string().s, p);
     }
 }
 
@@ -342,21 +521,27 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 
     if (!var.fromWith) return env->values[var.displ];
 
+    /* The first slot of a `with' environment holds a thunk for the
+       attribute set (rather than being overwritten with the set when
+       it's first needed), so the environment can be shared between
+       threads.  If `noEval' is set, undefined variables yield 0
+       rather than an error; the caller then creates a thunk that
+       throws the error if it's ever forced.  This way the outcome
+       doesn't depend on whether the set happened to have been
+       evaluated already. */
     while (1) {
-        if (!env->haveWithAttrs) {
-            if (noEval) return 0;
-            Value * v = allocValue();
-            evalAttrs(*env->up, (Expr *) env->values[0], *v);
-            env->values[0] = v;
-            env->haveWithAttrs = true;
-        }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        Value * vWith = env->values[0];
+        if (noEval && vWith->type() != tAttrs) return 0;
+        forceAttrs(*vWith);
+        Bindings::iterator j = vWith->attrs()->find(var.name);
+        if (j != vWith->attrs()->end()) {
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
-        if (!env->prevWith)
+        if (!env->prevWith) {
+            if (noEval) return 0;
             throwUndefinedVarError("undefined variable `%1%' at %2%", var.name, var.pos);
+        }
         for (unsigned int l = env->prevWith; l; --l, env = env->up) ;
     }
 }
@@ -365,7 +550,7 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 Value * EvalState::allocValue()
 {
     nrValues++;
-    return (Value *) GC_MALLOC(sizeof(Value));
+    return (Value *) valueArena.alloc(sizeof(Value));
 }
 
 
@@ -373,39 +558,31 @@ Env & EvalState::allocEnv(unsigned int size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) GC_MALLOC(sizeof(Env) + size * sizeof(Value *));
-
-    /* Clear the values because maybeThunk() and lookupVar fromWith expects this. */
-    for (unsigned i = 0; i < size; ++i)
-        env->values[i] = 0;
-
-    return *env;
+    /* Arena memory is zeroed, which maybeThunk() and lookupVar
+       fromWith expect. */
+    return *(Env *) envArena.alloc(sizeof(Env) + size * sizeof(Value *));
 }
 
 
 Value * EvalState::allocAttr(Value & vAttrs, const Symbol & name)
 {
     Value * v = allocValue();
-    vAttrs.attrs->push_back(Attr(name, v));
+    vAttrs.attrs()->push_back(Attr(name, v));
     return v;
 }
 
 
 void EvalState::mkList(Value & v, unsigned int length)
 {
-    v.type = tList;
-    v.list.length = length;
-    v.list.elems = length ? (Value * *) GC_MALLOC(length * sizeof(Value *)) : 0;
+    v.setList(length, length ? (Value * *) GC_MALLOC(length * sizeof(Value *)) : 0);
     nrListElems += length;
 }
 
 
 void EvalState::mkAttrs(Value & v, unsigned int expected)
 {
-    clearValue(v);
-    v.type = tAttrs;
-    v.attrs = NEW Bindings;
-    v.attrs->reserve(expected);
+    v.setAttrs(new (bindingsArena.alloc(sizeof(Bindings))) Bindings);
+    v.attrs()->reserve(expected);
     nrAttrsets++;
 }
 
@@ -414,9 +591,7 @@ unsigned long nrThunks = 0;
 
 static inline void mkThunk(Value & v, Env & env, Expr * expr)
 {
-    v.type = tThunk;
-    v.thunk.env = &env;
-    v.thunk.expr = expr;
+    v.setThunk(&env, expr);
     nrThunks++;
 }
 
@@ -434,7 +609,7 @@ void EvalState::mkPos(Value & v, Pos * pos)
         mkString(*allocAttr(v, sFile), pos->file);
         mkInt(*allocAttr(v, sLine), pos->line);
         mkInt(*allocAttr(v, sColumn), pos->column);
-        v.attrs->sort();
+        v.attrs()->sort();
     } else
         mkNull(v);
 }
@@ -486,17 +661,25 @@ Value * ExprPath::maybeThunk(EvalState & state, Env & env)
 void EvalState::evalFile(const Path & path, Value & v)
 {
     FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+    {
+        EvalLock lock;
+        if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
     }
 
     Path path2 = resolveExprPath(path);
-    if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+    if (inputs) inputs->addResolution(path, path2);
+    {
+        EvalLock lock;
+        if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
     }
 
+    checkSideEffect(lvlTalkative);
     startNest(nest, lvlTalkative, format("evaluating file `%1%'") % path2);
     Expr * e = parseExprFromFile(path2);
     try {
@@ -506,13 +689,18 @@ void EvalState::evalFile(const Path & path, Value & v)
         throw;
     }
 
-    fileEvalCache[path2] = v;
-    if (path != path2) fileEvalCache[path] = v;
+    /* If another thread evaluated the file in the meantime, use its
+       result, so that every import of a file yields the same
+       value. */
+    EvalLock lock;
+    v = fileEvalCache.insert(std::make_pair(path2, v)).first->second;
+    if (path != path2) fileEvalCache.insert(std::make_pair(path, v));
 }
 
 
 void EvalState::resetFileCache()
 {
+    EvalLock lock;
     fileEvalCache.clear();
 }
 
@@ -526,9 +714,9 @@ void EvalState::eval(Expr * e, Value & v)
 inline bool EvalState::evalBool(Env & env, Expr * e, Value & v)
 {
     e->eval(*this, env, v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError("value is %1% while a Boolean was expected", v);
-    return v.boolean;
+    return v.boolean();
 }
 
 
@@ -542,7 +730,7 @@ inline bool EvalState::evalBool(Env & env, Expr * e)
 inline void EvalState::evalAttrs(Env & env, Expr * e, Value & v)
 {
     e->eval(*this, env, v);
-    if (v.type != tAttrs)
+    if (v.type() != tAttrs)
         throwTypeError("value is %1% while a set was expected", v);
 }
 
@@ -598,7 +786,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             } else
                 vAttr = i->second.e->maybeThunk(state, i->second.inherited ? env : env2);
             env2.values[displ++] = vAttr;
-            v.attrs->push_back(Attr(i->first, vAttr, &i->second.pos));
+            v.attrs()->push_back(Attr(i->first, vAttr, &i->second.pos));
         }
 
         /* If the rec contains an attribute called `__overrides', then
@@ -610,38 +798,37 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
            been substituted into the bodies of the other attributes.
            Hence we need __overrides.) */
         if (hasOverrides) {
-            Value * vOverrides = (*v.attrs)[overrides->second.displ].value;
+            Value * vOverrides = (*v.attrs())[overrides->second.displ].value;
             state.forceAttrs(*vOverrides);
-            foreach (Bindings::iterator, i, *vOverrides->attrs) {
+            foreach (Bindings::iterator, i, *vOverrides->attrs()) {
                 AttrDefs::iterator j = attrs.find(i->name);
                 if (j != attrs.end()) {
-                    (*v.attrs)[j->second.displ] = *i;
+                    (*v.attrs())[j->second.displ] = *i;
                     env2.values[j->second.displ] = i->value;
                 } else
-                    v.attrs->push_back(*i);
+                    v.attrs()->push_back(*i);
             }
-            v.attrs->sort();
+            v.attrs()->sort();
         }
     }
 
     else
         foreach (AttrDefs::iterator, i, attrs)
-            v.attrs->push_back(Attr(i->first, i->second.e->maybeThunk(state, env), &i->second.pos));
+            v.attrs()->push_back(Attr(i->first, i->second.e->maybeThunk(state, env), &i->second.pos));
 
     /* dynamic attrs apply *after* rec and __overrides */
     foreach (DynamicAttrDefs::iterator, i, dynamicAttrs) {
         Value nameVal;
         i->nameExpr->eval(state, *dynamicEnv, nameVal);
         state.forceStringNoCtx(nameVal);
-        Symbol nameSym = state.symbols.create(nameVal.string.s);
-        Bindings::iterator j = v.attrs->find(nameSym);
-        if (j != v.attrs->end())
+        Symbol nameSym = state.symbols.create(nameVal.string().s);
+        Bindings::iterator j = v.attrs()->find(nameSym);
+        if (j != v.attrs()->end())
             throwEvalError("dynamic attribute `%1%' at %2% already defined at %3%", nameSym, i->pos, *j->pos);
 
         i->valueExpr->setName(nameSym);
         /* Keep sorted order so find can catch duplicates */
-        v.attrs->insert(lower_bound(v.attrs->begin(), v.attrs->end(), Attr(nameSym, 0)),
-                Attr(nameSym, i->valueExpr->maybeThunk(state, *dynamicEnv), &i->pos));
+        v.attrs()->insert(Attr(nameSym, i->valueExpr->maybeThunk(state, *dynamicEnv), &i->pos));
     }
 }
 
@@ -667,8 +854,8 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
 void ExprList::eval(EvalState & state, Env & env, Value & v)
 {
     state.mkList(v, elems.size());
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        v.list.elems[n] = elems[n]->maybeThunk(state, env);
+    for (unsigned int n = 0; n < v.list().length; ++n)
+        v.list().elems[n] = elems[n]->maybeThunk(state, env);
 }
 
 
@@ -698,15 +885,15 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             Symbol name = getName(*i, state, env);
             if (def) {
                 state.forceValue(*vAttrs);
-                if (vAttrs->type != tAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if (vAttrs->type() != tAttrs ||
+                    (j = vAttrs->attrs()->find(name)) == vAttrs->attrs()->end())
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if ((j = vAttrs->attrs()->find(name)) == vAttrs->attrs()->end())
                     throwEvalError("attribute `%1%' missing", showAttrPath(attrPath));
             }
             vAttrs = j->value;
@@ -738,8 +925,8 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
         state.forceValue(*vAttrs);
         Bindings::iterator j;
         Symbol name = getName(*i, state, env);
-        if (vAttrs->type != tAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+        if (vAttrs->type() != tAttrs ||
+            (j = vAttrs->attrs()->find(name)) == vAttrs->attrs()->end())
         {
             mkBool(v, false);
             return;
@@ -754,9 +941,7 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
 void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 {
-    v.type = tLambda;
-    v.lambda.env = &env;
-    v.lambda.fun = this;
+    v.setLambda(&env, this);
 }
 
 
@@ -772,12 +957,12 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v)
     /* Figure out the number of arguments still needed. */
     unsigned int argsDone = 0;
     Value * primOp = &fun;
-    while (primOp->type == tPrimOpApp) {
+    while (primOp->type() == tPrimOpApp) {
         argsDone++;
-        primOp = primOp->primOpApp.left;
+        primOp = primOp->primOpApp().left;
     }
-    assert(primOp->type == tPrimOp);
-    unsigned int arity = primOp->primOp->arity;
+    assert(primOp->type() == tPrimOp);
+    unsigned int arity = primOp->primOp()->arity;
     unsigned int argsLeft = arity - argsDone;
 
     if (argsLeft == 1) {
@@ -787,40 +972,38 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v)
         Value * vArgs[arity];
         unsigned int n = arity - 1;
         vArgs[n--] = &arg;
-        for (Value * arg = &fun; arg->type == tPrimOpApp; arg = arg->primOpApp.left)
-            vArgs[n--] = arg->primOpApp.right;
+        for (Value * arg = &fun; arg->type() == tPrimOpApp; arg = arg->primOpApp().left)
+            vArgs[n--] = arg->primOpApp().right;
 
         /* And call the primop. */
         nrPrimOpCalls++;
-        if (countCalls) primOpCalls[primOp->primOp->name]++;
-        primOp->primOp->fun(*this, vArgs, v);
+        if (countCalls) primOpCalls[primOp->primOp()->name]++;
+        primOp->primOp()->fun(*this, vArgs, v);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
-        v.type = tPrimOpApp;
-        v.primOpApp.left = fun2;
-        v.primOpApp.right = &arg;
+        v.setPrimOpApp(fun2, &arg);
     }
 }
 
 
 void EvalState::callFunction(Value & fun, Value & arg, Value & v)
 {
-    if (fun.type == tPrimOp || fun.type == tPrimOpApp) {
+    if (fun.type() == tPrimOp || fun.type() == tPrimOpApp) {
         callPrimOp(fun, arg, v);
         return;
     }
 
-    if (fun.type != tLambda)
+    if (fun.type() != tLambda)
         throwTypeError("attempt to call something which is not a function but %1%", fun);
 
-    ExprLambda & lambda(*fun.lambda.fun);
+    ExprLambda & lambda(*fun.lambda().fun);
 
     unsigned int size =
         (lambda.arg.empty() ? 0 : 1) +
         (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
     Env & env2(allocEnv(size));
-    env2.up = fun.lambda.env;
+    env2.up = fun.lambda().env;
 
     unsigned int displ = 0;
 
@@ -838,8 +1021,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v)
            argument has a default, use the default. */
         unsigned int attrsUsed = 0;
         foreach (Formals::Formals_::iterator, i, lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i->name);
-            if (j == arg.attrs->end()) {
+            Bindings::iterator j = arg.attrs()->find(i->name);
+            if (j == arg.attrs()->end()) {
                 if (!i->def) throwTypeError("%1% called without required argument `%2%'",
                     lambda, i->name);
                 env2.values[displ++] = i->def->maybeThunk(*this, env2);
@@ -851,10 +1034,10 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v)
 
         /* Check that each actual argument is listed as a formal
            argument (unless the attribute match specifies a `...'). */
-        if (!lambda.formals->ellipsis && attrsUsed != arg.attrs->size()) {
+        if (!lambda.formals->ellipsis && attrsUsed != arg.attrs()->size()) {
             /* Nope, so show the first unexpected argument to the
                user. */
-            foreach (Bindings::iterator, i, *arg.attrs)
+            foreach (Bindings::iterator, i, *arg.attrs())
                 if (lambda.formals->argNames.find(i->name) == lambda.formals->argNames.end())
                     throwTypeError("%1% called with unexpected argument `%2%'", lambda, i->name);
             abort(); // can't happen
@@ -874,7 +1057,7 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v)
             throw;
         }
     else
-        fun.lambda.fun->body->eval(*this, env2, v);
+        fun.lambda().fun->body->eval(*this, env2, v);
 }
 
 
@@ -890,23 +1073,23 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 {
     forceValue(fun);
 
-    if (fun.type != tLambda || !fun.lambda.fun->matchAttrs) {
+    if (fun.type() != tLambda || !fun.lambda().fun->matchAttrs) {
         res = fun;
         return;
     }
 
     Value * actualArgs = allocValue();
-    mkAttrs(*actualArgs, fun.lambda.fun->formals->formals.size());
+    mkAttrs(*actualArgs, fun.lambda().fun->formals->formals.size());
 
-    foreach (Formals::Formals_::iterator, i, fun.lambda.fun->formals->formals) {
+    foreach (Formals::Formals_::iterator, i, fun.lambda().fun->formals->formals) {
         Bindings::iterator j = args.find(i->name);
         if (j != args.end())
-            actualArgs->attrs->push_back(*j);
+            actualArgs->attrs()->push_back(*j);
         else if (!i->def)
             throwTypeError("cannot auto-call a function that has an argument without a default value (`%1%')", i->name);
     }
 
-    actualArgs->attrs->sort();
+    actualArgs->attrs()->sort();
 
     callFunction(fun, *actualArgs, res);
 }
@@ -917,8 +1100,7 @@ void ExprWith::eval(EvalState & state, Env & env, Value & v)
     Env & env2(state.allocEnv(1));
     env2.up = &env;
     env2.prevWith = prevWith;
-    env2.haveWithAttrs = false;
-    env2.values[0] = (Value *) attrs;
+    env2.values[0] = attrs->maybeThunk(state, env);
 
     body->eval(state, env2, v);
 }
@@ -949,8 +1131,8 @@ void ExprBuiltin::eval(EvalState & state, Env & env, Value & v)
     // Not a hot path at all, but would be nice to access state.baseEnv directly
     Env *baseEnv = &env;
     while (baseEnv->up) baseEnv = baseEnv->up;
-    Bindings::iterator binding = baseEnv->values[0]->attrs->find(name);
-    assert(binding != baseEnv->values[0]->attrs->end());
+    Bindings::iterator binding = baseEnv->values[0]->attrs()->find(name);
+    assert(binding != baseEnv->values[0]->attrs()->end());
     v = *binding->value;
 }
 
@@ -997,31 +1179,39 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
 
     state.nrOpUpdates++;
 
-    if (v1.attrs->size() == 0) { v = v2; return; }
-    if (v2.attrs->size() == 0) { v = v1; return; }
+    if (v1.attrs()->size() == 0) { v = v2; return; }
+    if (v2.attrs()->size() == 0) { v = v1; return; }
+
+    /* If one set is much larger than the other, share it rather than
+       copying it. */
+    state.mkAttrs(v, 0);
+    if (v.attrs()->layer(*v1.attrs(), *v2.attrs())) {
+        state.nrOpUpdateValuesCopied += v.attrs()->ownSize();
+        return;
+    }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
+    v.attrs()->reserve(v1.attrs()->size() + v2.attrs()->size());
 
     /* Merge the sets, preferring values from the second set.  Make
        sure to keep the resulting vector in sorted order. */
-    Bindings::iterator i = v1.attrs->begin();
-    Bindings::iterator j = v2.attrs->begin();
+    Bindings::iterator i = v1.attrs()->begin();
+    Bindings::iterator j = v2.attrs()->begin();
 
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
+    while (i != v1.attrs()->end() && j != v2.attrs()->end()) {
         if (i->name == j->name) {
-            v.attrs->push_back(*j);
+            v.attrs()->push_back(*j);
             ++i; ++j;
         }
         else if (i->name < j->name)
-            v.attrs->push_back(*i++);
+            v.attrs()->push_back(*i++);
         else
-            v.attrs->push_back(*j++);
+            v.attrs()->push_back(*j++);
     }
 
-    while (i != v1.attrs->end()) v.attrs->push_back(*i++);
-    while (j != v2.attrs->end()) v.attrs->push_back(*j++);
+    while (i != v1.attrs()->end()) v.attrs()->push_back(*i++);
+    while (j != v2.attrs()->end()) v.attrs()->push_back(*j++);
 
-    state.nrOpUpdateValuesCopied += v.attrs->size();
+    state.nrOpUpdateValuesCopied += v.attrs()->size();
 }
 
 
@@ -1042,20 +1232,20 @@ void EvalState::concatLists(Value & v, unsigned int nrLists, Value * * lists)
     unsigned int len = 0;
     for (unsigned int n = 0; n < nrLists; ++n) {
         forceList(*lists[n]);
-        unsigned int l = lists[n]->list.length;
+        unsigned int l = lists[n]->list().length;
         len += l;
         if (l) nonEmpty = lists[n];
     }
 
-    if (nonEmpty && len == nonEmpty->list.length) {
+    if (nonEmpty && len == nonEmpty->list().length) {
         v = *nonEmpty;
         return;
     }
 
     mkList(v, len);
     for (unsigned int n = 0, pos = 0; n < nrLists; ++n) {
-        unsigned int l = lists[n]->list.length;
-        memcpy(v.list.elems + pos, lists[n]->list.elems, l * sizeof(Value *));
+        unsigned int l = lists[n]->list().length;
+        memcpy(v.list().elems + pos, lists[n]->list().elems, l * sizeof(Value *));
         pos += l;
     }
 }
@@ -1079,14 +1269,14 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
            since paths are copied when they are used in a derivation),
            and none of the strings are allowed to have contexts. */
         if (first) {
-            firstType = vTmp.type;
+            firstType = vTmp.type();
             first = false;
         }
 
         if (firstType == tInt) {
-            if (vTmp.type != tInt)
+            if (vTmp.type() != tInt)
                 throwEvalError("cannot add %1% to an integer", showType(vTmp));
-            n += vTmp.integer;
+            n += vTmp.integer();
         } else
             s << state.coerceToString(vTmp, context, false, firstType == tString);
     }
@@ -1108,18 +1298,232 @@ void ExprPos::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+/* Concurrent evaluation (see ConcurrentEval). */
+
+/* Whether a ConcurrentEval object exists. */
+static bool concurrentEval = false;
+
+/* Set by ConcurrentEval::cancel(). */
+static volatile bool evalCancelled = false;
+
+/* Whether the current thread is a worker, and the thunks that it is
+   currently evaluating.  The latter is needed to tell infinite
+   recursion from contention when a thread runs into a blackhole. */
+static __thread bool isWorker = false;
+static __thread vector<Value *> * claimed = 0;
+
+/* The blackhole that the main thread is waiting for, if any. */
+static Value * volatile mainWaitingFor = 0;
+static pthread_mutex_t waitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitCond = PTHREAD_COND_INITIALIZER;
+
+/* The recursive mutex used by EvalLock. */
+static pthread_mutex_t evalMutex;
+static pthread_once_t evalMutexOnce = PTHREAD_ONCE_INIT;
+
+
+static void initEvalMutex()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&evalMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+/* Replace the blackhole `v' by `res'.  Then wake up the main thread
+   if it's waiting for `v'. */
+static void publishValue(Value & v, const Value & res)
+{
+    v.publish(res);
+
+    /* Pairs with the barrier in waitForValue(). */
+    __sync_synchronize();
+    if (mainWaitingFor == &v) {
+        pthread_mutex_lock(&waitMutex);
+        pthread_cond_broadcast(&waitCond);
+        pthread_mutex_unlock(&waitMutex);
+    }
+}
+
+
+static void waitForValue(Value & v)
+{
+    pthread_mutex_lock(&waitMutex);
+    mainWaitingFor = &v;
+    __sync_synchronize();
+    while (v.typeAcquire() == tBlackhole)
+        pthread_cond_wait(&waitCond, &waitMutex);
+    mainWaitingFor = 0;
+    pthread_mutex_unlock(&waitMutex);
+}
+
+
+void EvalState::forceValueConcurrent(Value & v)
+{
+    while (true) {
+        ValueType type = v.typeAcquire();
+
+        if (type == tThunk || type == tApp) {
+            if (isWorker && evalCancelled) throw EvalContention();
+
+            /* Claim the thunk.  If another thread beat us to it, look
+               again. */
+            Value saved, res;
+            if (!v.claim(saved)) continue;
+            type = saved.type();
+
+            /* The result is computed in a temporary, since the
+               evaluator may fill in a value in several steps. */
+            claimed->push_back(&v);
+            try {
+                if (type == tThunk)
+                    saved.thunk().expr->eval(*this, *saved.thunk().env, res);
+                else
+                    callFunction(*saved.app().left, *saved.app().right, res);
+            } catch (...) {
+                claimed->pop_back();
+                publishValue(v, saved);
+                throw;
+            }
+            claimed->pop_back();
+            publishValue(v, res);
+            return;
+        }
+
+        if (type != tBlackhole) return;
+
+        if (std::find(claimed->begin(), claimed->end(), &v) != claimed->end())
+            throwEvalError("infinite recursion encountered");
+
+        if (isWorker) throw EvalContention();
+
+        waitForValue(v);
+    }
+}
+
+
+ConcurrentEval::ConcurrentEval(EvalState & state)
+    : state(state)
+{
+    assert(available(state) && !concurrentEval);
+    pthread_once(&evalMutexOnce, initEvalMutex);
+#if HAVE_BOEHMGC && defined(GC_THREADS)
+    GC_allow_register_threads();
+#endif
+    claimed = new vector<Value *>;
+    evalCancelled = false;
+    concurrentEval = true;
+    state.symbols.setConcurrent(true);
+    state.concurrent = true;
+}
+
+
+ConcurrentEval::~ConcurrentEval()
+{
+    state.concurrent = false;
+    state.symbols.setConcurrent(false);
+    concurrentEval = false;
+    delete claimed;
+    claimed = 0;
+}
+
+
+bool ConcurrentEval::available(EvalState & state)
+{
+#if HAVE_BOEHMGC && !defined(GC_THREADS)
+    return false;
+#else
+    return !state.countCalls;
+#endif
+}
+
+
+void ConcurrentEval::cancel()
+{
+    evalCancelled = true;
+}
+
+
+#if HAVE_BOEHMGC && defined(GC_THREADS)
+/* The collector stops the world by sending signals to every
+   registered thread, so workers must not block them. */
+static void gcSignals(sigset_t & set)
+{
+    sigemptyset(&set);
+    sigaddset(&set, GC_get_suspend_signal());
+    sigaddset(&set, GC_get_thr_restart_signal());
+}
+#endif
+
+
+EvalWorker::EvalWorker()
+{
+#if HAVE_BOEHMGC && defined(GC_THREADS)
+    struct GC_stack_base sb;
+    if (GC_get_stack_base(&sb) != GC_SUCCESS)
+        throw Error("cannot determine the stack of the current thread");
+    GC_register_my_thread(&sb);
+    sigset_t set;
+    gcSignals(set);
+    pthread_sigmask(SIG_UNBLOCK, &set, 0);
+#endif
+    isWorker = true;
+    claimed = new vector<Value *>;
+}
+
+
+EvalWorker::~EvalWorker()
+{
+    delete claimed;
+    claimed = 0;
+    isWorker = false;
+#if HAVE_BOEHMGC && defined(GC_THREADS)
+    sigset_t set;
+    gcSignals(set);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+    GC_unregister_my_thread();
+#endif
+}
+
+
+EvalLock::EvalLock()
+    : locked(false)
+{
+    if (!concurrentEval) return;
+    if (isWorker) {
+        if (pthread_mutex_trylock(&evalMutex) != 0) throw EvalContention();
+    } else
+        pthread_mutex_lock(&evalMutex);
+    locked = true;
+}
+
+
+EvalLock::~EvalLock()
+{
+    if (locked) pthread_mutex_unlock(&evalMutex);
+}
+
+
+void checkSideEffect(Verbosity level)
+{
+    if (isWorker && level <= verbosity) throw EvalContention();
+}
+
+
 void EvalState::strictForceValue(Value & v)
 {
     forceValue(v);
 
-    if (v.type == tAttrs) {
-        foreach (Bindings::iterator, i, *v.attrs)
+    if (v.type() == tAttrs) {
+        foreach (Bindings::iterator, i, *v.attrs())
             strictForceValue(*i->value);
     }
 
-    else if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            strictForceValue(*v.list.elems[n]);
+    else if (v.type() == tList) {
+        for (unsigned int n = 0; n < v.list().length; ++n)
+            strictForceValue(*v.list().elems[n]);
     }
 }
 
@@ -1127,25 +1531,25 @@ void EvalState::strictForceValue(Value & v)
 NixInt EvalState::forceInt(Value & v)
 {
     forceValue(v);
-    if (v.type != tInt)
+    if (v.type() != tInt)
         throwTypeError("value is %1% while an integer was expected", v);
-    return v.integer;
+    return v.integer();
 }
 
 
 bool EvalState::forceBool(Value & v)
 {
     forceValue(v);
-    if (v.type != tBool)
+    if (v.type() != tBool)
         throwTypeError("value is %1% while a Boolean was expected", v);
-    return v.boolean;
+    return v.boolean();
 }
 
 
 void EvalState::forceFunction(Value & v)
 {
     forceValue(v);
-    if (v.type != tLambda && v.type != tPrimOp && v.type != tPrimOpApp)
+    if (v.type() != tLambda && v.type() != tPrimOp && v.type() != tPrimOpApp)
         throwTypeError("value is %1% while a function was expected", v);
 }
 
@@ -1153,16 +1557,16 @@ void EvalState::forceFunction(Value & v)
 string EvalState::forceString(Value & v)
 {
     forceValue(v);
-    if (v.type != tString)
+    if (v.type() != tString)
         throwTypeError("value is %1% while a string was expected", v);
-    return string(v.string.s);
+    return string(v.string().s);
 }
 
 
 void copyContext(const Value & v, PathSet & context)
 {
-    if (v.string.context)
-        for (const char * * p = v.string.context; *p; ++p)
+    if (v.string().context)
+        for (const char * * p = v.string().context; *p; ++p)
             context.insert(*p);
 }
 
@@ -1178,21 +1582,21 @@ string EvalState::forceString(Value & v, PathSet & context)
 string EvalState::forceStringNoCtx(Value & v)
 {
     string s = forceString(v);
-    if (v.string.context)
+    if (v.string().context)
         throwEvalError("the string `%1%' is not allowed to refer to a store path (such as `%2%')",
-            v.string.s, v.string.context[0]);
+            v.string().s, v.string().context[0]);
     return s;
 }
 
 
 bool EvalState::isDerivation(Value & v)
 {
-    if (v.type != tAttrs) return false;
-    Bindings::iterator i = v.attrs->find(sType);
-    if (i == v.attrs->end()) return false;
+    if (v.type() != tAttrs) return false;
+    Bindings::iterator i = v.attrs()->find(sType);
+    if (i == v.attrs()->end()) return false;
     forceValue(*i->value);
-    if (i->value->type != tString) return false;
-    return strcmp(i->value->string.s, "derivation") == 0;
+    if (i->value->type() != tString) return false;
+    return strcmp(i->value->string().s, "derivation") == 0;
 }
 
 
@@ -1203,19 +1607,19 @@ string EvalState::coerceToString(Value & v, PathSet & context,
 
     string s;
 
-    if (v.type == tString) {
+    if (v.type() == tString) {
         copyContext(v, context);
-        return v.string.s;
+        return v.string().s;
     }
 
-    if (v.type == tPath) {
-        Path path(canonPath(v.path));
+    if (v.type() == tPath) {
+        Path path(canonPath(v.path()));
         return copyToStore ? copyPathToStore(context, path) : path;
     }
 
-    if (v.type == tAttrs) {
-        Bindings::iterator i = v.attrs->find(sOutPath);
-        if (i == v.attrs->end()) throwTypeError("cannot coerce a set to a string");
+    if (v.type() == tAttrs) {
+        Bindings::iterator i = v.attrs()->find(sOutPath);
+        if (i == v.attrs()->end()) throwTypeError("cannot coerce a set to a string");
         return coerceToString(*i->value, context, coerceMore, copyToStore);
     }
 
@@ -1223,19 +1627,19 @@ string EvalState::coerceToString(Value & v, PathSet & context,
 
         /* Note that `false' is represented as an empty string for
            shell scripting convenience, just like `null'. */
-        if (v.type == tBool && v.boolean) return "1";
-        if (v.type == tBool && !v.boolean) return "";
-        if (v.type == tInt) return int2String(v.integer);
-        if (v.type == tNull) return "";
+        if (v.type() == tBool && v.boolean()) return "1";
+        if (v.type() == tBool && !v.boolean()) return "";
+        if (v.type() == tInt) return int2String(v.integer());
+        if (v.type() == tNull) return "";
 
-        if (v.type == tList) {
+        if (v.type() == tList) {
             string result;
-            for (unsigned int n = 0; n < v.list.length; ++n) {
-                result += coerceToString(*v.list.elems[n],
+            for (unsigned int n = 0; n < v.list().length; ++n) {
+                result += coerceToString(*v.list().elems[n],
                     context, coerceMore, copyToStore);
-                if (n < v.list.length - 1
+                if (n < v.list().length - 1
                     /* !!! not quite correct */
-                    && (v.list.elems[n]->type != tList || v.list.elems[n]->list.length != 0))
+                    && (v.list().elems[n]->type() != tList || v.list().elems[n]->list().length != 0))
                     result += " ";
             }
             return result;
@@ -1251,14 +1655,25 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (nix::isDerivation(path))
         throwEvalError("file names are not allowed to end in `%1%'", drvExtension);
 
+    EvalLock lock;
     Path dstPath;
     if (srcToStore[path] != "")
         dstPath = srcToStore[path];
     else {
-        dstPath = settings.readOnlyMode
-            ? computeStorePathForPath(path).first
-            : store->addToStore(path, true, htSHA256, defaultPathFilter, repair);
+        /* The evaluation cache records the NAR hash of `path', which
+           has just been computed anyway. */
+        Hash hash;
+        if (settings.readOnlyMode) {
+            std::pair<Path, Hash> p = computeStorePathForPath(path);
+            dstPath = p.first;
+            hash = p.second;
+        } else {
+            dstPath = store->addToStore(path, true, htSHA256, defaultPathFilter, repair);
+            if (inputs) hash = store->queryPathInfo(dstPath).hash;
+        }
+        if (inputs) inputs->addTree(path, hash);
         srcToStore[path] = dstPath;
+        checkSideEffect(lvlChatty);
         printMsg(lvlChatty, format("copied source `%1%' -> `%2%'")
             % path % dstPath);
     }
@@ -1287,20 +1702,20 @@ bool EvalState::eqValues(Value & v1, Value & v2)
        uniqList on a list of sets.)  Will remove this eventually. */
     if (&v1 == &v2) return true;
 
-    if (v1.type != v2.type) return false;
+    if (v1.type() != v2.type()) return false;
 
-    switch (v1.type) {
+    switch (v1.type()) {
 
         case tInt:
-            return v1.integer == v2.integer;
+            return v1.integer() == v2.integer();
 
         case tBool:
-            return v1.boolean == v2.boolean;
+            return v1.boolean() == v2.boolean();
 
         case tString: {
             /* Compare both the string and its context. */
-            if (strcmp(v1.string.s, v2.string.s) != 0) return false;
-            const char * * p = v1.string.context, * * q = v2.string.context;
+            if (strcmp(v1.string().s, v2.string().s) != 0) return false;
+            const char * * p = v1.string().context, * * q = v2.string().context;
             if (!p && !q) return true;
             if (!p || !q) return false;
             for ( ; *p && *q; ++p, ++q)
@@ -1310,32 +1725,32 @@ bool EvalState::eqValues(Value & v1, Value & v2)
         }
 
         case tPath:
-            return strcmp(v1.path, v2.path) == 0;
+            return strcmp(v1.path(), v2.path()) == 0;
 
         case tNull:
             return true;
 
         case tList:
-            if (v1.list.length != v2.list.length) return false;
-            for (unsigned int n = 0; n < v1.list.length; ++n)
-                if (!eqValues(*v1.list.elems[n], *v2.list.elems[n])) return false;
+            if (v1.list().length != v2.list().length) return false;
+            for (unsigned int n = 0; n < v1.list().length; ++n)
+                if (!eqValues(*v1.list().elems[n], *v2.list().elems[n])) return false;
             return true;
 
         case tAttrs: {
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
-                Bindings::iterator i = v1.attrs->find(sOutPath);
-                Bindings::iterator j = v2.attrs->find(sOutPath);
-                if (i != v1.attrs->end() && j != v2.attrs->end())
+                Bindings::iterator i = v1.attrs()->find(sOutPath);
+                Bindings::iterator j = v2.attrs()->find(sOutPath);
+                if (i != v1.attrs()->end() && j != v2.attrs()->end())
                     return eqValues(*i->value, *j->value);
             }
 
-            if (v1.attrs->size() != v2.attrs->size()) return false;
+            if (v1.attrs()->size() != v2.attrs()->size()) return false;
 
             /* Otherwise, compare the attributes one by one. */
             Bindings::iterator i, j;
-            for (i = v1.attrs->begin(), j = v2.attrs->begin(); i != v1.attrs->end(); ++i, ++j)
+            for (i = v1.attrs()->begin(), j = v2.attrs()->begin(); i != v1.attrs()->end(); ++i, ++j)
                 if (i->name != j->name || !eqValues(*i->value, *j->value))
                     return false;
 
@@ -1365,6 +1780,10 @@ void EvalState::printStats()
     float cpuTime = buf.ru_utime.tv_sec + ((float) buf.ru_utime.tv_usec / 1000000);
 
     printMsg(v, format("  time elapsed: %1%") % cpuTime);
+    printMsg(v, format("  peak resident size: %1% KiB") % buf.ru_maxrss);
+#if HAVE_BOEHMGC
+    printMsg(v, format("  garbage collector heap size: %1% bytes") % GC_get_heap_size());
+#endif
     printMsg(v, format("  size of a value: %1%") % sizeof(Value));
     printMsg(v, format("  environments allocated: %1% (%2% bytes)")
         % nrEnvs % (nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *)));
@@ -1374,6 +1793,24 @@ void EvalState::printStats()
     printMsg(v, format("  values allocated: %1% (%2% bytes)")
         % nrValues % (nrValues * sizeof(Value)));
     printMsg(v, format("  sets allocated: %1%") % nrAttrsets);
+#if HAVE_BOEHMGC
+    /* Collect garbage, so that the number of freed chunks shows how
+       many are retained by live objects. */
+    if (showStats) {
+        GC_gcollect();
+        GC_invoke_finalizers();
+        printMsg(v, format("  garbage collector heap size after collection: %1% bytes (%2% bytes free)")
+            % GC_get_heap_size() % GC_get_free_bytes());
+    }
+#endif
+    Arena * arenas[] = { &valueArena, &envArena, &bindingsArena };
+    for (unsigned int i = 0; i < sizeof(arenas) / sizeof(arenas[0]); ++i) {
+        Arena::Stats st = arenas[i]->getStats();
+        printMsg(v, format("  arena `%1%': %2% bytes used, %3% bytes in %4% chunks (%5% freed), %6% bytes wasted (%7$.1f%%), %8% bytes in large objects")
+            % arenas[i]->name % st.used % st.reserved % st.chunks % st.freed % st.wasted
+            % (st.used + st.wasted ? 100.0 * st.wasted / (st.used + st.wasted) : 0.0)
+            % st.large);
+    }
     printMsg(v, format("  right-biased unions: %1%") % nrOpUpdates);
     printMsg(v, format("  values copied in right-biased unions: %1%") % nrOpUpdateValuesCopied);
     printMsg(v, format("  symbols in symbol table: %1%") % symbols.size());
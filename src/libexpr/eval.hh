@@ -4,8 +4,10 @@
 #include "nixexpr.hh"
 #include "symbol-table.hh"
 #include "hash.hh"
+#include "arena.hh"
 
 #include <map>
+#include <cassert>
 
 #if HAVE_BOEHMGC
 #include <gc/gc_allocator.h>
@@ -19,23 +21,6 @@ class EvalState;
 struct Attr;
 
 
-/* Sets are represented as a vector of attributes, sorted by symbol
-   (i.e. pointer to the attribute name in the symbol table). */
-#if HAVE_BOEHMGC
-typedef std::vector<Attr, gc_allocator<Attr> > BindingsBase;
-#else
-typedef std::vector<Attr> BindingsBase;
-#endif
-
-
-class Bindings : public BindingsBase
-{
-public:
-    iterator find(const Symbol & name);
-    void sort();
-};
-
-
 typedef void (* PrimOpFun) (EvalState & state, Value * * args, Value & v);
 
 
@@ -49,14 +34,17 @@ struct PrimOp
 };
 
 
-struct Env
+/* Environments are pointed to by tagged pointers (see Value), so
+   they must be 8-byte aligned. */
+struct __attribute__((aligned(8))) Env
 {
     Env * up;
     unsigned short prevWith; // nr of levels up to next `with' environment
-    bool haveWithAttrs;
     Value * values[0];
 };
 
+typedef char EnvAlignmentCheck[__alignof__(Env) >= 8 ? 1 : -1];
+
 
 struct Attr
 {
@@ -75,6 +63,152 @@ struct Attr
 
 void mkString(Value & v, const string & s, const PathSet & context = PathSet());
 
+
+/* Sets are represented as a vector of attributes, sorted by symbol
+   (i.e. pointer to the attribute name in the symbol table).  Large
+   sets get a hash index to speed up lookups.
+
+   The result of `//' on a large and a small set is a layered set:
+   the attributes from the small set are stored in its vector, on
+   top of the large set (the base), which is shared rather than
+   copied.  Attributes in the vector take precedence.  The base is
+   never layered itself, and layered sets are immutable.  Iterating
+   over a layered set merges the two layers in sorted order. */
+#if HAVE_BOEHMGC
+typedef std::vector<Attr, gc_allocator<Attr> > BindingsBase;
+#else
+typedef std::vector<Attr> BindingsBase;
+#endif
+
+
+class Bindings
+{
+public:
+
+    class iterator
+    {
+    public:
+        iterator() : o(0), oEnd(0), b(0), bEnd(0) { };
+
+        Attr & operator * () const { return *cur(); }
+        Attr * operator -> () const { return cur(); }
+
+        iterator & operator ++ ()
+        {
+            if (cur() == o) {
+                if (b != bEnd && b->name == o->name) ++b;
+                ++o;
+            } else
+                ++b;
+            return *this;
+        }
+
+        iterator operator ++ (int)
+        {
+            iterator i(*this);
+            ++*this;
+            return i;
+        }
+
+        bool operator == (const iterator & i) const
+        {
+            return o == i.o && b == i.b;
+        }
+
+        bool operator != (const iterator & i) const
+        {
+            return !(*this == i);
+        }
+
+    private:
+        friend class Bindings;
+
+        /* The positions in the vector and in the base. */
+        Attr * o, * oEnd, * b, * bEnd;
+
+        iterator(Attr * o, Attr * oEnd, Attr * b, Attr * bEnd)
+            : o(o), oEnd(oEnd), b(b), bEnd(bEnd) { };
+
+        Attr * cur() const
+        {
+            return o != oEnd && (b == bEnd || !(b->name < o->name)) ? o : b;
+        }
+    };
+
+    Bindings() : extra(0) { };
+
+    iterator begin()
+    {
+        Bindings * base = getBase();
+        return base
+            ? iterator(first(attrs), last(attrs), first(base->attrs), last(base->attrs))
+            : iterator(first(attrs), last(attrs), 0, 0);
+    }
+
+    iterator end()
+    {
+        Bindings * base = getBase();
+        return base
+            ? iterator(last(attrs), last(attrs), last(base->attrs), last(base->attrs))
+            : iterator(last(attrs), last(attrs), 0, 0);
+    }
+
+    size_t size() const { return extra && extra->base ? extra->total : attrs.size(); }
+    bool empty() const { return size() == 0; }
+
+    /* Look up an attribute.  For layered sets, the result can only
+       be dereferenced or compared to end(), not incremented. */
+    iterator find(const Symbol & name);
+
+    /* Operations for building a set.  Call sort() after adding
+       attributes out of order. */
+    void reserve(size_t n) { attrs.reserve(n); }
+    void push_back(const Attr & attr) { assert(!getBase()); attrs.push_back(attr); }
+    Attr & operator [] (size_t n) { assert(!getBase()); return attrs[n]; }
+    void sort();
+
+    /* Add an attribute to a sorted set. */
+    void insert(const Attr & attr);
+
+    /* Turn this empty set into `b1 // b2' by layering the smaller
+       set on top of the larger one.  Returns false, leaving the set
+       empty, if the sets aren't suitable for that. */
+    bool layer(Bindings & b1, Bindings & b2);
+
+    /* The number of attributes stored in this set rather than in its
+       base. */
+    size_t ownSize() const { return attrs.size(); }
+
+private:
+    BindingsBase attrs;
+
+    struct Index;
+
+    /* Most sets are small and flat, so the rest of the state is kept
+       out of line. */
+    struct Extra
+    {
+        /* The set underneath a layered set, and the number of
+           attributes in the union. */
+        Bindings * base;
+        size_t total;
+
+        Index * volatile index;
+    };
+
+    Extra * volatile extra;
+
+    Bindings * getBase() const { return extra ? extra->base : 0; }
+
+    static Attr * first(BindingsBase & v) { return v.empty() ? 0 : &v[0]; }
+    static Attr * last(BindingsBase & v) { return v.empty() ? 0 : &v[0] + v.size(); }
+
+    /* Look up an attribute in the vector. */
+    Attr * lookup(const Symbol & name);
+    Extra * getExtra();
+    Index * getIndex();
+};
+
 void copyContext(const Value & v, PathSet & context);
 
 
@@ -83,6 +217,12 @@ void copyContext(const Value & v, PathSet & context);
 typedef std::map<Path, Path> SrcToStore;
 
 struct EvalState;
+class EvalInputs;
+
+
+/* The search path lookups (`<foo>') done while parsing a file, and
+   their results. */
+typedef list<std::pair<string, Path> > SearchPathLookups;
 
 
 std::ostream & operator << (std::ostream & str, const Value & v);
@@ -102,6 +242,10 @@ public:
        already exist there. */
     bool repair;
 
+    /* The inputs of the evaluation, if they're being recorded for
+       the evaluation cache (see eval-cache.hh), or 0 otherwise. */
+    EvalInputs * inputs;
+
 private:
     SrcToStore srcToStore;
 
@@ -113,6 +257,13 @@ private:
 #endif
     FileEvalCache fileEvalCache;
 
+    /* Whether values may be forced by several threads at once (see
+       ConcurrentEval). */
+    bool concurrent;
+
+    /* Where values, environments and sets are allocated. */
+    Arena valueArena, envArena, bindingsArena;
+
     typedef list<std::pair<string, Path> > SearchPath;
     SearchPath searchPath;
     SearchPath::iterator searchPathInsertionPoint;
@@ -156,6 +307,11 @@ public:
        result.  Otherwise, this is a no-op. */
     inline void forceValue(Value & v);
 
+private:
+    void forceValueConcurrent(Value & v);
+
+public:
+
     /* Force a value, then recursively force list elements and
        attributes. */
     void strictForceValue(Value & v);
@@ -221,7 +377,12 @@ private:
     friend class ExprLet;
 
     Expr * parse(const char * text, const Path & path,
-        const Path & basePath, StaticEnv & staticEnv);
+        const Path & basePath, StaticEnv & staticEnv,
+        SearchPathLookups * lookups = 0);
+
+    /* Parse the contents `s' of `path', or load the result from the
+       parse cache (see parse-cache.hh). */
+    Expr * parseCached(const string & s, const Path & path);
 
 public:
 
@@ -282,9 +443,82 @@ private:
     friend class ExprOpConcatLists;
     friend class ExprSelect;
     friend void prim_getAttr(EvalState & state, Value * * args, Value & v);
+    friend class ConcurrentEval;
+    friend class EvalCache;
+};
+
+
+/* While an object of this type exists, `state' may be used by several
+   threads at once.  The thread that created it is the main thread;
+   every other thread must hold an EvalWorker.  Thunks are claimed
+   atomically, so each thunk is evaluated by at most one thread at a
+   time, and the result is only made visible once it is complete.  If
+   the main thread needs a thunk that a worker is evaluating, it waits
+   for the worker.  If a worker needs a thunk that another thread is
+   evaluating, it throws EvalContention, which resets the thunks it
+   had claimed.  Since workers never wait, this can't deadlock, and
+   since a worker's results are either published in full or not at
+   all, the main thread computes the same values as it would on its
+   own.  Note that the evaluation statistics are approximate in this
+   mode, and that it must not be entered while the main thread is
+   evaluating a value. */
+class ConcurrentEval
+{
+public:
+    ConcurrentEval(EvalState & state);
+    ~ConcurrentEval();
+
+    /* Whether concurrent evaluation is possible.  It isn't if libgc
+       doesn't support threads, or if NIX_COUNT_CALLS is set. */
+    static bool available(EvalState & state);
+
+    /* Make the workers give up as soon as possible. */
+    void cancel();
+
+private:
+    EvalState & state;
+};
+
+
+/* Registers the current thread as a worker thread during concurrent
+   evaluation (and with the garbage collector). */
+class EvalWorker
+{
+public:
+    EvalWorker();
+    ~EvalWorker();
 };
 
 
+/* Thrown in a worker thread if it needs a value or a lock that is
+   held by another thread.  It doesn't derive from Error so that the
+   evaluator doesn't mistake it for an evaluation error. */
+struct EvalContention { };
+
+
+/* During concurrent evaluation, this serialises access to the Nix
+   store and to the evaluator's caches.  It's recursive, and a no-op
+   otherwise.  In a worker thread it throws EvalContention rather than
+   blocking. */
+class EvalLock
+{
+public:
+    EvalLock();
+    ~EvalLock();
+
+private:
+    bool locked;
+};
+
+
+/* Called before an operation with an observable side effect, such as
+   printing a message at level `level'.  In a worker thread, this
+   throws EvalContention if the effect would be visible, so that only
+   the main thread performs it, in evaluation order.  Workers thus
+   never write to the log, which isn't thread-safe. */
+void checkSideEffect(Verbosity level);
+
+
 /* Return a string representing the type of the value `v'. */
 string showType(const Value & v);
 
@@ -1,5 +1,7 @@
 #include "get-drvs.hh"
 #include "util.hh"
+#include "globals.hh"
+#include "thread-pool.hh"
 #include "eval-inline.hh"
 
 #include <cstring>
@@ -39,16 +41,16 @@ DrvInfo::Outputs DrvInfo::queryOutputs()
             state->forceList(*i->value);
 
             /* For each output... */
-            for (unsigned int j = 0; j < i->value->list.length; ++j) {
+            for (unsigned int j = 0; j < i->value->list().length; ++j) {
                 /* Evaluate the corresponding set. */
-                string name = state->forceStringNoCtx(*i->value->list.elems[j]);
+                string name = state->forceStringNoCtx(*i->value->list().elems[j]);
                 Bindings::iterator out = attrs->find(state->symbols.create(name));
                 if (out == attrs->end()) continue; // FIXME: throw error?
                 state->forceAttrs(*out->value);
 
                 /* And evaluate its ‘outPath’ attribute. */
-                Bindings::iterator outPath = out->value->attrs->find(state->sOutPath);
-                if (outPath == out->value->attrs->end()) continue; // FIXME: throw error?
+                Bindings::iterator outPath = out->value->attrs()->find(state->sOutPath);
+                if (outPath == out->value->attrs()->end()) continue; // FIXME: throw error?
                 PathSet context;
                 outputs[name] = state->coerceToPath(*outPath->value, context);
             }
@@ -76,7 +78,7 @@ Bindings * DrvInfo::getMeta()
     Bindings::iterator a = attrs->find(state->sMeta);
     if (a == attrs->end()) return 0;
     state->forceAttrs(*a->value);
-    meta = a->value->attrs;
+    meta = a->value->attrs();
     return meta;
 }
 
@@ -94,19 +96,19 @@ StringSet DrvInfo::queryMetaNames()
 bool DrvInfo::checkMeta(Value & v)
 {
     state->forceValue(v);
-    if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n)
-            if (!checkMeta(*v.list.elems[n])) return false;
+    if (v.type() == tList) {
+        for (unsigned int n = 0; n < v.list().length; ++n)
+            if (!checkMeta(*v.list().elems[n])) return false;
         return true;
     }
-    else if (v.type == tAttrs) {
-        Bindings::iterator i = v.attrs->find(state->sOutPath);
-        if (i != v.attrs->end()) return false;
-        foreach (Bindings::iterator, i, *v.attrs)
+    else if (v.type() == tAttrs) {
+        Bindings::iterator i = v.attrs()->find(state->sOutPath);
+        if (i != v.attrs()->end()) return false;
+        foreach (Bindings::iterator, i, *v.attrs())
             if (!checkMeta(*i->value)) return false;
         return true;
     }
-    else return v.type == tInt || v.type == tBool || v.type == tString;
+    else return v.type() == tInt || v.type() == tBool || v.type() == tString;
 }
 
 
@@ -122,8 +124,8 @@ Value * DrvInfo::queryMeta(const string & name)
 string DrvInfo::queryMetaString(const string & name)
 {
     Value * v = queryMeta(name);
-    if (!v || v->type != tString) return "";
-    return v->string.s;
+    if (!v || v->type() != tString) return "";
+    return v->string().s;
 }
 
 
@@ -131,12 +133,12 @@ int DrvInfo::queryMetaInt(const string & name, int def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tInt) return v->integer;
-    if (v->type == tString) {
+    if (v->type() == tInt) return v->integer();
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            integer meta fields. */
         int n;
-        if (string2Int(v->string.s, n)) return n;
+        if (string2Int(v->string().s, n)) return n;
     }
     return def;
 }
@@ -146,12 +148,12 @@ bool DrvInfo::queryMetaBool(const string & name, bool def)
 {
     Value * v = queryMeta(name);
     if (!v) return def;
-    if (v->type == tBool) return v->boolean;
-    if (v->type == tString) {
+    if (v->type() == tBool) return v->boolean();
+    if (v->type() == tString) {
         /* Backwards compatibility with before we had support for
            Boolean meta fields. */
-        if (strcmp(v->string.s, "true") == 0) return true;
-        if (strcmp(v->string.s, "false") == 0) return false;
+        if (strcmp(v->string().s, "true") == 0) return true;
+        if (strcmp(v->string().s, "false") == 0) return false;
     }
     return def;
 }
@@ -190,21 +192,21 @@ static bool getDerivation(EvalState & state, Value & v,
 
         /* Remove spurious duplicates (e.g., a set like `rec { x =
            derivation {...}; y = x;}'. */
-        if (done.find(v.attrs) != done.end()) return false;
-        done.insert(v.attrs);
+        if (done.find(v.attrs()) != done.end()) return false;
+        done.insert(v.attrs());
 
-        Bindings::iterator i = v.attrs->find(state.sName);
+        Bindings::iterator i = v.attrs()->find(state.sName);
         /* !!! We really would like to have a decent back trace here. */
-        if (i == v.attrs->end()) throw TypeError("derivation name missing");
+        if (i == v.attrs()->end()) throw TypeError("derivation name missing");
 
-        Bindings::iterator i2 = v.attrs->find(state.sSystem);
+        Bindings::iterator i2 = v.attrs()->find(state.sSystem);
 
         DrvInfo drv(
             state,
             state.forceStringNoCtx(*i->value),
             attrPath,
-            i2 == v.attrs->end() ? "unknown" : state.forceStringNoCtx(*i2->value),
-            v.attrs);
+            i2 == v.attrs()->end() ? "unknown" : state.forceStringNoCtx(*i2->value),
+            v.attrs());
 
         drvs.push_back(drv);
         return false;
@@ -234,10 +236,140 @@ static string addToPath(const string & s1, const string & s2)
 }
 
 
+/* Evaluates the attributes of the sets and the elements of the lists
+   that getDerivations() walks through on a pool of worker threads,
+   ahead of the main thread.  The workers evaluate the same values as
+   getDerivation() (and descend into sets that have a
+   `recurseForDerivations' attribute, as getDerivations() does), but
+   they don't produce results: all the decisions are still made by
+   the main thread, which merely finds many values already evaluated.
+   Errors in the workers are ignored; the thunk is reset and the main
+   thread will encounter the error itself.  The same happens when a
+   worker is about to print something (e.g. in `builtins.trace'), so
+   the output is the same as in a serial evaluation. */
+class Prefetcher
+{
+public:
+    Prefetcher(EvalState & state, unsigned int nrThreads);
+    ~Prefetcher();
+
+    /* Queue the attributes or elements of `v', unless that has been
+       done already. */
+    void expand(Value & v);
+
+private:
+
+    struct PrefetchTask : Task
+    {
+        Prefetcher & prefetcher;
+        Value * v;
+        PrefetchTask(Prefetcher & prefetcher, Value * v)
+            : prefetcher(prefetcher), v(v) { }
+        void run() { prefetcher.prefetch(*v); }
+    };
+
+    EvalState & state;
+    ConcurrentEval concurrent;
+    Symbol sRecurse;
+    volatile bool cancelled;
+
+    pthread_mutex_t mutex;
+    std::set<void *> expanded;
+
+    /* The queued values must stay visible to the garbage
+       collector. */
+#if HAVE_BOEHMGC
+    typedef list<PrefetchTask, traceable_allocator<PrefetchTask> > Tasks;
+#else
+    typedef list<PrefetchTask> Tasks;
+#endif
+    Tasks tasks;
+
+    ThreadPool pool;
+
+    void prefetch(Value & v);
+};
+
+
+Prefetcher::Prefetcher(EvalState & state, unsigned int nrThreads)
+    : state(state)
+    , concurrent(state)
+    , sRecurse(state.symbols.create("recurseForDerivations"))
+    , cancelled(false)
+    , pool(nrThreads)
+{
+    pthread_mutex_init(&mutex, 0);
+}
+
+
+Prefetcher::~Prefetcher()
+{
+    /* The main thread is done, so discard the remaining work. */
+    cancelled = true;
+    concurrent.cancel();
+    try {
+        pool.wait();
+    } catch (...) {
+        ignoreException();
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void Prefetcher::expand(Value & v)
+{
+    pthread_mutex_lock(&mutex);
+    bool isNew = expanded.insert(v.type() == tAttrs ? (void *) v.attrs() : (void *) v.list().elems).second;
+    pthread_mutex_unlock(&mutex);
+    if (!isNew) return;
+
+    vector<Value *> values;
+    if (v.type() == tAttrs) {
+        /* In the order in which getDerivations() visits them. */
+        typedef std::map<string, Value *> SortedAttrs;
+        SortedAttrs attrs;
+        foreach (Bindings::iterator, i, *v.attrs())
+            attrs.insert(std::pair<string, Value *>(i->name, i->value));
+        foreach (SortedAttrs::iterator, i, attrs)
+            values.push_back(i->second);
+    } else
+        values.insert(values.end(), v.list().elems, v.list().elems + v.list().length);
+
+    pthread_mutex_lock(&mutex);
+    foreach (vector<Value *>::iterator, i, values) {
+        tasks.push_back(PrefetchTask(*this, *i));
+        pool.enqueue(tasks.back());
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void Prefetcher::prefetch(Value & v)
+{
+    if (cancelled) return;
+    EvalWorker worker;
+    try {
+        state.forceValue(v);
+        if (state.isDerivation(v)) {
+            Bindings::iterator i = v.attrs()->find(state.sName);
+            if (i != v.attrs()->end()) state.forceValue(*i->value);
+            i = v.attrs()->find(state.sSystem);
+            if (i != v.attrs()->end()) state.forceValue(*i->value);
+        } else if (v.type() == tAttrs) {
+            Bindings::iterator i = v.attrs()->find(sRecurse);
+            if (i != v.attrs()->end() && state.forceBool(*i->value))
+                expand(v);
+        }
+    } catch (EvalContention & e) {
+    } catch (Error & e) {
+    }
+}
+
+
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
     DrvInfos & drvs, Done & done,
-    bool ignoreAssertionFailures)
+    bool ignoreAssertionFailures, Prefetcher * prefetcher)
 {
     Value v;
     state.autoCallFunction(autoArgs, vIn, v);
@@ -245,11 +377,13 @@ static void getDerivations(EvalState & state, Value & vIn,
     /* Process the expression. */
     if (!getDerivation(state, v, pathPrefix, drvs, done, ignoreAssertionFailures)) ;
 
-    else if (v.type == tAttrs) {
+    else if (v.type() == tAttrs) {
+
+        if (prefetcher) prefetcher->expand(v);
 
         /* !!! undocumented hackery to support combining channels in
            nix-env.cc. */
-        bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
+        bool combineChannels = v.attrs()->find(state.symbols.create("_combineChannels")) != v.attrs()->end();
 
         /* Consider the attributes in sorted order to get more
            deterministic behaviour in nix-env operations (e.g. when
@@ -258,35 +392,36 @@ static void getDerivations(EvalState & state, Value & vIn,
            precedence). */
         typedef std::map<string, Symbol> SortedSymbols;
         SortedSymbols attrs;
-        foreach (Bindings::iterator, i, *v.attrs)
+        foreach (Bindings::iterator, i, *v.attrs())
             attrs.insert(std::pair<string, Symbol>(i->name, i->name));
 
         foreach (SortedSymbols::iterator, i, attrs) {
             startNest(nest, lvlDebug, format("evaluating attribute `%1%'") % i->first);
             string pathPrefix2 = addToPath(pathPrefix, i->first);
-            Value & v2(*v.attrs->find(i->second)->value);
+            Value & v2(*v.attrs()->find(i->second)->value);
             if (combineChannels)
-                getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+                getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, prefetcher);
             else if (getDerivation(state, v2, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
                 /* If the value of this attribute is itself a set,
                    should we recurse into it?  => Only if it has a
                    `recurseForDerivations = true' attribute. */
-                if (v2.type == tAttrs) {
-                    Bindings::iterator j = v2.attrs->find(state.symbols.create("recurseForDerivations"));
-                    if (j != v2.attrs->end() && state.forceBool(*j->value))
-                        getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+                if (v2.type() == tAttrs) {
+                    Bindings::iterator j = v2.attrs()->find(state.symbols.create("recurseForDerivations"));
+                    if (j != v2.attrs()->end() && state.forceBool(*j->value))
+                        getDerivations(state, v2, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, prefetcher);
                 }
             }
         }
     }
 
-    else if (v.type == tList) {
-        for (unsigned int n = 0; n < v.list.length; ++n) {
+    else if (v.type() == tList) {
+        if (prefetcher) prefetcher->expand(v);
+        for (unsigned int n = 0; n < v.list().length; ++n) {
             startNest(nest, lvlDebug,
                 format("evaluating list element"));
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
-            if (getDerivation(state, *v.list.elems[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
-                getDerivations(state, *v.list.elems[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+            if (getDerivation(state, *v.list().elems[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
+                getDerivations(state, *v.list().elems[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures, prefetcher);
         }
     }
 
@@ -298,7 +433,12 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
 {
     Done done;
-    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
+    unsigned int nrThreads = getThreadCount(settings.evalThreads);
+    if (nrThreads > 1 && ConcurrentEval::available(state)) {
+        Prefetcher prefetcher(state, nrThreads - 1);
+        getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures, &prefetcher);
+    } else
+        getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures, 0);
 }
 
 
@@ -32,6 +32,8 @@ private:
 
     bool checkMeta(Value & v);
 
+    friend class EvalCache;
+
 public:
     string name;
     string attrPath; /* path towards the derivation */
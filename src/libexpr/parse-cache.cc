@@ -0,0 +1,764 @@
+#include "parse-cache.hh"
+#include "globals.hh"
+#include "util.hh"
+#include "hash.hh"
+
+#include <map>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <utime.h>
+#include <pthread.h>
+
+
+namespace nix {
+
+
+static const char magic[] = "nixast1\n";
+
+
+/* Cache entries that haven't been used for this long are removed.
+   The modification time of an entry is its last use, updated at most
+   once per `touchInterval'.  The cache is pruned at most once per
+   `pruneInterval', as recorded by the modification time of the file
+   `pruneStamp'. */
+static const time_t maxAge = 30 * 24 * 60 * 60;
+static const time_t touchInterval = 24 * 60 * 60;
+static const time_t pruneInterval = 24 * 60 * 60;
+static const char pruneStamp[] = ".last-pruned";
+
+
+enum {
+    nBackRef = 0, nInt, nString, nPath, nVar, nSelect, nOpHasAttr,
+    nAttrs, nList, nLambda, nLet, nWith, nIf, nAssert, nOpNot, nBuiltin,
+    nApp, nOpEq, nOpNEq, nOpAnd, nOpOr, nOpImpl, nOpUpdate,
+    nOpConcatLists, nConcatStrings, nPos
+};
+
+
+struct ExprWriter
+{
+    string out;
+    std::map<string, unsigned int> strings;
+    vector<const string *> stringsInOrder;
+    std::map<Expr *, unsigned int> exprs;
+
+    void num(unsigned long long n)
+    {
+        while (n >= 0x80) {
+            out += (char) (n | 0x80);
+            n >>= 7;
+        }
+        out += (char) n;
+    }
+
+    void str(const string & s)
+    {
+        std::pair<std::map<string, unsigned int>::iterator, bool> res =
+            strings.insert(std::make_pair(s, strings.size()));
+        if (res.second) stringsInOrder.push_back(&res.first->first);
+        num(res.first->second);
+    }
+
+    void sym(const Symbol & s)
+    {
+        if (!s.set()) { num(0); return; }
+        num(1);
+        str(s);
+    }
+
+    void pos(const Pos & pos)
+    {
+        num(pos.line);
+        if (pos.line) num(pos.column);
+    }
+
+    /* The dynamic parts of an attribute path are written before the
+       node, the names after it. */
+    void attrPathExprs(const AttrPath & attrPath)
+    {
+        foreach (AttrPath::const_iterator, i, attrPath)
+            if (!i->symbol.set()) expr(i->expr);
+    }
+
+    void attrPath(const AttrPath & attrPath)
+    {
+        num(attrPath.size());
+        foreach (AttrPath::const_iterator, i, attrPath)
+            if (i->symbol.set()) {
+                num(1);
+                str(i->symbol);
+            } else
+                num(0);
+    }
+
+    void binOp(unsigned int tag, Expr * e1, Expr * e2)
+    {
+        expr(e1);
+        expr(e2);
+        num(tag);
+    }
+
+    /* Children are written before their parent, so that the reader
+       can construct each node in one go. */
+    void expr(Expr * e);
+};
+
+
+void ExprWriter::expr(Expr * e)
+{
+    std::map<Expr *, unsigned int>::iterator i = exprs.find(e);
+    if (i != exprs.end()) {
+        num(nBackRef);
+        num(i->second);
+        return;
+    }
+
+    if (ExprInt * e2 = dynamic_cast<ExprInt *>(e)) {
+        num(nInt);
+        /* Zig-zag encoding, so that small negative numbers are
+           short. */
+        num(e2->n < 0 ? ((unsigned long long) ~e2->n << 1) | 1 : (unsigned long long) e2->n << 1);
+    }
+
+    else if (ExprString * e2 = dynamic_cast<ExprString *>(e)) {
+        num(nString);
+        str(e2->s);
+    }
+
+    else if (ExprPath * e2 = dynamic_cast<ExprPath *>(e)) {
+        num(nPath);
+        str(e2->s);
+    }
+
+    else if (ExprVar * e2 = dynamic_cast<ExprVar *>(e)) {
+        num(nVar);
+        pos(e2->pos);
+        str(e2->name);
+    }
+
+    else if (ExprSelect * e2 = dynamic_cast<ExprSelect *>(e)) {
+        expr(e2->e);
+        if (e2->def) expr(e2->def);
+        attrPathExprs(e2->attrPath);
+        num(nSelect);
+        attrPath(e2->attrPath);
+        num(e2->def != 0);
+    }
+
+    else if (ExprOpHasAttr * e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        expr(e2->e);
+        attrPathExprs(e2->attrPath);
+        num(nOpHasAttr);
+        attrPath(e2->attrPath);
+    }
+
+    else if (ExprAttrs * e2 = dynamic_cast<ExprAttrs *>(e)) {
+        foreach (ExprAttrs::AttrDefs::iterator, j, e2->attrs)
+            expr(j->second.e);
+        foreach (ExprAttrs::DynamicAttrDefs::iterator, j, e2->dynamicAttrs) {
+            expr(j->nameExpr);
+            expr(j->valueExpr);
+        }
+        num(nAttrs);
+        num(e2->recursive);
+        num(e2->attrs.size());
+        foreach (ExprAttrs::AttrDefs::iterator, j, e2->attrs) {
+            str(j->first);
+            num(j->second.inherited);
+            pos(j->second.pos);
+        }
+        num(e2->dynamicAttrs.size());
+        foreach (ExprAttrs::DynamicAttrDefs::iterator, j, e2->dynamicAttrs)
+            pos(j->pos);
+    }
+
+    else if (ExprList * e2 = dynamic_cast<ExprList *>(e)) {
+        foreach (vector<Expr *>::iterator, j, e2->elems)
+            expr(*j);
+        num(nList);
+        num(e2->elems.size());
+    }
+
+    else if (ExprLambda * e2 = dynamic_cast<ExprLambda *>(e)) {
+        if (e2->matchAttrs)
+            foreach (Formals::Formals_::iterator, j, e2->formals->formals)
+                if (j->def) expr(j->def);
+        expr(e2->body);
+        num(nLambda);
+        pos(e2->pos);
+        sym(e2->name);
+        str(e2->arg);
+        num(e2->matchAttrs);
+        if (e2->matchAttrs) {
+            num(e2->formals->ellipsis);
+            num(e2->formals->formals.size());
+            foreach (Formals::Formals_::iterator, j, e2->formals->formals) {
+                str(j->name);
+                num(j->def != 0);
+            }
+        }
+    }
+
+    else if (ExprLet * e2 = dynamic_cast<ExprLet *>(e)) {
+        expr(e2->attrs);
+        expr(e2->body);
+        num(nLet);
+    }
+
+    else if (ExprWith * e2 = dynamic_cast<ExprWith *>(e)) {
+        expr(e2->attrs);
+        expr(e2->body);
+        num(nWith);
+        pos(e2->pos);
+    }
+
+    else if (ExprIf * e2 = dynamic_cast<ExprIf *>(e)) {
+        expr(e2->cond);
+        expr(e2->then);
+        expr(e2->else_);
+        num(nIf);
+    }
+
+    else if (ExprAssert * e2 = dynamic_cast<ExprAssert *>(e)) {
+        expr(e2->cond);
+        expr(e2->body);
+        num(nAssert);
+        pos(e2->pos);
+    }
+
+    else if (ExprOpNot * e2 = dynamic_cast<ExprOpNot *>(e)) {
+        expr(e2->e);
+        num(nOpNot);
+    }
+
+    else if (ExprBuiltin * e2 = dynamic_cast<ExprBuiltin *>(e)) {
+        num(nBuiltin);
+        str(e2->name);
+    }
+
+    else if (ExprApp * e2 = dynamic_cast<ExprApp *>(e))
+        binOp(nApp, e2->e1, e2->e2);
+    else if (ExprOpEq * e2 = dynamic_cast<ExprOpEq *>(e))
+        binOp(nOpEq, e2->e1, e2->e2);
+    else if (ExprOpNEq * e2 = dynamic_cast<ExprOpNEq *>(e))
+        binOp(nOpNEq, e2->e1, e2->e2);
+    else if (ExprOpAnd * e2 = dynamic_cast<ExprOpAnd *>(e))
+        binOp(nOpAnd, e2->e1, e2->e2);
+    else if (ExprOpOr * e2 = dynamic_cast<ExprOpOr *>(e))
+        binOp(nOpOr, e2->e1, e2->e2);
+    else if (ExprOpImpl * e2 = dynamic_cast<ExprOpImpl *>(e))
+        binOp(nOpImpl, e2->e1, e2->e2);
+    else if (ExprOpUpdate * e2 = dynamic_cast<ExprOpUpdate *>(e))
+        binOp(nOpUpdate, e2->e1, e2->e2);
+    else if (ExprOpConcatLists * e2 = dynamic_cast<ExprOpConcatLists *>(e))
+        binOp(nOpConcatLists, e2->e1, e2->e2);
+
+    else if (ExprConcatStrings * e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        foreach (vector<Expr *>::iterator, j, *e2->es)
+            expr(*j);
+        num(nConcatStrings);
+        num(e2->forceString);
+        num(e2->es->size());
+    }
+
+    else if (ExprPos * e2 = dynamic_cast<ExprPos *>(e)) {
+        num(nPos);
+        pos(e2->pos);
+    }
+
+    else
+        throw Error("cannot serialise expression");
+
+    unsigned int n = exprs.size();
+    exprs[e] = n;
+}
+
+
+string serialiseExpr(Expr * e, const Path & path,
+    const SearchPathLookups & lookups)
+{
+    ExprWriter body;
+    body.str(path);
+    body.num(lookups.size());
+    foreach (SearchPathLookups::const_iterator, i, lookups) {
+        body.str(i->first);
+        body.str(i->second);
+    }
+    body.expr(e);
+
+    ExprWriter header;
+    header.out = string(magic, sizeof(magic) - 1);
+    header.num(body.stringsInOrder.size());
+    foreach (vector<const string *>::iterator, i, body.stringsInOrder) {
+        header.num((*i)->size());
+        header.out += **i;
+    }
+
+    return header.out + body.out;
+}
+
+
+MakeError(CorruptExpr, Error)
+
+
+struct ExprReader
+{
+    SymbolTable & symbols;
+    const unsigned char * p, * end;
+
+    /* The string table.  Strings are converted to symbols when
+       they're first used. */
+    vector<std::pair<const unsigned char *, size_t> > strings;
+    vector<Symbol> syms;
+
+    Symbol file;
+    vector<Expr *> stack;
+    vector<Expr *> exprs;
+
+    ExprReader(SymbolTable & symbols, const unsigned char * p, size_t size)
+        : symbols(symbols), p(p), end(p + size) { };
+
+    unsigned long long num()
+    {
+        unsigned long long n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            if (p == end || shift > 63) throw CorruptExpr("corrupt serialised expression");
+            unsigned char c = *p++;
+            n |= (unsigned long long) (c & 0x7f) << shift;
+            if (!(c & 0x80)) return n;
+        }
+    }
+
+    unsigned int index()
+    {
+        unsigned long long n = num();
+        if (n >= strings.size()) throw CorruptExpr("corrupt serialised expression");
+        return n;
+    }
+
+    string str()
+    {
+        unsigned int n = index();
+        return string((const char *) strings[n].first, strings[n].second);
+    }
+
+    Symbol sym()
+    {
+        unsigned int n = index();
+        if (!syms[n].set())
+            syms[n] = symbols.create(string((const char *) strings[n].first, strings[n].second));
+        return syms[n];
+    }
+
+    Symbol optSym()
+    {
+        return num() ? sym() : Symbol();
+    }
+
+    Pos pos()
+    {
+        unsigned int line = num();
+        if (!line) return noPos;
+        unsigned int column = num();
+        return Pos(file, line, column);
+    }
+
+    Expr * pop()
+    {
+        if (stack.empty()) throw CorruptExpr("corrupt serialised expression");
+        Expr * e = stack.back();
+        stack.pop_back();
+        return e;
+    }
+
+    /* Pop `n' expressions, in the order in which they were
+       pushed. */
+    void pop(size_t n, vector<Expr *> & res)
+    {
+        if (stack.size() < n) throw CorruptExpr("corrupt serialised expression");
+        res.assign(stack.end() - n, stack.end());
+        stack.resize(stack.size() - n);
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath res;
+        unsigned int n = num();
+        vector<Expr *> es;
+        for (unsigned int i = 0; i < n; ++i)
+            res.push_back(num() ? AttrName(sym()) : AttrName((Expr *) 0));
+        /* The dynamic attribute names were pushed in order. */
+        unsigned int nrDynamic = 0;
+        foreach (AttrPath::iterator, i, res)
+            if (!i->symbol.set()) nrDynamic++;
+        pop(nrDynamic, es);
+        unsigned int j = 0;
+        foreach (AttrPath::iterator, i, res)
+            if (!i->symbol.set()) i->expr = es[j++];
+        return res;
+    }
+
+    Expr * read();
+};
+
+
+Expr * ExprReader::read()
+{
+    while (true) {
+        unsigned int tag = num();
+        Expr * e;
+
+        switch (tag) {
+
+            case nBackRef: {
+                unsigned long long n = num();
+                if (n >= exprs.size()) throw CorruptExpr("corrupt serialised expression");
+                stack.push_back(exprs[n]);
+                continue;
+            }
+
+            case nInt: {
+                unsigned long long n = num();
+                e = new ExprInt(n & 1 ? ~(NixInt) (n >> 1) : (NixInt) (n >> 1));
+                break;
+            }
+
+            case nString:
+                e = new ExprString(sym());
+                break;
+
+            case nPath:
+                e = new ExprPath(str());
+                break;
+
+            case nVar: {
+                Pos pos2 = pos();
+                e = new ExprVar(pos2, sym());
+                break;
+            }
+
+            case nSelect: {
+                /* The dynamic parts of the attribute path are on top
+                   of the stack. */
+                AttrPath attrPath2 = attrPath();
+                bool hasDef = num();
+                Expr * def = hasDef ? pop() : 0;
+                e = new ExprSelect(pop(), attrPath2, def);
+                break;
+            }
+
+            case nOpHasAttr: {
+                AttrPath attrPath2 = attrPath();
+                e = new ExprOpHasAttr(pop(), attrPath2);
+                break;
+            }
+
+            case nAttrs: {
+                ExprAttrs * e2 = new ExprAttrs;
+                e2->recursive = num();
+                unsigned int nrAttrs = num();
+                vector<Symbol> names;
+                vector<ExprAttrs::AttrDef> defs;
+                for (unsigned int i = 0; i < nrAttrs; ++i) {
+                    names.push_back(sym());
+                    ExprAttrs::AttrDef def;
+                    def.inherited = num();
+                    def.pos = pos();
+                    defs.push_back(def);
+                }
+                unsigned int nrDynamic = num();
+                vector<Pos> dynPos;
+                for (unsigned int i = 0; i < nrDynamic; ++i)
+                    dynPos.push_back(pos());
+                vector<Expr *> es;
+                pop(nrAttrs + 2 * nrDynamic, es);
+                for (unsigned int i = 0; i < nrAttrs; ++i) {
+                    defs[i].e = es[i];
+                    e2->attrs[names[i]] = defs[i];
+                }
+                for (unsigned int i = 0; i < nrDynamic; ++i)
+                    e2->dynamicAttrs.push_back(ExprAttrs::DynamicAttrDef(
+                        es[nrAttrs + 2 * i], es[nrAttrs + 2 * i + 1], dynPos[i]));
+                e = e2;
+                break;
+            }
+
+            case nList: {
+                ExprList * e2 = new ExprList;
+                pop(num(), e2->elems);
+                e = e2;
+                break;
+            }
+
+            case nLambda: {
+                Expr * body = pop();
+                Pos pos2 = pos();
+                Symbol name = optSym();
+                Symbol arg = sym();
+                bool matchAttrs = num();
+                Formals * formals = 0;
+                if (matchAttrs) {
+                    formals = new Formals;
+                    formals->ellipsis = num();
+                    unsigned int nrFormals = num();
+                    vector<std::pair<Symbol, bool> > fs;
+                    unsigned int nrDefs = 0;
+                    for (unsigned int i = 0; i < nrFormals; ++i) {
+                        Symbol name = sym();
+                        bool hasDef = num();
+                        fs.push_back(std::make_pair(name, hasDef));
+                        if (hasDef) nrDefs++;
+                    }
+                    vector<Expr *> defs;
+                    pop(nrDefs, defs);
+                    unsigned int j = 0;
+                    for (unsigned int i = 0; i < nrFormals; ++i) {
+                        formals->formals.push_back(Formal(fs[i].first, fs[i].second ? defs[j++] : 0));
+                        formals->argNames.insert(fs[i].first);
+                    }
+                }
+                ExprLambda * e2 = new ExprLambda(pos2, arg, matchAttrs, formals, body);
+                e2->name = name;
+                e = e2;
+                break;
+            }
+
+            case nLet: {
+                Expr * body = pop();
+                ExprAttrs * attrs = dynamic_cast<ExprAttrs *>(pop());
+                if (!attrs) throw CorruptExpr("corrupt serialised expression");
+                e = new ExprLet(attrs, body);
+                break;
+            }
+
+            case nWith: {
+                Expr * body = pop();
+                Expr * attrs = pop();
+                e = new ExprWith(pos(), attrs, body);
+                break;
+            }
+
+            case nIf: {
+                Expr * else_ = pop();
+                Expr * then = pop();
+                e = new ExprIf(pop(), then, else_);
+                break;
+            }
+
+            case nAssert: {
+                Expr * body = pop();
+                e = new ExprAssert(pos(), pop(), body);
+                break;
+            }
+
+            case nOpNot:
+                e = new ExprOpNot(pop());
+                break;
+
+            case nBuiltin:
+                e = new ExprBuiltin(sym());
+                break;
+
+            case nApp: case nOpEq: case nOpNEq: case nOpAnd: case nOpOr:
+            case nOpImpl: case nOpUpdate: case nOpConcatLists: {
+                Expr * e2 = pop();
+                Expr * e1 = pop();
+                switch (tag) {
+                    case nApp: e = new ExprApp(e1, e2); break;
+                    case nOpEq: e = new ExprOpEq(e1, e2); break;
+                    case nOpNEq: e = new ExprOpNEq(e1, e2); break;
+                    case nOpAnd: e = new ExprOpAnd(e1, e2); break;
+                    case nOpOr: e = new ExprOpOr(e1, e2); break;
+                    case nOpImpl: e = new ExprOpImpl(e1, e2); break;
+                    case nOpUpdate: e = new ExprOpUpdate(e1, e2); break;
+                    default: e = new ExprOpConcatLists(e1, e2); break;
+                }
+                break;
+            }
+
+            case nConcatStrings: {
+                bool forceString = num();
+                vector<Expr *> * es = new vector<Expr *>;
+                pop(num(), *es);
+                e = new ExprConcatStrings(forceString, es);
+                break;
+            }
+
+            case nPos:
+                e = new ExprPos(pos());
+                break;
+
+            default:
+                throw CorruptExpr("corrupt serialised expression");
+        }
+
+        exprs.push_back(e);
+
+        /* The root is the only expression that isn't followed by
+           its parent. */
+        if (p == end && stack.empty()) return e;
+        stack.push_back(e);
+    }
+}
+
+
+Expr * deserialiseExpr(SymbolTable & symbols, const Path & path,
+    const unsigned char * data, size_t size,
+    SearchPathLookups & lookups)
+{
+    size_t len = sizeof(magic) - 1;
+    if (size < len || memcmp(data, magic, len) != 0)
+        throw CorruptExpr("not a serialised expression");
+
+    ExprReader reader(symbols, data + len, size - len);
+
+    unsigned int nrStrings = reader.num();
+    for (unsigned int i = 0; i < nrStrings; ++i) {
+        size_t n = reader.num();
+        if (n > (size_t) (reader.end - reader.p)) throw CorruptExpr("corrupt serialised expression");
+        reader.strings.push_back(std::make_pair(reader.p, n));
+        reader.p += n;
+    }
+    reader.syms.resize(nrStrings);
+
+    if (reader.str() != path)
+        throw CorruptExpr(format("serialised expression is not for `%1%'") % path);
+    reader.file = symbols.create(path);
+
+    unsigned int nrLookups = reader.num();
+    for (unsigned int i = 0; i < nrLookups; ++i) {
+        string name = reader.str();
+        lookups.push_back(std::make_pair(name, reader.str()));
+    }
+
+    return reader.read();
+}
+
+
+/* Read a cache file by mapping it into memory. */
+static Expr * loadCacheFile(SymbolTable & symbols, const Path & path,
+    const Path & cacheFile, SearchPathLookups & lookups)
+{
+    AutoCloseFD fd = open(cacheFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        throw SysError(format("opening `%1%'") % cacheFile);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("statting `%1%'") % cacheFile);
+    if (st.st_size == 0) return 0;
+
+    void * data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        throw SysError(format("mapping `%1%'") % cacheFile);
+
+    try {
+        Expr * e = deserialiseExpr(symbols, path,
+            (const unsigned char *) data, st.st_size, lookups);
+        munmap(data, st.st_size);
+        /* Record the use, so that pruneCache() keeps the entry.  This
+           is best effort; the cache may be read-only. */
+        if (st.st_mtime < time(0) - touchInterval)
+            utime(cacheFile.c_str(), 0);
+        return e;
+    } catch (...) {
+        munmap(data, st.st_size);
+        throw;
+    }
+}
+
+
+/* Remove the entries of the cache directory `dir' (including
+   temporary files left behind by interrupted writes) that haven't
+   been used for `maxAge' seconds.  This is done at most once per
+   process and per `pruneInterval'. */
+static void pruneCache(const Path & dir)
+{
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    static bool done = false;
+
+    pthread_mutex_lock(&mutex);
+    bool first = !done;
+    done = true;
+    pthread_mutex_unlock(&mutex);
+    if (!first) return;
+
+    time_t now = time(0);
+    Path stamp = dir + "/" + pruneStamp;
+    struct stat st;
+    if (stat(stamp.c_str(), &st) == 0 && st.st_mtime >= now - pruneInterval) return;
+    writeFile(stamp, "");
+
+    Strings names = readDirectory(dir);
+    foreach (Strings::iterator, i, names) {
+        if (*i == pruneStamp) continue;
+        Path entry = dir + "/" + *i;
+        if (lstat(entry.c_str(), &st) == -1) continue;
+        if (st.st_mtime < now - maxAge && unlink(entry.c_str()) == -1 && errno != ENOENT)
+            throw SysError(format("removing `%1%'") % entry);
+    }
+}
+
+
+Expr * EvalState::parseCached(const string & s, const Path & path)
+{
+    Path cacheFile;
+    SearchPathLookups lookups;
+
+    try {
+        const string sep(1, 0);
+        cacheFile = getCacheDir() + "/parse-cache-v1/"
+            + printHash32(hashString(htSHA256, nixVersion + sep + path + sep + s));
+
+        Expr * e = loadCacheFile(symbols, path, cacheFile, lookups);
+
+        /* `<foo>' paths are resolved by the parser, so the search
+           path lookups have to be redone. */
+        if (e)
+            foreach (SearchPathLookups::iterator, i, lookups)
+                if (findFile(i->first) != i->second) { e = 0; break; }
+
+        if (e) {
+            e->bindVars(staticBaseEnv);
+            return e;
+        }
+
+    } catch (Error & e) {
+        checkSideEffect(lvlDebug);
+        debug(format("ignoring parse cache entry for `%1%': %2%") % path % e.msg());
+    }
+
+    lookups.clear();
+    Expr * e = parse(s.c_str(), path, dirOf(path), staticBaseEnv, &lookups);
+
+    if (cacheFile != "")
+        try {
+            createDirs(dirOf(cacheFile));
+            pruneCache(dirOf(cacheFile));
+            Path tmpFile = (format("%1%.tmp-%2%") % cacheFile % getpid()).str();
+            writeFile(tmpFile, serialiseExpr(e, path, lookups));
+            if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+                throw SysError(format("renaming `%1%' to `%2%'") % tmpFile % cacheFile);
+        } catch (Error & e) {
+            static bool warned = false;
+            if (!warned) {
+                checkSideEffect(lvlError);
+                printMsg(lvlError, format("warning: cannot write to the parse cache: %1%") % e.msg());
+                warned = true;
+            }
+        }
+
+    return e;
+}
+
+
+}
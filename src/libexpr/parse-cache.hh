@@ -0,0 +1,34 @@
+#pragma once
+
+#include "eval.hh"
+
+
+namespace nix {
+
+
+/* A binary representation of parsed Nix expressions, used to cache
+   the result of parsing Nix expression files in ~/.cache/nix (see
+   the `parse-cache' option).  It includes positions, so error
+   messages are unaffected.  Variable bindings are not included,
+   since displacements depend on the order of symbols in memory;
+   bindVars() has to be called on the result.  Sub-expressions that
+   the parser shares (such as `e' in `inherit (e) a b') are shared in
+   the result as well.
+
+   The format is a magic string followed by the search path lookups
+   done while parsing, a string table and the expression tree in
+   post-order.  Numbers are stored as variable-length integers. */
+
+
+/* Serialise the expression `e' parsed from `path'. */
+string serialiseExpr(Expr * e, const Path & path,
+    const SearchPathLookups & lookups);
+
+/* Deserialise an expression.  Throws an error if `data' isn't valid,
+   or if it was created for another file than `path'. */
+Expr * deserialiseExpr(SymbolTable & symbols, const Path & path,
+    const unsigned char * data, size_t size,
+    SearchPathLookups & lookups);
+
+
+}
@@ -32,10 +32,12 @@ namespace nix {
         Symbol path;
         string error;
         Symbol sLetBody;
+        SearchPathLookups * lookups;
         ParseData(EvalState & state)
             : state(state)
             , symbols(state.symbols)
             , sLetBody(symbols.create("<let-body>"))
+            , lookups(0)
             { };
     };
 
@@ -387,6 +389,7 @@ expr_simple
   | SPATH {
       string path($1 + 1, strlen($1) - 2);
       Path path2 = data->state.findFile(path);
+      if (data->lookups) data->lookups->push_back(std::make_pair(path, path2));
       /* The file wasn't found in the search path.  However, we can't
          throw an error here, because the expression might never be
          evaluated.  So return an expression that lazily calls
@@ -541,18 +544,22 @@ formal
 #include <unistd.h>
 
 #include <eval.hh>
+#include <eval-cache.hh>
+#include <globals.hh>
 
 
 namespace nix {
 
 
 Expr * EvalState::parse(const char * text,
-    const Path & path, const Path & basePath, StaticEnv & staticEnv)
+    const Path & path, const Path & basePath, StaticEnv & staticEnv,
+    SearchPathLookups * lookups)
 {
     yyscan_t scanner;
     ParseData data(*this);
     data.basePath = basePath;
     data.path = data.symbols.create(path);
+    data.lookups = lookups;
 
     yylex_init(&scanner);
     yy_scan_string(text, scanner);
@@ -591,7 +598,9 @@ Path resolveExprPath(Path path)
 
 Expr * EvalState::parseExprFromFile(const Path & path)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticBaseEnv);
+    string s = inputs ? inputs->readFile(path) : readFile(path);
+    if (settings.parseCache) return parseCached(s, path);
+    return parse(s.c_str(), path, dirOf(path), staticBaseEnv);
 }
 
 
@@ -640,7 +649,9 @@ Path EvalState::findFile(const string & path)
             res = i->second +
                 (path.size() == i->first.size() ? "" : "/" + string(path, i->first.size()));
         }
-        if (pathExists(res)) return canonPath(res);
+        bool exists = pathExists(res);
+        if (inputs) inputs->addExists(res, exists);
+        if (exists) return canonPath(res);
     }
     return "";
 }
@@ -8,6 +8,7 @@
 #include "value-to-json.hh"
 #include "names.hh"
 #include "eval-inline.hh"
+#include "eval-cache.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,29 +45,37 @@ static void prim_import(EvalState & state, Value * * args, Value & v)
     PathSet context;
     Path path = state.coerceToPath(*args[0], context);
 
-    foreach (PathSet::iterator, i, context) {
-        Path ctx = decodeContext(*i).first;
-        assert(isStorePath(ctx));
-        if (!store->isValidPath(ctx))
-            throw EvalError(format("cannot import `%1%', since path `%2%' is not valid")
-                % path % ctx);
-        if (isDerivation(ctx))
-            try {
-                /* For performance, prefetch all substitute info. */
-                PathSet willBuild, willSubstitute, unknown;
-                unsigned long long downloadSize, narSize;
-                queryMissing(*store, singleton<PathSet>(ctx),
-                    willBuild, willSubstitute, unknown, downloadSize, narSize);
-
-                /* !!! If using a substitute, we only need to fetch
-                   the selected output of this derivation. */
-                store->buildPaths(singleton<PathSet>(ctx));
-            } catch (Error & e) {
-                throw ImportError(e.msg());
-            }
+    /* Don't hold the lock while evaluating the file. */
+    bool importDrv;
+    {
+        EvalLock lock;
+
+        foreach (PathSet::iterator, i, context) {
+            Path ctx = decodeContext(*i).first;
+            assert(isStorePath(ctx));
+            if (!store->isValidPath(ctx))
+                throw EvalError(format("cannot import `%1%', since path `%2%' is not valid")
+                    % path % ctx);
+            if (isDerivation(ctx))
+                try {
+                    /* For performance, prefetch all substitute info. */
+                    PathSet willBuild, willSubstitute, unknown;
+                    unsigned long long downloadSize, narSize;
+                    queryMissing(*store, singleton<PathSet>(ctx),
+                        willBuild, willSubstitute, unknown, downloadSize, narSize);
+
+                    /* !!! If using a substitute, we only need to fetch
+                       the selected output of this derivation. */
+                    store->buildPaths(singleton<PathSet>(ctx));
+                } catch (Error & e) {
+                    throw ImportError(e.msg());
+                }
+        }
+
+        importDrv = isStorePath(path) && store->isValidPath(path) && isDerivation(path);
     }
 
-    if (isStorePath(path) && store->isValidPath(path) && isDerivation(path)) {
+    if (importDrv) {
         Derivation drv = parseDerivation(readFile(path));
         Value & w = *state.allocValue();
         state.mkAttrs(w, 1 + drv.outputs.size());
@@ -74,14 +83,14 @@ static void prim_import(EvalState & state, Value * * args, Value & v)
         state.mkList(*state.allocAttr(w, state.symbols.create("outputs")), drv.outputs.size());
         unsigned int outputs_index = 0;
 
-        Value * outputsVal = w.attrs->find(state.symbols.create("outputs"))->value;
+        Value * outputsVal = w.attrs()->find(state.symbols.create("outputs"))->value;
         foreach (DerivationOutputs::iterator, i, drv.outputs) {
             mkString(*state.allocAttr(w, state.symbols.create(i->first)),
                 i->second.path, singleton<PathSet>("!" + i->first + "!" + path));
-            mkString(*(outputsVal->list.elems[outputs_index++] = state.allocValue()),
+            mkString(*(outputsVal->list().elems[outputs_index++] = state.allocValue()),
                 i->first);
         }
-        w.attrs->sort();
+        w.attrs()->sort();
         Value fun;
         state.evalFile(state.findFile("nix/imported-drv-to-derivation.nix"), fun);
         state.forceFunction(fun);
@@ -98,7 +107,7 @@ static void prim_typeOf(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
     string t;
-    switch (args[0]->type) {
+    switch (args[0]->type()) {
         case tInt: t = "int"; break;
         case tBool: t = "bool"; break;
         case tString: t = "string"; break;
@@ -121,7 +130,7 @@ static void prim_typeOf(EvalState & state, Value * * args, Value & v)
 static void prim_isNull(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tNull);
+    mkBool(v, args[0]->type() == tNull);
 }
 
 
@@ -129,7 +138,7 @@ static void prim_isNull(EvalState & state, Value * * args, Value & v)
 static void prim_isFunction(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tLambda);
+    mkBool(v, args[0]->type() == tLambda);
 }
 
 
@@ -137,7 +146,7 @@ static void prim_isFunction(EvalState & state, Value * * args, Value & v)
 static void prim_isInt(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tInt);
+    mkBool(v, args[0]->type() == tInt);
 }
 
 
@@ -145,7 +154,7 @@ static void prim_isInt(EvalState & state, Value * * args, Value & v)
 static void prim_isString(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tString);
+    mkBool(v, args[0]->type() == tString);
 }
 
 
@@ -153,7 +162,7 @@ static void prim_isString(EvalState & state, Value * * args, Value & v)
 static void prim_isBool(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tBool);
+    mkBool(v, args[0]->type() == tBool);
 }
 
 
@@ -161,15 +170,15 @@ struct CompareValues
 {
     bool operator () (const Value * v1, const Value * v2) const
     {
-        if (v1->type != v2->type)
+        if (v1->type() != v2->type())
             throw EvalError("cannot compare values of different types");
-        switch (v1->type) {
+        switch (v1->type()) {
             case tInt:
-                return v1->integer < v2->integer;
+                return v1->integer() < v2->integer();
             case tString:
-                return strcmp(v1->string.s, v2->string.s) < 0;
+                return strcmp(v1->string().s, v2->string().s) < 0;
             case tPath:
-                return strcmp(v1->path, v2->path) < 0;
+                return strcmp(v1->path(), v2->path()) < 0;
             default:
                 throw EvalError(format("cannot compare %1% with %2%") % showType(*v1) % showType(*v2));
         }
@@ -186,25 +195,26 @@ typedef list<Value *> ValueList;
 
 static void prim_genericClosure(EvalState & state, Value * * args, Value & v)
 {
+    checkSideEffect(lvlDebug);
     startNest(nest, lvlDebug, "finding dependencies");
 
     state.forceAttrs(*args[0]);
 
     /* Get the start set. */
     Bindings::iterator startSet =
-        args[0]->attrs->find(state.symbols.create("startSet"));
-    if (startSet == args[0]->attrs->end())
+        args[0]->attrs()->find(state.symbols.create("startSet"));
+    if (startSet == args[0]->attrs()->end())
         throw EvalError("attribute `startSet' required");
     state.forceList(*startSet->value);
 
     ValueList workSet;
-    for (unsigned int n = 0; n < startSet->value->list.length; ++n)
-        workSet.push_back(startSet->value->list.elems[n]);
+    for (unsigned int n = 0; n < startSet->value->list().length; ++n)
+        workSet.push_back(startSet->value->list().elems[n]);
 
     /* Get the operator. */
     Bindings::iterator op =
-        args[0]->attrs->find(state.symbols.create("operator"));
-    if (op == args[0]->attrs->end())
+        args[0]->attrs()->find(state.symbols.create("operator"));
+    if (op == args[0]->attrs()->end())
         throw EvalError("attribute `operator' required");
     state.forceValue(*op->value);
 
@@ -222,8 +232,8 @@ static void prim_genericClosure(EvalState & state, Value * * args, Value & v)
         state.forceAttrs(*e);
 
         Bindings::iterator key =
-            e->attrs->find(state.symbols.create("key"));
-        if (key == e->attrs->end())
+            e->attrs()->find(state.symbols.create("key"));
+        if (key == e->attrs()->end())
             throw EvalError("attribute `key' required");
         state.forceValue(*key->value);
 
@@ -237,9 +247,9 @@ static void prim_genericClosure(EvalState & state, Value * * args, Value & v)
         state.forceList(call);
 
         /* Add the values returned by the operator to the work set. */
-        for (unsigned int n = 0; n < call.list.length; ++n) {
-            state.forceValue(*call.list.elems[n]);
-            workSet.push_back(call.list.elems[n]);
+        for (unsigned int n = 0; n < call.list().length; ++n) {
+            state.forceValue(*call.list().elems[n]);
+            workSet.push_back(call.list().elems[n]);
         }
     }
 
@@ -247,7 +257,7 @@ static void prim_genericClosure(EvalState & state, Value * * args, Value & v)
     state.mkList(v, res.size());
     unsigned int n = 0;
     foreach (ValueList::iterator, i, res)
-        v.list.elems[n++] = *i;
+        v.list().elems[n++] = *i;
 }
 
 
@@ -286,13 +296,13 @@ static void prim_tryEval(EvalState & state, Value * * args, Value & v)
     state.mkAttrs(v, 2);
     try {
         state.forceValue(*args[0]);
-        v.attrs->push_back(Attr(state.sValue, args[0]));
+        v.attrs()->push_back(Attr(state.sValue, args[0]));
         mkBool(*state.allocAttr(v, state.symbols.create("success")), true);
     } catch (AssertionError & e) {
         mkBool(*state.allocAttr(v, state.sValue), false);
         mkBool(*state.allocAttr(v, state.symbols.create("success")), false);
     }
-    v.attrs->sort();
+    v.attrs()->sort();
 }
 
 
@@ -300,7 +310,19 @@ static void prim_tryEval(EvalState & state, Value * * args, Value & v)
 static void prim_getEnv(EvalState & state, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0]);
-    mkString(v, getEnv(name));
+    string value = getEnv(name);
+    if (state.inputs) state.inputs->addEnv(name, value);
+    mkString(v, value);
+}
+
+
+/* Return the current time.  This is the function behind the
+   `__currentTime' constant, so that the evaluation cache knows when
+   a result depends on it. */
+static void prim_currentTime(EvalState & state, Value * * args, Value & v)
+{
+    if (state.inputs) state.inputs->setUncacheable();
+    mkInt(v, time(0));
 }
 
 
@@ -309,8 +331,9 @@ static void prim_getEnv(EvalState & state, Value * * args, Value & v)
 static void prim_trace(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    if (args[0]->type == tString)
-        printMsg(lvlError, format("trace: %1%") % args[0]->string.s);
+    checkSideEffect(lvlError);
+    if (args[0]->type() == tString)
+        printMsg(lvlError, format("trace: %1%") % args[0]->string().s);
     else
         printMsg(lvlError, format("trace: %1%") % *args[0]);
     state.forceValue(*args[1]);
@@ -332,13 +355,16 @@ static void prim_trace(EvalState & state, Value * * args, Value & v)
    derivation. */
 static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
 {
+    /* This covers the messages printed below, which are all at level
+       lvlChatty or lower. */
+    checkSideEffect(lvlChatty);
     startNest(nest, lvlVomit, "evaluating derivation");
 
     state.forceAttrs(*args[0]);
 
     /* Figure out the name first (for stack backtraces). */
-    Bindings::iterator attr = args[0]->attrs->find(state.sName);
-    if (attr == args[0]->attrs->end())
+    Bindings::iterator attr = args[0]->attrs()->find(state.sName);
+    if (attr == args[0]->attrs()->end())
         throw EvalError("required attribute `name' missing");
     string drvName;
     Pos & posDrvName(*attr->pos);
@@ -351,8 +377,8 @@ static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
 
     /* Check whether null attributes should be ignored. */
     bool ignoreNulls = false;
-    attr = args[0]->attrs->find(state.sIgnoreNulls);
-    if (attr != args[0]->attrs->end())
+    attr = args[0]->attrs()->find(state.sIgnoreNulls);
+    if (attr != args[0]->attrs()->end())
         ignoreNulls = state.forceBool(*attr->value);
 
     /* Build the derivation expression by processing the attributes. */
@@ -366,7 +392,7 @@ static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
     StringSet outputs;
     outputs.insert("out");
 
-    foreach (Bindings::iterator, i, *args[0]->attrs) {
+    foreach (Bindings::iterator, i, *args[0]->attrs()) {
         if (i->name == state.sIgnoreNulls) continue;
         string key = i->name;
         startNest(nest, lvlVomit, format("processing attribute `%1%'") % key);
@@ -375,15 +401,15 @@ static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
 
             if (ignoreNulls) {
                 state.forceValue(*i->value);
-                if (i->value->type == tNull) continue;
+                if (i->value->type() == tNull) continue;
             }
 
             /* The `args' attribute is special: it supplies the
                command-line arguments to the builder. */
             if (key == "args") {
                 state.forceList(*i->value);
-                for (unsigned int n = 0; n < i->value->list.length; ++n) {
-                    string s = state.coerceToString(*i->value->list.elems[n], context, true);
+                for (unsigned int n = 0; n < i->value->list().length; ++n) {
+                    string s = state.coerceToString(*i->value->list().elems[n], context, true);
                     drv.args.push_back(s);
                 }
             }
@@ -433,6 +459,10 @@ static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
         }
     }
 
+    /* The rest doesn't evaluate anything, but it accesses the store
+       and `drvHashes'. */
+    EvalLock lock;
+
     /* Everything in the context of the strings in the derivation
        attributes should be added as dependencies of the resulting
        derivation. */
@@ -545,7 +575,7 @@ static void prim_derivationStrict(EvalState & state, Value * * args, Value & v)
         mkString(*state.allocAttr(v, state.symbols.create(i->first)),
             i->second.path, singleton<PathSet>("!" + i->first + "!" + drvPath));
     }
-    v.attrs->sort();
+    v.attrs()->sort();
 }
 
 
@@ -582,8 +612,10 @@ static void prim_storePath(EvalState & state, Value * * args, Value & v)
     if (!isInStore(path))
         throw EvalError(format("path `%1%' is not in the Nix store") % path);
     Path path2 = toStorePath(path);
-    if (!settings.readOnlyMode)
+    if (!settings.readOnlyMode) {
+        EvalLock lock;
         store->ensurePath(path2);
+    }
     context.insert(path2);
     mkString(v, path, context);
 }
@@ -595,7 +627,9 @@ static void prim_pathExists(EvalState & state, Value * * args, Value & v)
     Path path = state.coerceToPath(*args[0], context);
     if (!context.empty())
         throw EvalError(format("string `%1%' cannot refer to other paths") % path);
-    mkBool(v, pathExists(path));
+    bool exists = pathExists(path);
+    if (state.inputs) state.inputs->addExists(path, exists);
+    mkBool(v, exists);
 }
 
 
@@ -615,7 +649,7 @@ static void prim_dirOf(EvalState & state, Value * * args, Value & v)
 {
     PathSet context;
     Path dir = dirOf(state.coerceToPath(*args[0], context));
-    if (args[0]->type == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
+    if (args[0]->type() == tPath) mkPath(v, dir.c_str()); else mkString(v, dir, context);
 }
 
 
@@ -626,7 +660,7 @@ static void prim_readFile(EvalState & state, Value * * args, Value & v)
     Path path = state.coerceToPath(*args[0], context);
     if (!context.empty())
         throw EvalError(format("string `%1%' cannot refer to other paths") % path);
-    mkString(v, readFile(path).c_str());
+    mkString(v, (state.inputs ? state.inputs->readFile(path) : readFile(path)).c_str());
 }
 
 
@@ -677,6 +711,7 @@ static void prim_toFile(EvalState & state, Value * * args, Value & v)
         refs.insert(path);
     }
 
+    EvalLock lock;
     Path storePath = settings.readOnlyMode
         ? computeStorePathForText(name, contents, refs)
         : store->addTextToStore(name, contents, refs, state.repair);
@@ -736,15 +771,20 @@ static void prim_filterSource(EvalState & state, Value * * args, Value & v)
         throw EvalError(format("string `%1%' cannot refer to other paths") % path);
 
     state.forceValue(*args[0]);
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError(format("first argument in call to `filterSource' is not a function but %1%") % showType(*args[0]));
 
     FilterFromExpr filter(state, *args[0]);
 
+    EvalLock lock;
     Path dstPath = settings.readOnlyMode
         ? computeStorePathForPath(path, true, htSHA256, filter).first
         : store->addToStore(path, true, htSHA256, filter, state.repair);
 
+    /* The filter can't be recorded, so the result depends on all of
+       `path' as far as the evaluation cache is concerned. */
+    if (state.inputs) state.inputs->addTree(path);
+
     mkString(v, dstPath, singleton<PathSet>(dstPath));
 }
 
@@ -760,15 +800,15 @@ static void prim_attrNames(EvalState & state, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0]);
 
-    state.mkList(v, args[0]->attrs->size());
+    state.mkList(v, args[0]->attrs()->size());
 
     StringSet names;
-    foreach (Bindings::iterator, i, *args[0]->attrs)
+    foreach (Bindings::iterator, i, *args[0]->attrs())
         names.insert(i->name);
 
     unsigned int n = 0;
     foreach (StringSet::iterator, i, names)
-        mkString(*(v.list.elems[n++] = state.allocValue()), *i);
+        mkString(*(v.list().elems[n++] = state.allocValue()), *i);
 }
 
 
@@ -778,8 +818,8 @@ void prim_getAttr(EvalState & state, Value * * args, Value & v)
     string attr = state.forceStringNoCtx(*args[0]);
     state.forceAttrs(*args[1]);
     // !!! Should we create a symbol here or just do a lookup?
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    Bindings::iterator i = args[1]->attrs()->find(state.symbols.create(attr));
+    if (i == args[1]->attrs()->end())
         throw EvalError(format("attribute `%1%' missing") % attr);
     // !!! add to stack trace?
     if (state.countCalls && i->pos) state.attrSelects[*i->pos]++;
@@ -793,8 +833,8 @@ void prim_unsafeGetAttrPos(EvalState & state, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0]);
     state.forceAttrs(*args[1]);
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    Bindings::iterator i = args[1]->attrs()->find(state.symbols.create(attr));
+    if (i == args[1]->attrs()->end())
         mkNull(v);
     else
         state.mkPos(v, i->pos);
@@ -806,7 +846,7 @@ static void prim_hasAttr(EvalState & state, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0]);
     state.forceAttrs(*args[1]);
-    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != args[1]->attrs->end());
+    mkBool(v, args[1]->attrs()->find(state.symbols.create(attr)) != args[1]->attrs()->end());
 }
 
 
@@ -814,7 +854,7 @@ static void prim_hasAttr(EvalState & state, Value * * args, Value & v)
 static void prim_isAttrs(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tAttrs);
+    mkBool(v, args[0]->type() == tAttrs);
 }
 
 
@@ -825,18 +865,18 @@ static void prim_removeAttrs(EvalState & state, Value * * args, Value & v)
 
     /* Get the attribute names to be removed. */
     std::set<Symbol> names;
-    for (unsigned int i = 0; i < args[1]->list.length; ++i) {
-        state.forceStringNoCtx(*args[1]->list.elems[i]);
-        names.insert(state.symbols.create(args[1]->list.elems[i]->string.s));
+    for (unsigned int i = 0; i < args[1]->list().length; ++i) {
+        state.forceStringNoCtx(*args[1]->list().elems[i]);
+        names.insert(state.symbols.create(args[1]->list().elems[i]->string().s));
     }
 
     /* Copy all attributes not in that set.  Note that we don't need
        to sort v.attrs because it's a subset of an already sorted
        vector. */
-    state.mkAttrs(v, args[0]->attrs->size());
-    foreach (Bindings::iterator, i, *args[0]->attrs) {
+    state.mkAttrs(v, args[0]->attrs()->size());
+    foreach (Bindings::iterator, i, *args[0]->attrs()) {
         if (names.find(i->name) == names.end())
-            v.attrs->push_back(*i);
+            v.attrs()->push_back(*i);
     }
 }
 
@@ -850,31 +890,31 @@ static void prim_listToAttrs(EvalState & state, Value * * args, Value & v)
 {
     state.forceList(*args[0]);
 
-    state.mkAttrs(v, args[0]->list.length);
+    state.mkAttrs(v, args[0]->list().length);
 
     std::set<Symbol> seen;
 
-    for (unsigned int i = 0; i < args[0]->list.length; ++i) {
-        Value & v2(*args[0]->list.elems[i]);
+    for (unsigned int i = 0; i < args[0]->list().length; ++i) {
+        Value & v2(*args[0]->list().elems[i]);
         state.forceAttrs(v2);
 
-        Bindings::iterator j = v2.attrs->find(state.sName);
-        if (j == v2.attrs->end())
+        Bindings::iterator j = v2.attrs()->find(state.sName);
+        if (j == v2.attrs()->end())
             throw TypeError("`name' attribute missing in a call to `listToAttrs'");
         string name = state.forceStringNoCtx(*j->value);
 
         Symbol sym = state.symbols.create(name);
         if (seen.find(sym) == seen.end()) {
-            Bindings::iterator j2 = v2.attrs->find(state.symbols.create(state.sValue));
-            if (j2 == v2.attrs->end())
+            Bindings::iterator j2 = v2.attrs()->find(state.symbols.create(state.sValue));
+            if (j2 == v2.attrs()->end())
                 throw TypeError("`value' attribute missing in a call to `listToAttrs'");
 
-            v.attrs->push_back(Attr(sym, j2->value, j2->pos));
+            v.attrs()->push_back(Attr(sym, j2->value, j2->pos));
             seen.insert(sym);
         }
     }
 
-    v.attrs->sort();
+    v.attrs()->sort();
 }
 
 
@@ -886,12 +926,12 @@ static void prim_intersectAttrs(EvalState & state, Value * * args, Value & v)
     state.forceAttrs(*args[0]);
     state.forceAttrs(*args[1]);
 
-    state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
+    state.mkAttrs(v, std::min(args[0]->attrs()->size(), args[1]->attrs()->size()));
 
-    foreach (Bindings::iterator, i, *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i->name);
-        if (j != args[1]->attrs->end())
-            v.attrs->push_back(*j);
+    foreach (Bindings::iterator, i, *args[0]->attrs()) {
+        Bindings::iterator j = args[1]->attrs()->find(i->name);
+        if (j != args[1]->attrs()->end())
+            v.attrs()->push_back(*j);
     }
 }
 
@@ -912,19 +952,19 @@ static void prim_intersectAttrs(EvalState & state, Value * * args, Value & v)
 static void prim_functionArgs(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    if (args[0]->type != tLambda)
+    if (args[0]->type() != tLambda)
         throw TypeError("`functionArgs' requires a function");
 
-    if (!args[0]->lambda.fun->matchAttrs) {
+    if (!args[0]->lambda().fun->matchAttrs) {
         state.mkAttrs(v, 0);
         return;
     }
 
-    state.mkAttrs(v, args[0]->lambda.fun->formals->formals.size());
-    foreach (Formals::Formals_::iterator, i, args[0]->lambda.fun->formals->formals)
+    state.mkAttrs(v, args[0]->lambda().fun->formals->formals.size());
+    foreach (Formals::Formals_::iterator, i, args[0]->lambda().fun->formals->formals)
         // !!! should optimise booleans (allocate only once)
         mkBool(*state.allocAttr(v, i->name), i->def);
-    v.attrs->sort();
+    v.attrs()->sort();
 }
 
 
@@ -937,17 +977,17 @@ static void prim_functionArgs(EvalState & state, Value * * args, Value & v)
 static void prim_isList(EvalState & state, Value * * args, Value & v)
 {
     state.forceValue(*args[0]);
-    mkBool(v, args[0]->type == tList);
+    mkBool(v, args[0]->type() == tList);
 }
 
 
 static void elemAt(EvalState & state, Value & list, int n, Value & v)
 {
     state.forceList(list);
-    if (n < 0 || n >= list.list.length)
+    if (n < 0 || n >= list.list().length)
         throw Error(format("list index %1% is out of bounds") % n);
-    state.forceValue(*list.list.elems[n]);
-    v = *list.list.elems[n];
+    state.forceValue(*list.list().elems[n]);
+    v = *list.list().elems[n];
 }
 
 
@@ -971,11 +1011,11 @@ static void prim_head(EvalState & state, Value * * args, Value & v)
 static void prim_tail(EvalState & state, Value * * args, Value & v)
 {
     state.forceList(*args[0]);
-    if (args[0]->list.length == 0)
+    if (args[0]->list().length == 0)
         throw Error("`tail' called on an empty list");
-    state.mkList(v, args[0]->list.length - 1);
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        v.list.elems[n] = args[0]->list.elems[n + 1];
+    state.mkList(v, args[0]->list().length - 1);
+    for (unsigned int n = 0; n < v.list().length; ++n)
+        v.list().elems[n] = args[0]->list().elems[n + 1];
 }
 
 
@@ -985,11 +1025,11 @@ static void prim_map(EvalState & state, Value * * args, Value & v)
     state.forceFunction(*args[0]);
     state.forceList(*args[1]);
 
-    state.mkList(v, args[1]->list.length);
+    state.mkList(v, args[1]->list().length);
 
-    for (unsigned int n = 0; n < v.list.length; ++n)
-        mkApp(*(v.list.elems[n] = state.allocValue()),
-            *args[0], *args[1]->list.elems[n]);
+    for (unsigned int n = 0; n < v.list().length; ++n)
+        mkApp(*(v.list().elems[n] = state.allocValue()),
+            *args[0], *args[1]->list().elems[n]);
 }
 
 
@@ -1002,15 +1042,15 @@ static void prim_filter(EvalState & state, Value * * args, Value & v)
     state.forceList(*args[1]);
 
     // FIXME: putting this on the stack is risky.
-    Value * vs[args[1]->list.length];
+    Value * vs[args[1]->list().length];
     unsigned int k = 0;
 
     bool same = true;
-    for (unsigned int n = 0; n < args[1]->list.length; ++n) {
+    for (unsigned int n = 0; n < args[1]->list().length; ++n) {
         Value res;
-        state.callFunction(*args[0], *args[1]->list.elems[n], res);
+        state.callFunction(*args[0], *args[1]->list().elems[n], res);
         if (state.forceBool(res))
-            vs[k++] = args[1]->list.elems[n];
+            vs[k++] = args[1]->list().elems[n];
         else
             same = false;
     }
@@ -1019,7 +1059,7 @@ static void prim_filter(EvalState & state, Value * * args, Value & v)
         v = *args[1];
     else {
         state.mkList(v, k);
-        for (unsigned int n = 0; n < k; ++n) v.list.elems[n] = vs[n];
+        for (unsigned int n = 0; n < k; ++n) v.list().elems[n] = vs[n];
     }
 }
 
@@ -1029,8 +1069,8 @@ static void prim_elem(EvalState & state, Value * * args, Value & v)
 {
     bool res = false;
     state.forceList(*args[1]);
-    for (unsigned int n = 0; n < args[1]->list.length; ++n)
-        if (state.eqValues(*args[0], *args[1]->list.elems[n])) {
+    for (unsigned int n = 0; n < args[1]->list().length; ++n)
+        if (state.eqValues(*args[0], *args[1]->list().elems[n])) {
             res = true;
             break;
         }
@@ -1042,7 +1082,7 @@ static void prim_elem(EvalState & state, Value * * args, Value & v)
 static void prim_concatLists(EvalState & state, Value * * args, Value & v)
 {
     state.forceList(*args[0]);
-    state.concatLists(v, args[0]->list.length, args[0]->list.elems);
+    state.concatLists(v, args[0]->list().length, args[0]->list().elems);
 }
 
 
@@ -1050,7 +1090,7 @@ static void prim_concatLists(EvalState & state, Value * * args, Value & v)
 static void prim_length(EvalState & state, Value * * args, Value & v)
 {
     state.forceList(*args[0]);
-    mkInt(v, args[0]->list.length);
+    mkInt(v, args[0]->list().length);
 }
 
 
@@ -1192,7 +1232,7 @@ static void prim_parseDrvName(EvalState & state, Value * * args, Value & v)
     state.mkAttrs(v, 2);
     mkString(*state.allocAttr(v, state.sName), parsed.name);
     mkString(*state.allocAttr(v, state.symbols.create("version")), parsed.version);
-    v.attrs->sort();
+    v.attrs()->sort();
 }
 
 
@@ -1229,7 +1269,13 @@ void EvalState::createBaseEnv()
     mkNull(v);
     addConstant("null", v);
 
-    mkInt(v, time(0));
+    /* The current time is determined when it's first used (see
+       prim_currentTime()). */
+    Value * vCurrentTime = allocValue();
+    vCurrentTime->setPrimOp(new PrimOp(prim_currentTime, 1, symbols.create("currentTime")));
+    Value * vNull = allocValue();
+    mkNull(*vNull);
+    mkApp(v, *vCurrentTime, *vNull);
     addConstant("__currentTime", v);
 
     mkString(v, settings.thisSystem.c_str());
@@ -1328,7 +1374,7 @@ void EvalState::createBaseEnv()
 
     /* Now that we've added all primops, sort the `builtins' set,
        because attribute lookups expect it to be sorted. */
-    baseEnv.values[0]->attrs->sort();
+    baseEnv.values[0]->attrs()->sort();
 }
 
 
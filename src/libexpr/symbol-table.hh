@@ -4,6 +4,8 @@
 
 #include <map>
 
+#include <pthread.h>
+
 #if HAVE_TR1_UNORDERED_SET
 #include <tr1/unordered_set>
 #endif
@@ -53,6 +55,12 @@ public:
         return s;
     }
 
+    /* Symbols are interned, so their address identifies them. */
+    size_t hash() const
+    {
+        return (size_t) s;
+    }
+
     bool empty() const
     {
         return s->empty();
@@ -77,13 +85,36 @@ private:
 #endif
     Symbols symbols;
 
+    bool concurrent;
+    pthread_mutex_t mutex;
+
 public:
+    SymbolTable() : concurrent(false)
+    {
+        pthread_mutex_init(&mutex, 0);
+    }
+
+    ~SymbolTable()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+
     Symbol create(const string & s)
     {
+        if (concurrent) pthread_mutex_lock(&mutex);
         std::pair<Symbols::iterator, bool> res = symbols.insert(s);
+        if (concurrent) pthread_mutex_unlock(&mutex);
         return Symbol(&*res.first);
     }
 
+    /* Make create() safe to call from several threads at once.
+       Existing symbols stay valid when the table grows, so they
+       can be used without locking. */
+    void setConcurrent(bool b)
+    {
+        concurrent = b;
+    }
+
     unsigned int size() const
     {
         return symbols.size();
@@ -28,23 +28,23 @@ void printValueAsJSON(EvalState & state, bool strict,
 
     if (strict) state.forceValue(v);
 
-    switch (v.type) {
+    switch (v.type()) {
 
         case tInt:
-            str << v.integer;
+            str << v.integer();
             break;
 
         case tBool:
-            str << (v.boolean ? "true" : "false");
+            str << (v.boolean() ? "true" : "false");
             break;
 
         case tString:
             copyContext(v, context);
-            escapeJSON(str, v.string.s);
+            escapeJSON(str, v.string().s);
             break;
 
         case tPath:
-            escapeJSON(str, state.copyPathToStore(context, v.path));
+            escapeJSON(str, state.copyPathToStore(context, v.path()));
             break;
 
         case tNull:
@@ -52,14 +52,14 @@ void printValueAsJSON(EvalState & state, bool strict,
             break;
 
         case tAttrs: {
-            Bindings::iterator i = v.attrs->find(state.sOutPath);
-            if (i == v.attrs->end()) {
+            Bindings::iterator i = v.attrs()->find(state.sOutPath);
+            if (i == v.attrs()->end()) {
                 JSONObject json(str);
                 StringSet names;
-                foreach (Bindings::iterator, i, *v.attrs)
+                foreach (Bindings::iterator, i, *v.attrs())
                     names.insert(i->name);
                 foreach (StringSet::iterator, i, names) {
-                    Attr & a(*v.attrs->find(state.symbols.create(*i)));
+                    Attr & a(*v.attrs()->find(state.symbols.create(*i)));
                     json.attr(*i);
                     printValueAsJSON(state, strict, *a.value, str, context);
                 }
@@ -70,9 +70,9 @@ void printValueAsJSON(EvalState & state, bool strict,
 
         case tList: {
             JSONList json(str);
-            for (unsigned int n = 0; n < v.list.length; ++n) {
+            for (unsigned int n = 0; n < v.list().length; ++n) {
                 json.elem();
-                printValueAsJSON(state, strict, *v.list.elems[n], str, context);
+                printValueAsJSON(state, strict, *v.list().elems[n], str, context);
             }
             break;
         }
@@ -58,24 +58,24 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
 
     if (strict) state.forceValue(v);
         
-    switch (v.type) {
+    switch (v.type()) {
 
         case tInt:
-            doc.writeEmptyElement("int", singletonAttrs("value", (format("%1%") % v.integer).str()));
+            doc.writeEmptyElement("int", singletonAttrs("value", (format("%1%") % v.integer()).str()));
             break;
 
         case tBool:
-            doc.writeEmptyElement("bool", singletonAttrs("value", v.boolean ? "true" : "false"));
+            doc.writeEmptyElement("bool", singletonAttrs("value", v.boolean() ? "true" : "false"));
             break;
 
         case tString:
             /* !!! show the context? */
             copyContext(v, context);
-            doc.writeEmptyElement("string", singletonAttrs("value", v.string.s));
+            doc.writeEmptyElement("string", singletonAttrs("value", v.string().s));
             break;
 
         case tPath:
-            doc.writeEmptyElement("path", singletonAttrs("value", v.path));
+            doc.writeEmptyElement("path", singletonAttrs("value", v.path()));
             break;
 
         case tNull:
@@ -86,60 +86,60 @@ static void printValueAsXML(EvalState & state, bool strict, bool location,
             if (state.isDerivation(v)) {
                 XMLAttrs xmlAttrs;
             
-                Bindings::iterator a = v.attrs->find(state.symbols.create("derivation"));
+                Bindings::iterator a = v.attrs()->find(state.symbols.create("derivation"));
 
                 Path drvPath;
-                a = v.attrs->find(state.sDrvPath);
-                if (a != v.attrs->end()) {
+                a = v.attrs()->find(state.sDrvPath);
+                if (a != v.attrs()->end()) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
-                        xmlAttrs["drvPath"] = drvPath = a->value->string.s;
+                    if (a->value->type() == tString)
+                        xmlAttrs["drvPath"] = drvPath = a->value->string().s;
                 }
         
-                a = v.attrs->find(state.sOutPath);
-                if (a != v.attrs->end()) {
+                a = v.attrs()->find(state.sOutPath);
+                if (a != v.attrs()->end()) {
                     if (strict) state.forceValue(*a->value);
-                    if (a->value->type == tString)
-                        xmlAttrs["outPath"] = a->value->string.s;
+                    if (a->value->type() == tString)
+                        xmlAttrs["outPath"] = a->value->string().s;
                 }
 
                 XMLOpenElement _(doc, "derivation", xmlAttrs);
 
                 if (drvPath != "" && drvsSeen.find(drvPath) == drvsSeen.end()) {
                     drvsSeen.insert(drvPath);
-                    showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
+                    showAttrs(state, strict, location, *v.attrs(), doc, context, drvsSeen);
                 } else
                     doc.writeEmptyElement("repeated");
             }
 
             else {
                 XMLOpenElement _(doc, "attrs");
-                showAttrs(state, strict, location, *v.attrs, doc, context, drvsSeen);
+                showAttrs(state, strict, location, *v.attrs(), doc, context, drvsSeen);
             }
             
             break;
 
         case tList: {
             XMLOpenElement _(doc, "list");
-            for (unsigned int n = 0; n < v.list.length; ++n)
-                printValueAsXML(state, strict, location, *v.list.elems[n], doc, context, drvsSeen);
+            for (unsigned int n = 0; n < v.list().length; ++n)
+                printValueAsXML(state, strict, location, *v.list().elems[n], doc, context, drvsSeen);
             break;
         }
 
         case tLambda: {
             XMLAttrs xmlAttrs;
-            if (location) posToXML(xmlAttrs, v.lambda.fun->pos);
+            if (location) posToXML(xmlAttrs, v.lambda().fun->pos);
             XMLOpenElement _(doc, "function", xmlAttrs);
             
-            if (v.lambda.fun->matchAttrs) {
+            if (v.lambda().fun->matchAttrs) {
                 XMLAttrs attrs;
-                if (!v.lambda.fun->arg.empty()) attrs["name"] = v.lambda.fun->arg;
-                if (v.lambda.fun->formals->ellipsis) attrs["ellipsis"] = "1";
+                if (!v.lambda().fun->arg.empty()) attrs["name"] = v.lambda().fun->arg;
+                if (v.lambda().fun->formals->ellipsis) attrs["ellipsis"] = "1";
                 XMLOpenElement _(doc, "attrspat", attrs);
-                foreach (Formals::Formals_::iterator, i, v.lambda.fun->formals->formals)
+                foreach (Formals::Formals_::iterator, i, v.lambda().fun->formals->formals)
                     doc.writeEmptyElement("attr", singletonAttrs("name", i->name));
             } else
-                doc.writeEmptyElement("varpat", singletonAttrs("name", v.lambda.fun->arg));
+                doc.writeEmptyElement("varpat", singletonAttrs("name", v.lambda().fun->arg));
             
             break;
         }
@@ -2,23 +2,27 @@
 
 #include "symbol-table.hh"
 
+#include <stdint.h>
+
 namespace nix {
 
 
+/* The types whose values contain an aligned pointer come first: their
+   number is stored in the low bits of that pointer (see Value). */
 typedef enum {
-    tInt = 1,
-    tBool,
-    tString,
-    tPath,
-    tNull,
-    tAttrs,
+    tString = 1,
     tList,
     tThunk,
     tApp,
     tLambda,
+    tPrimOpApp,
+    tInt = 8,
+    tBool,
+    tPath,
+    tNull,
+    tAttrs,
     tBlackhole,
     tPrimOp,
-    tPrimOpApp,
 } ValueType;
 
 
@@ -34,108 +38,233 @@ struct Symbol;
 typedef long NixInt;
 
 
-struct Value
+/* A value is two words.  For the types from tString to tPrimOpApp,
+   the first word is a pointer with the type in its three low bits
+   (all the pointers involved are at least 8-byte aligned), or for
+   lists the length shifted left by three bits.  For the other types,
+   the low bits are zero and the rest of the first word is the type.
+   The second word holds the remaining payload, e.g. an integer or a
+   string without context.  Zeroed memory reads as type 0, which isn't
+   a valid type.
+
+   Since values are pointed to by tagged pointers, they are 8-byte
+   aligned even where the ABI doesn't require it (e.g. on i686 for
+   values on the stack).
+
+   Values must only be accessed through the methods below. */
+struct __attribute__((aligned(8))) Value
 {
-    ValueType type;
-    union
-    {
-        NixInt integer;
-        bool boolean;
-
-        /* Strings in the evaluator carry a so-called `context' which
-           is a list of strings representing store paths.  This is to
-           allow users to write things like
-
-             "--with-freetype2-library=" + freetype + "/lib"
-
-           where `freetype' is a derivation (or a source to be copied
-           to the store).  If we just concatenated the strings without
-           keeping track of the referenced store paths, then if the
-           string is used as a derivation attribute, the derivation
-           will not have the correct dependencies in its inputDrvs and
-           inputSrcs.
-
-           The semantics of the context is as follows: when a string
-           with context C is used as a derivation attribute, then the
-           derivations in C will be added to the inputDrvs of the
-           derivation, and the other store paths in C will be added to
-           the inputSrcs of the derivations.
-
-           For canonicity, the store paths should be in sorted order. */
-        struct {
-            const char * s;
-            const char * * context; // must be in sorted order
-        } string;
-
-        const char * path;
-        Bindings * attrs;
-        struct {
-            unsigned int length;
-            Value * * elems;
-        } list;
-        struct {
-            Env * env;
-            Expr * expr;
-        } thunk;
-        struct {
-            Value * left, * right;
-        } app;
-        struct {
-            Env * env;
-            ExprLambda * fun;
-        } lambda;
-        PrimOp * primOp;
-        struct {
-            Value * left, * right;
-        } primOpApp;
+private:
+    static const unsigned int tagBits = 3;
+    static const uintptr_t tagMask = (1 << tagBits) - 1;
+
+    uintptr_t w0, w1;
+
+    void set(ValueType type, uintptr_t payload)
+    {
+        w0 = (uintptr_t) type << tagBits;
+        w1 = payload;
+    }
+
+    void set(ValueType type, const void * p, uintptr_t payload)
+    {
+        w0 = (uintptr_t) p | type;
+        w1 = payload;
+    }
+
+    uintptr_t pointer() const
+    {
+        return w0 & ~tagMask;
+    }
+
+public:
+
+    /* Strings in the evaluator carry a so-called `context' which
+       is a list of strings representing store paths.  This is to
+       allow users to write things like
+
+         "--with-freetype2-library=" + freetype + "/lib"
+
+       where `freetype' is a derivation (or a source to be copied
+       to the store).  If we just concatenated the strings without
+       keeping track of the referenced store paths, then if the
+       string is used as a derivation attribute, the derivation
+       will not have the correct dependencies in its inputDrvs and
+       inputSrcs.
+
+       The semantics of the context is as follows: when a string
+       with context C is used as a derivation attribute, then the
+       derivations in C will be added to the inputDrvs of the
+       derivation, and the other store paths in C will be added to
+       the inputSrcs of the derivations.
+
+       For canonicity, the store paths should be in sorted order. */
+    struct String {
+        const char * s;
+        const char * * context; // must be in sorted order
+    };
+
+    struct List {
+        unsigned int length;
+        Value * * elems;
     };
+
+    struct Thunk {
+        Env * env;
+        Expr * expr;
+    };
+
+    struct Lambda {
+        Env * env;
+        ExprLambda * fun;
+    };
+
+    struct Pair {
+        Value * left, * right;
+    };
+
+    ValueType type() const
+    {
+        return typeOf(w0);
+    }
+
+    NixInt integer() const { return (NixInt) w1; }
+    bool boolean() const { return w1; }
+    const char * path() const { return (const char *) w1; }
+    Bindings * attrs() const { return (Bindings *) w1; }
+    PrimOp * primOp() const { return (PrimOp *) w1; }
+
+    String string() const
+    {
+        String r = { (const char *) w1, (const char * *) pointer() };
+        return r;
+    }
+
+    List list() const
+    {
+        List r = { (unsigned int) (w0 >> tagBits), (Value * *) w1 };
+        return r;
+    }
+
+    Thunk thunk() const
+    {
+        Thunk r = { (Env *) pointer(), (Expr *) w1 };
+        return r;
+    }
+
+    Lambda lambda() const
+    {
+        Lambda r = { (Env *) pointer(), (ExprLambda *) w1 };
+        return r;
+    }
+
+    Pair app() const
+    {
+        Pair r = { (Value *) pointer(), (Value *) w1 };
+        return r;
+    }
+
+    Pair primOpApp() const
+    {
+        return app();
+    }
+
+    /* Setters.  They overwrite both words, so that the garbage
+       collector doesn't see stale pointers. */
+    void setInt(NixInt n) { set(tInt, (uintptr_t) n); }
+    void setBool(bool b) { set(tBool, b); }
+    void setNull() { set(tNull, 0); }
+    void setPath(const char * s) { set(tPath, (uintptr_t) s); }
+    void setAttrs(Bindings * attrs) { set(tAttrs, (uintptr_t) attrs); }
+    void setBlackhole() { set(tBlackhole, 0); }
+    void setPrimOp(PrimOp * primOp) { set(tPrimOp, (uintptr_t) primOp); }
+
+    void setString(const char * s, const char * * context)
+    {
+        set(tString, context, (uintptr_t) s);
+    }
+
+    void setList(unsigned int length, Value * * elems)
+    {
+        w0 = ((uintptr_t) length << tagBits) | tList;
+        w1 = (uintptr_t) elems;
+    }
+
+    void setThunk(Env * env, Expr * expr) { set(tThunk, env, (uintptr_t) expr); }
+    void setLambda(Env * env, ExprLambda * fun) { set(tLambda, env, (uintptr_t) fun); }
+    void setApp(Value * left, Value * right) { set(tApp, left, (uintptr_t) right); }
+    void setPrimOpApp(Value * left, Value * right) { set(tPrimOpApp, left, (uintptr_t) right); }
+
+    /* Operations for concurrent evaluation (see
+       EvalState::forceValueConcurrent()). */
+
+    ValueType typeAcquire() const
+    {
+        return typeOf(__atomic_load_n(&w0, __ATOMIC_ACQUIRE));
+    }
+
+    /* Atomically replace a thunk or application by a blackhole.
+       Return false if the value isn't one (anymore); otherwise store
+       the previous contents in `old'. */
+    bool claim(Value & old)
+    {
+        uintptr_t w = __atomic_load_n(&w0, __ATOMIC_ACQUIRE);
+        ValueType type = typeOf(w);
+        if (type != tThunk && type != tApp) return false;
+        if (!__sync_bool_compare_and_swap(&w0, w, (uintptr_t) tBlackhole << tagBits)) return false;
+        old.w0 = w;
+        old.w1 = w1;
+        return true;
+    }
+
+    /* Overwrite a claimed value by `v'.  The type is written last, so
+       that other threads never see a partially written value. */
+    void publish(const Value & v)
+    {
+        w1 = v.w1;
+        __atomic_store_n(&w0, v.w0, __ATOMIC_RELEASE);
+    }
+
+private:
+    static ValueType typeOf(uintptr_t w)
+    {
+        uintptr_t tag = w & tagMask;
+        return (ValueType) (tag ? tag : w >> tagBits);
+    }
 };
 
 
-/* After overwriting an app node, be sure to clear pointers in the
-   Value to ensure that the target isn't kept alive unnecessarily. */
-static inline void clearValue(Value & v)
-{
-    v.app.right = 0;
-}
+/* Compile-time check that the tag bits of a Value pointer are free. */
+typedef char ValueAlignmentCheck[__alignof__(Value) >= 8 ? 1 : -1];
 
 
 static inline void mkInt(Value & v, NixInt n)
 {
-    clearValue(v);
-    v.type = tInt;
-    v.integer = n;
+    v.setInt(n);
 }
 
 
 static inline void mkBool(Value & v, bool b)
 {
-    clearValue(v);
-    v.type = tBool;
-    v.boolean = b;
+    v.setBool(b);
 }
 
 
 static inline void mkNull(Value & v)
 {
-    v.type = tNull;
-    v.app.left = v.app.right = 00; // scrub
+    v.setNull();
 }
 
 
 static inline void mkApp(Value & v, Value & left, Value & right)
 {
-    v.type = tApp;
-    v.app.left = &left;
-    v.app.right = &right;
+    v.setApp(&left, &right);
 }
 
 
 static inline void mkStringNoCopy(Value & v, const char * s)
 {
-    v.type = tString;
-    v.string.s = s;
-    v.string.context = 0;
+    v.setString(s, 0);
 }
 
 
@@ -150,9 +279,7 @@ void mkString(Value & v, const char * s);
 
 static inline void mkPathNoCopy(Value & v, const char * s)
 {
-    clearValue(v);
-    v.type = tPath;
-    v.path = s;
+    v.setPath(s);
 }
 
 
@@ -0,0 +1,218 @@
+/* Benchmark for the order in which builds are started.  It builds
+   synthetic dependency graphs of derivations that each take a fixed
+   amount of time, and compares the time needed with the best
+   possible one, i.e. the longer of the critical path and the total
+   build time divided by the number of build slots.
+
+   Usage: bench-build-order [-j N] [--duration SECS] [--seed N]
+
+   The graphs are:
+
+   - `chain': a chain of four builds plus four independent builds,
+     all needed by a top-level build;
+
+   - `random': a random DAG of 24 builds, in which each build
+     depends on each earlier one with a probability of 10%.
+
+   The builds are done in the store given by the usual environment
+   variables (e.g. NIX_STORE_DIR and NIX_DB_DIR), so use a scratch
+   store.  Each run creates new derivations, so nothing is reused
+   from previous runs.  To see the effect of a scheduling change, run
+   the benchmark with and without it.  Build with `make
+   bench-build-order'. */
+
+#include "store-api.hh"
+#include "derivations.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <iostream>
+#include <cstdlib>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+
+
+using namespace nix;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+struct Graph
+{
+    string name;
+    /* For each build, the indices of the (earlier) builds it
+       depends on. */
+    vector<vector<unsigned int> > deps;
+};
+
+
+static Graph chainGraph()
+{
+    Graph g;
+    g.name = "chain";
+    vector<unsigned int> top;
+    for (unsigned int i = 0; i < 4; ++i) {
+        g.deps.push_back(vector<unsigned int>());
+        if (i) g.deps.back().push_back(i - 1);
+    }
+    for (unsigned int i = 0; i < 8; ++i) top.push_back(i);
+    for (unsigned int i = 0; i < 4; ++i)
+        g.deps.push_back(vector<unsigned int>());
+    g.deps.push_back(top);
+    return g;
+}
+
+
+static Graph randomGraph()
+{
+    Graph g;
+    g.name = "random";
+    for (unsigned int i = 0; i < 24; ++i) {
+        g.deps.push_back(vector<unsigned int>());
+        for (unsigned int j = 0; j < i; ++j)
+            if (rand() % 10 == 0) g.deps.back().push_back(j);
+    }
+    return g;
+}
+
+
+/* The number of builds on the longest chain. */
+static unsigned int criticalPath(const Graph & g)
+{
+    vector<unsigned int> depth(g.deps.size(), 1);
+    unsigned int longest = 0;
+    for (unsigned int i = 0; i < g.deps.size(); ++i) {
+        foreach (vector<unsigned int>::const_iterator, j, g.deps[i])
+            depth[i] = std::max(depth[i], depth[*j] + 1);
+        longest = std::max(longest, depth[i]);
+    }
+    return longest;
+}
+
+
+/* Write the derivations of `g' to the store and return those that
+   nothing depends on. */
+static PathSet instantiate(StoreAPI & store, const Graph & g,
+    const Path & builder, double duration, const string & nonce)
+{
+    vector<Path> drvPaths, outPaths;
+    vector<bool> needed(g.deps.size(), false);
+
+    for (unsigned int i = 0; i < g.deps.size(); ++i) {
+        string name = (format("bench-%1%-%2%") % g.name % i).str();
+
+        Derivation drv;
+        drv.platform = settings.thisSystem;
+        drv.builder = builder;
+        drv.inputSrcs.insert(builder);
+        drv.env["name"] = name;
+        drv.env["system"] = drv.platform;
+        drv.env["builder"] = builder;
+        drv.env["duration"] = (format("%1%") % duration).str();
+        drv.env["nonce"] = nonce;
+
+        string deps;
+        foreach (vector<unsigned int>::const_iterator, j, g.deps[i]) {
+            drv.inputDrvs[drvPaths[*j]] = singleton<StringSet>("out");
+            deps += " " + outPaths[*j];
+            needed[*j] = true;
+        }
+        drv.env["deps"] = deps;
+
+        drv.env["out"] = "";
+        drv.outputs["out"] = DerivationOutput("", "", "");
+        Path outPath = makeOutputPath("out", hashDerivationModulo(store, drv), name);
+        drv.env["out"] = outPath;
+        drv.outputs["out"].path = outPath;
+
+        drvPaths.push_back(writeDerivation(store, drv, name));
+        outPaths.push_back(outPath);
+    }
+
+    PathSet top;
+    for (unsigned int i = 0; i < g.deps.size(); ++i)
+        if (!needed[i]) top.insert(drvPaths[i]);
+    return top;
+}
+
+
+static void bench(StoreAPI & store, const Graph & g,
+    const Path & builder, double duration)
+{
+    string nonce = (format("%1%-%2%") % getpid() % now()).str();
+    PathSet top = instantiate(store, g, builder, duration, nonce);
+
+    double start = now();
+    store.buildPaths(top);
+    double elapsed = now() - start;
+
+    unsigned int n = g.deps.size();
+    unsigned int slots = settings.maxBuildJobs;
+    double best = duration * std::max(criticalPath(g), (n + slots - 1) / slots);
+
+    std::cout << format("%1%: %2% builds, critical path %3%, %4% slots: %5$.1fs (best possible %6$.1fs)")
+        % g.name % n % criticalPath(g) % slots % elapsed % best << std::endl;
+}
+
+
+int main(int argc, char * * argv)
+{
+    try {
+        settings.processEnvironment();
+        settings.loadConfFile();
+        settings.maxBuildJobs = 2;
+        settings.useSubstitutes = false;
+
+        double duration = 1;
+        unsigned int seed = 42;
+
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc) {
+                if (!string2Int(argv[++i], settings.maxBuildJobs) || settings.maxBuildJobs == 0)
+                    throw Error("`-j' requires a positive number");
+            }
+            else if (arg == "--duration" && i + 1 < argc)
+                duration = atof(argv[++i]);
+            else if (arg == "--seed" && i + 1 < argc) {
+                if (!string2Int(argv[++i], seed))
+                    throw Error("`--seed' requires a number");
+            }
+            else
+                throw Error(format("unknown argument `%1%'") % arg);
+        }
+
+        srand(seed);
+
+        boost::shared_ptr<StoreAPI> store = openStore();
+
+        /* The builder must be executable, so it can't be added with
+           addTextToStore(). */
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+        Path script = tmpDir + "/builder.sh";
+        writeFile(script,
+            "#! /bin/sh\n"
+            "/bin/sleep $duration\n"
+            "echo $nonce $deps > $out\n");
+        if (chmod(script.c_str(), 0755) == -1)
+            throw SysError(format("making `%1%' executable") % script);
+        Path builder = store->addToStore(script);
+
+        bench(*store, chainGraph(), builder, duration);
+        bench(*store, randomGraph(), builder, duration);
+
+    } catch (std::exception & e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* Benchmark for the cost of setting up a chroot build.  It builds
+   trivial derivations with many inputs, both in a chroot and
+   without one, so the difference is the time spent on creating the
+   chroot: hard-linking file inputs, bind-mounting directory inputs
+   and unmounting everything again afterwards.
+
+   Usage: bench-chroot-setup [--files N] [--dirs N] [--runs N]
+
+   The builds are done in the store given by the usual environment
+   variables (e.g. NIX_STORE_DIR and NIX_DB_DIR), so use a scratch
+   store.  Chroot builds require root.  /bin, /lib, /lib64 and /usr
+   are made available in the chroot so that the builder can run.
+   Build with `make bench-chroot-setup'. */
+
+#include "store-api.hh"
+#include "derivations.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <iostream>
+#include <cstdlib>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+
+
+using namespace nix;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/* Add `files' regular files and `dirs' directories to the store. */
+static PathSet makeInputs(StoreAPI & store, unsigned int files,
+    unsigned int dirs, const Path & tmpDir)
+{
+    PathSet inputs;
+
+    for (unsigned int i = 0; i < files; ++i)
+        inputs.insert(store.addTextToStore(
+            (format("bench-file-%1%") % i).str(),
+            (format("file %1%\n") % i).str(), PathSet()));
+
+    for (unsigned int i = 0; i < dirs; ++i) {
+        Path dir = (format("%1%/bench-dir-%2%") % tmpDir % i).str();
+        createDirs(dir);
+        writeFile(dir + "/file", (format("dir %1%\n") % i).str());
+        inputs.insert(store.addToStore(dir));
+    }
+
+    return inputs;
+}
+
+
+static double build(StoreAPI & store, const PathSet & inputs,
+    const Path & builder, bool chroot)
+{
+    string name = chroot ? "bench-chroot" : "bench-no-chroot";
+
+    Derivation drv;
+    drv.platform = settings.thisSystem;
+    drv.builder = builder;
+    drv.inputSrcs = inputs;
+    drv.inputSrcs.insert(builder);
+    drv.env["name"] = name;
+    drv.env["system"] = drv.platform;
+    drv.env["builder"] = builder;
+    drv.env["nonce"] = (format("%1%-%2%") % getpid() % now()).str();
+
+    drv.env["out"] = "";
+    drv.outputs["out"] = DerivationOutput("", "", "");
+    Path outPath = makeOutputPath("out", hashDerivationModulo(store, drv), name);
+    drv.env["out"] = outPath;
+    drv.outputs["out"].path = outPath;
+
+    Path drvPath = writeDerivation(store, drv, name);
+
+    settings.useChroot = chroot;
+    double start = now();
+    store.buildPaths(singleton<PathSet>(drvPath));
+    return now() - start;
+}
+
+
+int main(int argc, char * * argv)
+{
+    try {
+        settings.processEnvironment();
+        settings.loadConfFile();
+        settings.useSubstitutes = false;
+        settings.dirsInChroot.insert("/bin");
+        settings.dirsInChroot.insert("/lib");
+        settings.dirsInChroot.insert("/lib64");
+        settings.dirsInChroot.insert("/usr");
+
+        unsigned int files = 1000, dirs = 1000, runs = 5;
+
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--files" && i + 1 < argc) {
+                if (!string2Int(argv[++i], files))
+                    throw Error("`--files' requires a number");
+            }
+            else if (arg == "--dirs" && i + 1 < argc) {
+                if (!string2Int(argv[++i], dirs))
+                    throw Error("`--dirs' requires a number");
+            }
+            else if (arg == "--runs" && i + 1 < argc) {
+                if (!string2Int(argv[++i], runs) || runs == 0)
+                    throw Error("`--runs' requires a positive number");
+            }
+            else
+                throw Error(format("unknown argument `%1%'") % arg);
+        }
+
+        boost::shared_ptr<StoreAPI> store = openStore();
+
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+        Path script = tmpDir + "/builder.sh";
+        writeFile(script,
+            "#! /bin/sh\n"
+            "echo $nonce > $out\n");
+        if (chmod(script.c_str(), 0755) == -1)
+            throw SysError(format("making `%1%' executable") % script);
+        Path builder = store->addToStore(script);
+
+        PathSet inputs = makeInputs(*store, files, dirs, tmpDir);
+
+        double plain = 0, chroot = 0;
+        for (unsigned int i = 0; i < runs; ++i) {
+            plain += build(*store, inputs, builder, false);
+            chroot += build(*store, inputs, builder, true);
+        }
+        plain /= runs;
+        chroot /= runs;
+
+        std::cout << format("%1% files, %2% directories: %3$.3fs without chroot, %4$.3fs with chroot (setup %5$.3fs)")
+            % files % dirs % plain % chroot % (chroot - plain) << std::endl;
+
+    } catch (std::exception & e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
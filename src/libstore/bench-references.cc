@@ -0,0 +1,167 @@
+/* Micro-benchmark for the reference scanner.  It measures the
+   throughput of searchHashParts() (with and without SIMD) and of the
+   scanner that Nix used before (a byte-wise scan using a std::set of
+   strings) on synthetic data and on real NARs.
+
+   Usage: bench-references [PATH...]
+
+   Each PATH is either a NAR file (e.g. produced by `nix-store
+   --dump') or a directory, which is dumped to a NAR first.  Build with
+   `make bench-references'. */
+
+#include "references.hh"
+#include "archive.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <iostream>
+#include <cstdlib>
+
+#include <sys/time.h>
+#include <sys/stat.h>
+
+
+using namespace nix;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+/* The scanner as it was before, for comparison. */
+static void legacySearch(const unsigned char * s, size_t len,
+    StringSet & hashes, StringSet & seen)
+{
+    static bool initialised = false;
+    static bool isBase32[256];
+    if (!initialised) {
+        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
+        for (unsigned int i = 0; i < base32Chars.size(); ++i)
+            isBase32[(unsigned char) base32Chars[i]] = true;
+        initialised = true;
+    }
+
+    for (size_t i = 0; i + 32 <= len; ) {
+        int j;
+        bool match = true;
+        for (j = 31; j >= 0; --j)
+            if (!isBase32[(unsigned char) s[i + j]]) {
+                i += j + 1;
+                match = false;
+                break;
+            }
+        if (!match) continue;
+        string ref((const char *) s + i, 32);
+        if (hashes.find(ref) != hashes.end()) {
+            seen.insert(ref);
+            hashes.erase(ref);
+        }
+        ++i;
+    }
+}
+
+
+static string randomHashPart()
+{
+    string s;
+    for (unsigned int i = 0; i < 32; ++i)
+        s += base32Chars[rand() % base32Chars.size()];
+    return s;
+}
+
+
+static void bench(const string & name, const string & data, const StringSet & parts)
+{
+    const unsigned char * p = (const unsigned char *) data.data();
+    double gb = data.size() / 1e9;
+    unsigned int rounds = data.size() < 64 * 1024 * 1024 ? 5 : 1;
+
+    HashPartSet set(parts);
+    StringSet seenLegacy, seenScalar, seenSimd;
+
+    double t0 = now();
+    for (unsigned int r = 0; r < rounds; ++r) {
+        StringSet hashes(parts);
+        seenLegacy.clear();
+        legacySearch(p, data.size(), hashes, seenLegacy);
+    }
+    double t1 = now();
+    for (unsigned int r = 0; r < rounds; ++r) {
+        seenScalar.clear();
+        searchHashParts(p, data.size(), set, seenScalar, false);
+    }
+    double t2 = now();
+    for (unsigned int r = 0; r < rounds; ++r) {
+        seenSimd.clear();
+        searchHashParts(p, data.size(), set, seenSimd, true);
+    }
+    double t3 = now();
+
+    std::cout << format("%1%: %2% MiB, %3% candidates, %4% found\n")
+        % name % (data.size() / (1024 * 1024)) % parts.size() % seenSimd.size();
+    std::cout << format("  legacy %.2f GB/s\n") % (gb * rounds / (t1 - t0));
+    std::cout << format("  scalar %.2f GB/s\n") % (gb * rounds / (t2 - t1));
+    std::cout << format("  simd   %.2f GB/s\n") % (gb * rounds / (t3 - t2));
+
+    if (seenLegacy != seenScalar || seenLegacy != seenSimd)
+        throw Error(format("%1%: scanners disagree") % name);
+}
+
+
+int main(int argc, char * * argv)
+{
+    try {
+        srand(42);
+
+        /* A set of candidate references, some of which are embedded
+           in the synthetic data. */
+        StringSet parts;
+        while (parts.size() < 1000) parts.insert(randomHashPart());
+
+        /* Binary data: mostly random bytes. */
+        string binary;
+        for (unsigned int i = 0; i < 128 * 1024 * 1024; ++i)
+            binary += (char) (rand() & 0xff);
+
+        /* Text-like data: long runs of base-32 characters, which is
+           the worst case for the scanner. */
+        string text;
+        while (text.size() < 64 * 1024 * 1024) {
+            unsigned int n = rand() % 64;
+            for (unsigned int i = 0; i < n; ++i)
+                text += base32Chars[rand() % base32Chars.size()];
+            text += "/\n "[rand() % 3];
+        }
+
+        StringSet::iterator j = parts.begin();
+        for (unsigned int i = 0; i < 100; ++i, ++j) {
+            binary.replace(rand() % (binary.size() - 32), 32, *j);
+            text.replace(rand() % (text.size() - 32), 32, *j);
+        }
+
+        bench("synthetic binary", binary, parts);
+        bench("synthetic text", text, parts);
+
+        for (int i = 1; i < argc; ++i) {
+            Path path = absPath(argv[i]);
+            string nar;
+            if (S_ISDIR(lstat(path).st_mode)) {
+                StringSink sink;
+                dumpPath(path, sink);
+                nar = sink.s;
+            } else
+                nar = readFile(path);
+            bench(path, nar, parts);
+        }
+
+    } catch (std::exception & e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
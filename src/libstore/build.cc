@@ -8,6 +8,7 @@
 #include "util.hh"
 #include "archive.hh"
 #include "affinity.hh"
+#include "thread-pool.hh"
 
 #include <map>
 #include <sstream>
@@ -66,6 +67,16 @@
 #define CAN_DO_LINUX32_BUILDS
 #endif
 
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
 
 namespace nix {
 
@@ -95,6 +106,9 @@ typedef set<WeakGoalPtr> WeakGoals;
 /* A map of paths to goals (and the other way around). */
 typedef map<Path, WeakGoalPtr> WeakGoalMap;
 
+/* Critical path lengths of goals, see Goal::getCriticalPath(). */
+typedef map<Goal *, double> CriticalPaths;
+
 
 
 class Goal : public boost::enable_shared_from_this<Goal>
@@ -166,6 +180,21 @@ public:
         return name;
     }
 
+    /* The estimated cost of this goal, in seconds of build time.
+       Goals that don't know better (e.g. because there is no
+       information on previous builds) cost 1, so that the critical
+       path is the longest chain of goals. */
+    virtual double getCost()
+    {
+        return 1;
+    }
+
+    /* Return the cost of the most expensive chain of goals that wait
+       (directly or indirectly) on this goal, including this goal.
+       Since a top-level goal can't finish before this chain is done,
+       goals with a longer critical path should be started first. */
+    double getCriticalPath(CriticalPaths & paths);
+
     ExitCode getExitCode()
     {
         return exitCode;
@@ -197,6 +226,36 @@ struct Child
 typedef map<pid_t, Child> Children;
 
 
+/* Waits for input on a set of file descriptors.  Descriptors are
+   registered once rather than on every wait, so with epoll the cost
+   of waiting depends on the number of descriptors that are ready,
+   not on the number of children.  Without epoll we fall back to
+   poll(), which unlike select() is not limited to FD_SETSIZE
+   descriptors. */
+class FdMonitor
+{
+#if HAVE_SYS_EPOLL_H
+    AutoCloseFD epollFd;
+#else
+    vector<struct pollfd> pollFds;
+#endif
+
+public:
+    FdMonitor();
+
+    void add(int fd);
+
+    /* Note: this must be called before `fd' is closed. */
+    void remove(int fd);
+
+    /* Wait until input (or EOF) is available on some registered
+       descriptors, which are returned in `ready', or until `timeout'
+       milliseconds have passed.  A negative timeout means wait
+       forever.  Returns false if interrupted by a signal. */
+    bool wait(int timeout, vector<int> & ready);
+};
+
+
 /* The worker class. */
 class Worker
 {
@@ -214,9 +273,19 @@ private:
     /* Goals waiting for a build slot. */
     WeakGoals wantingToBuild;
 
+    /* Goals that can start a build in a free build slot, and goals
+       that have been given one by assignBuildSlots(). */
+    WeakGoals readyToBuild;
+    WeakGoals grantedBuildSlot;
+
     /* Child processes currently running. */
     Children children;
 
+    /* The file descriptors of the children, and to which child
+       they belong. */
+    FdMonitor fdMonitor;
+    map<int, pid_t> childFds;
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -235,6 +304,21 @@ private:
     /* Last time the goals in `waitingForAWhile' where woken up. */
     time_t lastWokenUp;
 
+#if HAVE_SYS_INOTIFY_H
+    /* Inotify instance watching the lock files of paths locked by
+       other processes, and for each watch, the goals waiting for
+       that lock. */
+    AutoCloseFD lockNotifyFd;
+    bool lockNotifyFailed;
+    map<int, WeakGoals> lockWaiters;
+
+    void handleLockEvents();
+
+    /* Remove `goal' from `lockWaiters', and the watches that no goal
+       is waiting for anymore. */
+    void removeLockWaiter(GoalPtr goal);
+#endif
+
 public:
 
     /* Set if at least one derivation had a BuildError (i.e. permanent
@@ -278,16 +362,40 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Return true if `goal' may take a free build slot now.
+       Otherwise, `goal' is put to sleep until the worker hands out
+       the free slots, which happens once no goal is awake.  The goals
+       with the longest critical path get the slots; the others wait
+       for a build slot as usual. */
+    bool claimBuildSlot(GoalPtr goal);
+
+    void assignBuildSlots();
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
 
-    /* Wait for a few seconds and then retry this goal.  Used when
-       waiting for a lock held by another process.  This kind of
-       polling is inefficient, but POSIX doesn't really provide a way
-       to wait for multiple locks in the main select() loop. */
+    /* Wait for a few seconds and then retry this goal. */
     void waitForAWhile(GoalPtr goal);
 
+    /* Start an automatic garbage collection in the background if
+       there is too little free space (see LocalStore::autoGC()),
+       unless one is still running. */
+    void startAutoGC();
+
+    /* Retry this goal once the locks on `paths', held by another
+       process, may have been released.  The holder touches the lock
+       file when it releases the lock (see PathLocks::unlock()), which
+       we notice through inotify.  Since that doesn't work for every
+       holder (e.g. one that crashed), the goal is also retried every
+       few seconds, as with waitForAWhile(). */
+    void waitForLocks(GoalPtr goal, const PathSet & paths);
+
+    /* Try to acquire `locks' on `paths' without blocking.  If another
+       process holds them, put `goal' to sleep with waitForLocks() and
+       return false. */
+    bool lockPaths(GoalPtr goal, PathLocks & locks, const PathSet & paths);
+
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
@@ -301,6 +409,21 @@ public:
 //////////////////////////////////////////////////////////////////////
 
 
+double Goal::getCriticalPath(CriticalPaths & paths)
+{
+    CriticalPaths::iterator i = paths.find(this);
+    if (i != paths.end()) return i->second;
+
+    double longest = 0;
+    foreach (WeakGoals::iterator, j, waiters) {
+        GoalPtr waiter = j->lock();
+        if (waiter) longest = std::max(longest, waiter->getCriticalPath(paths));
+    }
+
+    return paths[this] = longest + getCost();
+}
+
+
 void Goal::addWaitee(GoalPtr waitee)
 {
     waitees.insert(waitee);
@@ -733,6 +856,14 @@ private:
     /* Number of bytes received from the builder's stdout/stderr. */
     unsigned long logSize;
 
+    /* When the builder or build hook was started, and the host
+       performing the build. */
+    struct timeval startTime;
+    string buildMachine;
+
+    /* Cached result of getCost(), or -1. */
+    double cost;
+
     /* Pipe for the builder's standard output/error. */
     Pipe builderOut;
 
@@ -794,6 +925,8 @@ public:
         return drvPath;
     }
 
+    double getCost();
+
     /* Add wanted outputs to an already existing derivation goal. */
     void addWantedOutputs(const StringSet & outputs);
 
@@ -845,6 +978,9 @@ private:
     /* Forcibly kill the child process, if any. */
     void killChild();
 
+    /* Record the resource usage of the build that just finished. */
+    void registerBuildStats(bool succeeded, const struct rusage * usage);
+
     Path addHashRewrite(const Path & path);
 
     void repairClosure();
@@ -858,6 +994,7 @@ DerivationGoal::DerivationGoal(const Path & drvPath, const StringSet & wantedOut
     , retrySubstitution(false)
     , fLogFile(0)
     , bzLogFile(0)
+    , cost(-1)
     , useChroot(false)
     , repair(repair)
 {
@@ -916,6 +1053,18 @@ void DerivationGoal::cancel(bool timeout)
 }
 
 
+/* The cost of a derivation is the average duration of its recent
+   builds, if it has been built before. */
+double DerivationGoal::getCost()
+{
+    if (cost < 0) {
+        cost = worker.store.queryAverageBuildTime(drvPath);
+        if (cost <= 0) cost = Goal::getCost();
+    }
+    return cost;
+}
+
+
 void DerivationGoal::work()
 {
     (this->*state)();
@@ -1229,12 +1378,10 @@ void DerivationGoal::tryToBuild()
     /* Obtain locks on all output paths.  The locks are automatically
        released when we exit this function or Nix crashes.  If we
        can't acquire the lock, then continue; hopefully some other
-       goal can start a build, and if not, the main loop will sleep a
-       few seconds and then retry this goal. */
-    if (!outputLocks.lockPaths(outputPaths(drv.outputs), "", false)) {
-        worker.waitForAWhile(shared_from_this());
+       goal can start a build, and if not, the main loop will wait
+       until the locks are released and then retry this goal. */
+    if (!worker.lockPaths(shared_from_this(), outputLocks, outputPaths(drv.outputs)))
         return;
-    }
 
     /* Now check again whether the outputs are valid.  This is because
        another process may have started building in parallel.  After
@@ -1281,6 +1428,7 @@ void DerivationGoal::tryToBuild()
             case rpAccept:
                 /* Yes, it has started doing so.  Wait until we get
                    EOF from the hook. */
+                worker.store.markPathsUsed(inputPaths);
                 state = &DerivationGoal::buildDone;
                 return;
             case rpPostpone:
@@ -1305,6 +1453,18 @@ void DerivationGoal::tryToBuild()
         return;
     }
 
+    /* A slot is free, but goals with a longer critical path may want
+       it too.  Let the worker decide. */
+    if (curBuilds < settings.maxBuildJobs && !worker.claimBuildSlot(shared_from_this())) {
+        outputLocks.unlock();
+        return;
+    }
+
+    /* Record that the inputs are used, so that the garbage collector
+       keeps them longer, and make sure there is enough free space. */
+    worker.store.markPathsUsed(inputPaths);
+    worker.startAutoGC();
+
     try {
 
         /* Okay, we have to build. */
@@ -1354,6 +1514,10 @@ void DerivationGoal::buildDone()
        :-) */
     int status;
     pid_t savedPid;
+    /* The resource usage of the hook is not that of the build, so
+       only get it for local builds. */
+    struct rusage usage;
+    bool haveUsage = !hook;
     if (hook) {
         savedPid = hook->pid;
         status = hook->pid.wait(true);
@@ -1361,7 +1525,7 @@ void DerivationGoal::buildDone()
         /* !!! this could block! security problem! solution: kill the
            child */
         savedPid = pid;
-        status = pid.wait(true);
+        status = pid.wait(true, &usage);
     }
 
     debug(format("builder process for `%1%' finished") % drvPath);
@@ -1487,6 +1651,15 @@ void DerivationGoal::buildDone()
         bool hookError = hook &&
             (!WIFEXITED(status) || WEXITSTATUS(status) != 100);
 
+        /* Don't let a failure to record the statistics (e.g. a busy
+           database) hide the build failure. */
+        if (!hookError)
+            try {
+                registerBuildStats(false, haveUsage ? &usage : 0);
+            } catch (...) {
+                ignoreException();
+            }
+
         if (settings.printBuildTrace) {
             if (hook && hookError)
                 printMsg(lvlError, format("@ hook-failed %1% - %2% %3%")
@@ -1515,6 +1688,8 @@ void DerivationGoal::buildDone()
     /* Release the build user, if applicable. */
     buildUser.release();
 
+    registerBuildStats(true, haveUsage ? &usage : 0);
+
     if (settings.printBuildTrace)
         printMsg(lvlError, format("@ build-succeeded %1% -") % drvPath);
 
@@ -1555,9 +1730,15 @@ HookReply DerivationGoal::tryBuildHook()
 
     debug(format("hook reply is `%1%'") % reply);
 
+    /* An accepting hook may say which machine it will use, as in
+       `accept <host>'. */
     if (reply == "decline" || reply == "postpone")
         return reply == "decline" ? rpDecline : rpPostpone;
-    else if (reply != "accept")
+    else if (reply == "accept")
+        buildMachine = "";
+    else if (string(reply, 0, 7) == "accept ")
+        buildMachine = string(reply, 7);
+    else
         throw Error(format("bad hook reply `%1%'") % reply);
 
     printMsg(lvlTalkative, format("using hook to build path(s) %1%")
@@ -1595,6 +1776,7 @@ HookReply DerivationGoal::tryBuildHook()
     fds.insert(hook->fromHook.readSide);
     fds.insert(hook->builderOut.readSide);
     worker.childStarted(shared_from_this(), hook->pid, fds, false, false);
+    gettimeofday(&startTime, 0);
 
     if (settings.printBuildTrace)
         printMsg(lvlError, format("@ build-started %1% - %2% %3%")
@@ -1844,10 +2026,9 @@ void DerivationGoal::startBuilder()
         /* Make the closure of the inputs available in the chroot,
            rather than the whole Nix store.  This prevents any access
            to undeclared dependencies.  Directories are bind-mounted,
-           while other inputs are hard-linked (since only directories
-           can be bind-mounted).  !!! As an extra security
-           precaution, make the fake Nix store only writable by the
-           build user. */
+           while other inputs are hard-linked (which is cheaper than a
+           mount).  !!! As an extra security precaution, make the fake
+           Nix store only writable by the build user. */
         createDirs(chrootRootDir + settings.nixStore);
         chmod_(chrootRootDir + settings.nixStore, 01777);
 
@@ -1863,13 +2044,15 @@ void DerivationGoal::startBuilder()
                     /* Hard-linking fails if we exceed the maximum
                        link count on a file (e.g. 32000 of ext3),
                        which is quite possible after a `nix-store
-                       --optimise'. */
+                       --optimise'.  Then bind-mount the file instead,
+                       or copy the symlink. */
                     if (errno != EMLINK)
                         throw SysError(format("linking `%1%' to `%2%'") % p % *i);
-                    StringSink sink;
-                    dumpPath(*i, sink);
-                    StringSource source(sink.s);
-                    restorePath(p, source);
+                    if (S_ISLNK(st.st_mode)) {
+                        if (symlink(readLink(*i).c_str(), p.c_str()) == -1)
+                            throw SysError(format("creating symlink `%1%'") % p);
+                    } else
+                        dirsInChroot[*i] = *i;
                 }
 
                 regularInputPaths.insert(*i);
@@ -1974,6 +2157,13 @@ void DerivationGoal::startBuilder()
     builderOut.writeSide.close();
     worker.childStarted(shared_from_this(), pid,
         singleton<set<int> >(builderOut.readSide), true, true);
+    gettimeofday(&startTime, 0);
+
+    char hostName[256];
+    if (gethostname(hostName, sizeof(hostName)) == 0) {
+        hostName[sizeof(hostName) - 1] = 0;
+        buildMachine = hostName;
+    }
 
     if (settings.printBuildTrace) {
         printMsg(lvlError, format("@ build-started %1% - %2% %3%")
@@ -2018,14 +2208,11 @@ void DerivationGoal::initChild()
                filesystems on top of a shared subtree still propagates
                outside of the namespace.  Making a subtree private is
                local to the namespace, though, so setting MS_PRIVATE
-               does not affect the outside world. */
-            Strings mounts = tokenizeString<Strings>(readFile("/proc/self/mountinfo", true), "\n");
-            foreach (Strings::iterator, i, mounts) {
-                vector<string> fields = tokenizeString<vector<string> >(*i, " ");
-                string fs = decodeOctalEscaped(fields.at(4));
-                if (mount(0, fs.c_str(), 0, MS_PRIVATE, 0) == -1)
-                    throw SysError(format("unable to make filesystem `%1%' private") % fs);
-            }
+               does not affect the outside world.  A single recursive
+               remount of / covers all filesystems, rather than one
+               call per entry in /proc/self/mountinfo. */
+            if (mount(0, "/", 0, MS_PRIVATE | MS_REC, 0) == -1)
+                throw SysError("unable to make filesystems private");
 
             /* Bind-mount all the directories from the "host"
                filesystem that we want in the chroot
@@ -2210,29 +2397,15 @@ void DerivationGoal::computeClosure()
         startNest(nest, lvlTalkative,
             format("scanning for references inside `%1%'") % path);
 
-        /* Check that fixed-output derivations produced the right
-           outputs (i.e., the content hash should match the specified
-           hash). */
+        /* The output path of a flat fixed-output derivation should be
+           a regular file without execute permission. */
         if (i->second.hash != "") {
-
             bool recursive; HashType ht; Hash h;
             i->second.parseHashInfo(recursive, ht, h);
-
-            if (!recursive) {
-                /* The output path should be a regular file without
-                   execute permission. */
-                if (!S_ISREG(st.st_mode) || (st.st_mode & S_IXUSR) != 0)
-                    throw BuildError(
-                        format("output path `%1% should be a non-executable regular file")
-                        % path);
-            }
-
-            /* Check the hash. */
-            Hash h2 = recursive ? hashPath(ht, path).first : hashFile(ht, path);
-            if (h != h2)
+            if (!recursive && (!S_ISREG(st.st_mode) || (st.st_mode & S_IXUSR) != 0))
                 throw BuildError(
-                    format("output path `%1%' should have %2% hash `%3%', instead has `%4%'")
-                    % path % i->second.hashAlgo % printHash16or32(h) % printHash16or32(h2));
+                    format("output path `%1% should be a non-executable regular file")
+                    % path);
         }
 
         /* Get rid of all weird permissions.  This also checks that
@@ -2243,10 +2416,30 @@ void DerivationGoal::computeClosure()
         /* For this output path, find the references to other paths
            contained in it.  Compute the SHA-256 NAR hash at the same
            time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        HashResult hash;
-        PathSet references = scanForReferences(path, allPaths, hash);
-        contentHashes[path] = hash;
+           verify later on whether nobody has messed with the store.
+           If we're going to optimise the path, also compute the
+           hashes of the individual files, so that optimisePath()
+           doesn't have to read them again. */
+        PathScanResult scan = scanPath(path, allPaths,
+            getThreadCount(settings.hashThreads), settings.autoOptimiseStore);
+        PathSet & references = scan.references;
+        contentHashes[path] = scan.narHash;
+
+        /* Check that fixed-output derivations produced the right
+           outputs (i.e., the content hash should match the specified
+           hash).  Canonicalisation doesn't affect the hash, so we can
+           reuse the NAR hash computed above in the common case. */
+        if (i->second.hash != "") {
+            bool recursive; HashType ht; Hash h;
+            i->second.parseHashInfo(recursive, ht, h);
+            Hash h2 =
+                recursive && ht == htSHA256 ? scan.narHash.first :
+                recursive ? hashPath(ht, path).first : hashFile(ht, path);
+            if (h != h2)
+                throw BuildError(
+                    format("output path `%1%' should have %2% hash `%3%', instead has `%4%'")
+                    % path % i->second.hashAlgo % printHash16or32(h) % printHash16or32(h2));
+        }
 
         /* For debugging, print out the referenced and unreferenced
            paths. */
@@ -2271,7 +2464,7 @@ void DerivationGoal::computeClosure()
                     throw BuildError(format("output is not allowed to refer to path `%1%'") % *i);
         }
 
-        worker.store.optimisePath(path); // FIXME: combine with scanForReferences()
+        worker.store.optimisePath(path, scan.fileHashes);
 
         worker.store.markContentsGood(path);
     }
@@ -2368,6 +2561,42 @@ void DerivationGoal::deleteTmpDir(bool force)
 }
 
 
+static unsigned long long toMilliseconds(const struct timeval & tv)
+{
+    return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+void DerivationGoal::registerBuildStats(bool succeeded, const struct rusage * usage)
+{
+    BuildStats stats;
+    stats.drvPath = drvPath;
+    stats.machine = buildMachine;
+    stats.startTime = startTime.tv_sec;
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+    stats.wallTime = toMilliseconds(now) - toMilliseconds(startTime);
+
+    if (usage) {
+        stats.userTime = toMilliseconds(usage->ru_utime);
+        stats.systemTime = toMilliseconds(usage->ru_stime);
+        stats.maxRSS = usage->ru_maxrss;
+    }
+
+    stats.logSize = logSize;
+
+    if (succeeded)
+        foreach (DerivationOutputs::iterator, i, drv.outputs)
+            if (worker.store.isValidPath(i->second.path))
+                stats.narSize += worker.store.queryPathInfo(i->second.path).narSize;
+
+    stats.succeeded = succeeded;
+
+    worker.store.registerBuildStats(stats);
+}
+
+
 void DerivationGoal::handleChildOutput(int fd, const string & data)
 {
     if ((hook && fd == hook->builderOut.readSide) ||
@@ -2658,10 +2887,8 @@ void SubstitutionGoal::tryToRun()
 
     /* Acquire a lock on the output path. */
     outputLock = boost::shared_ptr<PathLocks>(new PathLocks);
-    if (!outputLock->lockPaths(singleton<PathSet>(storePath), "", false)) {
-        worker.waitForAWhile(shared_from_this());
+    if (!worker.lockPaths(shared_from_this(), *outputLock, singleton<PathSet>(storePath)))
         return;
-    }
 
     /* Check again whether the path is invalid. */
     if (!repair && worker.store.isValidPath(storePath)) {
@@ -2845,6 +3072,11 @@ void SubstitutionGoal::handleEOF(int fd)
 
 static bool working = false;
 
+/* The automatic garbage collector started by Worker::startAutoGC(),
+   if it may still be running.  It outlives the worker that started
+   it, and is reaped by a later one (or by init). */
+static pid_t autoGCPid = -1;
+
 
 Worker::Worker(LocalStore & store)
     : store(store)
@@ -2855,6 +3087,9 @@ Worker::Worker(LocalStore & store)
     nrLocalBuilds = 0;
     lastWokenUp = 0;
     permanentFailure = false;
+#if HAVE_SYS_INOTIFY_H
+    lockNotifyFailed = false;
+#endif
 }
 
 
@@ -2956,6 +3191,11 @@ void Worker::childStarted(GoalPtr goal,
     child.respectTimeouts = respectTimeouts;
     children[pid] = child;
     if (inBuildSlot) nrLocalBuilds++;
+
+    foreach (set<int>::const_iterator, i, fds) {
+        fdMonitor.add(*i);
+        childFds[*i] = pid;
+    }
 }
 
 
@@ -2971,6 +3211,11 @@ void Worker::childTerminated(pid_t pid, bool wakeSleepers)
         nrLocalBuilds--;
     }
 
+    foreach (set<int>::iterator, j, i->second.fds) {
+        fdMonitor.remove(*j);
+        childFds.erase(*j);
+    }
+
     children.erase(pid);
 
     if (wakeSleepers) {
@@ -2996,6 +3241,62 @@ void Worker::waitForBuildSlot(GoalPtr goal)
 }
 
 
+typedef std::pair<double, GoalPtr> PrioritisedGoal;
+
+struct CompareCriticalPath
+{
+    bool operator () (const PrioritisedGoal & a, const PrioritisedGoal & b) const
+    {
+        return a.first > b.first;
+    }
+};
+
+
+bool Worker::claimBuildSlot(GoalPtr goal)
+{
+    if (grantedBuildSlot.erase(goal)) return true;
+    debug("wait for assignment of build slot");
+    readyToBuild.insert(goal);
+    return false;
+}
+
+
+void Worker::assignBuildSlots()
+{
+    CriticalPaths paths;
+    vector<PrioritisedGoal> ready;
+    foreach (WeakGoals::iterator, i, readyToBuild) {
+        GoalPtr goal = i->lock();
+        if (goal) ready.push_back(PrioritisedGoal(goal->getCriticalPath(paths), goal));
+    }
+    readyToBuild.clear();
+    grantedBuildSlot.clear();
+
+    std::stable_sort(ready.begin(), ready.end(), CompareCriticalPath());
+
+    unsigned int curBuilds = getNrLocalBuilds();
+    foreach (vector<PrioritisedGoal>::iterator, i, ready) {
+        if (curBuilds < settings.maxBuildJobs) {
+            i->second->trace(format("assigned build slot (critical path %1%)") % i->first);
+            grantedBuildSlot.insert(i->second);
+            wakeUp(i->second);
+            curBuilds++;
+        } else
+            wantingToBuild.insert(i->second);
+    }
+
+    /* If slots are left over, let the goals that are waiting for a
+       build slot compete for them in the next round. */
+    if (curBuilds < settings.maxBuildJobs) {
+        foreach (WeakGoals::iterator, i, wantingToBuild) {
+            GoalPtr goal = i->lock();
+            if (goal) wakeUp(goal);
+        }
+        wantingToBuild.clear();
+    }
+}
+
+
 void Worker::waitForAnyGoal(GoalPtr goal)
 {
     debug("wait for any goal");
@@ -3003,6 +3304,17 @@ void Worker::waitForAnyGoal(GoalPtr goal)
 }
 
 
+void Worker::startAutoGC()
+{
+    if (autoGCPid != -1) {
+        int res = waitpid(autoGCPid, 0, WNOHANG);
+        if (res == 0) return;
+        autoGCPid = -1;
+    }
+    autoGCPid = store.startAutoGC();
+}
+
+
 void Worker::waitForAWhile(GoalPtr goal)
 {
     debug("wait for a while");
@@ -3010,6 +3322,119 @@ void Worker::waitForAWhile(GoalPtr goal)
 }
 
 
+void Worker::waitForLocks(GoalPtr goal, const PathSet & paths)
+{
+    debug("wait for locks");
+    waitingForAWhile.insert(goal);
+
+#if HAVE_SYS_INOTIFY_H
+    if (lockNotifyFd == -1) {
+        if (lockNotifyFailed) return;
+        lockNotifyFd = inotify_init();
+        if (lockNotifyFd == -1) {
+            printMsg(lvlDebug, format("cannot create inotify instance: %1%") % strerror(errno));
+            lockNotifyFailed = true;
+            return;
+        }
+        closeOnExec(lockNotifyFd);
+        fdMonitor.add(lockNotifyFd);
+    }
+
+    foreach (PathSet::const_iterator, i, paths) {
+        Path lockPath = *i + ".lock";
+        int wd = inotify_add_watch(lockNotifyFd, lockPath.c_str(),
+            IN_ATTRIB | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd == -1) {
+            /* If the lock file is gone, the lock has probably been
+               released already, which lockPaths() will notice when
+               it tries again.  Otherwise (e.g. if we've run out of
+               watches), just poll. */
+            if (errno != ENOENT)
+                printMsg(lvlDebug, format("cannot watch lock file `%1%': %2%") % lockPath % strerror(errno));
+            continue;
+        }
+        lockWaiters[wd].insert(goal);
+    }
+#endif
+}
+
+
+bool Worker::lockPaths(GoalPtr goal, PathLocks & locks, const PathSet & paths)
+{
+    if (locks.lockPaths(paths, "", false)) return true;
+
+    waitForLocks(goal, paths);
+
+    /* The holder may have released the locks before the watches were
+       added, in which case there won't be an event.  So try once
+       more now that we're watching. */
+    if (!locks.lockPaths(paths, "", false)) return false;
+
+    waitingForAWhile.erase(goal);
+#if HAVE_SYS_INOTIFY_H
+    removeLockWaiter(goal);
+#endif
+    return true;
+}
+
+
+#if HAVE_SYS_INOTIFY_H
+void Worker::handleLockEvents()
+{
+    union {
+        struct inotify_event event;
+        char data[16384];
+    } buffer;
+
+    ssize_t rd = read(lockNotifyFd, buffer.data, sizeof(buffer.data));
+    if (rd == -1) {
+        if (errno == EINTR) return;
+        throw SysError("reading inotify events");
+    }
+
+    for (ssize_t pos = 0; pos < rd; ) {
+        struct inotify_event * event = (struct inotify_event *) (buffer.data + pos);
+        pos += sizeof(struct inotify_event) + event->len;
+
+        map<int, WeakGoals>::iterator i = lockWaiters.find(event->wd);
+        if (i == lockWaiters.end()) continue;
+
+        WeakGoals waiters = i->second;
+        lockWaiters.erase(i);
+        if (!(event->mask & IN_IGNORED))
+            inotify_rm_watch(lockNotifyFd, event->wd);
+
+        /* Only wake up goals that are still waiting; the others have
+           been retried in the meantime.  A woken goal no longer needs
+           the watches on its other locks. */
+        foreach (WeakGoals::iterator, j, waiters) {
+            GoalPtr goal = j->lock();
+            if (goal && waitingForAWhile.erase(goal)) {
+                goal->trace("lock may have been released");
+                removeLockWaiter(goal);
+                wakeUp(goal);
+            }
+        }
+    }
+}
+
+
+void Worker::removeLockWaiter(GoalPtr goal)
+{
+    map<int, WeakGoals>::iterator i = lockWaiters.begin();
+    while (i != lockWaiters.end()) {
+        i->second.erase(goal);
+        bool waited = false;
+        foreach (WeakGoals::iterator, j, i->second)
+            if (!j->expired()) { waited = true; break; }
+        if (waited) { ++i; continue; }
+        inotify_rm_watch(lockNotifyFd, i->first);
+        lockWaiters.erase(i++);
+    }
+}
+#endif
+
+
 void Worker::run(const Goals & _topGoals)
 {
     foreach (Goals::iterator, i,  _topGoals) topGoals.insert(*i);
@@ -3034,6 +3459,13 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* Now that every goal has had a chance to become ready to
+           build, hand out the free build slots. */
+        if (!readyToBuild.empty()) {
+            assignBuildSlots();
+            continue;
+        }
+
         /* Wait for input. */
         if (!children.empty() || !waitingForAWhile.empty())
             waitForInput();
@@ -3065,8 +3497,7 @@ void Worker::waitForInput()
        terminated. */
 
     bool useTimeout = false;
-    struct timeval timeout;
-    timeout.tv_usec = 0;
+    time_t timeout = 0;
     time_t before = time(0);
 
     /* If we're monitoring for silence on stdout/stderr, or if there
@@ -3074,107 +3505,116 @@ void Worker::waitForInput()
        deadline for any child. */
     assert(sizeof(time_t) >= sizeof(long));
     time_t nearest = LONG_MAX; // nearest deadline
-    foreach (Children::iterator, i, children) {
-        if (!i->second.respectTimeouts) continue;
-        if (settings.maxSilentTime != 0)
-            nearest = std::min(nearest, i->second.lastOutput + settings.maxSilentTime);
-        if (settings.buildTimeout != 0)
-            nearest = std::min(nearest, i->second.timeStarted + settings.buildTimeout);
-    }
+    if (settings.maxSilentTime != 0 || settings.buildTimeout != 0)
+        foreach (Children::iterator, i, children) {
+            if (!i->second.respectTimeouts) continue;
+            if (settings.maxSilentTime != 0)
+                nearest = std::min(nearest, i->second.lastOutput + settings.maxSilentTime);
+            if (settings.buildTimeout != 0)
+                nearest = std::min(nearest, i->second.timeStarted + settings.buildTimeout);
+        }
     if (nearest != LONG_MAX) {
-        timeout.tv_sec = std::max((time_t) 1, nearest - before);
+        timeout = std::max((time_t) 1, nearest - before);
         useTimeout = true;
-        printMsg(lvlVomit, format("sleeping %1% seconds") % timeout.tv_sec);
+        printMsg(lvlVomit, format("sleeping %1% seconds") % timeout);
     }
 
     /* If we are polling goals that are waiting for a lock, then wake
        up after a few seconds at most. */
     if (!waitingForAWhile.empty()) {
-        useTimeout = true;
         if (lastWokenUp == 0)
             printMsg(lvlError, "waiting for locks or build slots...");
         if (lastWokenUp == 0 || lastWokenUp > before) lastWokenUp = before;
-        timeout.tv_sec = std::max((time_t) 1, (time_t) (lastWokenUp + settings.pollInterval - before));
+        time_t t = std::max((time_t) 1, (time_t) (lastWokenUp + settings.pollInterval - before));
+        timeout = useTimeout ? std::min(timeout, t) : t;
+        useTimeout = true;
     } else lastWokenUp = 0;
 
-    using namespace std;
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
-    fd_set fds;
-    FD_ZERO(&fds);
-    int fdMax = 0;
-    foreach (Children::iterator, i, children) {
-        foreach (set<int>::iterator, j, i->second.fds) {
-            FD_SET(*j, &fds);
-            if (*j >= fdMax) fdMax = *j + 1;
-        }
-    }
-
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
-        if (errno == EINTR) return;
-        throw SysError("waiting for input");
-    }
+    vector<int> ready;
+    /* The timeout may be too large for an int in milliseconds (e.g.
+       a build timeout of a month).  Waking up early is harmless,
+       since the deadlines are checked again below. */
+    int timeoutMs = -1;
+    if (useTimeout)
+        timeoutMs = timeout >= INT_MAX / 1000 ? INT_MAX : (int) timeout * 1000;
+    if (!fdMonitor.wait(timeoutMs, ready)) return;
 
     time_t after = time(0);
 
-    /* Process all available file descriptors. */
-
-    /* Since goals may be canceled from inside the loop below (causing
-       them go be erased from the `children' map), we have to be
-       careful that we don't keep iterators alive across calls to
-       cancel(). */
-    set<pid_t> pids;
-    foreach (Children::iterator, i, children) pids.insert(i->first);
-
-    foreach (set<pid_t>::iterator, i, pids) {
+    /* Process the available file descriptors.  Since goals may be
+       canceled while handling their output (causing them to be
+       erased from the `children' map), we look up the child of each
+       descriptor again. */
+    foreach (vector<int>::iterator, i, ready) {
         checkInterrupt();
-        Children::iterator j = children.find(*i);
-        if (j == children.end()) continue; // child destroyed
-        GoalPtr goal = j->second.goal.lock();
+#if HAVE_SYS_INOTIFY_H
+        if (*i == lockNotifyFd) {
+            handleLockEvents();
+            continue;
+        }
+#endif
+        map<int, pid_t>::iterator j = childFds.find(*i);
+        if (j == childFds.end()) continue; // child destroyed
+        Children::iterator k = children.find(j->second);
+        assert(k != children.end());
+        Child & child(k->second);
+        GoalPtr goal = child.goal.lock();
         assert(goal);
 
-        set<int> fds2(j->second.fds);
-        foreach (set<int>::iterator, k, fds2) {
-            if (FD_ISSET(*k, &fds)) {
-                unsigned char buffer[4096];
-                ssize_t rd = read(*k, buffer, sizeof(buffer));
-                if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError(format("reading from %1%")
-                            % goal->getName());
-                } else if (rd == 0) {
-                    debug(format("%1%: got EOF") % goal->getName());
-                    goal->handleEOF(*k);
-                    j->second.fds.erase(*k);
-                } else {
-                    printMsg(lvlVomit, format("%1%: read %2% bytes")
-                        % goal->getName() % rd);
-                    string data((char *) buffer, rd);
-                    goal->handleChildOutput(*k, data);
-                    j->second.lastOutput = after;
-                }
-            }
+        unsigned char buffer[65536];
+        ssize_t rd = read(*i, buffer, sizeof(buffer));
+        if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError(format("reading from %1%")
+                    % goal->getName());
+        } else if (rd == 0) {
+            debug(format("%1%: got EOF") % goal->getName());
+            fdMonitor.remove(*i);
+            childFds.erase(*i);
+            child.fds.erase(*i);
+            goal->handleEOF(*i);
+        } else {
+            printMsg(lvlVomit, format("%1%: read %2% bytes")
+                % goal->getName() % rd);
+            child.lastOutput = after;
+            string data((char *) buffer, rd);
+            goal->handleChildOutput(*i, data);
         }
+    }
 
-        if (settings.maxSilentTime != 0 &&
-            j->second.respectTimeouts &&
-            after - j->second.lastOutput >= (time_t) settings.maxSilentTime)
-        {
-            printMsg(lvlError,
-                format("%1% timed out after %2% seconds of silence")
-                % goal->getName() % settings.maxSilentTime);
-            goal->cancel(true);
-        }
+    /* Kill the children that have exceeded a timeout. */
+    if (settings.maxSilentTime != 0 || settings.buildTimeout != 0) {
+        set<pid_t> pids;
+        foreach (Children::iterator, i, children) pids.insert(i->first);
+
+        foreach (set<pid_t>::iterator, i, pids) {
+            checkInterrupt();
+            Children::iterator j = children.find(*i);
+            if (j == children.end()) continue; // child destroyed
+            if (!j->second.respectTimeouts) continue;
+            GoalPtr goal = j->second.goal.lock();
+            assert(goal);
+
+            if (settings.maxSilentTime != 0 &&
+                after - j->second.lastOutput >= (time_t) settings.maxSilentTime)
+            {
+                printMsg(lvlError,
+                    format("%1% timed out after %2% seconds of silence")
+                    % goal->getName() % settings.maxSilentTime);
+                goal->cancel(true);
+            }
 
-        if (settings.buildTimeout != 0 &&
-            j->second.respectTimeouts &&
-            after - j->second.timeStarted >= (time_t) settings.buildTimeout)
-        {
-            printMsg(lvlError,
-                format("%1% timed out after %2% seconds")
-                % goal->getName() % settings.buildTimeout);
-            goal->cancel(true);
+            else if (settings.buildTimeout != 0 &&
+                after - j->second.timeStarted >= (time_t) settings.buildTimeout)
+            {
+                printMsg(lvlError,
+                    format("%1% timed out after %2% seconds")
+                    % goal->getName() % settings.buildTimeout);
+                goal->cancel(true);
+            }
         }
     }
 
@@ -3185,10 +3625,101 @@ void Worker::waitForInput()
             if (goal) wakeUp(goal);
         }
         waitingForAWhile.clear();
+
+#if HAVE_SYS_INOTIFY_H
+        /* Every goal waiting for a lock is awake now, so the watches
+           aren't needed anymore. */
+        for (map<int, WeakGoals>::iterator i = lockWaiters.begin(); i != lockWaiters.end(); ++i)
+            inotify_rm_watch(lockNotifyFd, i->first);
+        lockWaiters.clear();
+#endif
     }
 }
 
 
+#if HAVE_SYS_EPOLL_H
+
+FdMonitor::FdMonitor()
+{
+    epollFd = epoll_create(1);
+    if (epollFd == -1) throw SysError("creating epoll instance");
+    closeOnExec(epollFd);
+}
+
+
+void FdMonitor::add(int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+        throw SysError(format("adding file descriptor %1% to epoll instance") % fd);
+}
+
+
+void FdMonitor::remove(int fd)
+{
+    struct epoll_event event; /* ignored, but required by old kernels */
+    if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, &event) == -1 && errno != ENOENT)
+        throw SysError(format("removing file descriptor %1% from epoll instance") % fd);
+}
+
+
+bool FdMonitor::wait(int timeout, vector<int> & ready)
+{
+    struct epoll_event events[128];
+    int n = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), timeout);
+    if (n == -1) {
+        if (errno == EINTR) return false;
+        throw SysError("waiting for input");
+    }
+    for (int i = 0; i < n; i++)
+        ready.push_back(events[i].data.fd);
+    return true;
+}
+
+#else
+
+FdMonitor::FdMonitor()
+{
+}
+
+
+void FdMonitor::add(int fd)
+{
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    pollFds.push_back(p);
+}
+
+
+void FdMonitor::remove(int fd)
+{
+    foreach (vector<struct pollfd>::iterator, i, pollFds)
+        if (i->fd == fd) {
+            pollFds.erase(i);
+            return;
+        }
+}
+
+
+bool FdMonitor::wait(int timeout, vector<int> & ready)
+{
+    if (poll(pollFds.empty() ? 0 : &pollFds[0], pollFds.size(), timeout) == -1) {
+        if (errno == EINTR) return false;
+        throw SysError("waiting for input");
+    }
+    foreach (vector<struct pollfd>::iterator, i, pollFds)
+        if (i->revents) ready.push_back(i->fd);
+    return true;
+}
+
+#endif
+
+
 unsigned int Worker::exitStatus()
 {
     return permanentFailure ? 100 : 1;
@@ -1,6 +1,8 @@
+#include "config.h"
 #include "globals.hh"
 #include "misc.hh"
 #include "local-store.hh"
+#include "thread-pool.hh"
 
 #include <boost/shared_ptr.hpp>
 
@@ -14,16 +16,25 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#if HAVE_STATVFS
+#include <sys/statvfs.h>
+#endif
+
 
 namespace nix {
 
 
 static string gcLockName = "gc.lock";
+static string gcRunningLockName = "gc-running.lock";
 static string tempRootsDir = "temproots";
 static string gcRootsDir = "gcroots";
 
 static const int defaultGcLevel = 1000;
 
+/* The number of garbage paths deleted per acquisition of the global
+   GC lock. */
+static const unsigned int gcBatchSize = 100;
+
 
 /* Acquire the global GC lock.  This is used to prevent new Nix
    processes from starting after the temporary root files have been
@@ -55,6 +66,29 @@ int LocalStore::openGCLock(LockType lockType)
 }
 
 
+/* Acquire the lock held by a garbage collector while it deletes
+   paths, from just before it reads the roots for the last time.
+   Collectors take it in write mode, since they share the trash
+   directory.  Processes that add permanent roots take it in read mode
+   (see syncWithGC()).  It must never be acquired while holding the
+   global GC lock, since collectors acquire the latter while holding
+   it. */
+static int openGCRunningLock(LockType lockType)
+{
+    Path fnLock = (format("%1%/%2%")
+        % settings.nixStateDir % gcRunningLockName).str();
+
+    AutoCloseFD fdLock = openLockFile(fnLock, true);
+
+    if (!lockFile(fdLock, lockType, false)) {
+        printMsg(lvlError, format("waiting for the garbage collector to finish..."));
+        lockFile(fdLock, lockType, true);
+    }
+
+    return fdLock.borrow();
+}
+
+
 void createSymlink(const Path & link, const Path & target)
 {
     /* Create directories up to `gcRoot'. */
@@ -76,7 +110,14 @@ void createSymlink(const Path & link, const Path & target)
 
 void LocalStore::syncWithGC()
 {
-    AutoCloseFD fdGCLock = openGCLock(ltRead);
+    /* The collector only holds the global GC lock while scanning the
+       roots and while deleting a batch of paths.  A root added after
+       it has read the roots for the last time is not seen by it, so
+       wait until it has finished deleting.  Until then the caller's
+       temporary roots keep the path alive.  A root added before that
+       point is found by the collector, so we only wait if a deletion
+       phase is in progress. */
+    AutoCloseFD fdRunning = openGCRunningLock(ltRead);
 }
 
 
@@ -243,35 +284,49 @@ static void readTempRoots(PathSet & tempRoots, FDs & fds)
         Path path = (format("%1%/%2%/%3%") % settings.nixStateDir % tempRootsDir % *i).str();
 
         debug(format("reading temporary root file `%1%'") % path);
-        FDPtr fd(new AutoCloseFD(open(path.c_str(), O_RDWR, 0666)));
-        if (*fd == -1) {
-            /* It's okay if the file has disappeared. */
-            if (errno == ENOENT) continue;
-            throw SysError(format("opening temporary roots file `%1%'") % path);
-        }
 
-        /* This should work, but doesn't, for some reason. */
-        //FDPtr fd(new AutoCloseFD(openLockFile(path, false)));
-        //if (*fd == -1) continue;
-
-        /* Try to acquire a write lock without blocking.  This can
-           only succeed if the owning process has died.  In that case
-           we don't care about its temporary roots. */
-        if (lockFile(*fd, ltWrite, false)) {
-            printMsg(lvlError, format("removing stale temporary roots file `%1%'") % path);
-            unlink(path.c_str());
-            writeFull(*fd, (const unsigned char *) "d", 1);
-            continue;
-        }
+        string contents;
+
+        /* When the collector runs in a process that has temporary
+           roots itself (see autoGC()), don't lock our own file.
+           Since locks are per process, the write lock below would
+           succeed, and we would consider ourselves dead. */
+        if (path == fnTempRoots)
+            contents = readFile(path);
+
+        else {
+            FDPtr fd(new AutoCloseFD(open(path.c_str(), O_RDWR, 0666)));
+            if (*fd == -1) {
+                /* It's okay if the file has disappeared. */
+                if (errno == ENOENT) continue;
+                throw SysError(format("opening temporary roots file `%1%'") % path);
+            }
+
+            /* This should work, but doesn't, for some reason. */
+            //FDPtr fd(new AutoCloseFD(openLockFile(path, false)));
+            //if (*fd == -1) continue;
+
+            /* Try to acquire a write lock without blocking.  This can
+               only succeed if the owning process has died.  In that
+               case we don't care about its temporary roots. */
+            if (lockFile(*fd, ltWrite, false)) {
+                printMsg(lvlError, format("removing stale temporary roots file `%1%'") % path);
+                unlink(path.c_str());
+                writeFull(*fd, (const unsigned char *) "d", 1);
+                continue;
+            }
 
-        /* Acquire a read lock.  This will prevent the owning process
-           from upgrading to a write lock, therefore it will block in
-           addTempRoot(). */
-        debug(format("waiting for read lock on `%1%'") % path);
-        lockFile(*fd, ltRead, true);
+            /* Acquire a read lock.  This will prevent the owning
+               process from upgrading to a write lock, therefore it
+               will block in addTempRoot(). */
+            debug(format("waiting for read lock on `%1%'") % path);
+            lockFile(*fd, ltRead, true);
 
-        /* Read the entire file. */
-        string contents = readFile(*fd);
+            /* Read the entire file. */
+            contents = readFile(*fd);
+
+            fds.push_back(fd); /* keep open */
+        }
 
         /* Extract the roots. */
         string::size_type pos = 0, end;
@@ -283,8 +338,6 @@ static void readTempRoots(PathSet & tempRoots, FDs & fds)
             tempRoots.insert(root);
             pos = end + 1;
         }
-
-        fds.push_back(fd); /* keep open */
     }
 }
 
@@ -387,20 +440,61 @@ static void addAdditionalRoots(StoreAPI & store, PathSet & roots)
 struct GCLimitReached { };
 
 
+/* Return the number of bytes available to unprivileged users on the
+   file system containing the store. */
+static unsigned long long getAvailableSpace()
+{
+#if HAVE_STATVFS
+    struct statvfs st;
+    if (statvfs(settings.nixStore.c_str(), &st) == -1)
+        throw SysError(format("getting file system info about `%1%'") % settings.nixStore);
+    return (unsigned long long) st.f_bavail * st.f_frsize;
+#else
+    throw Error("determining the available space in the Nix store is not supported on this platform");
+#endif
+}
+
+
 struct LocalStore::GCState
 {
     GCOptions options;
     GCResults & results;
     PathSet roots;
     PathSet tempRoots;
+    /* Paths found dead or alive by canReachRoot(). */
     PathSet dead;
     PathSet alive;
+    /* The reference graph at the start of the collection, and the
+       paths in it that are reachable from the roots. */
+    PathGraph graph;
+    vector<bool> marked;
+    /* Live paths registered after the graph was loaded. */
+    PathSet live;
+    /* The highest id of the valid paths considered so far. */
+    unsigned long long lastId;
+    /* Read locks on the temporary root files. */
+    FDs fds;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
+    /* The estimated size of the directories moved to the trash
+       directory, and the number of bytes actually freed by emptying
+       it. */
     unsigned long long bytesInvalidated;
+    unsigned long long bytesFreedFromTrash;
     Path trashDir;
     bool shouldDelete;
-    GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
+    GCState(GCResults & results_) : results(results_), lastId(0), bytesInvalidated(0), bytesFreedFromTrash(0) { }
+
+    /* The number of bytes freed, as counted against --max-freed.
+       Emptying the trash directory frees little if the store is
+       optimised, since most files are still linked from the links
+       directory, so the estimate for the trashed directories counts
+       if it's larger. */
+    unsigned long long bytesFreedEstimate() const
+    {
+        return std::max(results.bytesFreed,
+            results.bytesFreed - bytesFreedFromTrash + bytesInvalidated);
+    }
 };
 
 
@@ -464,10 +558,8 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
     } else
         deleteGarbage(state, path);
 
-    if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
-        printMsg(lvlInfo, format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+    if (state.bytesFreedEstimate() > state.options.maxFreed)
         throw GCLimitReached();
-    }
 }
 
 
@@ -560,6 +652,212 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
+int PathGraph::find(const Path & path) const
+{
+    unsigned int lo = 0, hi = byPath.size();
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        const Path & p(paths[byPath[mid]]);
+        if (p == path) return byPath[mid];
+        if (p < path) lo = mid + 1; else hi = mid;
+    }
+    return -1;
+}
+
+
+void PathGraph::mark(unsigned int root, vector<bool> & marked) const
+{
+    if (marked[root]) return;
+    marked[root] = true;
+
+    vector<unsigned int> stack;
+    stack.push_back(root);
+
+    while (!stack.empty()) {
+        unsigned int n = stack.back();
+        stack.pop_back();
+        for (unsigned int i = offsets[n]; i < offsets[n + 1]; ++i) {
+            unsigned int m = targets[i];
+            if (marked[m]) continue;
+            marked[m] = true;
+            stack.push_back(m);
+        }
+    }
+}
+
+
+/* Mark `roots' and everything reachable from them as live, following
+   the outputs and derivers of paths if gc-keep-outputs or
+   gc-keep-derivations is set. */
+void LocalStore::markLive(GCState & state, const PathSet & roots)
+{
+    /* Paths in the graph are marked there.  The remaining ones were
+       registered after the graph was loaded, so traverse them using
+       the database until we get back into the graph.  (Temporary
+       roots need not be valid, e.g. the outputs of a build in
+       progress; isDead() takes care of those.) */
+    PathSet todo;
+    foreach (PathSet::const_iterator, i, roots) {
+        int n = state.graph.find(*i);
+        if (n != -1)
+            state.graph.mark(n, state.marked);
+        else if (state.live.find(*i) == state.live.end())
+            todo.insert(*i);
+    }
+
+    while (!todo.empty()) {
+        PathSet valid = queryValidPaths(todo);
+        state.live.insert(valid.begin(), valid.end());
+
+        ValidPathInfoMap infos;
+        queryPathInfos(valid, infos);
+
+        PathSet edges;
+        foreach (ValidPathInfoMap::iterator, i, infos) {
+            edges.insert(i->second.references.begin(), i->second.references.end());
+            if (state.gcKeepDerivations && i->second.deriver != "")
+                edges.insert(i->second.deriver);
+            if (state.gcKeepOutputs && isDerivation(i->first)) {
+                PathSet outputs = queryDerivationOutputs(i->first);
+                edges.insert(outputs.begin(), outputs.end());
+            }
+        }
+
+        todo.clear();
+        foreach (PathSet::iterator, i, edges) {
+            int n = state.graph.find(*i);
+            if (n != -1)
+                state.graph.mark(n, state.marked);
+            else if (state.live.find(*i) == state.live.end())
+                todo.insert(*i);
+        }
+    }
+}
+
+
+/* Re-read the temporary roots, and mark them and the paths registered
+   since the last scan as live.  The caller must hold the global GC
+   lock.  The read locks on the temporary root files are kept in
+   `state.fds', so no temporary roots can be added until those are
+   released. */
+void LocalStore::markNewRoots(GCState & state)
+{
+    state.fds.clear();
+    PathSet roots;
+    readTempRoots(roots, state.fds);
+    state.tempRoots.insert(roots.begin(), roots.end());
+
+    PathSet registered = queryValidPathsSince(state.lastId);
+    roots.insert(registered.begin(), registered.end());
+
+    markLive(state, roots);
+}
+
+
+bool LocalStore::isDead(const GCState & state, const Path & path)
+{
+    int n = state.graph.find(path);
+    return path != linksDir && path != state.trashDir
+        && (n == -1 ? state.live.find(path) == state.live.end() : !state.marked[n])
+        && state.tempRoots.find(path) == state.tempRoots.end()
+        /* A lock file belonging to a path that we're building right
+           now isn't garbage. */
+        && !isActiveTempFile(state, path, ".lock")
+        /* Don't delete .chroot directories for derivations that are
+           currently being built. */
+        && !isActiveTempFile(state, path, ".chroot");
+}
+
+
+static unsigned int getDeleteThreads()
+{
+    unsigned int nrThreads = getThreadCount(settings.gcDeleteThreads);
+    return nrThreads > 1 ? nrThreads : 0;
+}
+
+
+struct DeletePathTask : Task
+{
+    Path path;
+    unsigned long long bytesFreed;
+    DeletePathTask(const Path & path) : path(path), bytesFreed(0) { }
+    void run()
+    {
+        deletePathQuiet(path, bytesFreed);
+    }
+};
+
+
+/* Delete the contents of the trash directory, in parallel. */
+void LocalStore::emptyTrash(GCState & state)
+{
+    Strings names = readDirectory(state.trashDir);
+
+    list<DeletePathTask> tasks;
+    ThreadPool pool(getDeleteThreads());
+
+    foreach (Strings::iterator, i, names) {
+        tasks.push_back(DeletePathTask(state.trashDir + "/" + *i));
+        pool.enqueue(tasks.back());
+    }
+
+    pool.wait();
+
+    foreach (list<DeletePathTask>::iterator, i, tasks) {
+        state.results.bytesFreed += i->bytesFreed;
+        state.bytesFreedFromTrash += i->bytesFreed;
+    }
+}
+
+
+/* The number of entries of the links directory processed per task. */
+static const unsigned int linksPerTask = 1024;
+
+
+struct RemoveLinksTask : Task
+{
+    Path linksDir;
+    Strings names;
+    long long actualSize, unsharedSize;
+    unsigned long long bytesFreed;
+    unsigned int linksDeleted;
+    list<ino_t> inodesDeleted;
+
+    RemoveLinksTask(const Path & linksDir)
+        : linksDir(linksDir), actualSize(0), unsharedSize(0), bytesFreed(0), linksDeleted(0) { }
+
+    void run()
+    {
+        foreach (Strings::iterator, i, names) {
+            checkInterrupt();
+            Path path = linksDir + "/" + *i;
+
+            struct stat st;
+            if (lstat(path.c_str(), &st) == -1) {
+                /* readdir() may return entries that another task has
+                   just deleted. */
+                if (errno == ENOENT) continue;
+                throw SysError(format("statting `%1%'") % path);
+            }
+
+            if (st.st_nlink != 1) {
+                unsigned long long size = st.st_blocks * 512ULL;
+                actualSize += size;
+                unsharedSize += (st.st_nlink - 1) * size;
+                continue;
+            }
+
+            if (unlink(path.c_str()) == -1)
+                throw SysError(format("deleting `%1%'") % path);
+
+            bytesFreed += st.st_blocks * 512;
+            linksDeleted++;
+            inodesDeleted.push_back(st.st_ino);
+        }
+    }
+};
+
+
 /* Unlink all files in /nix/store/.links that have a link count of 1,
    which indicates that there are no other links and so they can be
    safely deleted.  FIXME: race condition with optimisePath(): we
@@ -571,33 +869,51 @@ void LocalStore::removeUnusedLinks(const GCState & state)
     if (!dir) throw SysError(format("opening directory `%1%'") % linksDir);
 
     long long actualSize = 0, unsharedSize = 0;
+    unsigned int linksDeleted = 0;
+
+    list<RemoveLinksTask> tasks;
+    ThreadPool pool(getDeleteThreads());
+    unsigned int maxTasks = 16 * (pool.getNrThreads() + 1);
+
+    tasks.push_back(RemoveLinksTask(linksDir));
 
     struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir)) {
+    while (true) {
+        errno = 0;
+        dirent = readdir(dir);
         checkInterrupt();
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        Path path = linksDir + "/" + name;
-
-        struct stat st;
-        if (lstat(path.c_str(), &st) == -1)
-            throw SysError(format("statting `%1%'") % path);
-
-        if (st.st_nlink != 1) {
-            unsigned long long size = st.st_blocks * 512ULL;
-            actualSize += size;
-            unsharedSize += (st.st_nlink - 1) * size;
-            continue;
+
+        if (dirent) {
+            string name = dirent->d_name;
+            if (name == "." || name == "..") continue;
+            tasks.back().names.push_back(name);
+            if (tasks.back().names.size() < linksPerTask) continue;
         }
 
-        printMsg(lvlTalkative, format("deleting unused link `%1%'") % path);
+        pool.enqueue(tasks.back());
+
+        /* Bound the number of names in memory. */
+        if (!dirent || tasks.size() >= maxTasks) {
+            pool.wait();
+            std::set<ino_t> inodesDeleted;
+            foreach (list<RemoveLinksTask>::iterator, i, tasks) {
+                actualSize += i->actualSize;
+                unsharedSize += i->unsharedSize;
+                state.results.bytesFreed += i->bytesFreed;
+                linksDeleted += i->linksDeleted;
+                inodesDeleted.insert(i->inodesDeleted.begin(), i->inodesDeleted.end());
+            }
+            tasks.clear();
+            unregisterLinkedInodes(inodesDeleted);
+        }
 
-        if (unlink(path.c_str()) == -1)
-            throw SysError(format("deleting `%1%'") % path);
+        if (!dirent) break;
 
-        state.results.bytesFreed += st.st_blocks * 512;
+        tasks.push_back(RemoveLinksTask(linksDir));
     }
 
+    printMsg(lvlTalkative, format("deleted %1% unused links") % linksDeleted);
+
     struct stat st;
     if (stat(linksDir.c_str(), &st) == -1)
         throw SysError(format("statting `%1%'") % linksDir);
@@ -608,6 +924,15 @@ void LocalStore::removeUnusedLinks(const GCState & state)
 }
 
 
+struct CompareLastUsed
+{
+    bool operator () (const std::pair<time_t, Path> & a, const std::pair<time_t, Path> & b) const
+    {
+        return a.first < b.first;
+    }
+};
+
+
 void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     GCState state(results);
@@ -627,6 +952,191 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     state.shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
 
+    /* Keep other collectors from deleting while we empty the trash
+       directory or delete paths. */
+    AutoCloseFD fdRunning;
+    if (state.shouldDelete) fdRunning = openGCRunningLock(ltWrite);
+
+    if (options.action == GCOptions::gcDeleteSpecific) {
+        deleteSpecific(state);
+        return;
+    }
+
+    /* Find the roots.  We don't hold the GC lock while doing so or
+       while marking, so roots may be added concurrently; those are
+       picked up below. */
+    printMsg(lvlError, format("finding garbage collector roots..."));
+    if (!options.ignoreLiveness) {
+        Roots rootMap = findRoots();
+        foreach (Roots::iterator, i, rootMap) state.roots.insert(i->second);
+
+        /* Add additional roots returned by the program specified by
+           the NIX_ROOT_FINDER environment variable.  This is
+           typically used to add running programs to the set of roots
+           (to prevent them from being garbage collected). */
+        addAdditionalRoots(*this, state.roots);
+    }
+
+    readTempRoots(state.tempRoots, state.fds);
+    state.fds.clear();
+    state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
+
+    if (state.shouldDelete) {
+        createDirs(state.trashDir);
+        emptyTrash(state);
+    }
+
+    /* Don't keep processes that add permanent roots waiting while
+       we're marking. */
+    fdRunning.close();
+
+    if (options.maxFreed == 0) return;
+
+    /* Load the reference graph and mark everything reachable from
+       the roots.  With WAL, a read transaction gives a consistent view
+       of the database without blocking writers.  Otherwise the graph
+       may lack some edges of paths registered while loading it, which
+       is harmless since those paths are treated as new below.  Paths
+       registered after `lastId' are dealt with by markNewRoots(). */
+    printMsg(lvlError, format("determining live/dead paths..."));
+    {
+        boost::shared_ptr<SQLiteReadTxn> txn;
+        if (settings.useSQLiteWAL) txn = boost::shared_ptr<SQLiteReadTxn>(new SQLiteReadTxn(db));
+        queryPathGraph(state.graph, state.gcKeepOutputs, state.gcKeepDerivations);
+    }
+    state.lastId = state.graph.ids.empty() ? 0 : state.graph.ids.back();
+    state.marked.assign(state.graph.paths.size(), false);
+    markLive(state, state.roots);
+
+    /* Read the store.  We don't use readDirectory() here so that
+       GCing can start faster.  Entries created after this point are
+       not considered. */
+    Paths entries;
+    {
+        AutoCloseDir dir = opendir(settings.nixStore.c_str());
+        if (!dir) throw SysError(format("opening directory `%1%'") % settings.nixStore);
+        struct dirent * dirent;
+        while (errno = 0, dirent = readdir(dir)) {
+            checkInterrupt();
+            string name = dirent->d_name;
+            if (name == "." || name == "..") continue;
+            Path path = settings.nixStore + "/" + name;
+            if (isDead(state, path)) entries.push_back(path);
+        }
+    }
+
+    /* From here on, processes that add permanent roots wait until
+       we're done (see syncWithGC()), since we won't see their roots.
+       Then acquire the global GC lock.  This prevents processes from
+       creating new temporary root files.  Then find the roots added
+       while we were marking. */
+    if (state.shouldDelete) fdRunning = openGCRunningLock(ltWrite);
+    AutoCloseFD fdGCLock = openGCLock(ltWrite);
+
+    if (!options.ignoreLiveness) {
+        Roots rootMap = findRoots();
+        PathSet roots;
+        foreach (Roots::iterator, i, rootMap) roots.insert(i->second);
+        markLive(state, roots);
+    }
+    markNewRoots(state);
+
+    /* Delete invalid paths first.  When using --max-freed etc.,
+       deleting invalid paths is preferred over deleting unreachable
+       paths, since unreachable paths could become reachable again.
+       Then delete the valid paths that were used the longest time
+       ago.  Among paths last used at the same time, randomise the
+       order to make the collector less biased towards deleting paths
+       that come alphabetically first (e.g. /nix/store/000...).  Dead
+       valid paths are always in the graph, since paths registered
+       after it was loaded are live. */
+    vector<Path> dead;
+    vector<std::pair<time_t, Path> > deadValid;
+    foreach (Paths::iterator, i, entries) {
+        if (!isDead(state, *i)) continue;
+        int n = state.graph.find(*i);
+        if (n == -1)
+            dead.push_back(*i);
+        else
+            deadValid.push_back(std::pair<time_t, Path>(state.graph.lastUsed[n], *i));
+    }
+    random_shuffle(deadValid.begin(), deadValid.end());
+    stable_sort(deadValid.begin(), deadValid.end(), CompareLastUsed());
+    for (vector<std::pair<time_t, Path> >::iterator i = deadValid.begin(); i != deadValid.end(); ++i)
+        dead.push_back(i->second);
+
+    if (state.options.action == GCOptions::gcReturnLive) {
+        state.results.paths = state.live;
+        for (unsigned int n = 0; n < state.marked.size(); ++n)
+            if (state.marked[n]) state.results.paths.insert(state.graph.paths[n]);
+        return;
+    }
+
+    if (state.options.action == GCOptions::gcReturnDead) {
+        state.results.paths.insert(dead.begin(), dead.end());
+        return;
+    }
+
+    /* Delete the dead paths in batches.  Between batches, release the
+       GC lock so that other processes can add temporary roots, and
+       delete the paths moved to the trash directory.  Before each
+       batch, mark the new temporary roots and paths registered in the
+       meantime as live.
+
+       The size of directories moved to the trash is estimated using
+       their NAR size.  If the number of bytes freed, counting that
+       estimate, reaches the limit set by --max-freed,
+       deletePathRecursive() ends the batch early and we stop. */
+    printMsg(lvlError, format("deleting garbage..."));
+
+    vector<Path>::iterator i = dead.begin();
+    while (true) {
+        if (state.options.targetFree && getAvailableSpace() >= state.options.targetFree) {
+            printMsg(lvlInfo, format("at least %1% bytes are available; stopping") % state.options.targetFree);
+            break;
+        }
+
+        try {
+            unsigned int n = 0;
+            while (i != dead.end() && n < gcBatchSize) {
+                Path path = *i++;
+                if (!isDead(state, path)) continue;
+                deletePathRecursive(state, path);
+                n++;
+            }
+        } catch (GCLimitReached & e) {
+        }
+
+        /* Allow other processes to add to the store while we're
+           emptying the trash. */
+        fdGCLock.close();
+        state.fds.clear();
+
+        emptyTrash(state);
+
+        printMsg(lvlInfo, format("%1% store paths deleted, %2$.2f MiB freed so far")
+            % state.results.paths.size() % (state.results.bytesFreed / (1024.0 * 1024.0)));
+
+        if (state.bytesFreedEstimate() >= state.options.maxFreed) {
+            printMsg(lvlInfo, format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+            break;
+        }
+
+        if (i == dead.end()) break;
+
+        fdGCLock = openGCLock(ltWrite);
+        markNewRoots(state);
+    }
+
+    fdGCLock.close();
+    state.fds.clear();
+
+    finishDeletion(state);
+}
+
+
+void LocalStore::deleteSpecific(GCState & state)
+{
     /* Acquire the global GC root.  This prevents
        a) New roots from being added.
        b) Processes from creating new temporary root files. */
@@ -635,119 +1145,133 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     /* Find the roots.  Since we've grabbed the GC lock, the set of
        permanent roots cannot increase now. */
     printMsg(lvlError, format("finding garbage collector roots..."));
-    Roots rootMap = options.ignoreLiveness ? Roots() : findRoots();
+    Roots rootMap = state.options.ignoreLiveness ? Roots() : findRoots();
 
     foreach (Roots::iterator, i, rootMap) state.roots.insert(i->second);
 
-    /* Add additional roots returned by the program specified by the
-       NIX_ROOT_FINDER environment variable.  This is typically used
-       to add running programs to the set of roots (to prevent them
-       from being garbage collected). */
-    if (!options.ignoreLiveness)
+    if (!state.options.ignoreLiveness)
         addAdditionalRoots(*this, state.roots);
 
     /* Read the temporary roots.  This acquires read locks on all
        per-process temporary root files.  So after this point no paths
        can be added to the set of temporary roots. */
-    FDs fds;
-    readTempRoots(state.tempRoots, fds);
+    readTempRoots(state.tempRoots, state.fds);
     state.roots.insert(state.tempRoots.begin(), state.tempRoots.end());
 
-    /* After this point the set of roots or temporary roots cannot
-       increase, since we hold locks on everything.  So everything
-       that is not reachable from `roots'. */
+    createDirs(state.trashDir);
+    emptyTrash(state);
 
-    if (state.shouldDelete) {
-        if (pathExists(state.trashDir)) deleteGarbage(state, state.trashDir);
-        createDirs(state.trashDir);
-    }
-
-    /* Now either delete all garbage paths, or just the specified
-       paths (for gcDeleteSpecific). */
-
-    if (options.action == GCOptions::gcDeleteSpecific) {
-
-        foreach (PathSet::iterator, i, options.pathsToDelete) {
+    try {
+        foreach (PathSet::iterator, i, state.options.pathsToDelete) {
             assertStorePath(*i);
             tryToDelete(state, *i);
             if (state.dead.find(*i) == state.dead.end())
                 throw Error(format("cannot delete path `%1%' since it is still alive") % *i);
         }
+    } catch (GCLimitReached & e) {
+        printMsg(lvlInfo, format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+    }
 
-    } else if (options.maxFreed > 0) {
+    /* Allow other processes to add to the store from here on. */
+    fdGCLock.close();
+    state.fds.clear();
 
-        if (state.shouldDelete)
-            printMsg(lvlError, format("deleting garbage..."));
-        else
-            printMsg(lvlError, format("determining live/dead paths..."));
+    finishDeletion(state);
+}
 
-        try {
 
-            AutoCloseDir dir = opendir(settings.nixStore.c_str());
-            if (!dir) throw SysError(format("opening directory `%1%'") % settings.nixStore);
-
-            /* Read the store and immediately delete all paths that
-               aren't valid.  When using --max-freed etc., deleting
-               invalid paths is preferred over deleting unreachable
-               paths, since unreachable paths could become reachable
-               again.  We don't use readDirectory() here so that GCing
-               can start faster. */
-            Paths entries;
-            struct dirent * dirent;
-            while (errno = 0, dirent = readdir(dir)) {
-                checkInterrupt();
-                string name = dirent->d_name;
-                if (name == "." || name == "..") continue;
-                Path path = settings.nixStore + "/" + name;
-                if (isValidPath(path))
-                    entries.push_back(path);
-                else
-                    tryToDelete(state, path);
-            }
+void LocalStore::finishDeletion(GCState & state)
+{
+    /* Delete the trash directory. */
+    printMsg(lvlInfo, format("deleting `%1%'") % state.trashDir);
+    emptyTrash(state);
+    deleteGarbage(state, state.trashDir);
 
-            dir.close();
+    /* Clean up the links directory. */
+    printMsg(lvlError, format("deleting unused links..."));
+    removeUnusedLinks(state);
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
-            vector<Path> entries_(entries.begin(), entries.end());
-            random_shuffle(entries_.begin(), entries_.end());
+    /* While we're at it, vacuum the database. */
+    if (state.options.action == GCOptions::gcDeleteDead) vacuumDB();
+}
 
-            foreach (vector<Path>::iterator, i, entries_)
-                tryToDelete(state, *i);
 
-        } catch (GCLimitReached & e) {
-        }
-    }
+/* Whether to collect garbage automatically now, i.e., whether the
+   file system containing the store has less than `gc-min-free' bytes
+   available.  Don't collect more than once a minute, in case the
+   collector can't reach the target. */
+static bool wantAutoGC(unsigned long long & avail)
+{
+    if (settings.gcMinFree == 0) return false;
 
-    if (state.options.action == GCOptions::gcReturnLive) {
-        state.results.paths = state.alive;
-        return;
-    }
+    static time_t lastRun = 0;
+    if (lastRun && time(0) < lastRun + 60) return false;
 
-    if (state.options.action == GCOptions::gcReturnDead) {
-        state.results.paths = state.dead;
+    avail = getAvailableSpace();
+    if (avail >= settings.gcMinFree) return false;
+
+    lastRun = time(0);
+    return true;
+}
+
+
+void LocalStore::autoGC()
+{
+    unsigned long long avail;
+    try {
+        if (!wantAutoGC(avail)) return;
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: automatic garbage collection failed: %1%") % e.msg());
         return;
     }
+    runAutoGC(avail);
+}
 
-    /* Allow other processes to add to the store from here on. */
-    fdGCLock.close();
-    fds.clear();
 
-    /* Delete the trash directory. */
-    printMsg(lvlInfo, format("deleting `%1%'") % state.trashDir);
-    deleteGarbage(state, state.trashDir);
+pid_t LocalStore::startAutoGC()
+{
+    unsigned long long avail;
+    pid_t pid;
+    try {
+        if (!wantAutoGC(avail)) return -1;
+        pid = fork();
+        if (pid == -1) throw SysError("unable to fork");
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: automatic garbage collection failed: %1%") % e.msg());
+        return -1;
+    }
+    if (pid != 0) return pid;
 
-    /* Clean up the links directory. */
-    if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
-        printMsg(lvlError, format("deleting unused links..."));
-        removeUnusedLinks(state);
+    try {
+        /* A SQLite connection cannot be used after fork(), not even
+           to close it, so leave ours alone and open a new one. */
+        LocalStore store;
+        store.runAutoGC(avail);
+    } catch (std::exception & e) {
+        writeToStderr("automatic garbage collection failed: " + string(e.what()) + "\n");
     }
+    _exit(0);
+}
 
-    /* While we're at it, vacuum the database. */
-    if (options.action == GCOptions::gcDeleteDead) vacuumDB();
+
+void LocalStore::runAutoGC(unsigned long long avail)
+{
+    try {
+        printMsg(lvlError, format("only %1% bytes are available in the Nix store; collecting garbage...") % avail);
+
+        GCOptions options;
+        options.action = GCOptions::gcDeleteDead;
+        options.targetFree = std::max(settings.gcTargetFree, settings.gcMinFree);
+
+        GCResults results;
+        collectGarbage(options, results);
+
+        printMsg(lvlError, format("%1% store paths deleted, %2$.2f MiB freed")
+            % results.paths.size() % (results.bytesFreed / (1024.0 * 1024.0)));
+
+    } catch (Error & e) {
+        printMsg(lvlError, format("warning: automatic garbage collection failed: %1%") % e.msg());
+    }
 }
 
 
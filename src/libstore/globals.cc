@@ -52,7 +52,16 @@ Settings::Settings()
     checkRootReachability = false;
     gcKeepOutputs = false;
     gcKeepDerivations = true;
+    gcDeleteThreads = 0;
+    gcMinFree = 0;
+    gcTargetFree = 0;
     autoOptimiseStore = false;
+    optimiseMethod = "hardlink";
+    hashThreads = 0;
+    evalThreads = 1;
+    evalCache = false;
+    parseCache = false;
+    daemonWorkers = 0;
     envKeepDerivations = false;
     lockCPU = getEnv("NIX_AFFINITY_HACK", "1") == "1";
     showTrace = false;
@@ -149,7 +158,16 @@ void Settings::update()
     get(checkRootReachability, "gc-check-reachability");
     get(gcKeepOutputs, "gc-keep-outputs");
     get(gcKeepDerivations, "gc-keep-derivations");
+    get(gcDeleteThreads, "gc-delete-threads");
+    get(gcMinFree, "gc-min-free");
+    get(gcTargetFree, "gc-target-free");
     get(autoOptimiseStore, "auto-optimise-store");
+    get(optimiseMethod, "optimise-method");
+    get(hashThreads, "hash-threads");
+    get(evalThreads, "eval-threads");
+    get(evalCache, "eval-cache");
+    get(parseCache, "parse-cache");
+    get(daemonWorkers, "daemon-workers");
     get(envKeepDerivations, "env-keep-derivations");
 }
 
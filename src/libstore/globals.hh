@@ -175,10 +175,47 @@ struct Settings {
        paths. */
     bool gcKeepDerivations;
 
+    /* Number of threads used by the garbage collector to delete
+       paths.  0 means the number of CPU cores. */
+    unsigned int gcDeleteThreads;
+
+    /* If the file system containing the store has less than this many
+       bytes available when a build starts, run the garbage collector
+       until `gcTargetFree' bytes are available.  0 disables this. */
+    unsigned long long gcMinFree;
+    unsigned long long gcTargetFree;
+
     /* Whether to automatically replace files with identical contents
        with hard links. */
     bool autoOptimiseStore;
 
+    /* How files with identical contents are deduplicated: `hardlink'
+       or `reflink' (share extents on a copy-on-write file system). */
+    string optimiseMethod;
+
+    /* Number of threads used to hash and scan store paths (such as
+       build outputs) and to hash files when optimising the store.  0
+       means the number of CPU cores. */
+    unsigned int hashThreads;
+
+    /* Number of threads used to evaluate the attributes of a Nix
+       expression when looking for derivations (e.g. in `nix-env
+       -qa').  0 means the number of CPU cores. */
+    unsigned int evalThreads;
+
+    /* Whether to cache the results of `nix-env -qa' and
+       `nix-instantiate' in ~/.cache/nix, keyed on the files and
+       environment variables that the evaluation depended on. */
+    bool evalCache;
+
+    /* Whether to cache parsed Nix expressions in ~/.cache/nix. */
+    bool parseCache;
+
+    /* Number of pre-forked nix-daemon processes that serve read-only
+       requests without forking per connection.  0 means that the
+       daemon forks a process for every connection. */
+    unsigned int daemonWorkers;
+
     /* Whether to add derivations as a dependency of user environments
        (to prevent them from being GCed). */
     bool envKeepDerivations;
@@ -6,6 +6,8 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "affinity.hh"
+#include "references.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -39,171 +41,6 @@
 namespace nix {
 
 
-MakeError(SQLiteError, Error);
-MakeError(SQLiteBusy, SQLiteError);
-
-
-static void throwSQLiteError(sqlite3 * db, const format & f)
-    __attribute__ ((noreturn));
-
-static void throwSQLiteError(sqlite3 * db, const format & f)
-{
-    int err = sqlite3_errcode(db);
-    if (err == SQLITE_BUSY || err == SQLITE_PROTOCOL) {
-        if (err == SQLITE_PROTOCOL)
-            printMsg(lvlError, "warning: SQLite database is busy (SQLITE_PROTOCOL)");
-        else {
-            static bool warned = false;
-            if (!warned) {
-                printMsg(lvlError, "warning: SQLite database is busy");
-                warned = true;
-            }
-        }
-        /* Sleep for a while since retrying the transaction right away
-           is likely to fail again. */
-#if HAVE_NANOSLEEP
-        struct timespec t;
-        t.tv_sec = 0;
-        t.tv_nsec = (random() % 100) * 1000 * 1000; /* <= 0.1s */
-        nanosleep(&t, 0);
-#else
-        sleep(1);
-#endif
-        throw SQLiteBusy(format("%1%: %2%") % f.str() % sqlite3_errmsg(db));
-    }
-    else
-        throw SQLiteError(format("%1%: %2%") % f.str() % sqlite3_errmsg(db));
-}
-
-
-/* Convenience macros for retrying a SQLite transaction. */
-#define retry_sqlite while (1) { try {
-#define end_retry_sqlite break; } catch (SQLiteBusy & e) { } }
-
-
-SQLite::~SQLite()
-{
-    try {
-        if (db && sqlite3_close(db) != SQLITE_OK)
-            throwSQLiteError(db, "closing database");
-    } catch (...) {
-        ignoreException();
-    }
-}
-
-
-void SQLiteStmt::create(sqlite3 * db, const string & s)
-{
-    checkInterrupt();
-    assert(!stmt);
-    if (sqlite3_prepare_v2(db, s.c_str(), -1, &stmt, 0) != SQLITE_OK)
-        throwSQLiteError(db, "creating statement");
-    this->db = db;
-}
-
-
-void SQLiteStmt::reset()
-{
-    assert(stmt);
-    /* Note: sqlite3_reset() returns the error code for the most
-       recent call to sqlite3_step().  So ignore it. */
-    sqlite3_reset(stmt);
-    curArg = 1;
-}
-
-
-SQLiteStmt::~SQLiteStmt()
-{
-    try {
-        if (stmt && sqlite3_finalize(stmt) != SQLITE_OK)
-            throwSQLiteError(db, "finalizing statement");
-    } catch (...) {
-        ignoreException();
-    }
-}
-
-
-void SQLiteStmt::bind(const string & value)
-{
-    if (sqlite3_bind_text(stmt, curArg++, value.c_str(), -1, SQLITE_TRANSIENT) != SQLITE_OK)
-        throwSQLiteError(db, "binding argument");
-}
-
-
-void SQLiteStmt::bind(int value)
-{
-    if (sqlite3_bind_int(stmt, curArg++, value) != SQLITE_OK)
-        throwSQLiteError(db, "binding argument");
-}
-
-
-void SQLiteStmt::bind64(long long value)
-{
-    if (sqlite3_bind_int64(stmt, curArg++, value) != SQLITE_OK)
-        throwSQLiteError(db, "binding argument");
-}
-
-
-void SQLiteStmt::bind()
-{
-    if (sqlite3_bind_null(stmt, curArg++) != SQLITE_OK)
-        throwSQLiteError(db, "binding argument");
-}
-
-
-/* Helper class to ensure that prepared statements are reset when
-   leaving the scope that uses them.  Unfinished prepared statements
-   prevent transactions from being aborted, and can cause locks to be
-   kept when they should be released. */
-struct SQLiteStmtUse
-{
-    SQLiteStmt & stmt;
-    SQLiteStmtUse(SQLiteStmt & stmt) : stmt(stmt)
-    {
-        stmt.reset();
-    }
-    ~SQLiteStmtUse()
-    {
-        try {
-            stmt.reset();
-        } catch (...) {
-            ignoreException();
-        }
-    }
-};
-
-
-struct SQLiteTxn
-{
-    bool active;
-    sqlite3 * db;
-
-    SQLiteTxn(sqlite3 * db) : active(false) {
-        this->db = db;
-        if (sqlite3_exec(db, "begin;", 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "starting transaction");
-        active = true;
-    }
-
-    void commit()
-    {
-        if (sqlite3_exec(db, "commit;", 0, 0, 0) != SQLITE_OK)
-            throwSQLiteError(db, "committing transaction");
-        active = false;
-    }
-
-    ~SQLiteTxn()
-    {
-        try {
-            if (active && sqlite3_exec(db, "rollback;", 0, 0, 0) != SQLITE_OK)
-                throwSQLiteError(db, "aborting transaction");
-        } catch (...) {
-            ignoreException();
-        }
-    }
-};
-
-
 void checkStoreNotSymlink()
 {
     if (getEnv("NIX_IGNORE_SYMLINK_STORE") == "1") return;
@@ -228,7 +65,7 @@ LocalStore::LocalStore(bool reserveSpace)
     schemaPath = settings.nixDBPath + "/schema";
 
     if (settings.readOnlyMode) {
-        openDB(false);
+        openDBReadOnly();
         return;
     }
 
@@ -249,22 +86,7 @@ LocalStore::LocalStore(bool reserveSpace)
 
     checkStoreNotSymlink();
 
-    /* We can't open a SQLite database if the disk is full.  Since
-       this prevents the garbage collector from running when it's most
-       needed, we reserve some dummy space that we can free just
-       before doing a garbage collection. */
-    try {
-        Path reservedPath = settings.nixDBPath + "/reserved";
-        if (reserveSpace) {
-            struct stat st;
-            if (stat(reservedPath.c_str(), &st) == -1 ||
-                st.st_size != settings.reservedSize)
-                writeFile(reservedPath, string(settings.reservedSize, 'X'));
-        }
-        else
-            deletePath(reservedPath);
-    } catch (SysError & e) { /* don't care about errors */
-    }
+    updateReservedSpace(reserveSpace);
 
     /* Acquire the big fat lock in shared mode to make sure that no
        schema upgrade is in progress. */
@@ -274,7 +96,7 @@ LocalStore::LocalStore(bool reserveSpace)
     } catch (SysError & e) {
         if (e.errNo != EACCES) throw;
         settings.readOnlyMode = true;
-        openDB(false);
+        openDBReadOnly();
         return;
     }
 
@@ -293,6 +115,7 @@ LocalStore::LocalStore(bool reserveSpace)
     else if (curSchema == 0) { /* new store */
         curSchema = nixSchemaVersion;
         openDB(true);
+        prepareStatements();
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
     }
 
@@ -313,14 +136,63 @@ LocalStore::LocalStore(bool reserveSpace)
         curSchema = getSchema();
 
         if (curSchema < 6) upgradeStore6();
-        else if (curSchema < 7) { upgradeStore7(); openDB(true); }
+        else {
+            if (curSchema < 7) { upgradeStore7(); openDB(true); }
+            else openDB(false);
+            if (curSchema < 8) upgradeStore8();
+            if (curSchema < 9) upgradeStore9();
+            if (curSchema < 10) upgradeStore10();
+            if (curSchema < 11) upgradeStore11();
+            prepareStatements();
+        }
 
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock, ltRead, true);
     }
 
-    else openDB(false);
+    else {
+        openDB(false);
+        prepareStatements();
+    }
+}
+
+
+void LocalStore::releaseBigLock()
+{
+    if (globalLock != -1) lockFile(globalLock, ltNone, true);
+}
+
+
+bool LocalStore::reacquireBigLock()
+{
+    if (globalLock == -1) return true;
+    if (!lockFile(globalLock, ltRead, false)) {
+        printMsg(lvlError, "waiting for the big Nix store lock...");
+        lockFile(globalLock, ltRead, true);
+    }
+    return getSchema() == nixSchemaVersion;
+}
+
+
+void LocalStore::updateReservedSpace(bool reserveSpace)
+{
+    /* We can't open a SQLite database if the disk is full.  Since
+       this prevents the garbage collector from running when it's most
+       needed, we reserve some dummy space that we can free just
+       before doing a garbage collection. */
+    try {
+        Path reservedPath = settings.nixDBPath + "/reserved";
+        if (reserveSpace) {
+            struct stat st;
+            if (stat(reservedPath.c_str(), &st) == -1 ||
+                st.st_size != settings.reservedSize)
+                writeFile(reservedPath, string(settings.reservedSize, 'X'));
+        }
+        else
+            deletePath(reservedPath);
+    } catch (SysError & e) { /* don't care about errors */
+    }
 }
 
 
@@ -340,6 +212,24 @@ LocalStore::~LocalStore()
 }
 
 
+void LocalStore::openDBReadOnly()
+{
+    /* We can't upgrade the schema without write access, and the
+       prepared statements refer to the tables and columns of the
+       current schema. */
+    int curSchema = getSchema();
+    if (curSchema > nixSchemaVersion)
+        throw Error(format("current Nix store schema is version %1%, but I only support %2%")
+            % curSchema % nixSchemaVersion);
+    if (curSchema != 0 && curSchema < nixSchemaVersion)
+        throw Error(format("the Nix store database (schema version %1%) needs to be upgraded to version %2%, "
+                "which requires write access; please run a Nix command as a user that owns the store")
+            % curSchema % nixSchemaVersion);
+    openDB(false);
+    prepareStatements();
+}
+
+
 int LocalStore::getSchema()
 {
     int curSchema = 0;
@@ -405,12 +295,17 @@ void LocalStore::openDB(bool create)
         if (sqlite3_exec(db, (const char *) schema, 0, 0, 0) != SQLITE_OK)
             throwSQLiteError(db, "initialising database schema");
     }
+}
+
 
-    /* Prepare SQL statements. */
+/* Prepare SQL statements.  This is done after any schema upgrades,
+   since the statements may refer to new tables and columns. */
+void LocalStore::prepareStatements()
+{
     stmtRegisterValidPath.create(db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize) values (?, ?, ?, ?, ?);");
     stmtUpdatePathInfo.create(db,
-        "update ValidPaths set narSize = ?, hash = ? where path = ?;");
+        "update ValidPaths set narSize = ?, hash = ?, optimised = null where path = ?;");
     stmtAddReference.create(db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
     stmtQueryPathInfo.create(db,
@@ -441,6 +336,37 @@ void LocalStore::openDB(bool create)
     // ensure efficient lookup.
     stmtQueryPathFromHashPart.create(db,
         "select path from ValidPaths where path >= ? limit 1;");
+    stmtQueryLinkedInode.create(db,
+        "select hash from LinkedInodes where ino = ?;");
+    stmtQueryReflinkSource.create(db,
+        "select v.path, r.name from ReflinkSources r join ValidPaths v on r.path = v.id where r.hash = ?;");
+    stmtRegisterBuildStats.create(db,
+        "insert into BuildStats (drvPath, name, machine, startTime, wallTime, userTime, systemTime, maxRSS, logSize, narSize, succeeded) "
+        "values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);");
+    stmtQueryBuildStats.create(db,
+        "select machine, startTime, wallTime, userTime, systemTime, maxRSS, logSize, narSize, succeeded "
+        "from BuildStats where drvPath = ? order by id;");
+    stmtQueryAverageBuildTime.create(db,
+        "select avg(wallTime) from (select wallTime from BuildStats where name = ? and succeeded = 1 order by id desc limit 5);");
+
+    /* Closures are computed by a recursive query starting at the
+       paths in the temporary table ClosureRoots.  Recursive queries
+       require SQLite 3.8.3; with older versions queryClosure() falls
+       back to following the references one level at a time. */
+    if (sqlite3_libversion_number() >= 3008003) {
+        if (sqlite3_exec(db, "create temp table if not exists ClosureRoots (id integer primary key not null);", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "creating temporary table");
+        stmtAddClosureRoot.create(db,
+            "insert into ClosureRoots (id) select id from ValidPaths where path = ?;");
+        stmtQueryClosure.create(db,
+            "with recursive Closure(id) as (select id from ClosureRoots "
+            "union select reference from Refs join Closure on referrer = Closure.id) "
+            "select path from Closure join ValidPaths on ValidPaths.id = Closure.id;");
+        stmtQueryReverseClosure.create(db,
+            "with recursive Closure(id) as (select id from ClosureRoots "
+            "union select referrer from Refs join Closure on reference = Closure.id) "
+            "select path from Closure join ValidPaths on ValidPaths.id = Closure.id;");
+    }
 }
 
 
@@ -754,6 +680,95 @@ void LocalStore::clearFailedPaths(const PathSet & paths)
 }
 
 
+/* Bind `n', or null if it's 0 (i.e. unknown). */
+static void bindOptional(SQLiteStmt & stmt, unsigned long long n)
+{
+    if (n != 0)
+        stmt.bind64(n);
+    else
+        stmt.bind(); // null
+}
+
+
+/* Return the name of a derivation, i.e. its store path without the
+   hash and the `.drv' extension.  Builds are grouped by name, since
+   the derivation path changes whenever any input changes. */
+static string drvName(const Path & drvPath)
+{
+    string name = storePathToName(drvPath);
+    if (isDerivation(name)) name = string(name, 0, name.size() - drvExtension.size());
+    return name;
+}
+
+
+void LocalStore::registerBuildStats(const BuildStats & stats)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtRegisterBuildStats);
+        stmtRegisterBuildStats.bind(stats.drvPath);
+        stmtRegisterBuildStats.bind(drvName(stats.drvPath));
+        stmtRegisterBuildStats.bind(stats.machine);
+        stmtRegisterBuildStats.bind64(stats.startTime);
+        stmtRegisterBuildStats.bind64(stats.wallTime);
+        bindOptional(stmtRegisterBuildStats, stats.userTime);
+        bindOptional(stmtRegisterBuildStats, stats.systemTime);
+        bindOptional(stmtRegisterBuildStats, stats.maxRSS);
+        stmtRegisterBuildStats.bind64(stats.logSize);
+        bindOptional(stmtRegisterBuildStats, stats.narSize);
+        stmtRegisterBuildStats.bind(stats.succeeded ? 1 : 0);
+        if (sqlite3_step(stmtRegisterBuildStats) != SQLITE_DONE)
+            throwSQLiteError(db, format("registering build statistics of `%1%'") % stats.drvPath);
+    } end_retry_sqlite;
+}
+
+
+BuildStatsList LocalStore::queryBuildStats(const Path & drvPath)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryBuildStats);
+        stmtQueryBuildStats.bind(drvPath);
+
+        BuildStatsList res;
+        int r;
+        while ((r = sqlite3_step(stmtQueryBuildStats)) == SQLITE_ROW) {
+            BuildStats stats;
+            stats.drvPath = drvPath;
+            const char * s = (const char *) sqlite3_column_text(stmtQueryBuildStats, 0);
+            assert(s);
+            stats.machine = s;
+            stats.startTime = sqlite3_column_int64(stmtQueryBuildStats, 1);
+            stats.wallTime = sqlite3_column_int64(stmtQueryBuildStats, 2);
+            stats.userTime = sqlite3_column_int64(stmtQueryBuildStats, 3);
+            stats.systemTime = sqlite3_column_int64(stmtQueryBuildStats, 4);
+            stats.maxRSS = sqlite3_column_int64(stmtQueryBuildStats, 5);
+            stats.logSize = sqlite3_column_int64(stmtQueryBuildStats, 6);
+            stats.narSize = sqlite3_column_int64(stmtQueryBuildStats, 7);
+            stats.succeeded = sqlite3_column_int(stmtQueryBuildStats, 8) != 0;
+            res.push_back(stats);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, format("querying build statistics of `%1%'") % drvPath);
+
+        return res;
+    } end_retry_sqlite;
+}
+
+
+double LocalStore::queryAverageBuildTime(const Path & drvPath)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryAverageBuildTime);
+        stmtQueryAverageBuildTime.bind(drvName(drvPath));
+        if (sqlite3_step(stmtQueryAverageBuildTime) != SQLITE_ROW)
+            throwSQLiteError(db, "querying average build time");
+        /* avg() returns null if there are no builds, which reads as
+           0. */
+        return sqlite3_column_double(stmtQueryAverageBuildTime, 0) / 1000.0;
+    } end_retry_sqlite;
+}
+
+
 Hash parseHashField(const Path & path, const string & s)
 {
     string::size_type colon = s.find(':');
@@ -768,6 +783,26 @@ Hash parseHashField(const Path & path, const string & s)
 }
 
 
+/* SQLite limits the number of parameters of a statement, so queries
+   on sets of paths are done in chunks of this size. */
+static const size_t maxQueryPaths = 500;
+
+
+/* Prepare `query' with a parameter list for the next chunk of paths
+   starting at `i' substituted for `%1%', and bind the paths. */
+static void prepareChunk(sqlite3 * db, SQLiteStmt & stmt, const string & query,
+    PathSet::const_iterator & i, const PathSet::const_iterator & end)
+{
+    PathSet::const_iterator j = i;
+    string params;
+    for (size_t n = 0; j != end && n < maxQueryPaths; ++j, ++n)
+        params += params.empty() ? "?" : ", ?";
+    stmt.create(db, (format(query) % params).str());
+    stmt.reset();
+    for ( ; i != j; ++i) stmt.bind(*i);
+}
+
+
 ValidPathInfo LocalStore::queryPathInfo(const Path & path)
 {
     ValidPathInfo info;
@@ -819,8 +854,66 @@ ValidPathInfo LocalStore::queryPathInfo(const Path & path)
 }
 
 
+void LocalStore::queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos)
+{
+    retry_sqlite {
+
+        /* Use one transaction so that we get a consistent view of
+           all paths. */
+        SQLiteReadTxn txn(db);
+
+        for (PathSet::const_iterator i = paths.begin(); i != paths.end(); ) {
+            PathSet::const_iterator chunk = i;
+
+            /* Get the path info. */
+            SQLiteStmt stmt1;
+            prepareChunk(db, stmt1,
+                "select id, path, hash, registrationTime, deriver, narSize from ValidPaths where path in (%1%);",
+                i, paths.end());
+
+            int r;
+            while ((r = sqlite3_step(stmt1)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmt1, 1);
+                assert(s);
+                ValidPathInfo & info(infos[s]);
+                info.path = s;
+                info.id = sqlite3_column_int(stmt1, 0);
+                s = (const char *) sqlite3_column_text(stmt1, 2);
+                assert(s);
+                info.hash = parseHashField(info.path, s);
+                info.registrationTime = sqlite3_column_int(stmt1, 3);
+                s = (const char *) sqlite3_column_text(stmt1, 4);
+                if (s) info.deriver = s;
+                info.narSize = sqlite3_column_int64(stmt1, 5);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "querying paths in database");
+
+            /* Get the references. */
+            SQLiteStmt stmt2;
+            prepareChunk(db, stmt2,
+                "select x.path, v.path from ValidPaths x join Refs r on r.referrer = x.id "
+                "join ValidPaths v on r.reference = v.id where x.path in (%1%);",
+                chunk, i);
+
+            while ((r = sqlite3_step(stmt2)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmt2, 0);
+                const char * s2 = (const char *) sqlite3_column_text(stmt2, 1);
+                assert(s && s2);
+                infos[s].references.insert(s2);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "getting references of paths");
+        }
+    } end_retry_sqlite;
+}
+
+
 /* Update path info in the database.  Currently only updates the
-   narSize field. */
+   narSize and hash fields.  Since the contents of the path may have
+   changed, it's no longer considered to be optimised. */
 void LocalStore::updatePathInfo(const ValidPathInfo & info)
 {
     SQLiteStmtUse use(stmtUpdatePathInfo);
@@ -868,9 +961,183 @@ bool LocalStore::isValidPath(const Path & path)
 PathSet LocalStore::queryValidPaths(const PathSet & paths)
 {
     retry_sqlite {
+        SQLiteReadTxn txn(db);
+
         PathSet res;
-        foreach (PathSet::const_iterator, i, paths)
-            if (isValidPath_(*i)) res.insert(*i);
+        for (PathSet::const_iterator i = paths.begin(); i != paths.end(); ) {
+            SQLiteStmt stmt;
+            prepareChunk(db, stmt, "select path from ValidPaths where path in (%1%);", i, paths.end());
+
+            int r;
+            while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmt, 0);
+                assert(s);
+                res.insert(s);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "querying paths in database");
+        }
+
+        return res;
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::markPathsUsed(const PathSet & paths)
+{
+    if (settings.readOnlyMode) return;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+        markPathsUsed_(paths);
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::markPathsUsed_(const PathSet & paths)
+{
+    string query = (format("update ValidPaths set lastUsed = %1% where path in (%%1%%);") % time(0)).str();
+
+    for (PathSet::const_iterator i = paths.begin(); i != paths.end(); ) {
+        SQLiteStmt stmt;
+        prepareChunk(db, stmt, query, i, paths.end());
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+            throwSQLiteError(db, "recording the use of paths");
+    }
+}
+
+
+string LocalStore::queryLinkedInode(ino_t ino)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryLinkedInode);
+        stmtQueryLinkedInode.bind64(ino);
+        int r = sqlite3_step(stmtQueryLinkedInode);
+        if (r == SQLITE_DONE) return "";
+        if (r != SQLITE_ROW) throwSQLiteError(db, "querying linked inode");
+        const char * s = (const char *) sqlite3_column_text(stmtQueryLinkedInode, 0);
+        assert(s);
+        return s;
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::registerLinkedInodes(const LinkedInodes & linked,
+    const Path & optimisedPath)
+{
+    if (settings.readOnlyMode) return;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        SQLiteStmt stmt;
+        stmt.create(db, "insert or replace into LinkedInodes (ino, hash) values (?, ?);");
+        foreach (LinkedInodes::const_iterator, i, linked) {
+            stmt.reset();
+            stmt.bind64(i->first);
+            stmt.bind(i->second);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                throwSQLiteError(db, "registering linked inode");
+        }
+
+        if (optimisedPath != "") {
+            SQLiteStmt stmt2;
+            stmt2.create(db, "update ValidPaths set optimised = 1 where path = ?;");
+            stmt2.reset();
+            stmt2.bind(optimisedPath);
+            if (sqlite3_step(stmt2) != SQLITE_DONE)
+                throwSQLiteError(db, format("marking path `%1%' as optimised") % optimisedPath);
+        }
+
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
+Path LocalStore::queryReflinkSource(const string & hash)
+{
+    retry_sqlite {
+        SQLiteStmtUse use(stmtQueryReflinkSource);
+        stmtQueryReflinkSource.bind(hash);
+        int r = sqlite3_step(stmtQueryReflinkSource);
+        if (r == SQLITE_DONE) return "";
+        if (r != SQLITE_ROW) throwSQLiteError(db, "querying reflink source");
+        const char * path = (const char *) sqlite3_column_text(stmtQueryReflinkSource, 0);
+        const char * name = (const char *) sqlite3_column_text(stmtQueryReflinkSource, 1);
+        assert(path && name);
+        return *name ? string(path) + "/" + name : string(path);
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::registerReflinkSources(const ReflinkSources & sources)
+{
+    if (settings.readOnlyMode || sources.empty()) return;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        SQLiteStmt stmt;
+        stmt.create(db,
+            "insert or replace into ReflinkSources (hash, path, name) "
+            "select ?, id, ? from ValidPaths where path = ?;");
+        foreach (ReflinkSources::const_iterator, i, sources) {
+            Path storePath = toStorePath(i->second);
+            string name = i->second.size() > storePath.size()
+                ? string(i->second, storePath.size() + 1) : "";
+            stmt.reset();
+            stmt.bind(i->first);
+            stmt.bind(name);
+            stmt.bind(storePath);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                throwSQLiteError(db, format("registering reflink source `%1%'") % i->second);
+        }
+
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::unregisterLinkedInodes(const std::set<ino_t> & inodes)
+{
+    if (inodes.empty()) return;
+
+    retry_sqlite {
+        SQLiteTxn txn(db);
+
+        SQLiteStmt stmt;
+        stmt.create(db, "delete from LinkedInodes where ino = ?;");
+        foreach (std::set<ino_t>::const_iterator, i, inodes) {
+            stmt.reset();
+            stmt.bind64(*i);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                throwSQLiteError(db, "unregistering linked inode");
+        }
+
+        txn.commit();
+    } end_retry_sqlite;
+}
+
+
+PathSet LocalStore::queryUnoptimisedPaths()
+{
+    retry_sqlite {
+        SQLiteStmt stmt;
+        stmt.create(db, "select path from ValidPaths where optimised is null");
+
+        PathSet res;
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char * s = (const char *) sqlite3_column_text(stmt, 0);
+            assert(s);
+            res.insert(s);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "error getting unoptimised paths");
+
         return res;
     } end_retry_sqlite;
 }
@@ -898,6 +1165,123 @@ PathSet LocalStore::queryAllValidPaths()
 }
 
 
+struct ComparePaths
+{
+    const vector<Path> & paths;
+    ComparePaths(const vector<Path> & paths) : paths(paths) { }
+    bool operator () (unsigned int a, unsigned int b) const
+    {
+        return paths[a] < paths[b];
+    }
+};
+
+
+/* Add the edges returned by `query' (as pairs of ValidPaths ids) to
+   `edges' (as pairs of indices).  Edges to or from paths that are not
+   in the graph are skipped; they can only appear if the database
+   changed while the graph was being loaded. */
+static void queryEdges(sqlite3 * db, const vector<unsigned long long> & ids,
+    const string & query, vector<std::pair<unsigned int, unsigned int> > & edges)
+{
+    SQLiteStmt stmt;
+    stmt.create(db, query);
+
+    int r;
+    while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+        unsigned long long from = sqlite3_column_int64(stmt, 0);
+        unsigned long long to = sqlite3_column_int64(stmt, 1);
+        vector<unsigned long long>::const_iterator i = std::lower_bound(ids.begin(), ids.end(), from);
+        vector<unsigned long long>::const_iterator j = std::lower_bound(ids.begin(), ids.end(), to);
+        if (i == ids.end() || *i != from || j == ids.end() || *j != to) continue;
+        edges.push_back(std::pair<unsigned int, unsigned int>(i - ids.begin(), j - ids.begin()));
+    }
+
+    if (r != SQLITE_DONE)
+        throwSQLiteError(db, "querying reference graph");
+}
+
+
+void LocalStore::queryPathGraph(PathGraph & graph, bool includeOutputs, bool includeDerivers)
+{
+    retry_sqlite {
+        graph = PathGraph();
+
+        SQLiteStmt stmt;
+        stmt.create(db, "select id, path, coalesce(lastUsed, registrationTime) from ValidPaths order by id");
+
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            graph.ids.push_back(sqlite3_column_int64(stmt, 0));
+            const char * s = (const char *) sqlite3_column_text(stmt, 1);
+            assert(s);
+            graph.paths.push_back(s);
+            graph.lastUsed.push_back(sqlite3_column_int64(stmt, 2));
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying valid paths");
+
+        vector<std::pair<unsigned int, unsigned int> > edges;
+
+        queryEdges(db, graph.ids, "select referrer, reference from Refs", edges);
+
+        if (includeOutputs)
+            queryEdges(db, graph.ids,
+                "select d.drv, v.id from DerivationOutputs d join ValidPaths v on v.path = d.path", edges);
+
+        if (includeDerivers)
+            queryEdges(db, graph.ids,
+                "select v.id, d.id from ValidPaths v join ValidPaths d on d.path = v.deriver", edges);
+
+        /* Convert the edge list to adjacency arrays. */
+        unsigned int n = graph.paths.size();
+        graph.offsets.assign(n + 1, 0);
+        for (vector<std::pair<unsigned int, unsigned int> >::iterator i = edges.begin(); i != edges.end(); ++i)
+            graph.offsets[i->first + 1]++;
+        for (unsigned int i = 0; i < n; ++i)
+            graph.offsets[i + 1] += graph.offsets[i];
+
+        graph.targets.resize(edges.size());
+        vector<unsigned int> pos(graph.offsets.begin(), graph.offsets.end() - 1);
+        for (vector<std::pair<unsigned int, unsigned int> >::iterator i = edges.begin(); i != edges.end(); ++i)
+            graph.targets[pos[i->first]++] = i->second;
+
+        graph.byPath.resize(n);
+        for (unsigned int i = 0; i < n; ++i) graph.byPath[i] = i;
+        std::sort(graph.byPath.begin(), graph.byPath.end(), ComparePaths(graph.paths));
+
+        return;
+    } end_retry_sqlite;
+}
+
+
+PathSet LocalStore::queryValidPathsSince(unsigned long long & id)
+{
+    retry_sqlite {
+        SQLiteStmt stmt;
+        stmt.create(db, "select id, path from ValidPaths where id > ?");
+        stmt.reset();
+        stmt.bind64(id);
+
+        PathSet res;
+        unsigned long long maxId = id;
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            maxId = std::max(maxId, (unsigned long long) sqlite3_column_int64(stmt, 0));
+            const char * s = (const char *) sqlite3_column_text(stmt, 1);
+            assert(s);
+            res.insert(s);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "querying new valid paths");
+
+        id = maxId;
+        return res;
+    } end_retry_sqlite;
+}
+
+
 void LocalStore::queryReferences(const Path & path,
     PathSet & references)
 {
@@ -933,6 +1317,100 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+void LocalStore::queryReferrersOfPaths(const PathSet & paths, PathSet & referrers)
+{
+    foreach (PathSet::const_iterator, i, paths) assertStorePath(*i);
+
+    retry_sqlite {
+        SQLiteReadTxn txn(db);
+
+        for (PathSet::const_iterator i = paths.begin(); i != paths.end(); ) {
+            /* Like RemoteStore, refuse invalid paths rather than
+               returning no referrers for them. */
+            PathSet::const_iterator start = i;
+            SQLiteStmt check;
+            prepareChunk(db, check,
+                "select path from ValidPaths where path in (%1%);",
+                i, paths.end());
+
+            PathSet valid;
+            int r;
+            while ((r = sqlite3_step(check)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(check, 0);
+                assert(s);
+                valid.insert(s);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "checking validity of paths");
+
+            for (PathSet::const_iterator j = start; j != i; ++j)
+                if (valid.find(*j) == valid.end())
+                    throw Error(format("path `%1%' is not valid") % *j);
+
+            i = start;
+            SQLiteStmt stmt;
+            prepareChunk(db, stmt,
+                "select v.path from ValidPaths x join Refs r on r.reference = x.id "
+                "join ValidPaths v on r.referrer = v.id where x.path in (%1%);",
+                i, paths.end());
+
+            while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+                const char * s = (const char *) sqlite3_column_text(stmt, 0);
+                assert(s);
+                referrers.insert(s);
+            }
+
+            if (r != SQLITE_DONE)
+                throwSQLiteError(db, "getting referrers of paths");
+        }
+    } end_retry_sqlite;
+}
+
+
+void LocalStore::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection)
+{
+    if (!stmtQueryClosure) {
+        StoreAPI::queryClosure(paths, closure, flipDirection);
+        return;
+    }
+
+    retry_sqlite {
+        SQLiteReadTxn txn(db);
+
+        if (sqlite3_exec(db, "delete from ClosureRoots;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "clearing temporary table");
+
+        foreach (PathSet::const_iterator, i, paths) {
+            SQLiteStmtUse use(stmtAddClosureRoot);
+            stmtAddClosureRoot.bind(*i);
+            if (sqlite3_step(stmtAddClosureRoot) != SQLITE_DONE)
+                throwSQLiteError(db, format("adding closure root `%1%'") % *i);
+            /* Like queryReferrers(), the reverse closure accepts
+               invalid paths; the forward closure does not. */
+            if (sqlite3_changes(db) == 0 && !flipDirection)
+                throw Error(format("path `%1%' is not valid") % *i);
+        }
+
+        SQLiteStmt & stmt(flipDirection ? stmtQueryReverseClosure : stmtQueryClosure);
+        SQLiteStmtUse use(stmt);
+
+        int r;
+        while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char * s = (const char *) sqlite3_column_text(stmt, 0);
+            assert(s);
+            closure.insert(s);
+        }
+
+        if (r != SQLITE_DONE)
+            throwSQLiteError(db, "computing closure");
+
+        closure.insert(paths.begin(), paths.end());
+    } end_retry_sqlite;
+}
+
+
 Path LocalStore::queryDeriver(const Path & path)
 {
     return queryPathInfo(path).deriver;
@@ -1280,6 +1758,10 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
                 addReference(referrer, queryValidPathId(*j));
         }
 
+        /* The paths have just been built or substituted, so they
+           count as used now, whatever their registration time is. */
+        markPathsUsed_(paths);
+
         /* Do a topological sort of the paths.  This will throw an
            error if a cycle is detected and roll back the
            transaction.  Cycles can only occur when a derivation
@@ -1311,11 +1793,29 @@ void LocalStore::invalidatePath(const Path & path)
 }
 
 
-Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
-    bool recursive, HashType hashAlgo, bool repair)
+struct HashAndReadSource : Source
 {
-    Hash h = hashString(hashAlgo, dump);
+    Source & readSource;
+    HashSink hashSink;
+    bool hashing;
+    HashAndReadSource(Source & readSource, HashType ht = htSHA256)
+        : readSource(readSource), hashSink(ht)
+    {
+        hashing = true;
+    }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = readSource.read(data, len);
+        if (hashing) hashSink(data, n);
+        return n;
+    }
+};
 
+
+Path LocalStore::addUnpackedToStore(const Path & unpacked, const string & name,
+    bool recursive, HashType hashAlgo, const Hash & h, const HashResult & narHash,
+    bool repair)
+{
     Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, name);
 
     addTempRoot(dstPath);
@@ -1331,31 +1831,18 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 
             if (pathExists(dstPath)) deletePath(dstPath);
 
-            if (recursive) {
-                StringSource source(dump);
-                restorePath(dstPath, source);
-            } else
-                writeFile(dstPath, dump);
+            if (rename(unpacked.c_str(), dstPath.c_str()) == -1)
+                throw SysError(format("cannot move `%1%' to `%2%'")
+                    % unpacked % dstPath);
 
             canonicalisePathMetaData(dstPath, -1);
 
-            /* Register the SHA-256 hash of the NAR serialisation of
-               the path in the database.  We may just have computed it
-               above (if called with recursive == true and hashAlgo ==
-               sha256); otherwise, compute it here. */
-            HashResult hash;
-            if (recursive) {
-                hash.first = hashAlgo == htSHA256 ? h : hashString(htSHA256, dump);
-                hash.second = dump.size();
-            } else
-                hash = hashPath(htSHA256, dstPath);
-
-            optimisePath(dstPath); // FIXME: combine with hashPath()
+            optimisePath(dstPath); // FIXME: combine with hashing
 
             ValidPathInfo info;
             info.path = dstPath;
-            info.hash = hash.first;
-            info.narSize = hash.second;
+            info.hash = narHash.first;
+            info.narSize = narHash.second;
             registerValidPath(info);
         }
 
@@ -1366,22 +1853,173 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
 }
 
 
+Path LocalStore::addToStoreFromDump(Source & dump, const string & name,
+    bool recursive, HashType hashAlgo, bool repair)
+{
+    UnpackedDump unpacked;
+    unpackDump(dump, unpacked, recursive, hashAlgo);
+    return addUnpackedDump(unpacked, name, repair);
+}
+
+
+void LocalStore::unpackDump(Source & dump, UnpackedDump & res,
+    bool recursive, HashType hashAlgo)
+{
+    /* Unpack the dump into a temporary directory in the store while
+       hashing it, so that it never has to be held in memory. */
+    res.tmpDir = createTempDirInStore();
+    res.delTmp = boost::shared_ptr<AutoDelete>(new AutoDelete(res.tmpDir));
+    res.unpacked = res.tmpDir + "/unpacked";
+    res.recursive = recursive;
+    res.hashAlgo = hashAlgo;
+
+    HashAndReadSource narSource(dump);
+    HashAndReadSource source(narSource, hashAlgo);
+    source.hashing = recursive && hashAlgo != htSHA256;
+
+    restorePath(res.unpacked, source);
+
+    res.narHash = narSource.hashSink.finish();
+    if (recursive)
+        res.h = source.hashing ? source.hashSink.finish().first : res.narHash.first;
+}
+
+
+Path LocalStore::addUnpackedDump(UnpackedDump & dump, const string & name,
+    bool repair)
+{
+    if (!dump.recursive) {
+        struct stat st;
+        if (lstat(dump.unpacked.c_str(), &st))
+            throw SysError(format("getting attributes of path `%1%'") % dump.unpacked);
+        if (!S_ISREG(st.st_mode)) throw Error("regular file expected");
+
+        /* Flat files are never executable, so the NAR we received
+           may not be the one of the resulting path. */
+        if (st.st_mode & S_IXUSR) {
+            if (chmod(dump.unpacked.c_str(), 0644) == -1)
+                throw SysError(format("changing mode of `%1%'") % dump.unpacked);
+            dump.narHash = hashPath(htSHA256, dump.unpacked);
+        }
+
+        dump.h = hashFile(dump.hashAlgo, dump.unpacked);
+    }
+
+    return addUnpackedToStore(dump.unpacked, name, dump.recursive,
+        dump.hashAlgo, dump.h, dump.narHash, repair);
+}
+
+
+/* Copy `srcPath' to `dstPath', keeping exactly what dumpPath() would
+   put in a NAR of `srcPath': directories, symlinks and regular files
+   (with their executable bit) that pass `filter'. */
+static void copyPathFiltered(const Path & srcPath, const Path & dstPath,
+    PathFilter & filter)
+{
+    checkInterrupt();
+
+    struct stat st;
+    if (lstat(srcPath.c_str(), &st))
+        throw SysError(format("getting attributes of path `%1%'") % srcPath);
+
+    if (S_ISREG(st.st_mode)) {
+        AutoCloseFD from = open(srcPath.c_str(), O_RDONLY);
+        if (from == -1) throw SysError(format("opening file `%1%'") % srcPath);
+
+        AutoCloseFD to = open(dstPath.c_str(), O_CREAT | O_EXCL | O_WRONLY,
+            st.st_mode & S_IXUSR ? 0777 : 0666);
+        if (to == -1) throw SysError(format("creating file `%1%'") % dstPath);
+
+        unsigned char buf[65536];
+        ssize_t n;
+        while ((n = read(from, buf, sizeof(buf)))) {
+            checkInterrupt();
+            if (n == -1) throw SysError(format("reading file `%1%'") % srcPath);
+            writeFull(to, buf, n);
+        }
+
+        to.close();
+    }
+
+    else if (S_ISDIR(st.st_mode)) {
+        if (mkdir(dstPath.c_str(), 0777) == -1)
+            throw SysError(format("creating directory `%1%'") % dstPath);
+        Strings names = readDirectory(srcPath);
+        foreach (Strings::iterator, i, names) {
+            Path entry = srcPath + "/" + *i;
+            if (filter(entry))
+                copyPathFiltered(entry, dstPath + "/" + *i, filter);
+        }
+    }
+
+    else if (S_ISLNK(st.st_mode)) {
+        if (symlink(readLink(srcPath).c_str(), dstPath.c_str()) == -1)
+            throw SysError(format("creating symlink `%1%'") % dstPath);
+    }
+
+    else throw Error(format("file `%1%' has an unknown type") % srcPath);
+}
+
+
 Path LocalStore::addToStore(const Path & _srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter, bool repair)
 {
     Path srcPath(absPath(_srcPath));
     debug(format("adding `%1%' to the store") % srcPath);
 
-    /* Read the whole path into memory. This is not a very scalable
-       method for very large paths, but `copyPath' is mainly used for
-       small files. */
-    StringSink sink;
-    if (recursive)
-        dumpPath(srcPath, sink, filter);
-    else
-        sink.s = readFile(srcPath);
+    /* If the path is already valid, there is no need for a copy.
+       Computing the store path only requires hashing `srcPath', which
+       is streamed, so this is cheap compared to copying it. */
+    if (!repair) {
+        Hash h = recursive
+            ? hashPath(hashAlgo, srcPath, filter).first
+            : hashFile(hashAlgo, srcPath);
+        Path dstPath = makeFixedOutputPath(recursive, hashAlgo, h, baseNameOf(srcPath));
+        addTempRoot(dstPath);
+        if (isValidPath(dstPath)) return dstPath;
+    }
+
+    /* Copy the path to a temporary directory in the store and hash
+       the copy, rather than serialising the path into memory.
+       Hashing the copy also ensures that the hash matches what ends
+       up in the store even if `srcPath' changes meanwhile. */
+    Path tmpDir = createTempDirInStore();
+    AutoDelete delTmp(tmpDir);
+    Path copy = tmpDir + "/copy";
+
+    HashResult narHash;
+    Hash h;
+
+    if (recursive) {
+        copyPathFiltered(srcPath, copy, filter);
+        narHash = hashPath(htSHA256, copy);
+        h = hashAlgo == htSHA256 ? narHash.first : hashPath(hashAlgo, copy).first;
+    }
 
-    return addToStoreFromDump(sink.s, baseNameOf(srcPath), recursive, hashAlgo, repair);
+    else {
+        /* Like readFile(), this follows symlinks. */
+        AutoCloseFD from = open(srcPath.c_str(), O_RDONLY);
+        if (from == -1) throw SysError(format("opening file `%1%'") % srcPath);
+
+        AutoCloseFD to = open(copy.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+        if (to == -1) throw SysError(format("creating file `%1%'") % copy);
+
+        HashSink hashSink(hashAlgo);
+        unsigned char buf[65536];
+        ssize_t n;
+        while ((n = read(from, buf, sizeof(buf)))) {
+            checkInterrupt();
+            if (n == -1) throw SysError(format("reading file `%1%'") % srcPath);
+            hashSink(buf, n);
+            writeFull(to, buf, n);
+        }
+        to.close();
+
+        h = hashSink.finish().first;
+        narHash = hashPath(htSHA256, copy);
+    }
+
+    return addUnpackedToStore(copy, baseNameOf(srcPath), recursive, hashAlgo, h, narHash, repair);
 }
 
 
@@ -1517,24 +2155,6 @@ void LocalStore::exportPath(const Path & path, bool sign,
 }
 
 
-struct HashAndReadSource : Source
-{
-    Source & readSource;
-    HashSink hashSink;
-    bool hashing;
-    HashAndReadSource(Source & readSource) : readSource(readSource), hashSink(htSHA256)
-    {
-        hashing = true;
-    }
-    size_t read(unsigned char * data, size_t len)
-    {
-        size_t n = readSource.read(data, len);
-        if (hashing) hashSink(data, n);
-        return n;
-    }
-};
-
-
 /* Create a temporary directory in the store that won't be
    garbage-collected. */
 Path LocalStore::createTempDirInStore()
@@ -1641,9 +2261,11 @@ Path LocalStore::importPath(bool requireSignature, Source & source)
 
             /* !!! if we were clever, we could prevent the hashPath()
                here. */
-            HashResult hash = hashPath(htSHA256, dstPath);
+            PathScanResult scan = scanPath(dstPath, PathSet(),
+                getThreadCount(settings.hashThreads), settings.autoOptimiseStore);
+            HashResult & hash = scan.narHash;
 
-            optimisePath(dstPath); // FIXME: combine with hashPath()
+            optimisePath(dstPath, scan.fileHashes);
 
             ValidPathInfo info;
             info.path = dstPath;
@@ -1907,6 +2529,7 @@ void LocalStore::upgradeStore6()
     printMsg(lvlError, "upgrading Nix store to new schema (this may take a while)...");
 
     openDB(true);
+    prepareStatements();
 
     PathSet validPaths = queryValidPathsOld();
 
@@ -1986,6 +2609,49 @@ void LocalStore::upgradeStore7()
 #endif
 
 
+/* Upgrade from schema 7 (Nix 1.3) to schema 8. */
+void LocalStore::upgradeStore8()
+{
+    if (sqlite3_exec(db, "alter table ValidPaths add column lastUsed integer;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "adding column to the ValidPaths table");
+}
+
+
+/* Upgrade from schema 8 to schema 9. */
+void LocalStore::upgradeStore9()
+{
+    if (sqlite3_exec(db, "alter table ValidPaths add column optimised integer;", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "adding column to the ValidPaths table");
+    if (sqlite3_exec(db, "create table if not exists LinkedInodes (ino integer primary key not null, hash text not null);", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "creating the LinkedInodes table");
+}
+
+
+/* Upgrade from schema 9 to schema 10. */
+void LocalStore::upgradeStore10()
+{
+    if (sqlite3_exec(db,
+            "create table if not exists ReflinkSources (hash text primary key not null, path integer not null, name text not null, "
+            "foreign key (path) references ValidPaths(id) on delete cascade); "
+            "create index if not exists IndexReflinkSources on ReflinkSources(path);", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "creating the ReflinkSources table");
+}
+
+
+/* Upgrade from schema 10 to schema 11. */
+void LocalStore::upgradeStore11()
+{
+    if (sqlite3_exec(db,
+            "create table if not exists BuildStats (id integer primary key autoincrement not null, "
+            "drvPath text not null, name text not null, machine text not null, startTime integer not null, "
+            "wallTime integer not null, userTime integer, systemTime integer, maxRSS integer, "
+            "logSize integer not null, narSize integer, succeeded integer not null); "
+            "create index if not exists IndexBuildStatsDrv on BuildStats(drvPath); "
+            "create index if not exists IndexBuildStatsName on BuildStats(name);", 0, 0, 0) != SQLITE_OK)
+        throwSQLiteError(db, "creating the BuildStats table");
+}
+
+
 void LocalStore::vacuumDB()
 {
     if (sqlite3_exec(db, "vacuum;", 0, 0, 0) != SQLITE_OK)
@@ -5,10 +5,9 @@
 #include "store-api.hh"
 #include "util.hh"
 #include "pathlocks.hh"
+#include "sqlite.hh"
 
-
-class sqlite3;
-class sqlite3_stmt;
+#include <boost/shared_ptr.hpp>
 
 
 namespace nix {
@@ -17,8 +16,11 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. */
-const int nixSchemaVersion = 7;
+   Nix 1.0.  Version 7 is Nix 1.3.  Version 8 records when paths were
+   last used.  Version 9 records which paths have been optimised.  Version 10
+   adds the ReflinkSources table.  Version 11 records build
+   statistics. */
+const int nixSchemaVersion = 11;
 
 
 extern string drvsLogDir;
@@ -27,6 +29,19 @@ extern string drvsLogDir;
 struct Derivation;
 
 
+/* A NAR dump unpacked by LocalStore::unpackDump().  The temporary
+   directory holding it is deleted when this object is destroyed. */
+struct UnpackedDump
+{
+    Path tmpDir, unpacked;
+    boost::shared_ptr<AutoDelete> delTmp;
+    bool recursive;
+    HashType hashAlgo;
+    HashResult narHash;
+    Hash h;
+};
+
+
 struct OptimiseStats
 {
     unsigned long totalFiles;
@@ -42,6 +57,40 @@ struct OptimiseStats
 };
 
 
+/* Maps the inodes of files in the .links directory to their names. */
+typedef std::map<ino_t, string> LinkedInodes;
+
+/* Maps file hashes to files with those contents, for the `reflink'
+   optimisation method. */
+typedef std::map<string, Path> ReflinkSources;
+
+struct FileToLink;
+
+
+/* The reference graph of the valid paths, as used by the garbage
+   collector.  Paths are identified by their index in `paths', which is
+   sorted by ValidPaths.id.  The successors of path i are
+   targets[offsets[i]] up to targets[offsets[i + 1]]. */
+struct PathGraph
+{
+    vector<unsigned long long> ids;
+    vector<Path> paths;
+    vector<unsigned int> offsets, targets;
+
+    /* The time each path was last used. */
+    vector<time_t> lastUsed;
+
+    /* Indices of `paths' sorted by path, for find(). */
+    vector<unsigned int> byPath;
+
+    /* Return the index of `path', or -1 if it's not in the graph. */
+    int find(const Path & path) const;
+
+    /* Set marked[i] for every path i reachable from `root'. */
+    void mark(unsigned int root, vector<bool> & marked) const;
+};
+
+
 struct RunningSubstituter
 {
     Path program;
@@ -53,34 +102,6 @@ struct RunningSubstituter
 };
 
 
-/* Wrapper object to close the SQLite database automatically. */
-struct SQLite
-{
-    sqlite3 * db;
-    SQLite() { db = 0; }
-    ~SQLite();
-    operator sqlite3 * () { return db; }
-};
-
-
-/* Wrapper object to create and destroy SQLite prepared statements. */
-struct SQLiteStmt
-{
-    sqlite3 * db;
-    sqlite3_stmt * stmt;
-    unsigned int curArg;
-    SQLiteStmt() { stmt = 0; }
-    void create(sqlite3 * db, const string & s);
-    void reset();
-    ~SQLiteStmt();
-    operator sqlite3_stmt * () { return stmt; }
-    void bind(const string & value);
-    void bind(int value);
-    void bind64(long long value);
-    void bind();
-};
-
-
 class LocalStore : public StoreAPI
 {
 private:
@@ -95,6 +116,11 @@ public:
        necessary. */
     LocalStore(bool reserveSpace = true);
 
+    /* Create or delete the file that reserves some disk space for the
+       garbage collector.  The constructor calls this, but the daemon's
+       pool workers serve clients that may want either. */
+    void updateReservedSpace(bool reserveSpace);
+
     ~LocalStore();
 
     /* Implementations of abstract store API methods. */
@@ -107,12 +133,19 @@ public:
 
     ValidPathInfo queryPathInfo(const Path & path);
 
+    void queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    void queryReferrersOfPaths(const PathSet & paths, PathSet & referrers);
+
+    void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false);
+
     Path queryDeriver(const Path & path);
 
     PathSet queryValidDerivers(const Path & path);
@@ -135,13 +168,25 @@ public:
         bool recursive = true, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, bool repair = false);
 
-    /* Like addToStore(), but the contents of the path are contained
-       in `dump', which is either a NAR serialisation (if recursive ==
-       true) or simply the contents of a regular file (if recursive ==
-       false). */
-    Path addToStoreFromDump(const string & dump, const string & name,
+    /* Like addToStore(), but the contents of the path are read from
+       `dump', which is a NAR serialisation.  If recursive == false,
+       it must be the serialisation of a regular file.  The dump is
+       unpacked as it is read, so memory use doesn't depend on its
+       size. */
+    Path addToStoreFromDump(Source & dump, const string & name,
         bool recursive = true, HashType hashAlgo = htSHA256, bool repair = false);
 
+    /* addToStoreFromDump() in two steps: unpackDump() reads `dump'
+       and unpacks it into a temporary directory in the store, and
+       addUnpackedDump() adds the result to the store.  The daemon
+       uses this to read the entire dump before it starts reporting
+       errors to the client. */
+    void unpackDump(Source & dump, UnpackedDump & res,
+        bool recursive = true, HashType hashAlgo = htSHA256);
+
+    Path addUnpackedDump(UnpackedDump & dump, const string & name,
+        bool repair = false);
+
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, bool repair = false);
 
@@ -168,8 +213,11 @@ public:
        files with the same contents. */
     void optimiseStore(OptimiseStats & stats);
 
-    /* Optimise a single store path. */
-    void optimisePath(const Path & path);
+    /* Optimise a single store path.  `fileHashes' optionally
+       contains the previously computed hashes of (some of) the files
+       in the path, as returned by scanPath(). */
+    void optimisePath(const Path & path,
+        const std::map<Path, Hash> & fileHashes = std::map<Path, Hash>());
 
     /* Check the integrity of the Nix store.  Returns true if errors
        remain. */
@@ -196,6 +244,16 @@ public:
 
     void clearFailedPaths(const PathSet & paths);
 
+    /* Record the resource usage of a build. */
+    void registerBuildStats(const BuildStats & stats);
+
+    BuildStatsList queryBuildStats(const Path & drvPath);
+
+    /* Return the average wall time in seconds of the most recent
+       successful builds of derivations with the same name as
+       `drvPath', or 0 if there are none. */
+    double queryAverageBuildTime(const Path & drvPath);
+
     void vacuumDB();
 
     /* Repair the contents of the given path by redownloading it using
@@ -210,6 +268,28 @@ public:
 
     void setSubstituterEnv();
 
+    /* Record that the given paths have been used (e.g. as the inputs
+       of a build), so that the garbage collector deletes them after
+       paths that haven't been used for longer. */
+    void markPathsUsed(const PathSet & paths);
+
+    /* Run the garbage collector if the file system containing the
+       store has less than `gc-min-free' bytes available. */
+    void autoGC();
+
+    /* Like autoGC(), but collect garbage in a child process, so that
+       the caller (e.g. the build loop) can carry on.  Returns the pid
+       of the child, or -1 if no collection was started. */
+    pid_t startAutoGC();
+
+    /* Release the shared lock that keeps other processes from
+       upgrading the database schema, e.g. while a long-lived process
+       is idle.  reacquireBigLock() takes it again, and returns false
+       if the schema has changed in the meantime; the store object
+       must then be reopened. */
+    void releaseBigLock();
+    bool reacquireBigLock();
+
 private:
 
     Path schemaPath;
@@ -236,6 +316,14 @@ private:
     SQLiteStmt stmtQueryValidDerivers;
     SQLiteStmt stmtQueryDerivationOutputs;
     SQLiteStmt stmtQueryPathFromHashPart;
+    SQLiteStmt stmtQueryLinkedInode;
+    SQLiteStmt stmtQueryReflinkSource;
+    SQLiteStmt stmtRegisterBuildStats;
+    SQLiteStmt stmtQueryBuildStats;
+    SQLiteStmt stmtQueryAverageBuildTime;
+    SQLiteStmt stmtAddClosureRoot;
+    SQLiteStmt stmtQueryClosure;
+    SQLiteStmt stmtQueryReverseClosure;
 
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
@@ -246,10 +334,27 @@ private:
 
     void openDB(bool create);
 
+    /* Open the database in read-only mode, which requires that its
+       schema is current. */
+    void openDBReadOnly();
+
+    void prepareStatements();
+
     void makeStoreWritable();
 
     unsigned long long queryValidPathId(const Path & path);
 
+    /* Load the reference graph of all valid paths.  If
+       `includeOutputs' is set, derivations also point to their valid
+       outputs; if `includeDerivers' is set, paths also point to their
+       valid derivers. */
+    void queryPathGraph(PathGraph & graph, bool includeOutputs, bool includeDerivers);
+
+    /* Return the valid paths with an id higher than `id', and set
+       `id' to the highest id among them.  Since ids are never reused,
+       these are the paths registered after path `id'. */
+    PathSet queryValidPathsSince(unsigned long long & id);
+
     unsigned long long addValidPath(const ValidPathInfo & info, bool checkOutputs = true);
 
     void addReference(unsigned long long referrer, unsigned long long reference);
@@ -270,6 +375,10 @@ private:
 
     void upgradeStore6();
     void upgradeStore7();
+    void upgradeStore8();
+    void upgradeStore9();
+    void upgradeStore10();
+    void upgradeStore11();
     PathSet queryValidPathsOld();
     ValidPathInfo queryPathInfoOld(const Path & path);
 
@@ -281,6 +390,16 @@ private:
 
     bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
 
+    void markLive(GCState & state, const PathSet & roots);
+
+    void markNewRoots(GCState & state);
+
+    bool isDead(const GCState & state, const Path & path);
+
+    void deleteSpecific(GCState & state);
+
+    void finishDeletion(GCState & state);
+
     void deletePathRecursive(GCState & state, const Path & path);
 
     bool isActiveTempFile(const GCState & state,
@@ -288,8 +407,16 @@ private:
 
     int openGCLock(LockType lockType);
 
+    void emptyTrash(GCState & state);
+
     void removeUnusedLinks(const GCState & state);
 
+    void runAutoGC(unsigned long long avail);
+
+    /* Set the last use time of `paths' to now, within a transaction
+       of the caller (see markPathsUsed()). */
+    void markPathsUsed_(const PathSet & paths);
+
     void startSubstituter(const Path & substituter,
         RunningSubstituter & runningSubstituter);
 
@@ -299,11 +426,63 @@ private:
 
     Path createTempDirInStore();
 
+    /* Move `unpacked', a temporary copy of the contents of a path
+       added by addToStore(), to its final location and register
+       it. */
+    Path addUnpackedToStore(const Path & unpacked, const string & name,
+        bool recursive, HashType hashAlgo, const Hash & h,
+        const HashResult & narHash, bool repair);
+
     Path importPath(bool requireSignature, Source & source);
 
     void checkDerivationOutputs(const Path & drvPath, const Derivation & drv);
 
-    void optimisePath_(OptimiseStats & stats, const Path & path);
+    /* Deduplicate the files in `path', by hard-linking them into the
+       .links directory or by sharing their extents, depending on the
+       `optimise-method' setting.  The inodes of newly linked files
+       are added to `linked', and new reflink sources to `sources'.
+       `complete' is cleared if a file had to be skipped. */
+    void optimisePath_(OptimiseStats & stats, const Path & path,
+        const std::map<Path, Hash> & fileHashes, LinkedInodes & linked,
+        ReflinkSources & sources, bool & complete);
+
+    /* Add the files in `path' that are not known to be linked into
+       .links to `files'. */
+    void findFilesToLink(OptimiseStats & stats, const Path & path,
+        list<FileToLink> & files, bool & complete);
+
+    /* Hard-link a hashed file into .links.  `complete' is cleared if
+       the file couldn't be linked because of the link limit. */
+    void linkFile(OptimiseStats & stats, const FileToLink & file,
+        LinkedInodes & linked, bool & complete);
+
+    /* Share the extents of a hashed file with those of an earlier
+       file with the same contents.  If there is none, the file is
+       added to `sources'. */
+    void reflinkFile(OptimiseStats & stats, const FileToLink & file,
+        ReflinkSources & sources);
+
+    /* Return the recorded file with hash `hash', or "" if there is
+       none. */
+    Path queryReflinkSource(const string & hash);
+
+    /* Record the files in `sources'.  Files in paths that are not
+       valid (yet) are ignored. */
+    void registerReflinkSources(const ReflinkSources & sources);
+
+    /* Return the name in .links of the file with inode `ino', if it
+       has been recorded, or "" otherwise. */
+    string queryLinkedInode(ino_t ino);
+
+    /* Record the inodes in `linked', and if `optimisedPath' is not
+       empty, mark it as optimised. */
+    void registerLinkedInodes(const LinkedInodes & linked,
+        const Path & optimisedPath);
+
+    PathSet queryUnoptimisedPaths();
+
+    /* Forget the inodes of deleted files in .links. */
+    void unregisterLinkedInodes(const std::set<ino_t> & inodes);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(const Path & path);
@@ -18,44 +18,90 @@ Derivation derivationFromPath(StoreAPI & store, const Path & drvPath)
 void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
-    if (paths.find(path) != paths.end()) return;
-    paths.insert(path);
+    computeFSClosure(store, singleton<PathSet>(path), paths,
+        flipDirection, includeOutputs, includeDerivers);
+}
+
+
+void computeFSClosure(StoreAPI & store, const PathSet & roots,
+    PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Plain closures can be computed by the store in one go. */
+    if (!includeOutputs && !includeDerivers) {
+        store.queryClosure(roots, paths, flipDirection);
+        return;
+    }
 
-    PathSet edges;
+    /* Traverse the graph breadth-first, so that the edges of all
+       paths at the same depth can be fetched at once. */
+    PathSet todo(roots);
 
-    if (flipDirection) {
-        store.queryReferrers(path, edges);
+    while (true) {
 
-        if (includeOutputs) {
-            PathSet derivers = store.queryValidDerivers(path);
-            foreach (PathSet::iterator, i, derivers)
-                edges.insert(*i);
-        }
+        PathSet next;
+        foreach (PathSet::iterator, i, todo)
+            if (paths.insert(*i).second) next.insert(*i);
+        if (next.empty()) break;
 
-        if (includeDerivers && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i) && store.queryDeriver(*i) == path)
-                    edges.insert(*i);
-        }
+        PathSet edges, maybeValid;
+
+        if (flipDirection) {
+            store.queryReferrersOfPaths(next, edges);
+
+            std::map<Path, PathSet> drvOutputs;
+            PathSet outputs;
+
+            foreach (PathSet::iterator, i, next) {
+                if (includeOutputs) {
+                    PathSet derivers = store.queryValidDerivers(*i);
+                    edges.insert(derivers.begin(), derivers.end());
+                }
+
+                if (includeDerivers && isDerivation(*i)) {
+                    PathSet & outs(drvOutputs[*i]);
+                    outs = store.queryDerivationOutputs(*i);
+                    outputs.insert(outs.begin(), outs.end());
+                }
+            }
+
+            if (!outputs.empty()) {
+                ValidPathInfoMap infos;
+                store.queryPathInfos(outputs, infos);
+                foreach (ValidPathInfoMap::iterator, i, infos) {
+                    std::map<Path, PathSet>::iterator j = drvOutputs.find(i->second.deriver);
+                    if (j != drvOutputs.end() && j->second.find(i->first) != j->second.end())
+                        edges.insert(i->first);
+                }
+            }
 
-    } else {
-        store.queryReferences(path, edges);
+        } else {
+            ValidPathInfoMap infos;
+            store.queryPathInfos(next, infos);
+
+            foreach (PathSet::iterator, i, next) {
+                ValidPathInfoMap::iterator info = infos.find(*i);
+                if (info == infos.end())
+                    throw Error(format("path `%1%' is not valid") % *i);
+
+                edges.insert(info->second.references.begin(), info->second.references.end());
+
+                if (includeOutputs && isDerivation(*i)) {
+                    PathSet outputs = store.queryDerivationOutputs(*i);
+                    maybeValid.insert(outputs.begin(), outputs.end());
+                }
 
-        if (includeOutputs && isDerivation(path)) {
-            PathSet outputs = store.queryDerivationOutputs(path);
-            foreach (PathSet::iterator, i, outputs)
-                if (store.isValidPath(*i)) edges.insert(*i);
+                if (includeDerivers && info->second.deriver != "")
+                    maybeValid.insert(info->second.deriver);
+            }
         }
 
-        if (includeDerivers) {
-            Path deriver = store.queryDeriver(path);
-            if (store.isValidPath(deriver)) edges.insert(deriver);
+        if (!maybeValid.empty()) {
+            PathSet valid = store.queryValidPaths(maybeValid);
+            edges.insert(valid.begin(), valid.end());
         }
-    }
 
-    foreach (PathSet::iterator, i, edges)
-        computeFSClosure(store, *i, paths, flipDirection, includeOutputs, includeDerivers);
+        todo.swap(edges);
+    }
 }
 
 
@@ -98,24 +144,44 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
 
         PathSet query, todoDrv, todoNonDrv;
 
-        foreach (PathSet::iterator, i, todo) {
-            if (done.find(*i) != done.end()) continue;
-            done.insert(*i);
+        PathSet todo2;
+        foreach (PathSet::iterator, i, todo)
+            if (done.insert(*i).second) todo2.insert(*i);
+
+        /* Check the validity of the paths in ‘todo’, and then of the
+           outputs of the derivations among them, with one query
+           each. */
+        PathSet paths;
+        foreach (PathSet::iterator, i, todo2)
+            paths.insert(parseDrvPathWithOutputs(*i).first);
+        PathSet valid = store.queryValidPaths(paths);
+
+        std::map<Path, Derivation> drvs;
+        PathSet outputs;
+        foreach (PathSet::iterator, i, paths) {
+            if (!isDerivation(*i) || valid.find(*i) == valid.end()) continue;
+            Derivation & drv(drvs[*i]);
+            drv = derivationFromPath(store, *i);
+            foreach (DerivationOutputs::iterator, j, drv.outputs)
+                outputs.insert(j->second.path);
+        }
+        PathSet validOutputs = store.queryValidPaths(outputs);
 
+        foreach (PathSet::iterator, i, todo2) {
             DrvPathWithOutputs i2 = parseDrvPathWithOutputs(*i);
 
             if (isDerivation(i2.first)) {
-                if (!store.isValidPath(i2.first)) {
+                if (valid.find(i2.first) == valid.end()) {
                     // FIXME: we could try to substitute p.
                     unknown.insert(*i);
                     continue;
                 }
-                Derivation drv = derivationFromPath(store, i2.first);
+                Derivation & drv(drvs[i2.first]);
 
                 PathSet invalid;
                 foreach (DerivationOutputs::iterator, j, drv.outputs)
                     if (wantOutput(j->first, i2.second)
-                        && !store.isValidPath(j->second.path))
+                        && validOutputs.find(j->second.path) == validOutputs.end())
                         invalid.insert(j->second.path);
                 if (invalid.empty()) continue;
 
@@ -125,7 +191,7 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
             }
 
             else {
-                if (store.isValidPath(*i)) continue;
+                if (valid.find(*i) != valid.end()) continue;
                 query.insert(*i);
                 todoNonDrv.insert(*i);
             }
@@ -139,15 +205,14 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
         foreach (PathSet::iterator, i, todoDrv) {
             DrvPathWithOutputs i2 = parseDrvPathWithOutputs(*i);
 
-            // FIXME: cache this
-            Derivation drv = derivationFromPath(store, i2.first);
+            Derivation & drv(drvs[i2.first]);
 
             PathSet outputs;
             bool mustBuild = false;
             if (settings.useSubstitutes && !willBuildLocally(drv)) {
                 foreach (DerivationOutputs::iterator, j, drv.outputs) {
                     if (!wantOutput(j->first, i2.second)) continue;
-                    if (!store.isValidPath(j->second.path)) {
+                    if (validOutputs.find(j->second.path) == validOutputs.end()) {
                         if (infos.find(j->second.path) == infos.end())
                             mustBuild = true;
                         else
@@ -181,7 +246,7 @@ void queryMissing(StoreAPI & store, const PathSet & targets,
 }
 
 
-static void dfsVisit(StoreAPI & store, const PathSet & paths,
+static void dfsVisit(const ValidPathInfoMap & infos, const PathSet & paths,
     const Path & path, PathSet & visited, Paths & sorted,
     PathSet & parents)
 {
@@ -192,15 +257,13 @@ static void dfsVisit(StoreAPI & store, const PathSet & paths,
     visited.insert(path);
     parents.insert(path);
 
-    PathSet references;
-    if (store.isValidPath(path))
-        store.queryReferences(path, references);
-
-    foreach (PathSet::iterator, i, references)
-        /* Don't traverse into paths that don't exist.  That can
-           happen due to substitutes for non-existent paths. */
-        if (*i != path && paths.find(*i) != paths.end())
-            dfsVisit(store, paths, *i, visited, sorted, parents);
+    ValidPathInfoMap::const_iterator info = infos.find(path);
+    if (info != infos.end())
+        foreach (PathSet::const_iterator, i, info->second.references)
+            /* Don't traverse into paths that don't exist.  That can
+               happen due to substitutes for non-existent paths. */
+            if (*i != path && paths.find(*i) != paths.end())
+                dfsVisit(infos, paths, *i, visited, sorted, parents);
 
     sorted.push_front(path);
     parents.erase(path);
@@ -209,10 +272,13 @@ static void dfsVisit(StoreAPI & store, const PathSet & paths,
 
 Paths topoSortPaths(StoreAPI & store, const PathSet & paths)
 {
+    ValidPathInfoMap infos;
+    store.queryPathInfos(paths, infos);
+
     Paths sorted;
     PathSet visited, parents;
     foreach (PathSet::const_iterator, i, paths)
-        dfsVisit(store, paths, *i, visited, sorted, parents);
+        dfsVisit(infos, paths, *i, visited, sorted, parents);
     return sorted;
 }
 
@@ -21,6 +21,11 @@ void computeFSClosure(StoreAPI & store, const Path & path,
     PathSet & paths, bool flipDirection = false,
     bool includeOutputs = false, bool includeDerivers = false);
 
+/* Like the above, but for the union of the closures of `roots'. */
+void computeFSClosure(StoreAPI & store, const PathSet & roots,
+    PathSet & paths, bool flipDirection = false,
+    bool includeOutputs = false, bool includeDerivers = false);
+
 /* Return the path corresponding to the output identifier `id' in the
    given derivation. */
 Path findOutput(const Derivation & drv, string id);
@@ -3,12 +3,20 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+
+#if HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 
 namespace nix {
@@ -40,7 +48,17 @@ struct MakeReadOnly
 };
 
 
-void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
+/* A file that is a candidate for being hard-linked into .links. */
+struct FileToLink
+{
+    Path path;
+    struct stat st;
+    Hash hash;
+};
+
+
+void LocalStore::findFilesToLink(OptimiseStats & stats, const Path & path,
+    list<FileToLink> & files, bool & complete)
 {
     checkInterrupt();
     
@@ -51,7 +69,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectory(path);
         foreach (Strings::iterator, i, names)
-            optimisePath_(stats, path + "/" + *i);
+            findFilesToLink(stats, path + "/" + *i, files, complete);
         return;
     }
 
@@ -68,28 +86,53 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
        those files.  FIXME: check the modification time. */
     if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
         printMsg(lvlError, format("skipping suspicious writable file `%1%'") % path);
+        complete = false;
         return;
     }
 
-    /* Hash the file.  Note that hashPath() returns the hash over the
-       NAR serialisation, which includes the execute bit on the file.
-       Thus, executable and non-executable files with the same
-       contents *won't* be linked (which is good because otherwise the
-       permissions would be screwed up).
+    /* If the inode of the file has been recorded as being in .links,
+       and the link still refers to it, the file is already linked
+       and we don't need to read it. */
+    if (st.st_nlink > 1) {
+        string name = queryLinkedInode(st.st_ino);
+        struct stat stLink;
+        if (name != "" && lstat((linksDir + "/" + name).c_str(), &stLink) == 0
+            && stLink.st_ino == st.st_ino)
+        {
+            stats.totalFiles++;
+            stats.sameContents++;
+            printMsg(lvlDebug, format("`%1%' is already linked to `%2%'") % path % name);
+            return;
+        }
+    }
+
+    FileToLink file;
+    file.path = path;
+    file.st = st;
+    files.push_back(file);
+}
+
+
+void LocalStore::linkFile(OptimiseStats & stats, const FileToLink & file,
+    LinkedInodes & linked, bool & complete)
+{
+    const Path & path(file.path);
+    const struct stat & st(file.st);
+    const Hash & hash(file.hash);
 
-       Also note that if `path' is a symlink, then we're hashing the
-       contents of the symlink (i.e. the result of readlink()), not
-       the contents of the target (which may not even exist). */
-    Hash hash = hashPath(htSHA256, path).first;
     stats.totalFiles++;
     printMsg(lvlDebug, format("`%1%' has hash `%2%'") % path % printHash(hash));
 
     /* Check if this is a known hash. */
-    Path linkPath = linksDir + "/" + printHash32(hash);
+    string name = printHash32(hash);
+    Path linkPath = linksDir + "/" + name;
 
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
-        if (link(path.c_str(), linkPath.c_str()) == 0) return;
+        if (link(path.c_str(), linkPath.c_str()) == 0) {
+            linked[st.st_ino] = name;
+            return;
+        }
         if (errno != EEXIST)
             throw SysError(format("cannot link `%1%' to `%2%'") % linkPath % path);
         /* Fall through if another process created ‘linkPath’ before
@@ -103,6 +146,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
         throw SysError(format("getting attributes of path `%1%'") % linkPath);
 
     stats.sameContents++;
+    linked[stLink.st_ino] = name;
     if (st.st_ino == stLink.st_ino) {
         printMsg(lvlDebug, format("`%1%' is already linked to `%2%'") % path % linkPath);
         return;
@@ -127,9 +171,11 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
         if (errno == EMLINK) {
             /* Too many links to the same file (>= 32000 on most file
                systems).  This is likely to happen with empty files.
-               Just shrug and ignore. */
+               Just shrug and ignore, but don't mark the path as
+               optimised. */
             if (st.st_size)
                 printMsg(lvlInfo, format("`%1%' has maximum number of links") % linkPath);
+            complete = false;
             return;
         }
         throw SysError(format("cannot link `%1%' to `%2%'") % tempLink % linkPath);
@@ -146,6 +192,7 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
                decreasing it again.) */
             if (st.st_size)
                 printMsg(lvlInfo, format("`%1%' has maximum number of links") % linkPath);
+            complete = false;
             return;
         }
         throw SysError(format("cannot rename `%1%' to `%2%'") % tempLink % path);
@@ -157,23 +204,248 @@ void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path)
 }
 
 
+/* Hash a file.  Note that hashPath() returns the hash over the NAR
+   serialisation, which includes the execute bit on the file.  Thus,
+   executable and non-executable files with the same contents *won't*
+   be linked (which is good because otherwise the permissions would be
+   screwed up).
+
+   Also note that if `path' is a symlink, then we're hashing the
+   contents of the symlink (i.e. the result of readlink()), not the
+   contents of the target (which may not even exist). */
+static Hash hashFile(const Path & path)
+{
+    return hashPath(htSHA256, path).first;
+}
+
+
+/* Return whether files should be deduplicated by sharing their
+   extents rather than by hard-linking them. */
+static bool useReflinks()
+{
+    if (settings.optimiseMethod == "hardlink") return false;
+    if (settings.optimiseMethod != "reflink")
+        throw Error(format("unknown optimisation method `%1%'") % settings.optimiseMethod);
+#ifndef FIDEDUPERANGE
+    throw Error("the `reflink' optimisation method is not supported on this platform");
+#endif
+    return true;
+}
+
+
+#ifdef FIDEDUPERANGE
+
+/* Let the kernel share the extents of `path' with those of `source'.
+   The kernel compares the contents itself, so this is safe even if
+   `source' is stale.  Returns false if the contents differ or
+   `source' has disappeared. */
+static bool dedupeFile(const Path & source, const Path & path, off_t size)
+{
+    AutoCloseFD srcFd = open(source.c_str(), O_RDONLY);
+    if (srcFd == -1) {
+        if (errno == ENOENT) return false;
+        throw SysError(format("opening file `%1%'") % source);
+    }
+
+    struct stat st;
+    if (fstat(srcFd, &st) == -1)
+        throw SysError(format("getting attributes of path `%1%'") % source);
+    if (!S_ISREG(st.st_mode) || st.st_size != size) return false;
+
+    AutoCloseFD dstFd = open(path.c_str(), O_RDONLY);
+    if (dstFd == -1) throw SysError(format("opening file `%1%'") % path);
+
+    /* File systems may deduplicate less than requested (e.g. Btrfs
+       does at most 16 MiB per call), so loop. */
+    vector<unsigned char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    struct file_dedupe_range * range = (struct file_dedupe_range *) &buf[0];
+    off_t offset = 0;
+
+    while (offset < size) {
+        checkInterrupt();
+        memset(&buf[0], 0, buf.size());
+        range->src_offset = offset;
+        range->src_length = size - offset;
+        range->dest_count = 1;
+        range->info[0].dest_fd = dstFd;
+        range->info[0].dest_offset = offset;
+        if (ioctl(srcFd, FIDEDUPERANGE, range) == -1)
+            throw SysError(format("sharing extents of `%1%' with `%2%'") % path % source);
+        if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) return false;
+        if (range->info[0].status < 0) {
+            errno = -range->info[0].status;
+            throw SysError(format("sharing extents of `%1%' with `%2%'") % path % source);
+        }
+        if (range->info[0].bytes_deduped == 0)
+            throw Error(format("cannot share extents of `%1%' with `%2%'") % path % source);
+        offset += range->info[0].bytes_deduped;
+    }
+
+    return true;
+}
+
+
+void LocalStore::reflinkFile(OptimiseStats & stats, const FileToLink & file,
+    ReflinkSources & sources)
+{
+    const Path & path(file.path);
+    const struct stat & st(file.st);
+
+    stats.totalFiles++;
+
+    /* Symlinks have no extents, and neither do empty files. */
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) return;
+
+    string hash = printHash32(file.hash);
+
+    ReflinkSources::iterator i = sources.find(hash);
+    Path source = i != sources.end() ? i->second : queryReflinkSource(hash);
+
+    if (source == path) return;
+
+    if (source != "" && dedupeFile(source, path, st.st_size)) {
+        printMsg(lvlTalkative, format("sharing extents of `%1%' with `%2%'") % path % source);
+        stats.sameContents++;
+        stats.filesLinked++;
+        stats.bytesFreed += st.st_size;
+        stats.blocksFreed += st.st_blocks;
+        return;
+    }
+
+    /* This file becomes the one that later files with the same
+       contents are deduplicated against. */
+    sources[hash] = path;
+}
+
+#else
+
+void LocalStore::reflinkFile(OptimiseStats & stats, const FileToLink & file,
+    ReflinkSources & sources)
+{
+    abort();
+}
+
+#endif
+
+
+void LocalStore::optimisePath_(OptimiseStats & stats, const Path & path,
+    const std::map<Path, Hash> & fileHashes, LinkedInodes & linked,
+    ReflinkSources & sources, bool & complete)
+{
+    bool reflink = useReflinks();
+
+    list<FileToLink> files;
+    findFilesToLink(stats, path, files, complete);
+
+    /* The caller may already have computed the hashes, e.g. while
+       scanning a build output for references. */
+    foreach (list<FileToLink>::iterator, i, files) {
+        std::map<Path, Hash>::const_iterator known = fileHashes.find(i->path);
+        i->hash = known != fileHashes.end() ? known->second : hashFile(i->path);
+        if (reflink)
+            reflinkFile(stats, *i, sources);
+        else
+            linkFile(stats, *i, linked, complete);
+    }
+}
+
+
+struct HashFileTask : Task
+{
+    FileToLink & file;
+    HashFileTask(FileToLink & file) : file(file) { }
+    void run()
+    {
+        file.hash = hashFile(file.path);
+    }
+};
+
+
+/* The files of a store path that need to be hashed and linked. */
+struct PathToLink
+{
+    Path path;
+    list<FileToLink> files;
+    bool complete;
+};
+
+
+/* The number of files hashed in parallel before they're linked. */
+static const size_t filesPerBatch = 4096;
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
-    PathSet paths = queryAllValidPaths();
+    /* Store paths are immutable, so paths that have been optimised
+       completely before don't need to be looked at again. */
+    PathSet paths = queryUnoptimisedPaths();
+
+    bool reflink = useReflinks();
+
+    /* Process the paths in batches.  The files in a batch are hashed
+       in parallel; the links are then created by this thread, so
+       races between files with the same contents are confined to
+       other processes, which linkFile() already handles. */
+    PathSet::iterator i = paths.begin();
+    while (i != paths.end()) {
+
+        list<PathToLink> batch;
+        size_t nrFiles = 0;
+
+        for ( ; i != paths.end() && nrFiles < filesPerBatch; ++i) {
+            addTempRoot(*i);
+            if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
+            printMsg(lvlChatty, format("hashing files in `%1%'") % *i);
+            batch.push_back(PathToLink());
+            PathToLink & p(batch.back());
+            p.path = *i;
+            p.complete = true;
+            findFilesToLink(stats, p.path, p.files, p.complete);
+            nrFiles += p.files.size();
+        }
 
-    foreach (PathSet::iterator, i, paths) {
-        addTempRoot(*i);
-        if (!isValidPath(*i)) continue; /* path was GC'ed, probably */
-        startNest(nest, lvlChatty, format("hashing files in `%1%'") % *i);
-        optimisePath_(stats, *i);
+        {
+            list<HashFileTask> tasks;
+            ThreadPool pool(getThreadCount(settings.hashThreads));
+            foreach (list<PathToLink>::iterator, j, batch)
+                foreach (list<FileToLink>::iterator, k, j->files) {
+                    tasks.push_back(HashFileTask(*k));
+                    pool.enqueue(tasks.back());
+                }
+            pool.wait();
+        }
+
+        foreach (list<PathToLink>::iterator, j, batch) {
+            startNest(nest, lvlChatty, format("linking files in `%1%'") % j->path);
+            LinkedInodes linked;
+            ReflinkSources sources;
+            foreach (list<FileToLink>::iterator, k, j->files)
+                if (reflink)
+                    reflinkFile(stats, *k, sources);
+                else
+                    linkFile(stats, *k, linked, j->complete);
+            registerReflinkSources(sources);
+            registerLinkedInodes(linked, j->complete ? j->path : "");
+        }
     }
 }
 
 
-void LocalStore::optimisePath(const Path & path)
+void LocalStore::optimisePath(const Path & path,
+    const std::map<Path, Hash> & fileHashes)
 {
+    if (!settings.autoOptimiseStore) return;
     OptimiseStats stats;
-    if (settings.autoOptimiseStore) optimisePath_(stats, path);
+    LinkedInodes linked;
+    ReflinkSources sources;
+    bool complete = true;
+    optimisePath_(stats, path, fileHashes, linked, sources, complete);
+    /* The path usually isn't valid yet, so it can't be marked as
+       optimised and registerReflinkSources() ignores its files, but
+       recording its inodes makes a later `nix-store --optimise'
+       cheap. */
+    registerReflinkSources(sources);
+    registerLinkedInodes(linked, "");
 }
 
 
@@ -1,3 +1,5 @@
+#include "config.h"
+
 #include "pathlocks.hh"
 #include "util.hh"
 
@@ -171,6 +173,21 @@ void PathLocks::unlock()
     foreach (list<FDPair>::iterator, i, fds) {
         if (deletePaths) deleteLockFile(i->second, i->first);
 
+#if HAVE_SYS_INOTIFY_H
+        /* Release the lock and then update the timestamps of the lock
+           file.  This wakes up other processes waiting for the lock
+           (see Worker::waitForLocks()).  Closing the file would
+           release the lock too, but without an event that only the
+           lock holder generates. */
+        struct flock lock;
+        lock.l_type = F_UNLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = 0;
+        lock.l_len = 0;
+        if (fcntl(i->first, F_SETLK, &lock) == 0)
+            futimens(i->first, 0);
+#endif
+
         lockedPaths.erase(i->second);
         if (close(i->first) == -1)
             printMsg(lvlError,
@@ -2,69 +2,348 @@
 #include "hash.hh"
 #include "util.hh"
 #include "archive.hh"
+#include "thread-pool.hh"
 
 #include <map>
 #include <cstdlib>
+#include <cstring>
+
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if HAVE_AVX2_TARGET
+#include <immintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const unsigned int refLength = 32; /* characters */
+
+
+static bool isBase32[256];
 
+#if HAVE_AVX2_TARGET
+static bool haveAVX2 = false;
+#endif
 
-static void search(const unsigned char * s, unsigned int len, 
-    StringSet & hashes, StringSet & seen)
+
+/* Must be called from the main thread before any searching is done.
+   This happens when the first HashPartSet is constructed. */
+static void initScanner()
 {
     static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
-    }
-    
-    for (unsigned int i = 0; i + refLength <= len; ) {
+    if (initialised) return;
+    for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
+    for (unsigned int i = 0; i < base32Chars.size(); ++i)
+        isBase32[(unsigned char) base32Chars[i]] = true;
+#if HAVE_AVX2_TARGET
+    haveAVX2 = __builtin_cpu_supports("avx2");
+#endif
+    initialised = true;
+}
+
+
+static inline uint64_t hashPart(const unsigned char * s, unsigned int shift)
+{
+    uint64_t n;
+    memcpy(&n, s, sizeof n);
+    return (n * 0x9e3779b97f4a7c15ULL) >> shift;
+}
+
+
+HashPartSet::HashPartSet(const StringSet & parts)
+{
+    initScanner();
+
+    nrParts = parts.size();
+    unsigned int size = 16, bits = 4;
+    while (size < 2 * nrParts) { size *= 2; bits++; }
+    shift = 64 - bits;
+    table.resize(size, 0);
+
+    foreach (StringSet::const_iterator, i, parts) {
+        assert(i->size() == refLength);
+        unsigned int idx = this->parts.size() / refLength;
+        this->parts += *i;
+        uint64_t h = hashPart((const unsigned char *) i->data(), shift);
+        while (table[h]) h = (h + 1) & (size - 1);
+        table[h] = idx + 1;
+    }
+}
+
+
+bool HashPartSet::contains(const unsigned char * s) const
+{
+    uint64_t h = hashPart(s, shift);
+    while (unsigned int idx = table[h]) {
+        if (memcmp(parts.data() + (idx - 1) * refLength, s, refLength) == 0)
+            return true;
+        h = (h + 1) & (table.size() - 1);
+    }
+    return false;
+}
+
+
+/* The portable scanner.  It checks each candidate position from
+   right to left, so that a non-base-32 character allows it to skip
+   ahead by up to 32 bytes. */
+static void searchScalar(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen)
+{
+    for (size_t i = 0; i + refLength <= len; ) {
         int j;
         bool match = true;
         for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
+            if (!isBase32[s[i + j]]) {
                 i += j + 1;
                 match = false;
                 break;
             }
         if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.find(ref) != hashes.end()) {
-            debug(format("found reference to `%1%' at offset `%2%'")
-                  % ref % i);
-            seen.insert(ref);
-            hashes.erase(ref);
-        }
+        if (parts.contains(s + i))
+            seen.insert(string((const char *) s + i, refLength));
         ++i;
     }
 }
 
 
+/* The vectorised scanners classify 32 bytes at a time, returning a
+   bitmask indicating which bytes are base-32 characters.  They
+   hard-code the base-32 alphabet, which is [0-9a-z] minus `e', `o',
+   `t' and `u'.  The SSE2 classifier uses signed comparisons, which is
+   fine since characters >= 128 compare as negative and are therefore
+   outside both ranges. */
+
+#if __SSE2__
+struct SSE2Classifier
+{
+    static uint32_t classify16(const unsigned char * s)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) s);
+        __m128i digit = _mm_and_si128(
+            _mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+            _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), x));
+        __m128i lower = _mm_and_si128(
+            _mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)),
+            _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), x));
+        __m128i excluded = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('e')), _mm_cmpeq_epi8(x, _mm_set1_epi8('o'))),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('t')), _mm_cmpeq_epi8(x, _mm_set1_epi8('u'))));
+        return _mm_movemask_epi8(_mm_or_si128(digit, _mm_andnot_si128(excluded, lower)));
+    }
+
+    static uint32_t classify(const unsigned char * s)
+    {
+        return classify16(s) | classify16(s + 16) << 16;
+    }
+};
+#endif
+
+
+#if HAVE_AVX2_TARGET
+/* The AVX2 classifier uses the nibble lookup trick: each byte is in
+   the alphabet iff the bits selected by its high nibble (one bit for
+   each of 0x3?, 0x6? and 0x7?) intersect the bits selected by its
+   low nibble. */
+struct AVX2Classifier
+{
+    __attribute__((target("avx2")))
+    static uint32_t classify(const unsigned char * s)
+    {
+        const __m256i lutLo = _mm256_setr_epi8(
+            5, 7, 7, 7, 3, 1, 7, 7, 7, 7, 6, 2, 2, 2, 2, 0,
+            5, 7, 7, 7, 3, 1, 7, 7, 7, 7, 6, 2, 2, 2, 2, 0);
+        const __m256i lutHi = _mm256_setr_epi8(
+            0, 0, 0, 1, 0, 0, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 0, 0, 1, 0, 0, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        __m256i x = _mm256_loadu_si256((const __m256i *) s);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, _mm256_and_si256(x, nibble));
+        __m256i hi = _mm256_shuffle_epi8(lutHi, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+        __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        return ~(uint32_t) _mm256_movemask_epi8(none);
+    }
+};
+#endif
+
+
+/* Return a bitmask of the base-32 characters in the 64 bytes
+   starting at s + pos, where bytes outside of [0, len) count as
+   non-base-32. */
+template<class Classifier>
+static inline __attribute__((always_inline))
+uint64_t classifyWindow(const unsigned char * s, size_t len, ptrdiff_t pos)
+{
+    if (pos >= 0 && pos + 64 <= (ptrdiff_t) len)
+        return Classifier::classify(s + pos) | (uint64_t) Classifier::classify(s + pos + 32) << 32;
+    uint64_t m = 0;
+    for (ptrdiff_t i = pos < 0 ? 0 : pos; i < pos + 64 && i < (ptrdiff_t) len; ++i)
+        if (isBase32[s[i]]) m |= (uint64_t) 1 << (i - pos);
+    return m;
+}
+
+
+static inline bool hasGroup(uint32_t m)
+{
+    return (m & 0xffff) == 0xffff || (m >> 16) == 0xffff;
+}
+
+
+/* Return the offset of the first 32-byte block at or after `pos'
+   that contains a 16-byte aligned group of base-32 characters, and
+   its classification in `m'; or `len' if there is none.  This is the
+   hot loop, so it must not contain function calls. */
+template<class Classifier>
+static inline __attribute__((always_inline))
+size_t findGroup(const unsigned char * s, size_t len, size_t pos, uint32_t & m)
+{
+    for ( ; pos + 64 <= len; pos += 64) {
+        uint32_t m0 = Classifier::classify(s + pos);
+        uint32_t m1 = Classifier::classify(s + pos + 32);
+        if (hasGroup(m0) | hasGroup(m1)) {
+            if (hasGroup(m0)) { m = m0; return pos; }
+            m = m1; return pos + 32;
+        }
+    }
+
+    if (pos + 32 <= len) {
+        m = Classifier::classify(s + pos);
+        if (hasGroup(m)) return pos;
+        pos += 32;
+    }
+
+    if (pos + 16 <= len) {
+        m = 0;
+        for (size_t i = pos; i < pos + 16; ++i)
+            if (isBase32[s[i]]) m |= (uint32_t) 1 << (i - pos);
+        if (hasGroup(m)) return pos;
+    }
+
+    return len;
+}
+
+
+/* The vectorised search.  Any run of 32 base-32 characters contains
+   a 16-byte aligned group of base-32 characters, which is rare in
+   binary data.  So we classify the data 32 bytes at a time and only
+   look closer when we find such a group at offset G.  The runs that
+   contain it must start in [G - 16, G]; these start positions are
+   found by classifying the 64 bytes from G - 16 and ANDing the mask
+   with shifted versions of itself.  Only the resulting positions are
+   looked up in the hash table. */
+template<class Classifier>
+static inline __attribute__((always_inline))
+void searchBlocks(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen)
+{
+    if (len < refLength) return;
+
+    size_t next = 0; /* first start position not yet examined */
+    uint32_t m;
+
+    for (size_t pos = 0; (pos = findGroup<Classifier>(s, len, pos, m)) < len; pos += 32) {
+
+        for (size_t g = pos; g < pos + 32 && g + 16 <= len; g += 16) {
+            if (((m >> (g - pos)) & 0xffff) != 0xffff) continue;
+
+            size_t lo = g < 16 ? 0 : g - 16;
+            if (lo < next) lo = next;
+            size_t hi = g + refLength <= len ? g : len - refLength;
+            if (lo > hi) continue;
+
+            ptrdiff_t base = (ptrdiff_t) g - 16;
+            uint64_t w = classifyWindow<Classifier>(s, len, base);
+            w &= w >> 1; w &= w >> 2; w &= w >> 4; w &= w >> 8; w &= w >> 16;
+            w >>= lo - base;
+            w &= ((uint64_t) 2 << (hi - lo)) - 1;
+
+            while (w) {
+                const unsigned char * p = s + lo + __builtin_ctzll(w);
+                if (parts.contains(p))
+                    seen.insert(string((const char *) p, refLength));
+                w &= w - 1;
+            }
+
+            next = hi + 1;
+        }
+    }
+}
+
+
+#if __SSE2__
+static void searchSSE2(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen)
+{
+    searchBlocks<SSE2Classifier>(s, len, parts, seen);
+}
+#endif
+
+
+#if HAVE_AVX2_TARGET
+/* The loop is instantiated inside an AVX2 function so that the
+   classifier can be inlined. */
+__attribute__((target("avx2")))
+static void searchAVX2(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen)
+{
+    searchBlocks<AVX2Classifier>(s, len, parts, seen);
+}
+#endif
+
+
+void searchHashParts(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen, bool allowSimd)
+{
+    if (parts.empty()) return;
+#if HAVE_AVX2_TARGET
+    if (allowSimd && haveAVX2) {
+        searchAVX2(s, len, parts, seen);
+        return;
+    }
+#endif
+#if __SSE2__
+    if (allowSimd) {
+        searchSSE2(s, len, parts, seen);
+        return;
+    }
+#endif
+    searchScalar(s, len, parts, seen);
+}
+
+
+static inline void search(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen)
+{
+    searchHashParts(s, len, parts, seen, true);
+}
+
+
 struct RefScanSink : Sink
 {
-    HashSink hashSink;
-    StringSet hashes;
+    const HashPartSet & hashes;
     StringSet seen;
 
     string tail;
 
-    RefScanSink() : hashSink(htSHA256) { }
-    
+    RefScanSink(const HashPartSet & hashes) : hashes(hashes) { }
+
     void operator () (const unsigned char * data, size_t len);
 };
 
 
 void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
-    hashSink(data, len);
-
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
@@ -80,10 +359,183 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
 }
 
 
-PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+/* A regular file in the tree being scanned.  `metaPos' is the offset
+   in the metadata stream (i.e. the NAR without file contents) at
+   which the contents of this file belong. */
+struct ScannedFile
+{
+    Path path;
+    size_t metaPos;
+    unsigned long long size;
+    bool executable;
+    unsigned char * data;
+    Hash hash;
+};
+
+
+struct FileCollector : ContentsHandler
+{
+    StringSink & meta;
+    vector<ScannedFile> & files;
+
+    FileCollector(StringSink & meta, vector<ScannedFile> & files)
+        : meta(meta), files(files) { }
+
+    void operator () (const Path & path, unsigned long long size, bool executable)
+    {
+        ScannedFile file;
+        file.path = path;
+        file.metaPos = meta.s.size();
+        file.size = size;
+        file.executable = executable;
+        file.data = 0;
+        files.push_back(file);
+    }
+};
+
+
+/* The NAR serialisation of a single regular file, minus its contents.
+   This must match dump() in archive.cc, so that the resulting hash is
+   the same as hashPath() on the file. */
+static void writeFileHeader(const ScannedFile & file, Sink & sink)
+{
+    writeString(archiveVersion1, sink);
+    writeString("(", sink);
+    writeString("type", sink);
+    writeString("regular", sink);
+    if (file.executable) {
+        writeString("executable", sink);
+        writeString("", sink);
+    }
+    writeString("contents", sink);
+    writeLongLong(file.size, sink);
+}
+
+
+static void writeFileTrailer(const ScannedFile & file, Sink & sink)
 {
-    RefScanSink sink;
+    writePadding(file.size, sink);
+    writeString(")", sink);
+}
+
+
+/* Scan a part of a mapped file for references. */
+struct ScanTask : Task
+{
+    const HashPartSet & hashes;
+    const unsigned char * data;
+    size_t len;
+    StringSet seen;
+
+    ScanTask(const HashPartSet & hashes, const unsigned char * data, size_t len)
+        : hashes(hashes), data(data), len(len) { }
+
+    void run()
+    {
+        search(data, len, hashes, seen);
+    }
+};
+
+
+/* Compute the hash of a mapped file, as hashPath() would. */
+struct FileHashTask : Task
+{
+    ScannedFile & file;
+
+    FileHashTask(ScannedFile & file) : file(file) { }
+
+    void run()
+    {
+        HashSink sink(htSHA256);
+        writeFileHeader(file, sink);
+        sink(file.data, file.size);
+        writeFileTrailer(file, sink);
+        file.hash = sink.finish().first;
+    }
+};
+
+
+struct Mappings
+{
+    typedef list<std::pair<void *, size_t> > List;
+    List maps;
+    ~Mappings() { clear(); }
+    void add(void * p, size_t len) { maps.push_back(std::pair<void *, size_t>(p, len)); }
+    void clear()
+    {
+        foreach (List::iterator, i, maps) munmap(i->first, i->second);
+        maps.clear();
+    }
+};
+
+
+/* Map a file into memory.  Returns 0 if the file cannot be mapped
+   (e.g. because it's empty or too large for the address space), in
+   which case the caller should fall back to reading it. */
+static unsigned char * mapFile(const ScannedFile & file)
+{
+    if (file.size == 0 || file.size != (size_t) file.size) return 0;
+
+    AutoCloseFD fd = open(file.path.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening file `%1%'") % file.path);
+
+    /* Accessing a mapping beyond the end of the file gives SIGBUS,
+       so make sure that the file hasn't been truncated. */
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError(format("getting attributes of path `%1%'") % file.path);
+    if ((unsigned long long) st.st_size != file.size)
+        throw Error(format("file `%1%' changed while it was being scanned") % file.path);
+
+    void * p = mmap(0, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    return p == MAP_FAILED ? 0 : (unsigned char *) p;
+}
+
+
+/* Fallback for files that couldn't be mapped: read the file in the
+   calling thread, feeding it to the NAR hash, the reference scanner
+   and the per-file hash at the same time. */
+static void readFileSerially(ScannedFile & file, HashSink & narSink,
+    const HashPartSet & hashes, StringSet & seen, bool computeFileHashes)
+{
+    AutoCloseFD fd = open(file.path.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(format("opening file `%1%'") % file.path);
+
+    RefScanSink scanSink(hashes);
+    HashSink fileSink(htSHA256);
+    writeFileHeader(file, fileSink);
+
+    unsigned char buf[65536];
+    unsigned long long left = file.size;
+
+    while (left > 0) {
+        checkInterrupt();
+        size_t n = left > sizeof(buf) ? sizeof(buf) : left;
+        readFull(fd, buf, n);
+        left -= n;
+        narSink(buf, n);
+        scanSink(buf, n);
+        if (computeFileHashes) fileSink(buf, n);
+    }
+
+    writeFileTrailer(file, fileSink);
+    file.hash = fileSink.finish().first;
+    seen.insert(scanSink.seen.begin(), scanSink.seen.end());
+}
+
+
+/* Limits on the amount of file data mapped at the same time. */
+static const unsigned int maxWindowFiles = 1024;
+static const unsigned long long maxWindowBytes = 256ULL * 1024 * 1024;
+
+/* Large files are scanned in chunks of this size. */
+static const size_t scanChunkSize = 4 * 1024 * 1024;
+
+
+PathScanResult scanPath(const Path & path, const PathSet & refs,
+    unsigned int nrThreads, bool computeFileHashes)
+{
+    StringSet hashParts;
     std::map<string, Path> backMap;
 
     /* For efficiency (and a higher hit rate), just search for the
@@ -98,24 +550,126 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        hashParts.insert(s);
         backMap[s] = *i;
     }
 
-    /* Look for the hashes in the NAR dump of the path. */
-    dumpPath(path, sink);
+    HashPartSet hashes(hashParts);
+
+    /* Walk the tree once to get the NAR serialisation of everything
+       except the contents of regular files. */
+    StringSink meta;
+    vector<ScannedFile> files;
+    FileCollector collector(meta, files);
+    dumpPathMetadata(path, meta, collector);
+
+    /* Now process the file contents in windows of mapped files.  The
+       worker threads scan the files for references and compute the
+       per-file hashes, while this thread computes the hash of the
+       NAR, which is inherently sequential. */
+    HashSink narSink(htSHA256);
+    StringSet seen;
+    size_t metaDone = 0;
+
+    Mappings mappings;
+    list<ScanTask> scanTasks;
+    list<FileHashTask> hashTasks;
+    ThreadPool pool(nrThreads > 1 ? nrThreads - 1 : 0);
+
+    vector<ScannedFile>::iterator i = files.begin();
+    while (i != files.end()) {
+
+        vector<ScannedFile>::iterator start = i;
+        unsigned int windowFiles = 0;
+        unsigned long long windowBytes = 0;
+
+        for ( ; i != files.end() &&
+                  (windowFiles == 0 ||
+                   (windowFiles < maxWindowFiles && windowBytes + i->size <= maxWindowBytes));
+              ++i, ++windowFiles)
+        {
+            checkInterrupt();
+
+            windowBytes += i->size;
+            i->data = mapFile(*i);
+
+            if (!i->data) {
+                if (i->size == 0 && computeFileHashes)
+                    FileHashTask(*i).run();
+                continue;
+            }
+
+            mappings.add(i->data, i->size);
+
+            for (size_t pos = 0; pos < i->size; pos += scanChunkSize) {
+                /* Let chunks overlap so that references spanning
+                   a chunk boundary are found. */
+                size_t len = i->size - pos;
+                if (len > scanChunkSize + refLength - 1)
+                    len = scanChunkSize + refLength - 1;
+                scanTasks.push_back(ScanTask(hashes, i->data + pos, len));
+                pool.enqueue(scanTasks.back());
+            }
+
+            if (computeFileHashes) {
+                hashTasks.push_back(FileHashTask(*i));
+                pool.enqueue(hashTasks.back());
+            }
+        }
+
+        for (vector<ScannedFile>::iterator j = start; j != i; ++j) {
+            checkInterrupt();
+            narSink((const unsigned char *) meta.s.data() + metaDone, j->metaPos - metaDone);
+            metaDone = j->metaPos;
+            if (j->data)
+                narSink(j->data, j->size);
+            else if (j->size)
+                readFileSerially(*j, narSink, hashes, seen, computeFileHashes);
+        }
+
+        pool.wait();
+
+        foreach (list<ScanTask>::iterator, j, scanTasks)
+            seen.insert(j->seen.begin(), j->seen.end());
+
+        scanTasks.clear();
+        hashTasks.clear();
+        mappings.clear();
+        for (vector<ScannedFile>::iterator j = start; j != i; ++j)
+            j->data = 0;
+    }
+
+    narSink((const unsigned char *) meta.s.data() + metaDone, meta.s.size() - metaDone);
+
+    /* References can also occur in file names and symlink
+       targets. */
+    search((const unsigned char *) meta.s.data(), meta.s.size(), hashes, seen);
+
+    PathScanResult result;
+    result.narHash = narSink.finish();
 
     /* Map the hashes found back to their store paths. */
-    PathSet found;
-    foreach (StringSet::iterator, i, sink.seen) {
-        std::map<string, Path>::iterator j;
-        if ((j = backMap.find(*i)) == backMap.end()) abort();
-        found.insert(j->second);
+    foreach (StringSet::iterator, j, seen) {
+        std::map<string, Path>::iterator k;
+        if ((k = backMap.find(*j)) == backMap.end()) abort();
+        debug(format("found reference to `%1%'") % k->second);
+        result.references.insert(k->second);
     }
 
-    hash = sink.hashSink.finish();
-        
-    return found;
+    if (computeFileHashes)
+        foreach (vector<ScannedFile>::iterator, j, files)
+            result.fileHashes[j->path] = j->hash;
+
+    return result;
+}
+
+
+PathSet scanForReferences(const string & path,
+    const PathSet & refs, HashResult & hash)
+{
+    PathScanResult result = scanPath(path, refs, 1, false);
+    hash = result.narHash;
+    return result.references;
 }
 
 
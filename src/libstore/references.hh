@@ -3,9 +3,62 @@
 #include "types.hh"
 #include "hash.hh"
 
+#include <map>
+#include <vector>
+
 namespace nix {
 
 PathSet scanForReferences(const Path & path, const PathSet & refs,
     HashResult & hash);
-    
+
+
+/* A set of hash parts of store paths (i.e. the 32 base-32 characters
+   preceding the first dash in the base name) to search for.  It is
+   an open-addressing hash table over the raw characters, so lookups
+   don't allocate.  It is immutable after construction and can be
+   shared between threads. */
+class HashPartSet
+{
+public:
+    HashPartSet(const StringSet & parts);
+
+    bool empty() const { return nrParts == 0; }
+
+    /* Return whether the 32 characters at `s' are in the set. */
+    bool contains(const unsigned char * s) const;
+
+private:
+    string parts;
+    vector<unsigned int> table;
+    unsigned int nrParts, shift;
+};
+
+/* Add the elements of `parts' that occur in the given buffer to
+   `seen'.  This uses SSE2 or AVX2 where available, unless `allowSimd'
+   is false. */
+void searchHashParts(const unsigned char * s, size_t len,
+    const HashPartSet & parts, StringSet & seen, bool allowSimd = true);
+
+
+struct PathScanResult
+{
+    /* The SHA-256 hash and size of the NAR serialisation. */
+    HashResult narHash;
+
+    /* The subset of the candidate references that occur in the
+       path. */
+    PathSet references;
+
+    /* The hash of each regular file in the path, as computed by
+       hashPath() on that file.  Only filled in if requested. */
+    std::map<Path, Hash> fileHashes;
+};
+
+/* Compute the NAR hash of `path', scan it for references and
+   (optionally) compute the hashes of the files it contains, in a
+   single pass over the tree.  File contents are scanned and hashed by
+   `nrThreads' threads in parallel. */
+PathScanResult scanPath(const Path & path, const PathSet & refs,
+    unsigned int nrThreads, bool computeFileHashes);
+
 }
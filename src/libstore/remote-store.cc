@@ -280,12 +280,8 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 }
 
 
-ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
+static ValidPathInfo readPathInfo(const Path & path, Source & from)
 {
-    openConnection();
-    writeInt(wopQueryPathInfo, to);
-    writeString(path, to);
-    processStderr();
     ValidPathInfo info;
     info.path = path;
     info.deriver = readString(from);
@@ -298,6 +294,45 @@ ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
 }
 
 
+ValidPathInfo RemoteStore::queryPathInfo(const Path & path)
+{
+    openConnection();
+    writeInt(wopQueryPathInfo, to);
+    writeString(path, to);
+    processStderr();
+    return readPathInfo(path, from);
+}
+
+
+void RemoteStore::queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 16) {
+        StoreAPI::queryPathInfos(paths, infos);
+        return;
+    }
+
+    vector<BatchRequest> requests;
+    foreach (PathSet::const_iterator, i, paths) {
+        StringSink args;
+        writeString(*i, args);
+        requests.push_back(BatchRequest(wopQueryPathInfo, args.s));
+    }
+
+    performBatch(requests);
+
+    /* Requests for invalid paths fail; those are omitted. */
+    PathSet::const_iterator i = paths.begin();
+    foreach (vector<BatchRequest>::iterator, j, requests) {
+        if (!j->failed) {
+            StringSource reply(j->reply);
+            infos[*i] = readPathInfo(*i, reply);
+        }
+        ++i;
+    }
+}
+
+
 Hash RemoteStore::queryPathHash(const Path & path)
 {
     openConnection();
@@ -333,6 +368,50 @@ void RemoteStore::queryReferrers(const Path & path,
 }
 
 
+void RemoteStore::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 15) {
+        StoreAPI::queryClosure(paths, closure, flipDirection);
+        return;
+    }
+    writeInt(wopQueryClosure, to);
+    writeStrings(paths, to);
+    writeInt(flipDirection ? 1 : 0, to);
+    processStderr();
+    PathSet closure2 = readStorePaths<PathSet>(from);
+    closure.insert(closure2.begin(), closure2.end());
+}
+
+
+void RemoteStore::queryReferrersOfPaths(const PathSet & paths,
+    PathSet & referrers)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 16) {
+        StoreAPI::queryReferrersOfPaths(paths, referrers);
+        return;
+    }
+
+    vector<BatchRequest> requests;
+    foreach (PathSet::const_iterator, i, paths) {
+        StringSink args;
+        writeString(*i, args);
+        requests.push_back(BatchRequest(wopQueryReferrers, args.s));
+    }
+
+    performBatch(requests);
+
+    foreach (vector<BatchRequest>::iterator, j, requests) {
+        if (j->failed) throw Error(j->reply);
+        StringSource reply(j->reply);
+        PathSet referrers2 = readStorePaths<PathSet>(reply);
+        referrers.insert(referrers2.begin(), referrers2.end());
+    }
+}
+
+
 Path RemoteStore::queryDeriver(const Path & path)
 {
     openConnection();
@@ -526,6 +605,9 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     openConnection(false);
 
+    if (options.targetFree && GET_PROTOCOL_MINOR(daemonVersion) < 17)
+        throw Error("the Nix daemon is too old to collect garbage up to a free space target");
+
     writeInt(wopCollectGarbage, to);
     writeInt(options.action, to);
     writeStrings(options.pathsToDelete, to);
@@ -537,6 +619,8 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
         writeInt(0, to);
         writeInt(0, to);
     }
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 17)
+        writeLongLong(options.targetFree, to);
 
     processStderr();
 
@@ -565,6 +649,59 @@ void RemoteStore::clearFailedPaths(const PathSet & paths)
 }
 
 
+BuildStatsList RemoteStore::queryBuildStats(const Path & drvPath)
+{
+    openConnection();
+    if (GET_PROTOCOL_MINOR(daemonVersion) < 18)
+        throw Error("the Nix daemon is too old to query build statistics");
+    writeInt(wopQueryBuildStats, to);
+    writeString(drvPath, to);
+    processStderr();
+    BuildStatsList res;
+    unsigned int count = readInt(from);
+    while (count--) {
+        BuildStats stats;
+        stats.drvPath = drvPath;
+        stats.machine = readString(from);
+        stats.startTime = readLongLong(from);
+        stats.wallTime = readLongLong(from);
+        stats.userTime = readLongLong(from);
+        stats.systemTime = readLongLong(from);
+        stats.maxRSS = readLongLong(from);
+        stats.logSize = readLongLong(from);
+        stats.narSize = readLongLong(from);
+        stats.succeeded = readInt(from) != 0;
+        res.push_back(stats);
+    }
+    return res;
+}
+
+
+void RemoteStore::performBatch(vector<BatchRequest> & requests)
+{
+    openConnection();
+    writeInt(wopBatch, to);
+    writeInt(requests.size(), to);
+    for (unsigned int n = 0; n < requests.size(); n++) {
+        writeInt(n, to);
+        writeInt(requests[n].op, to);
+        writeString(requests[n].args, to);
+    }
+    processStderr();
+
+    unsigned int count = readInt(from);
+    if (count != requests.size())
+        throw Error("protocol error: wrong number of replies to batch");
+    for (unsigned int n = 0; n < count; n++) {
+        unsigned int id = readInt(from);
+        if (id >= requests.size())
+            throw Error("protocol error: invalid request ID in batch reply");
+        requests[id].failed = readInt(from) != 0;
+        requests[id].reply = readString(from);
+    }
+}
+
+
 void RemoteStore::processStderr(Sink * sink, Source * source)
 {
     to.flush();
@@ -32,12 +32,19 @@ public:
     
     ValidPathInfo queryPathInfo(const Path & path);
 
+    void queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos);
+
     Hash queryPathHash(const Path & path);
 
     void queryReferences(const Path & path, PathSet & references);
 
     void queryReferrers(const Path & path, PathSet & referrers);
 
+    void queryReferrersOfPaths(const PathSet & paths, PathSet & referrers);
+
+    void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false);
+
     Path queryDeriver(const Path & path);
     
     PathSet queryValidDerivers(const Path & path);
@@ -82,6 +89,8 @@ public:
     PathSet queryFailedPaths();
 
     void clearFailedPaths(const PathSet & paths);
+
+    BuildStatsList queryBuildStats(const Path & drvPath);
     
 private:
     AutoCloseFD fdSocket;
@@ -95,6 +104,24 @@ private:
 
     void processStderr(Sink * sink = 0, Source * source = 0);
 
+    /* A request that is sent to the daemon as part of a batch.  The
+       arguments and the reply are serialised as they would be for the
+       operation on its own. */
+    struct BatchRequest
+    {
+        unsigned int op;
+        string args;
+        bool failed;
+        string reply;
+        BatchRequest(unsigned int op, const string & args)
+            : op(op), args(args), failed(false) { }
+    };
+
+    /* Perform a number of read-only requests in a single round-trip.
+       Requests that fail have `failed' set and the error message in
+       `reply'. */
+    void performBatch(vector<BatchRequest> & requests);
+
     void connectToDaemon();
 
     void setOptions();
@@ -4,7 +4,9 @@ create table if not exists ValidPaths (
     hash             text not null,
     registrationTime integer not null,
     deriver          text,
-    narSize          integer
+    narSize          integer,
+    lastUsed         integer, -- null means registrationTime
+    optimised        integer -- 1 if all files have been hard-linked into .links
 );
 
 create table if not exists Refs (
@@ -42,3 +44,43 @@ create table if not exists FailedPaths (
     path text primary key not null,
     time integer not null
 );
+
+-- Maps the inodes of the files in the .links directory to their names
+-- (the hashes of their contents), so that `nix-store --optimise'
+-- doesn't have to read files that are already hard-linked.
+create table if not exists LinkedInodes (
+    ino  integer primary key not null,
+    hash text not null
+);
+
+-- In the `reflink' optimisation mode, records for each file hash a
+-- file with those contents (`name' relative to store path `path'),
+-- with which other files with the same hash share their extents.
+create table if not exists ReflinkSources (
+    hash text primary key not null,
+    path integer not null,
+    name text not null,
+    foreign key (path) references ValidPaths(id) on delete cascade
+);
+
+create index if not exists IndexReflinkSources on ReflinkSources(path);
+
+-- Resource usage of the builds performed by this store, successful or
+-- not.  Used to estimate the duration of future builds.
+create table if not exists BuildStats (
+    id         integer primary key autoincrement not null,
+    drvPath    text not null,
+    name       text not null, -- derivation name, e.g. "hello-2.8"
+    machine    text not null, -- host that performed the build
+    startTime  integer not null,
+    wallTime   integer not null, -- in milliseconds
+    userTime   integer, -- in milliseconds; null if unknown
+    systemTime integer, -- in milliseconds; null if unknown
+    maxRSS     integer, -- in KiB; null if unknown
+    logSize    integer not null,
+    narSize    integer, -- total NAR size of the outputs
+    succeeded  integer not null
+);
+
+create index if not exists IndexBuildStatsDrv on BuildStats(drvPath);
+create index if not exists IndexBuildStatsName on BuildStats(name);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.hh"
+
+
+class sqlite3;
+class sqlite3_stmt;
+
+
+namespace nix {
+
+
+/* Wrapper object to close the SQLite database automatically. */
+struct SQLite
+{
+    sqlite3 * db;
+    SQLite() { db = 0; }
+    ~SQLite();
+    operator sqlite3 * () { return db; }
+};
+
+
+/* Wrapper object to create and destroy SQLite prepared statements. */
+struct SQLiteStmt
+{
+    sqlite3 * db;
+    sqlite3_stmt * stmt;
+    unsigned int curArg;
+    SQLiteStmt() { stmt = 0; }
+    void create(sqlite3 * db, const string & s);
+    void reset();
+    ~SQLiteStmt();
+    operator sqlite3_stmt * () { return stmt; }
+    void bind(const string & value);
+    void bind(int value);
+    void bind64(long long value);
+    void bind();
+};
+
+
+/* Helper class to ensure that prepared statements are reset when
+   leaving the scope that uses them.  Unfinished prepared statements
+   prevent transactions from being aborted, and can cause locks to be
+   kept when they should be released. */
+struct SQLiteStmtUse
+{
+    SQLiteStmt & stmt;
+    SQLiteStmtUse(SQLiteStmt & stmt);
+    ~SQLiteStmtUse();
+};
+
+
+/* RAII helper for a SQLite transaction.  The transaction is rolled
+   back unless commit() is called. */
+struct SQLiteTxn
+{
+    bool active;
+    sqlite3 * db;
+    SQLiteTxn(sqlite3 * db);
+    void commit();
+    ~SQLiteTxn();
+};
+
+
+/* RAII helper for reading from a SQLite database consistently.
+   Unlike SQLiteTxn, it can be used inside another transaction. */
+struct SQLiteReadTxn
+{
+    sqlite3 * db;
+    SQLiteReadTxn(sqlite3 * db);
+    ~SQLiteReadTxn();
+};
+
+
+MakeError(SQLiteError, Error);
+MakeError(SQLiteBusy, SQLiteError);
+
+
+/* Throw SQLiteError, or SQLiteBusy (after a short random delay) if
+   the database is locked by another process. */
+void throwSQLiteError(sqlite3 * db, const format & f)
+    __attribute__ ((noreturn));
+
+
+/* Convenience macros for retrying a SQLite transaction. */
+#define retry_sqlite while (1) { try {
+#define end_retry_sqlite break; } catch (SQLiteBusy & e) { } }
+
+
+}
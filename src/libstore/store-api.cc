@@ -13,6 +13,7 @@ GCOptions::GCOptions()
     action = gcDeleteDead;
     ignoreLiveness = false;
     maxFreed = ULLONG_MAX;
+    targetFree = 0;
 }
 
 
@@ -227,6 +228,51 @@ Path computeStorePathForText(const string & name, const string & s,
 }
 
 
+void StoreAPI::queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos)
+{
+    PathSet valid = queryValidPaths(paths);
+    foreach (PathSet::iterator, i, valid)
+        infos[*i] = queryPathInfo(*i);
+}
+
+
+void StoreAPI::queryReferrersOfPaths(const PathSet & paths, PathSet & referrers)
+{
+    foreach (PathSet::const_iterator, i, paths)
+        queryReferrers(*i, referrers);
+}
+
+
+void StoreAPI::queryClosure(const PathSet & paths, PathSet & closure,
+    bool flipDirection)
+{
+    PathSet done, todo(paths);
+
+    while (!todo.empty()) {
+        PathSet next;
+        foreach (PathSet::iterator, i, todo)
+            if (done.insert(*i).second) next.insert(*i);
+        todo.clear();
+
+        if (flipDirection)
+            queryReferrersOfPaths(next, todo);
+
+        else {
+            ValidPathInfoMap infos;
+            queryPathInfos(next, infos);
+            foreach (PathSet::iterator, i, next) {
+                ValidPathInfoMap::iterator info = infos.find(*i);
+                if (info == infos.end())
+                    throw Error(format("path `%1%' is not valid") % *i);
+                todo.insert(info->second.references.begin(), info->second.references.end());
+            }
+        }
+    }
+
+    closure.insert(done.begin(), done.end());
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -234,11 +280,16 @@ string StoreAPI::makeValidityRegistration(const PathSet & paths,
     bool showDerivers, bool showHash)
 {
     string s = "";
-    
+
+    ValidPathInfoMap infos;
+    queryPathInfos(paths, infos);
+
     foreach (PathSet::iterator, i, paths) {
         s += *i + "\n";
 
-        ValidPathInfo info = queryPathInfo(*i);
+        ValidPathInfoMap::iterator k = infos.find(*i);
+        if (k == infos.end()) throw Error(format("path `%1%' is not valid") % *i);
+        ValidPathInfo & info(k->second);
 
         if (showHash) {
             s += printHash(info.hash) + "\n";
@@ -51,6 +51,10 @@ struct GCOptions
     /* Stop after at least `maxFreed' bytes have been freed. */
     unsigned long long maxFreed;
 
+    /* Stop once the file system containing the store has at least
+       `targetFree' bytes available.  0 means no target. */
+    unsigned long long targetFree;
+
     GCOptions();
 };
 
@@ -97,6 +101,28 @@ struct ValidPathInfo
 
 typedef list<ValidPathInfo> ValidPathInfos;
 
+typedef std::map<Path, ValidPathInfo> ValidPathInfoMap;
+
+
+/* Resource usage of a build of a derivation. */
+struct BuildStats
+{
+    Path drvPath;
+    string machine; /* the host that performed the build */
+    time_t startTime;
+    unsigned long long wallTime; /* in milliseconds */
+    unsigned long long userTime; /* in milliseconds; 0 = unknown */
+    unsigned long long systemTime; /* in milliseconds; 0 = unknown */
+    unsigned long long maxRSS; /* in KiB; 0 = unknown */
+    unsigned long long logSize; /* bytes of build log */
+    unsigned long long narSize; /* total NAR size of the outputs */
+    bool succeeded;
+    BuildStats() : startTime(0), wallTime(0), userTime(0), systemTime(0),
+        maxRSS(0), logSize(0), narSize(0), succeeded(false) { }
+};
+
+typedef list<BuildStats> BuildStatsList;
+
 
 class StoreAPI 
 {
@@ -116,6 +142,10 @@ public:
     /* Query information about a valid path. */
     virtual ValidPathInfo queryPathInfo(const Path & path) = 0;
 
+    /* Query information about the valid paths among `paths'.
+       Invalid paths are omitted from `infos'. */
+    virtual void queryPathInfos(const PathSet & paths, ValidPathInfoMap & infos);
+
     /* Query the hash of a valid path. */ 
     virtual Hash queryPathHash(const Path & path) = 0;
 
@@ -129,6 +159,18 @@ public:
     virtual void queryReferrers(const Path & path,
         PathSet & referrers) = 0;
 
+    /* Like queryReferrers(), but for a set of paths.  The result is
+       the union of their referrers. */
+    virtual void queryReferrersOfPaths(const PathSet & paths,
+        PathSet & referrers);
+
+    /* Add to `closure' all paths reachable from `paths' under the
+       references relation, or under the referrers relation if
+       `flipDirection' is true.  The paths themselves are included.
+       The result is not cleared. */
+    virtual void queryClosure(const PathSet & paths, PathSet & closure,
+        bool flipDirection = false);
+
     /* Query the deriver of a store path.  Return the empty string if
        no deriver has been set. */
     virtual Path queryDeriver(const Path & path) = 0;
@@ -243,6 +285,10 @@ public:
        value `*' causes all failed paths to be cleared. */
     virtual void clearFailedPaths(const PathSet & paths) = 0;
 
+    /* Return the recorded builds of the derivation `drvPath', oldest
+       first. */
+    virtual BuildStatsList queryBuildStats(const Path & drvPath) = 0;
+
     /* Return a string representing information about the path that
        can be loaded into the database using `nix-store --load-db' or
        `nix-store --register-validity'. */
@@ -18,16 +18,18 @@
 namespace nix {
 
 
-static string archiveVersion1 = "nix-archive-1";
+const string archiveVersion1 = "nix-archive-1";
 
 
 PathFilter defaultPathFilter;
 
 
-static void dump(const string & path, Sink & sink, PathFilter & filter);
+static void dump(const string & path, Sink & sink, PathFilter & filter,
+    ContentsHandler * handler);
 
 
-static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter)
+static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter,
+    ContentsHandler * handler)
 {
     Strings names = readDirectory(path);
     vector<string> names2(names.begin(), names.end());
@@ -43,7 +45,7 @@ static void dumpEntries(const Path & path, Sink & sink, PathFilter & filter)
             writeString("name", sink);
             writeString(*i, sink);
             writeString("node", sink);
-            dump(entry, sink, filter);
+            dump(entry, sink, filter, handler);
             writeString(")", sink);
         }
     }
@@ -73,7 +75,8 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+static void dump(const Path & path, Sink & sink, PathFilter & filter,
+    ContentsHandler * handler)
 {
     struct stat st;
     if (lstat(path.c_str(), &st))
@@ -88,13 +91,19 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
             writeString("executable", sink);
             writeString("", sink);
         }
-        dumpContents(path, (size_t) st.st_size, sink);
+        if (handler) {
+            writeString("contents", sink);
+            writeLongLong(st.st_size, sink);
+            (*handler)(path, st.st_size, st.st_mode & S_IXUSR);
+            writePadding(st.st_size, sink);
+        } else
+            dumpContents(path, (size_t) st.st_size, sink);
     } 
 
     else if (S_ISDIR(st.st_mode)) {
         writeString("type", sink);
         writeString("directory", sink);
-        dumpEntries(path, sink, filter);
+        dumpEntries(path, sink, filter, handler);
     }
 
     else if (S_ISLNK(st.st_mode)) {
@@ -113,7 +122,15 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     writeString(archiveVersion1, sink);
-    dump(path, sink, filter);
+    dump(path, sink, filter, 0);
+}
+
+
+void dumpPathMetadata(const Path & path, Sink & sink,
+    ContentsHandler & handler, PathFilter & filter)
+{
+    writeString(archiveVersion1, sink);
+    dump(path, sink, filter, &handler);
 }
 
 
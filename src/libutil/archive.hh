@@ -55,6 +55,23 @@ extern PathFilter defaultPathFilter;
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* Like dumpPath(), but doesn't read the contents of regular files.
+   Instead, the handler is called at the point in the archive where
+   the contents of a file would appear (i.e., between its length
+   field and its padding).  This allows the caller to process file
+   contents out of order, e.g. in parallel. */
+struct ContentsHandler
+{
+    virtual ~ContentsHandler() { }
+    virtual void operator () (const Path & path,
+        unsigned long long size, bool executable) = 0;
+};
+
+void dumpPathMetadata(const Path & path, Sink & sink,
+    ContentsHandler & handler, PathFilter & filter = defaultPathFilter);
+
+extern const string archiveVersion1;
+
 struct ParseSink
 {
     virtual void createDirectory(const Path & path) { };
@@ -0,0 +1,167 @@
+#include "thread-pool.hh"
+#include "util.hh"
+#include "affinity.hh"
+
+#include <cerrno>
+
+#include <signal.h>
+#include <unistd.h>
+
+
+namespace nix {
+
+
+ThreadPool::ThreadPool(unsigned int nrThreads)
+    : active(0), quit(false), failed(false), interrupted(false)
+{
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&work, 0);
+    pthread_cond_init(&done, 0);
+
+    if (nrThreads == 0) return;
+
+    /* Block all signals in the worker threads, so that SIGINT and
+       friends are delivered to the main thread (which knows how to
+       deal with them). */
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for (unsigned int n = 0; n < nrThreads; ++n) {
+        pthread_t thread;
+        int err = pthread_create(&thread, 0, workerEntry, this);
+        if (err) {
+            pthread_sigmask(SIG_SETMASK, &old, 0);
+            shutdown();
+            errno = err;
+            throw SysError("creating worker thread");
+        }
+        threads.push_back(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    shutdown();
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void ThreadPool::shutdown()
+{
+    pthread_mutex_lock(&mutex);
+    quit = true;
+    queue.clear();
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&mutex);
+
+    foreach (vector<pthread_t>::iterator, i, threads)
+        pthread_join(*i, 0);
+    threads.clear();
+}
+
+
+void ThreadPool::enqueue(Task & task)
+{
+    if (threads.empty()) {
+        task.run();
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (!failed) {
+        queue.push_back(&task);
+        pthread_cond_signal(&work);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void ThreadPool::wait()
+{
+    pthread_mutex_lock(&mutex);
+    while (!queue.empty() || active)
+        pthread_cond_wait(&done, &mutex);
+    bool failed = this->failed, interrupted = this->interrupted;
+    string error = this->error;
+    this->failed = this->interrupted = false;
+    this->error = "";
+    pthread_mutex_unlock(&mutex);
+
+    if (interrupted) throw Interrupted("interrupted by the user");
+    if (failed) throw Error(format("%1%") % error);
+
+    /* A signal may have arrived while we were waiting. */
+    checkInterrupt();
+}
+
+
+void * ThreadPool::workerEntry(void * arg)
+{
+    /* In the daemon, the worker process may have been locked to the
+       client's CPU.  Don't let that serialise the pool. */
+    restoreAffinity();
+    ((ThreadPool *) arg)->workerLoop();
+    return 0;
+}
+
+
+void ThreadPool::workerLoop()
+{
+    pthread_mutex_lock(&mutex);
+
+    while (true) {
+
+        while (queue.empty() && !quit)
+            pthread_cond_wait(&work, &mutex);
+        if (quit) break;
+
+        Task * task = queue.front();
+        queue.pop_front();
+        active++;
+        pthread_mutex_unlock(&mutex);
+
+        /* Don't start new work if the user hit Ctrl-C; the main
+           thread will notice the interrupt in wait().  Note that we
+           don't reset _isInterrupted here. */
+        bool ok = true, intr = false;
+        string msg;
+        if (_isInterrupted) { ok = false; intr = true; }
+        else {
+            try {
+                task->run();
+            } catch (Interrupted & e) {
+                ok = false; intr = true;
+            } catch (std::exception & e) {
+                ok = false; msg = e.what();
+            }
+        }
+
+        pthread_mutex_lock(&mutex);
+        active--;
+        if (!ok && !failed && !interrupted) {
+            if (intr) interrupted = true; else { failed = true; error = msg; }
+            queue.clear();
+        }
+        if (queue.empty() && !active)
+            pthread_cond_broadcast(&done);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+
+unsigned int getThreadCount(unsigned int setting)
+{
+    if (setting) return setting;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n;
+}
+
+
+}
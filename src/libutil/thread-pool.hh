@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.hh"
+
+#include <pthread.h>
+
+
+namespace nix {
+
+
+/* A unit of work that can be executed by a ThreadPool.  Tasks run
+   concurrently with the thread that queued them, so they must not
+   touch non-thread-safe global state (in particular, they should not
+   print messages or open log nests). */
+struct Task
+{
+    virtual ~Task() { }
+    virtual void run() = 0;
+};
+
+
+/* A fixed-size pool of worker threads.  Tasks are executed in FIFO
+   order.  The pool does not take ownership of tasks; they must stay
+   alive until wait() returns.  If a task throws, the remaining queued
+   tasks are discarded and wait() rethrows the first error in the
+   calling thread.  A pool of 0 threads doesn't create any threads
+   at all but runs tasks synchronously in enqueue().  The pool must be
+   destroyed before the tasks it refers to, so declare it after
+   them. */
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned int nrThreads);
+    ~ThreadPool();
+
+    void enqueue(Task & task);
+
+    /* Wait until all queued tasks have finished. */
+    void wait();
+
+    unsigned int getNrThreads() const { return threads.size(); }
+
+private:
+    vector<pthread_t> threads;
+    list<Task *> queue;
+    unsigned int active;
+    bool quit;
+
+    bool failed, interrupted;
+    string error;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work, done;
+
+    void shutdown();
+    static void * workerEntry(void * arg);
+    void workerLoop();
+};
+
+
+/* Return the number of threads to use for a pool, given a setting
+   where 0 means `the number of online CPUs'. */
+unsigned int getThreadCount(unsigned int setting);
+
+
+}
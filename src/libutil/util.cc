@@ -309,11 +309,11 @@ void computePathSize(const Path & path,
 }
 
 
-static void _deletePath(const Path & path, unsigned long long & bytesFreed)
+static void _deletePath(const Path & path, unsigned long long & bytesFreed, bool log)
 {
     checkInterrupt();
 
-    printMsg(lvlVomit, format("%1%") % path);
+    if (log) printMsg(lvlVomit, format("%1%") % path);
 
     struct stat st = lstat(path);
 
@@ -330,7 +330,7 @@ static void _deletePath(const Path & path, unsigned long long & bytesFreed)
         }
 
         for (Strings::iterator i = names.begin(); i != names.end(); ++i)
-            _deletePath(path + "/" + *i, bytesFreed);
+            _deletePath(path + "/" + *i, bytesFreed, log);
     }
 
     if (remove(path.c_str()) == -1)
@@ -350,7 +350,14 @@ void deletePath(const Path & path, unsigned long long & bytesFreed)
     startNest(nest, lvlDebug,
         format("recursively deleting path `%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(path, bytesFreed, true);
+}
+
+
+void deletePathQuiet(const Path & path, unsigned long long & bytesFreed)
+{
+    bytesFreed = 0;
+    _deletePath(path, bytesFreed, false);
 }
 
 
@@ -433,6 +440,18 @@ Paths createDirs(const Path & path)
 }
 
 
+Path getCacheDir()
+{
+    Path cacheDir = getEnv("XDG_CACHE_HOME", "");
+    if (cacheDir == "") {
+        Path homeDir = getEnv("HOME", "");
+        if (homeDir == "") throw Error("neither XDG_CACHE_HOME nor HOME is set");
+        cacheDir = homeDir + "/.cache";
+    }
+    return cacheDir + "/nix";
+}
+
+
 LogType logType = ltPretty;
 Verbosity verbosity = lvlInfo;
 
@@ -801,12 +820,14 @@ void Pid::kill()
 }
 
 
-int Pid::wait(bool block)
+int Pid::wait(bool block, struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, block ? 0 : WNOHANG);
+        int res = usage
+            ? wait4(pid, &status, block ? 0 : WNOHANG, usage)
+            : waitpid(pid, &status, block ? 0 : WNOHANG);
         if (res == pid) {
             pid = -1;
             return status;
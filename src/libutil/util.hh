@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <cstdio>
 
@@ -89,6 +90,10 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, unsigned long long & bytesFreed);
 
+/* Like deletePath(), but without logging, so that it can be called
+   from a ThreadPool task. */
+void deletePathQuiet(const Path & path, unsigned long long & bytesFreed);
+
 /* Make a path read-only recursively. */
 void makePathReadOnly(const Path & path);
 
@@ -100,6 +105,11 @@ Path createTempDir(const Path & tmpRoot = "", const Path & prefix = "nix",
    list of created directories, in order of creation. */
 Paths createDirs(const Path & path);
 
+/* Return the directory in which Nix keeps per-user caches, i.e.
+   $XDG_CACHE_HOME/nix or ~/.cache/nix.  Throws an error if neither
+   variable is set.  The directory is not created. */
+Path getCacheDir();
+
 
 template<class T, class A>
 T singleton(const A & a)
@@ -245,7 +255,10 @@ public:
     void operator =(pid_t pid);
     operator pid_t();
     void kill();
-    int wait(bool block);
+    /* Wait for the process to exit and return its status.  If
+       `usage' is not null, it receives the resources used by the
+       process (and its waited-for children). */
+    int wait(bool block, struct rusage * usage = 0);
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
 };
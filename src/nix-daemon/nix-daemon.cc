@@ -17,6 +17,7 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 
 using namespace nix;
 
@@ -46,6 +47,23 @@ static FdSink to(STDOUT_FILENO);
 bool canSendStderr;
 pid_t myPid;
 
+/* Whether we're performing the requests of a wopBatch operation.
+   Their replies are collected and sent all at once, so startWork()
+   and stopWork() must not write anything. */
+static bool inBatch = false;
+
+/* Whether we're a pool worker, i.e. a process that keeps the store
+   open and serves connections one after the other (see
+   poolWorkerLoop()). */
+static bool pooled = false;
+
+/* The socket on which the daemon accepts connections. */
+static int fdListen = -1;
+
+/* In a pool worker, the socket over which the daemon passes
+   connections to it, and over which it reports that it's idle. */
+static int fdChannel = -1;
+
 
 
 /* This function is called anytime we want to write something to
@@ -163,6 +181,8 @@ static void setSigPollAction(bool enable)
    want to send out stderr to the client. */
 static void startWork()
 {
+    if (inBatch) return;
+
     canSendStderr = true;
 
     /* Handle client death asynchronously. */
@@ -186,6 +206,8 @@ static void startWork()
    client. */
 static void stopWork(bool success = true, const string & msg = "", unsigned int status = 0)
 {
+    if (inBatch) return;
+
     /* Stop handling async client death; we're going to a state where
        we're either sending or receiving from the client, so we'll be
        notified of client death anyway. */
@@ -238,45 +260,35 @@ struct TunnelSource : BufferedSource
 };
 
 
-/* If the NAR archive contains a single file at top-level, then save
-   the contents of the file to `s'.  Otherwise barf. */
-struct RetrieveRegularNARSink : ParseSink
+/* Operations that a pool worker performs itself.  They don't modify
+   the store, and they don't depend on the options set by
+   wopSetOptions (which only apply to the current connection).
+   Except for those two, they can also be part of a wopBatch. */
+static bool isReadOnlyOp(WorkerOp op)
 {
-    bool regular;
-    string s;
-
-    RetrieveRegularNARSink() : regular(true) { }
-
-    void createDirectory(const Path & path)
-    {
-        regular = false;
-    }
-
-    void receiveContents(unsigned char * data, unsigned int len)
-    {
-        s.append((const char *) data, len);
-    }
-
-    void createSymlink(const Path & path, const string & target)
-    {
-        regular = false;
-    }
-};
-
-
-/* Adapter class of a Source that saves all data read to `s'. */
-struct SavingSourceAdapter : Source
-{
-    Source & orig;
-    string s;
-    SavingSourceAdapter(Source & orig) : orig(orig) { }
-    size_t read(unsigned char * data, size_t len)
-    {
-        size_t n = orig.read(data, len);
-        s.append((const char *) data, n);
-        return n;
+    switch (op) {
+        case wopIsValidPath:
+        case wopQueryValidPaths:
+        case wopQueryPathHash:
+        case wopQueryReferences:
+        case wopQueryReferrers:
+        case wopQueryValidDerivers:
+        case wopQueryDerivationOutputs:
+        case wopQueryDerivationOutputNames:
+        case wopQueryDeriver:
+        case wopQueryPathInfo:
+        case wopQueryAllValidPaths:
+        case wopQueryFailedPaths:
+        case wopQueryPathFromHashPart:
+        case wopQueryClosure:
+        case wopQueryBuildStats:
+        case wopSetOptions:
+        case wopBatch:
+            return true;
+        default:
+            return false;
     }
-};
+}
 
 
 static void performOp(bool trusted, unsigned int clientVersion,
@@ -357,6 +369,17 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopQueryClosure: {
+        PathSet paths = readStorePaths<PathSet>(from);
+        bool flipDirection = readInt(from) == 1;
+        startWork();
+        PathSet closure;
+        store->queryClosure(paths, closure, flipDirection);
+        stopWork();
+        writeStrings(closure, to);
+        break;
+    }
+
     case wopQueryDerivationOutputNames: {
         Path path = readStorePath(from);
         startWork();
@@ -397,22 +420,16 @@ static void performOp(bool trusted, unsigned int clientVersion,
         }
         HashType hashAlgo = parseHashType(s);
 
-        SavingSourceAdapter savedNAR(from);
-        RetrieveRegularNARSink savedRegular;
-
-        if (recursive) {
-            /* Get the entire NAR dump from the client and save it to
-               a string so that we can pass it to
-               addToStoreFromDump(). */
-            ParseSink sink; /* null sink; just parse the NAR */
-            parseDump(sink, savedNAR);
-        } else
-            parseDump(savedRegular, from);
-
+        /* Unpack the dump while reading it from the client.  This
+           has to happen before startWork(), since the client doesn't
+           read our messages until it has sent the entire dump.  The
+           rest happens afterwards, so that errors are reported to the
+           client. */
+        LocalStore * localStore = dynamic_cast<LocalStore *>(store.get());
+        UnpackedDump unpacked;
+        localStore->unpackDump(from, unpacked, recursive, hashAlgo);
         startWork();
-        if (!savedRegular.regular) throw Error("regular file expected");
-        Path path = dynamic_cast<LocalStore *>(store.get())
-            ->addToStoreFromDump(recursive ? savedNAR.s : savedRegular.s, baseName, recursive, hashAlgo);
+        Path path = localStore->addUnpackedDump(unpacked, baseName);
         stopWork();
 
         writeString(path, to);
@@ -518,6 +535,8 @@ static void performOp(bool trusted, unsigned int clientVersion,
             readInt(from);
             readInt(from);
         }
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 17)
+            options.targetFree = readLongLong(from);
 
         GCResults results;
 
@@ -630,6 +649,74 @@ static void performOp(bool trusted, unsigned int clientVersion,
         break;
     }
 
+    case wopQueryBuildStats: {
+        Path drvPath = readStorePath(from);
+        startWork();
+        BuildStatsList builds = store->queryBuildStats(drvPath);
+        stopWork();
+        writeInt(builds.size(), to);
+        foreach (BuildStatsList::iterator, i, builds) {
+            writeString(i->machine, to);
+            writeLongLong(i->startTime, to);
+            writeLongLong(i->wallTime, to);
+            writeLongLong(i->userTime, to);
+            writeLongLong(i->systemTime, to);
+            writeLongLong(i->maxRSS, to);
+            writeLongLong(i->logSize, to);
+            writeLongLong(i->narSize, to);
+            writeInt(i->succeeded ? 1 : 0, to);
+        }
+        break;
+    }
+
+    case wopBatch: {
+        /* Read all requests first, since we can't read from the
+           client once we've called startWork(). */
+        unsigned int count = readInt(from);
+        vector<std::pair<unsigned int, WorkerOp> > requests;
+        vector<string> args;
+        for (unsigned int n = 0; n < count; n++) {
+            unsigned int id = readInt(from);
+            WorkerOp op2 = (WorkerOp) readInt(from);
+            requests.push_back(std::pair<unsigned int, WorkerOp>(id, op2));
+            args.push_back(readString(from));
+        }
+
+        startWork();
+        vector<string> replies(count);
+        vector<bool> failed(count, false);
+        inBatch = true;
+        for (unsigned int n = 0; n < count; n++) {
+            WorkerOp op2 = requests[n].second;
+            try {
+                if (!isReadOnlyOp(op2) || op2 == wopSetOptions || op2 == wopBatch)
+                    throw Error(format("operation %1% is not allowed in a batch") % op2);
+                StringSource source(args[n]);
+                StringSink sink;
+                performOp(trusted, clientVersion, source, sink, op2);
+                replies[n] = sink.s;
+            } catch (Error & e) {
+                failed[n] = true;
+                replies[n] = e.msg();
+            } catch (...) {
+                inBatch = false;
+                throw;
+            }
+        }
+        inBatch = false;
+        stopWork();
+
+        /* The replies are tagged with the request IDs, so clients
+           must not rely on them being in order. */
+        writeInt(count, to);
+        for (unsigned int n = 0; n < count; n++) {
+            writeInt(requests[n].first, to);
+            writeInt(failed[n] ? 1 : 0, to);
+            writeString(replies[n], to);
+        }
+        break;
+    }
+
     case wopQueryPathInfo: {
         Path path = readStorePath(from);
         startWork();
@@ -649,6 +736,42 @@ static void performOp(bool trusted, unsigned int clientVersion,
 }
 
 
+static void setSigChldAction(bool autoReap);
+
+
+/* Let a new process handle the rest of the current connection, so
+   that operations that modify the store or build something are
+   isolated from the pool worker, just like in the fork-per-connection
+   mode.  Returns true in the child and false in the pool worker. */
+static bool handOffConnection(bool reserveSpace)
+{
+    pid_t child = fork();
+    if (child == -1) throw SysError("unable to fork");
+    if (child != 0) return false;
+
+    pooled = false;
+    close(fdChannel);
+
+    if (setsid() == -1)
+        throw SysError(format("creating a new session"));
+
+    setSigChldAction(false);
+
+    myPid = getpid();
+#ifdef HAVE_HUP_NOTIFICATION
+    if (fcntl(from.fd, F_SETOWN, getpid()) == -1)
+        throw SysError("F_SETOWN");
+#endif
+
+    /* A SQLite connection cannot be used after fork(), not even to
+       close it, so leak the worker's store and open a new one. */
+    new boost::shared_ptr<StoreAPI>(store);
+    store = boost::shared_ptr<StoreAPI>(new LocalStore(reserveSpace));
+
+    return true;
+}
+
+
 static void processConnection(bool trusted)
 {
     canSendStderr = false;
@@ -694,8 +817,11 @@ static void processConnection(bool trusted)
             throw Error("if you run `nix-daemon' as root, then you MUST set `build-users-group'!");
 #endif
 
-        /* Open the store. */
-        store = boost::shared_ptr<StoreAPI>(new LocalStore(reserveSpace));
+        /* Open the store.  Pool workers already have it open. */
+        if (!pooled)
+            store = boost::shared_ptr<StoreAPI>(new LocalStore(reserveSpace));
+        else if (!settings.readOnlyMode)
+            dynamic_cast<LocalStore *>(store.get())->updateReservedSpace(reserveSpace);
 
         stopWork();
         to.flush();
@@ -720,6 +846,8 @@ static void processConnection(bool trusted)
         opCount++;
 
         try {
+            if (pooled && !isReadOnlyOp(op) && !handOffConnection(reserveSpace))
+                return;
             performOp(trusted, clientVersion, from, to, op);
         } catch (Error & e) {
             /* If we're not in a state where we can send replies, then
@@ -764,6 +892,406 @@ static void setSigChldAction(bool autoReap)
 }
 
 
+/* Accept a connection on the daemon socket.  Set `trusted' if the
+   client runs as root. */
+static int acceptConnection(bool & trusted, pid_t & clientPid)
+{
+    while (1) {
+        struct sockaddr_un remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+        int remote = accept(fdListen,
+            (struct sockaddr *) &remoteAddr, &remoteAddrLen);
+        checkInterrupt();
+        if (remote == -1) {
+            if (errno == EINTR)
+                continue;
+            else
+                throw SysError("accepting connection");
+        }
+
+        closeOnExec(remote);
+
+        /* Get the identity of the caller, if possible. */
+        uid_t clientUid = -1;
+        clientPid = -1;
+        trusted = false;
+
+#if defined(SO_PEERCRED)
+        ucred cred;
+        socklen_t credLen = sizeof(cred);
+        if (getsockopt(remote, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != -1) {
+            clientPid = cred.pid;
+            clientUid = cred.uid;
+            if (clientUid == 0) trusted = true;
+        }
+#endif
+
+        printMsg(lvlInfo, format("accepted connection from pid %1%, uid %2%") % clientPid % clientUid);
+
+        return remote;
+    }
+}
+
+
+/* The identity of a client, sent along with a connection to a pool
+   worker. */
+struct ConnectionInfo
+{
+    int trusted;
+    pid_t clientPid;
+};
+
+
+/* Pass the connection `remote' to the pool worker at the other end
+   of `channel'. */
+static void sendConnection(int channel, int remote, bool trusted, pid_t clientPid)
+{
+    ConnectionInfo info;
+    info.trusted = trusted;
+    info.clientPid = clientPid;
+
+    struct iovec iov;
+    iov.iov_base = &info;
+    iov.iov_len = sizeof(info);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &remote, sizeof(int));
+
+    while (sendmsg(channel, &msg, MSG_NOSIGNAL) == -1) {
+        checkInterrupt();
+        if (errno != EINTR) throw SysError("passing a connection to a pool worker");
+    }
+}
+
+
+/* Receive a connection from the daemon.  Returns -1 if the daemon has
+   gone away. */
+static int receiveConnection(bool & trusted, pid_t & clientPid)
+{
+    ConnectionInfo info;
+
+    struct iovec iov;
+    iov.iov_base = &info;
+    iov.iov_len = sizeof(info);
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(fdChannel, &msg, 0)) == -1) {
+        checkInterrupt();
+        if (errno != EINTR) throw SysError("receiving a connection");
+    }
+    if (n == 0) return -1;
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(info) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        throw Error("invalid message from the daemon");
+
+    int remote;
+    memcpy(&remote, CMSG_DATA(cmsg), sizeof(int));
+    closeOnExec(remote);
+
+    trusted = info.trusted;
+    clientPid = info.clientPid;
+    return remote;
+}
+
+
+/* The main loop of a pool worker.  It opens the store once, and then
+   serves the connections that the daemon passes to it one at a time,
+   saving the cost of a fork() and of opening the database per
+   connection.  As soon as a client requests an operation that isn't
+   read-only, the connection is handed off to a child process (see
+   handOffConnection()). */
+static void poolWorkerLoop()
+{
+    pooled = true;
+
+    if (setsid() == -1)
+        throw SysError(format("creating a new session"));
+
+    /* Reap the processes that took over a connection. */
+    setSigChldAction(true);
+
+    boost::shared_ptr<LocalStore> localStore(new LocalStore());
+    store = localStore;
+
+    while (1) {
+
+        /* Don't hold up schema upgrades while we're idle. */
+        localStore->releaseBigLock();
+
+        bool trusted = false;
+        pid_t clientPid = -1;
+        AutoCloseFD remote = receiveConnection(trusted, clientPid);
+        if (remote == -1) exit(0);
+
+        /* If the schema was upgraded in the meantime, the database
+           must be reopened. */
+        if (!localStore->reacquireBigLock()) {
+            store.reset();
+            localStore.reset();
+            localStore = boost::shared_ptr<LocalStore>(new LocalStore());
+            store = localStore;
+        }
+
+        /* Options set by the client only apply to this
+           connection. */
+        Settings savedSettings = settings;
+        Verbosity savedVerbosity = verbosity;
+        LogType savedLogType = logType;
+
+        from.fd = remote;
+        to.fd = remote;
+
+        try {
+            processConnection(trusted);
+        } catch (Interrupted & e) {
+            /* The client went away in the middle of an operation. */
+            blockInt = 0;
+        } catch (Error & e) {
+            printMsg(lvlError, format("error processing connection: %1%") % e.msg());
+        }
+
+        /* If we handed off the connection, we're the child. */
+        if (!pooled) exit(0);
+
+        /* Discard whatever is left of the connection. */
+        from.bufPosIn = from.bufPosOut = 0;
+        to.bufPos = 0;
+        canSendStderr = false;
+
+        settings = savedSettings;
+        verbosity = savedVerbosity;
+        logType = savedLogType;
+
+        /* Tell the daemon that we can take another connection. */
+        remote.close();
+        unsigned char c = 0;
+        writeFull(fdChannel, &c, 1);
+    }
+}
+
+
+/* A pool worker, as seen by the daemon.  Connections are only passed
+   to idle workers; if none is idle, the daemon forks a process for
+   the connection, so that long-lived clients can't starve the
+   others. */
+struct PoolWorker
+{
+    pid_t pid;
+    int channel;
+    bool idle;
+    /* If the worker has died, when to start it again. */
+    time_t restartTime;
+};
+
+typedef list<PoolWorker> PoolWorkers;
+static PoolWorkers poolWorkers;
+
+
+/* Close the daemon's ends of the pool worker channels in a child
+   process. */
+static void closePoolChannels()
+{
+    foreach (PoolWorkers::iterator, i, poolWorkers)
+        if (i->channel != -1) close(i->channel);
+}
+
+
+static void startPoolWorker(PoolWorker & worker)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw SysError("creating a socket pair");
+
+    pid_t child = fork();
+    if (child == -1) {
+        int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = err;
+        throw SysError("unable to fork");
+    }
+
+    if (child != 0) {
+        close(fds[1]);
+        closeOnExec(fds[0]);
+        worker.pid = child;
+        worker.channel = fds[0];
+        worker.idle = true;
+        worker.restartTime = 0;
+        return;
+    }
+
+    try {
+        closePoolChannels();
+        close(fds[0]);
+        close(fdListen);
+        fdChannel = fds[1];
+        closeOnExec(fdChannel);
+        poolWorkerLoop();
+    } catch (std::exception & e) {
+        writeToStderr("unexpected Nix daemon error: " + string(e.what()) + "\n");
+    }
+    exit(1);
+}
+
+
+/* Fork a child to handle the connection `remote'. */
+static void forkConnection(int remote, bool trusted, pid_t clientPid)
+{
+    pid_t child;
+    child = fork();
+
+    switch (child) {
+
+    case -1:
+        throw SysError("unable to fork");
+
+    case 0:
+        try { /* child */
+
+            closePoolChannels();
+
+            /* Background the daemon. */
+            if (setsid() == -1)
+                throw SysError(format("creating a new session"));
+
+            /* Restore normal handling of SIGCHLD. */
+            setSigChldAction(false);
+
+            /* For debugging, stuff the pid into argv[1]. */
+            if (clientPid != -1 && argvSaved[1]) {
+                string processName = int2String(clientPid);
+                strncpy(argvSaved[1], processName.c_str(), strlen(argvSaved[1]));
+            }
+
+            /* Handle the connection. */
+            from.fd = remote;
+            to.fd = remote;
+            processConnection(trusted);
+
+        } catch (std::exception & e) {
+            writeToStderr("unexpected Nix daemon error: " + string(e.what()) + "\n");
+        }
+        exit(0);
+    }
+}
+
+
+/* Accept connections and pass each to an idle pool worker, or to a
+   new process if all workers are busy.  Restart workers that die,
+   which we notice because their channel is closed. */
+static void poolLoop()
+{
+    for (unsigned int n = 0; n < settings.daemonWorkers; ++n) {
+        poolWorkers.push_back(PoolWorker());
+        startPoolWorker(poolWorkers.back());
+    }
+
+    while (1) {
+
+        /* Restart the workers that died a while ago.  The delay keeps
+           a worker that dies right away (e.g. because the store can't
+           be opened) from making us spin. */
+        time_t now = time(0), nextRestart = 0;
+        foreach (PoolWorkers::iterator, i, poolWorkers) {
+            if (i->channel != -1) continue;
+            if (i->restartTime <= now) {
+                try {
+                    startPoolWorker(*i);
+                    continue;
+                } catch (Error & e) {
+                    printMsg(lvlError, format("cannot restart pool worker: %1%") % e.msg());
+                    i->restartTime = now + 1;
+                }
+            }
+            if (nextRestart == 0 || i->restartTime < nextRestart)
+                nextRestart = i->restartTime;
+        }
+
+        vector<struct pollfd> fds;
+        struct pollfd pfd;
+        pfd.fd = fdListen;
+        pfd.events = POLLIN;
+        fds.push_back(pfd);
+        foreach (PoolWorkers::iterator, i, poolWorkers) {
+            pfd.fd = i->channel; /* ignored by poll() if -1 */
+            fds.push_back(pfd);
+        }
+
+        int timeout = nextRestart ? (nextRestart - now) * 1000 : -1;
+
+        if (poll(&fds[0], fds.size(), timeout) == -1) {
+            checkInterrupt();
+            if (errno == EINTR) continue;
+            throw SysError("waiting for connections");
+        }
+        checkInterrupt();
+
+        unsigned int n = 1;
+        foreach (PoolWorkers::iterator, i, poolWorkers) {
+            if (!fds[n++].revents) continue;
+            unsigned char c;
+            ssize_t res = read(i->channel, &c, 1);
+            if (res == 1)
+                i->idle = true;
+            else if (res == 0 || errno != EINTR) {
+                printMsg(lvlError, format("pool worker %1% died; restarting") % i->pid);
+                close(i->channel);
+                i->channel = -1;
+                i->idle = false;
+                i->restartTime = time(0) + 1;
+            }
+        }
+
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        try {
+            bool trusted;
+            pid_t clientPid;
+            AutoCloseFD remote = acceptConnection(trusted, clientPid);
+
+            PoolWorkers::iterator i = poolWorkers.begin();
+            while (i != poolWorkers.end() && !i->idle) ++i;
+
+            if (i != poolWorkers.end()) {
+                sendConnection(i->channel, remote, trusted, clientPid);
+                i->idle = false;
+            } else
+                forkConnection(remote, trusted, clientPid);
+
+        } catch (Interrupted & e) {
+            throw;
+        } catch (Error & e) {
+            printMsg(lvlError, format("error processing connection: %1%") % e.msg());
+        }
+    }
+}
+
+
 #define SD_LISTEN_FDS_START 3
 
 
@@ -824,6 +1352,11 @@ static void daemonLoop()
     }
 
     closeOnExec(fdSocket);
+    fdListen = fdSocket;
+
+    /* If requested, let a pool of worker processes serve
+       connections. */
+    if (settings.daemonWorkers > 0) poolLoop();
 
     /* Loop accepting connections. */
     while (1) {
@@ -833,74 +1366,12 @@ static void daemonLoop()
                database, because it doesn't like forks very much. */
             assert(!store);
 
-            /* Accept a connection. */
-            struct sockaddr_un remoteAddr;
-            socklen_t remoteAddrLen = sizeof(remoteAddr);
-
-            AutoCloseFD remote = accept(fdSocket,
-                (struct sockaddr *) &remoteAddr, &remoteAddrLen);
-            checkInterrupt();
-            if (remote == -1) {
-                if (errno == EINTR)
-                    continue;
-                else
-                    throw SysError("accepting connection");
-            }
-
-            closeOnExec(remote);
-
-            /* Get the identity of the caller, if possible. */
-            uid_t clientUid = -1;
-            pid_t clientPid = -1;
-            bool trusted = false;
-
-#if defined(SO_PEERCRED)
-            ucred cred;
-            socklen_t credLen = sizeof(cred);
-            if (getsockopt(remote, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) != -1) {
-                clientPid = cred.pid;
-                clientUid = cred.uid;
-                if (clientUid == 0) trusted = true;
-            }
-#endif
-
-            printMsg(lvlInfo, format("accepted connection from pid %1%, uid %2%") % clientPid % clientUid);
+            bool trusted;
+            pid_t clientPid;
+            AutoCloseFD remote = acceptConnection(trusted, clientPid);
 
             /* Fork a child to handle the connection. */
-            pid_t child;
-            child = fork();
-
-            switch (child) {
-
-            case -1:
-                throw SysError("unable to fork");
-
-            case 0:
-                try { /* child */
-
-                    /* Background the daemon. */
-                    if (setsid() == -1)
-                        throw SysError(format("creating a new session"));
-
-                    /* Restore normal handling of SIGCHLD. */
-                    setSigChldAction(false);
-
-                    /* For debugging, stuff the pid into argv[1]. */
-                    if (clientPid != -1 && argvSaved[1]) {
-                        string processName = int2String(clientPid);
-                        strncpy(argvSaved[1], processName.c_str(), strlen(argvSaved[1]));
-                    }
-
-                    /* Handle the connection. */
-                    from.fd = remote;
-                    to.fd = remote;
-                    processConnection(trusted);
-
-                } catch (std::exception & e) {
-                    writeToStderr("unexpected Nix daemon error: " + string(e.what()) + "\n");
-                }
-                exit(0);
-            }
+            forkConnection(remote, trusted, clientPid);
 
         } catch (Interrupted & e) {
             throw;
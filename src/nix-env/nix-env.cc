@@ -12,6 +12,7 @@
 #include "user-env.hh"
 #include "util.hh"
 #include "value-to-json.hh"
+#include "eval-cache.hh"
 
 #include <cerrno>
 #include <ctime>
@@ -107,6 +108,7 @@ static void getAllExprs(EvalState & state,
 {
     Strings names = readDirectory(path);
     StringSet namesSorted(names.begin(), names.end());
+    if (state.inputs) state.inputs->addDirectory(path);
 
     foreach (StringSet::iterator, i, namesSorted) {
         /* Ignore the manifest.nix used by profiles.  This is
@@ -120,6 +122,9 @@ static void getAllExprs(EvalState & state,
         if (stat(path2.c_str(), &st) == -1)
             continue; // ignore dangling symlinks in ~/.nix-defexpr
 
+        if (state.inputs && S_ISDIR(st.st_mode))
+            state.inputs->addExists(path2 + "/default.nix", pathExists(path2 + "/default.nix"));
+
         if (isNixExpr(path2, st) && (!S_ISREG(st.st_mode) || hasSuffix(path2, ".nix"))) {
             /* Strip off the `.nix' filename suffix (if applicable),
                otherwise the attribute cannot be selected with the
@@ -170,21 +175,25 @@ static void loadSourceExpr(EvalState & state, const Path & path, Value & v)
         state.mkList(*state.allocAttr(v, state.symbols.create("_combineChannels")), 0);
         StringSet attrs;
         getAllExprs(state, path, attrs, v);
-        v.attrs->sort();
+        v.attrs()->sort();
     }
 }
 
 
 static void loadDerivations(EvalState & state, Path nixExprPath,
     string systemFilter, Bindings & autoArgs,
-    const string & pathPrefix, DrvInfos & elems)
+    const string & pathPrefix, DrvInfos & elems, EvalCache * cache = 0)
 {
-    Value vRoot;
-    loadSourceExpr(state, nixExprPath, vRoot);
+    if (!cache || !cache->lookup(elems)) {
+        Value vRoot;
+        loadSourceExpr(state, nixExprPath, vRoot);
+
+        Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
 
-    Value & v(*findAlongAttrPath(state, pathPrefix, autoArgs, vRoot));
+        getDerivations(state, v, pathPrefix, autoArgs, elems, true);
 
-    getDerivations(state, v, pathPrefix, autoArgs, elems, true);
+        if (cache) cache->insert(elems, true);
+    }
 
     /* Filter out all derivations not applicable to the current
        system. */
@@ -944,10 +953,20 @@ static void opQuery(Globals & globals,
     if (source == sInstalled || compareVersions || printStatus)
         installedElems = queryInstalled(globals.state, globals.profile);
 
-    if (source == sAvailable || compareVersions)
+    if (source == sAvailable || compareVersions) {
+        /* The available derivations can be cached, given the
+           attributes that we're going to print. */
+        unsigned int fields =
+            (printStatus || printDrvPath || printOutPath || globals.prebuiltOnly ? EvalCache::fieldPaths : 0) |
+            (printDescription || printMeta || jsonOutput ? EvalCache::fieldMeta : 0);
+        const string sep(1, 0);
+        EvalCache cache(globals.state,
+            "nix-env -q" + sep + globals.instSource.nixExprPath + sep + attrPath,
+            globals.instSource.autoArgs, fields);
         loadDerivations(globals.state, globals.instSource.nixExprPath,
             globals.instSource.systemFilter, globals.instSource.autoArgs,
-            attrPath, availElems);
+            attrPath, availElems, &cache);
+    }
 
     DrvInfos elems_ = filterBySelector(globals.state,
         source == sInstalled ? installedElems : availElems,
@@ -1128,25 +1147,25 @@ static void opQuery(Globals & globals,
                             if (!v)
                                 printMsg(lvlError, format("derivation `%1%' has invalid meta attribute `%2%'") % i->name % *j);
                             else {
-                                if (v->type == tString) {
+                                if (v->type() == tString) {
                                     attrs2["type"] = "string";
-                                    attrs2["value"] = v->string.s;
+                                    attrs2["value"] = v->string().s;
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tInt) {
+                                } else if (v->type() == tInt) {
                                     attrs2["type"] = "int";
-                                    attrs2["value"] = (format("%1%") % v->integer).str();
+                                    attrs2["value"] = (format("%1%") % v->integer()).str();
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tBool) {
+                                } else if (v->type() == tBool) {
                                     attrs2["type"] = "bool";
-                                    attrs2["value"] = v->boolean ? "true" : "false";
+                                    attrs2["value"] = v->boolean() ? "true" : "false";
                                     xml.writeEmptyElement("meta", attrs2);
-                                } else if (v->type == tList) {
+                                } else if (v->type() == tList) {
                                     attrs2["type"] = "strings";
                                     XMLOpenElement m(xml, "meta", attrs2);
-                                    for (unsigned int j = 0; j < v->list.length; ++j) {
-                                        if (v->list.elems[j]->type != tString) continue;
+                                    for (unsigned int j = 0; j < v->list().length; ++j) {
+                                        if (v->list().elems[j]->type() != tString) continue;
                                         XMLAttrs attrs3;
-                                        attrs3["value"] = v->list.elems[j]->string.s;
+                                        attrs3["value"] = v->list().elems[j]->string().s;
                                         xml.writeEmptyElement("string", attrs3);
                                     }
                                 }
@@ -52,7 +52,7 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
         Path drvPath = keepDerivations ? i->queryDrvPath() : "";
 
         Value & v(*state.allocValue());
-        manifest.list.elems[n++] = &v;
+        manifest.list().elems[n++] = &v;
         state.mkAttrs(v, 16);
 
         mkString(*state.allocAttr(v, state.sType), "derivation");
@@ -69,7 +69,7 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
         state.mkList(vOutputs, outputs.size());
         unsigned int m = 0;
         foreach (DrvInfo::Outputs::iterator, j, outputs) {
-            mkString(*(vOutputs.list.elems[m++] = state.allocValue()), j->first);
+            mkString(*(vOutputs.list().elems[m++] = state.allocValue()), j->first);
             Value & vOutputs = *state.allocAttr(v, state.symbols.create(j->first));
             state.mkAttrs(vOutputs, 2);
             mkString(*state.allocAttr(vOutputs, state.sOutPath), j->second);
@@ -89,9 +89,9 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
         foreach (StringSet::iterator, j, metaNames) {
             Value * v = i->queryMeta(*j);
             if (!v) continue;
-            vMeta.attrs->push_back(Attr(state.symbols.create(*j), v));
+            vMeta.attrs()->push_back(Attr(state.symbols.create(*j), v));
         }
-        v.attrs->sort();
+        v.attrs()->sort();
 
         if (drvPath != "") references.insert(drvPath);
     }
@@ -112,16 +112,16 @@ bool createUserEnv(EvalState & state, DrvInfos & elems,
     state.mkAttrs(args, 3);
     mkString(*state.allocAttr(args, state.symbols.create("manifest")),
         manifestFile, singleton<PathSet>(manifestFile));
-    args.attrs->push_back(Attr(state.symbols.create("derivations"), &manifest));
-    args.attrs->sort();
+    args.attrs()->push_back(Attr(state.symbols.create("derivations"), &manifest));
+    args.attrs()->sort();
     mkApp(topLevel, envBuilder, args);
 
     /* Evaluate it. */
     debug("evaluating user environment builder");
     state.forceValue(topLevel);
     PathSet context;
-    Path topLevelDrv = state.coerceToPath(*topLevel.attrs->find(state.sDrvPath)->value, context);
-    Path topLevelOut = state.coerceToPath(*topLevel.attrs->find(state.sOutPath)->value, context);
+    Path topLevelDrv = state.coerceToPath(*topLevel.attrs()->find(state.sDrvPath)->value, context);
+    Path topLevelOut = state.coerceToPath(*topLevel.attrs()->find(state.sOutPath)->value, context);
 
     /* Realise the resulting store expression. */
     debug("building user environment");
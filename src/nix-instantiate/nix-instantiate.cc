@@ -9,6 +9,7 @@
 #include "store-api.hh"
 #include "common-opts.hh"
 #include "misc.hh"
+#include "eval-cache.hh"
 
 #include <map>
 #include <iostream>
@@ -35,9 +36,33 @@ static int rootNr = 0;
 static bool indirectRoot = false;
 
 
+static void printDrvPaths(DrvInfos & drvs)
+{
+    foreach (DrvInfos::iterator, i, drvs) {
+        Path drvPath = i->queryDrvPath();
+
+        /* What output do we want? */
+        string outputName = i->queryOutputName();
+        if (outputName == "")
+            throw Error(format("derivation `%1%' lacks an `outputName' attribute ") % drvPath);
+
+        if (gcRoot == "")
+            printGCWarning();
+        else {
+            Path rootName = gcRoot;
+            if (++rootNr > 1) rootName += "-" + int2String(rootNr);
+            drvPath = addPermRoot(*store, drvPath, rootName, indirectRoot);
+        }
+        std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
+    }
+}
+
+
+/* The derivations that are printed are appended to `allDrvs'. */
 void processExpr(EvalState & state, const Strings & attrPaths,
     bool parseOnly, bool strict, Bindings & autoArgs,
-    bool evalOnly, bool xmlOutput, bool location, Expr * e)
+    bool evalOnly, bool xmlOutput, bool location, Expr * e,
+    DrvInfos & allDrvs)
 {
     if (parseOnly) {
         std::cout << format("%1%\n") % *e;
@@ -62,23 +87,8 @@ void processExpr(EvalState & state, const Strings & attrPaths,
         else {
             DrvInfos drvs;
             getDerivations(state, v, "", autoArgs, drvs, false);
-            foreach (DrvInfos::iterator, i, drvs) {
-                Path drvPath = i->queryDrvPath();
-
-                /* What output do we want? */
-                string outputName = i->queryOutputName();
-                if (outputName == "")
-                    throw Error(format("derivation `%1%' lacks an `outputName' attribute ") % drvPath);
-
-                if (gcRoot == "")
-                    printGCWarning();
-                else {
-                    Path rootName = gcRoot;
-                    if (++rootNr > 1) rootName += "-" + int2String(rootNr);
-                    drvPath = addPermRoot(*store, drvPath, rootName, indirectRoot);
-                }
-                std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
-            }
+            printDrvPaths(drvs);
+            allDrvs.splice(allDrvs.end(), drvs);
         }
     }
 }
@@ -158,15 +168,34 @@ void run(Strings args)
 
     if (readStdin) {
         Expr * e = parseStdin(state);
+        DrvInfos drvs;
         processExpr(state, attrPaths, parseOnly, strict, autoArgs,
-            evalOnly, xmlOutput, xmlOutputSourceLocation, e);
+            evalOnly, xmlOutput, xmlOutputSourceLocation, e, drvs);
     } else if (files.empty())
         files.push_back("./default.nix");
 
     foreach (Strings::iterator, i, files) {
-        Expr * e = state.parseExprFromFile(resolveExprPath(lookupFileArg(state, *i)));
+        Path path = lookupFileArg(state, *i);
+
+        /* The derivations in `path' can be cached, unless we're
+           only evaluating. */
+        const string sep(1, 0);
+        EvalCache cache(state,
+            parseOnly || evalOnly || state.repair ? "" :
+            "nix-instantiate" + sep + path + sep + concatStringsSep(sep, attrPaths),
+            autoArgs, EvalCache::fieldPaths);
+        DrvInfos drvs;
+        if (cache.lookup(drvs)) {
+            printDrvPaths(drvs);
+            continue;
+        }
+
+        Path path2 = resolveExprPath(path);
+        if (state.inputs) state.inputs->addResolution(path, path2);
+        Expr * e = state.parseExprFromFile(path2);
         processExpr(state, attrPaths, parseOnly, strict, autoArgs,
-            evalOnly, xmlOutput, xmlOutputSourceLocation, e);
+            evalOnly, xmlOutput, xmlOutputSourceLocation, e, drvs);
+        cache.insert(drvs, false);
     }
 
     state.printStats();
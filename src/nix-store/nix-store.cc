@@ -256,12 +256,19 @@ static void printTree(const Path & path,
 }
 
 
+/* Print an optional number, with `-' denoting "unknown". */
+static string showOptional(unsigned long long n)
+{
+    return n == 0 ? "-" : (format("%1%") % n).str();
+}
+
+
 /* Perform various sorts of queries. */
 static void opQuery(Strings opFlags, Strings opArgs)
 {
     enum { qOutputs, qRequisites, qReferences, qReferrers
          , qReferrersClosure, qDeriver, qBinding, qHash, qSize
-         , qTree, qGraph, qXml, qResolve, qRoots } query = qOutputs;
+         , qTree, qGraph, qXml, qResolve, qRoots, qBuildStats } query = qOutputs;
     bool useOutput = false;
     bool includeOutputs = false;
     bool forceRealise = false;
@@ -288,6 +295,7 @@ static void opQuery(Strings opFlags, Strings opArgs)
         else if (*i == "--xml") query = qXml;
         else if (*i == "--resolve") query = qResolve;
         else if (*i == "--roots") query = qRoots;
+        else if (*i == "--build-stats") query = qBuildStats;
         else if (*i == "--use-output" || *i == "-u") useOutput = true;
         else if (*i == "--force-realise" || *i == "--force-realize" || *i == "-f") forceRealise = true;
         else if (*i == "--include-outputs") includeOutputs = true;
@@ -310,16 +318,16 @@ static void opQuery(Strings opFlags, Strings opArgs)
         case qReferences:
         case qReferrers:
         case qReferrersClosure: {
-            PathSet paths;
+            PathSet roots, paths;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet ps = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, ps) {
-                    if (query == qRequisites) computeFSClosure(*store, *j, paths, false, includeOutputs);
-                    else if (query == qReferences) store->queryReferences(*j, paths);
-                    else if (query == qReferrers) store->queryReferrers(*j, paths);
-                    else if (query == qReferrersClosure) computeFSClosure(*store, *j, paths, true);
-                }
+                roots.insert(ps.begin(), ps.end());
             }
+            if (query == qRequisites) computeFSClosure(*store, roots, paths, false, includeOutputs);
+            else if (query == qReferences)
+                foreach (PathSet::iterator, j, roots) store->queryReferences(*j, paths);
+            else if (query == qReferrers) store->queryReferrersOfPaths(roots, paths);
+            else if (query == qReferrersClosure) computeFSClosure(*store, roots, paths, true);
             Paths sorted = topoSortPaths(*store, paths);
             for (Paths::reverse_iterator i = sorted.rbegin();
                  i != sorted.rend(); ++i)
@@ -396,13 +404,13 @@ static void opQuery(Strings opFlags, Strings opArgs)
         }
 
         case qRoots: {
-            PathSet referrers;
+            PathSet targets, referrers;
             foreach (Strings::iterator, i, opArgs) {
                 PathSet paths = maybeUseOutputs(followLinksToStorePath(*i), useOutput, forceRealise);
-                foreach (PathSet::iterator, j, paths)
-                    computeFSClosure(*store, *j, referrers, true,
-                        settings.gcKeepOutputs, settings.gcKeepDerivations);
+                targets.insert(paths.begin(), paths.end());
             }
+            computeFSClosure(*store, targets, referrers, true,
+                settings.gcKeepOutputs, settings.gcKeepDerivations);
             Roots roots = store->findRoots();
             foreach (Roots::iterator, i, roots)
                 if (referrers.find(i->second) != referrers.end())
@@ -410,6 +418,21 @@ static void opQuery(Strings opFlags, Strings opArgs)
             break;
         }
 
+        case qBuildStats:
+            foreach (Strings::iterator, i, opArgs) {
+                Path path = useDeriver(followLinksToStorePath(*i));
+                BuildStatsList builds = store->queryBuildStats(path);
+                foreach (BuildStatsList::iterator, j, builds)
+                    cout << format("%1% %2% %3% %4% %5% %6% %7% %8% %9% %10%\n")
+                        % path % j->startTime
+                        % (j->machine == "" ? "-" : j->machine)
+                        % (j->succeeded ? "succeeded" : "failed")
+                        % j->wallTime % showOptional(j->userTime)
+                        % showOptional(j->systemTime) % showOptional(j->maxRSS)
+                        % j->logSize % showOptional(j->narSize);
+            }
+            break;
+
         default:
             abort();
     }
@@ -620,6 +643,10 @@ static void opGC(Strings opFlags, Strings opArgs)
             long long maxFreed = getIntArg<long long>(*i, i, opFlags.end());
             options.maxFreed = maxFreed >= 0 ? maxFreed : 0;
         }
+        else if (*i == "--target-free") {
+            long long targetFree = getIntArg<long long>(*i, i, opFlags.end());
+            options.targetFree = targetFree >= 0 ? targetFree : 0;
+        }
         else throw UsageError(format("bad sub-operation `%1%' in GC") % *i);
 
     if (!opArgs.empty()) throw UsageError("no arguments expected");
@@ -790,8 +817,9 @@ static void opRepairPath(Strings opFlags, Strings opArgs)
 static void showOptimiseStats(OptimiseStats & stats)
 {
     printMsg(lvlError,
-        format("%1% freed by hard-linking %2% files; there are %3% files with equal contents out of %4% files in total")
+        format("%1% freed by %2% %3% files; there are %4% files with equal contents out of %5% files in total")
         % showBytes(stats.bytesFreed)
+        % (settings.optimiseMethod == "reflink" ? "sharing the extents of" : "hard-linking")
         % stats.filesLinked
         % stats.sameContents
         % stats.totalFiles);
@@ -906,7 +934,7 @@ void run(Strings args)
             noOutput = true;
         else if (arg[0] == '-') {
             opFlags.push_back(arg);
-            if (arg == "--max-freed" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
+            if (arg == "--max-freed" || arg == "--target-free" || arg == "--max-links" || arg == "--max-atime") { /* !!! hack */
                 if (i != args.end()) opFlags.push_back(*i++);
             }
         }
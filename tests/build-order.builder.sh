@@ -0,0 +1,2 @@
+echo $name >> $shared.order
+echo $name > $out
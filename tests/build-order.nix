@@ -0,0 +1,21 @@
+with import ./config.nix;
+
+let
+
+  mkDrv = name: inputs: mkDerivation {
+    inherit name inputs shared;
+    builder = ./build-order.builder.sh;
+  };
+
+  # The critical path.
+  c1 = mkDrv "c1" [];
+  c2 = mkDrv "c2" [c1];
+  c3 = mkDrv "c3" [c2];
+  c4 = mkDrv "c4" [c3];
+
+  l1 = mkDrv "l1" [];
+  l2 = mkDrv "l2" [];
+  l3 = mkDrv "l3" [];
+  l4 = mkDrv "l4" [];
+
+in mkDrv "top" [l1 l2 l3 l4 c4]
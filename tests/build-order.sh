@@ -0,0 +1,14 @@
+source common.sh
+
+clearStore
+
+rm -f $SHARED.order
+
+nix-build -j1 build-order.nix --no-out-link
+
+# With a single build slot, the chain c1 -> c2 -> c3 -> c4 is the
+# critical path, so it should be started before the other builds.
+order=$(head -n 3 $SHARED.order | tr '\n' ' ')
+if test "$order" != "c1 c2 c3 "; then
+    fail "builds were not started in critical path order: $(cat $SHARED.order)"
+fi
@@ -0,0 +1,18 @@
+#! /bin/sh
+
+# Accept the `remote' build and say which machine it runs on.
+
+while read x y drv rest; do
+
+    outPath=`sed 's/Derive(\[("out",\"\([^\"]*\)\".*/\1/' $drv`
+
+    if `echo $outPath | grep -q build-stats-remote`; then
+        echo "# accept test-machine" >&2
+        read inputs
+        read outputs
+        mkdir $outPath
+    else
+        echo "# decline" >&2
+    fi
+
+done
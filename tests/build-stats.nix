@@ -0,0 +1,20 @@
+with import ./config.nix;
+
+rec {
+
+  succeed = mkDerivation {
+    name = "build-stats-succeed";
+    builder = builtins.toFile "builder.sh" "echo SUCCEED; mkdir $out";
+  };
+
+  fail = mkDerivation {
+    name = "build-stats-fail";
+    builder = builtins.toFile "builder.sh" "echo FAIL; exit 1";
+  };
+
+  remote = mkDerivation {
+    name = "build-stats-remote";
+    builder = builtins.toFile "builder.sh" "mkdir $out";
+  };
+
+}
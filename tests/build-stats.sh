@@ -0,0 +1,23 @@
+source common.sh
+
+clearStore
+
+# A successful local build.
+drv=$(nix-instantiate build-stats.nix -A succeed)
+outPath=$(nix-store -r $drv)
+stats=$(nix-store -q --build-stats $drv)
+test "$(echo "$stats" | wc -l)" = 1 || fail "expected one build: $stats"
+echo "$stats" | grep -q "^$drv [0-9]* [^ ]* succeeded " || fail "bad statistics: $stats"
+
+# The statistics can also be queried through the output path.
+test "$(nix-store -q --build-stats $outPath)" = "$stats" || fail "lookup by output failed"
+
+# A failed build is recorded as well.
+drv=$(nix-instantiate build-stats.nix -A fail)
+nix-store -r $drv && fail "should fail"
+nix-store -q --build-stats $drv | grep -q "^$drv [0-9]* [^ ]* failed " || fail "failed build not recorded"
+
+# A build hook that replies `accept <host>' determines the machine.
+drv=$(nix-instantiate build-stats.nix -A remote)
+NIX_BUILD_HOOK="build-stats.hook.sh" nix-store -r $drv
+nix-store -q --build-stats $drv | grep -q "^$drv [0-9]* test-machine succeeded " || fail "machine not recorded"
@@ -47,6 +47,9 @@ input2OutPath=$(echo "$deps" | grep "dependencies-input-2")
 # The referrers closure of input-2 should include outPath.
 nix-store -q --referrers-closure "$input2OutPath" | grep "$outPath"
 
+# Asking for the referrers of an invalid path is an error.
+if nix-store -q --referrers "$input2OutPath" "$NIX_STORE_DIR/00000000000000000000000000000000-foo"; then exit 1; fi
+
 # Check that the derivers are set properly.
 test $(nix-store -q --deriver "$outPath") = "$drvPath"
 nix-store -q --deriver "$input2OutPath" | grep -q -- "-input-2.drv" 